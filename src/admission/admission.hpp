@@ -0,0 +1,188 @@
+#ifndef ZQ29_ADMISSION
+#define ZQ29_ADMISSION
+
+#include <atomic>
+#include <chrono>
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * decides which requests are worth sending to a server while the
+	 * proxy is overloaded, so the ones it does take stay fast instead of
+	 * everybody getting slow
+	 *
+	 * two signals:
+	 * queueing delay: every request tells onDequeue() how long it waited
+	 *   for a worker (or a fiber slot), CoDel style
+	 *   until requests have waited longer than `target` for a whole
+	 *   `interval` in a row, the queue is only absorbing a burst and just
+	 *   the ones that waited longer than `interval` are shed
+	 *   after that there is a standing queue, and every request that
+	 *   waited longer than `target` is shed until one is fast again
+	 * in-flight requests: at most `maxInflight` go to servers at once,
+	 *   each one holds a Slot while it does
+	 *
+	 * what "shed" means is up to the caller, the proxy still serves cache
+	 * hits and only turns misses away, see main.cpp
+	 *
+	 * thread-safe, nothing blocks
+	*/
+	class AdmissionController {
+	public:
+		typedef chrono::steady_clock Clock;
+
+		struct Options {
+			size_t targetMs;
+			size_t intervalMs;
+			size_t maxInflight;
+		};
+
+		/*
+		 * an in-flight request, move-only, given back when destroyed
+		 * an empty slot (false) means the request was not admitted
+		*/
+		class Slot {
+		public:
+			Slot();
+			~Slot();
+			Slot(Slot&& rhs);
+			Slot& operator=(Slot&& rhs);
+			Slot(const Slot& rhs) = delete;
+			Slot& operator=(const Slot& rhs) = delete;
+
+			explicit operator bool() const;
+
+		private:
+			friend class AdmissionController;
+			AdmissionController* owner;
+
+			Slot(AdmissionController* owner);
+			void reset();
+		};
+
+		AdmissionController(const Options& options);
+		AdmissionController(const AdmissionController& rhs) = delete;
+		AdmissionController& operator=(const AdmissionController& rhs) = delete;
+
+		/*
+		 * a request leaves the queue after waiting for `sojourn`
+		 * returns true if it waited too long and should be shed
+		*/
+		bool onDequeue(const Clock::duration sojourn, const Clock::time_point now = Clock::now());
+
+		/*
+		 * a request wants to go to a server, late is what onDequeue said
+		 * returns an empty slot if it should be shed
+		*/
+		Slot admit(const bool late);
+
+		/*
+		 * there is a standing queue right now
+		*/
+		bool overloaded(const Clock::time_point now = Clock::now()) const;
+
+		size_t inflight() const;
+		/*
+		 * requests admit() turned away, since the start
+		*/
+		size_t shed() const;
+
+	private:
+		const Clock::duration target;
+		const Clock::duration interval;
+		const size_t maxInflight;
+		// since when requests wait longer than target, 0 if they don't
+		atomic<Clock::rep> firstSlow;
+		atomic<size_t> inflightCount;
+		atomic<size_t> shedCount;
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Slot Implementation ////////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	AdmissionController::Slot::Slot() : owner(nullptr) {}
+
+	AdmissionController::Slot::Slot(AdmissionController* owner) : owner(owner) {}
+
+	AdmissionController::Slot::~Slot() {
+		reset();
+	}
+
+	AdmissionController::Slot::Slot(Slot&& rhs) : owner(rhs.owner) {
+		rhs.owner = nullptr;
+	}
+
+	AdmissionController::Slot& AdmissionController::Slot::operator=(Slot&& rhs) {
+		if(this != &rhs) {
+			reset();
+			owner = rhs.owner;
+			rhs.owner = nullptr;
+		}
+		return *this;
+	}
+
+	AdmissionController::Slot::operator bool() const {
+		return owner != nullptr;
+	}
+
+	void AdmissionController::Slot::reset() {
+		if(owner == nullptr) { return; }
+		owner->inflightCount.fetch_sub(1, memory_order_relaxed);
+		owner = nullptr;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// AdmissionController Implementation /////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	AdmissionController::AdmissionController(const Options& options) :
+		target(chrono::milliseconds(options.targetMs)),
+		interval(chrono::milliseconds(options.intervalMs)),
+		maxInflight(options.maxInflight),
+		firstSlow(0),
+		inflightCount(0),
+		shedCount(0)
+	{}
+
+	bool AdmissionController::onDequeue(const Clock::duration sojourn, const Clock::time_point now) {
+		if(sojourn < target) {
+			firstSlow.store(0, memory_order_relaxed);
+			return false;
+		}
+		Clock::rep none = 0;
+		firstSlow.compare_exchange_strong(none, now.time_since_epoch().count(), memory_order_relaxed);
+		return sojourn > (overloaded(now) ? target : interval);
+	}
+
+	AdmissionController::Slot AdmissionController::admit(const bool late) {
+		size_t current = inflightCount.load(memory_order_relaxed);
+		do {
+			if(late || current >= maxInflight) {
+				shedCount.fetch_add(1, memory_order_relaxed);
+				return Slot();
+			}
+		} while(!inflightCount.compare_exchange_weak(current, current + 1, memory_order_relaxed));
+		return Slot(this);
+	}
+
+	bool AdmissionController::overloaded(const Clock::time_point now) const {
+		const Clock::rep since = firstSlow.load(memory_order_relaxed);
+		return since != 0 && now - Clock::time_point(Clock::duration(since)) >= interval;
+	}
+
+	size_t AdmissionController::inflight() const { return inflightCount.load(memory_order_relaxed); }
+	size_t AdmissionController::shed() const { return shedCount.load(memory_order_relaxed); }
+
+}
+	using zq29Inner::AdmissionController;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "admission.hpp"
+
+using namespace zq29;
+using namespace std;
+
+typedef AdmissionController::Clock Clock;
+
+chrono::milliseconds ms(const int n) { return chrono::milliseconds(n); }
+
+/*
+ * a burst is absorbed, a standing queue is not
+*/
+void testQueueDelay() {
+	const string TAG = "testQueueDelay";
+	bool failFlag = false;
+
+	AdmissionController ac({ 5, 100, 1000 });
+	const Clock::time_point t0 = Clock::now();
+
+	// a burst: slow for less than an interval, only the very late are shed
+	if(ac.onDequeue(ms(1), t0) || ac.onDequeue(ms(50), t0 + ms(10))
+		|| !ac.onDequeue(ms(150), t0 + ms(20)) || ac.onDequeue(ms(6), t0 + ms(100))
+		|| ac.overloaded(t0 + ms(100))) {
+		failFlag = true;
+		Log::testFail(TAG, "burst");
+	}
+
+	// slow for a whole interval, everything above target is shed
+	if(!ac.onDequeue(ms(6), t0 + ms(110)) || !ac.overloaded(t0 + ms(110))) {
+		failFlag = true;
+		Log::testFail(TAG, "standing queue");
+	}
+	if(ac.onDequeue(ms(5), t0 + ms(115))) {
+		failFlag = true;
+		Log::testFail(TAG, "shed at the target");
+	}
+
+	// one fast request ends it
+	ac.onDequeue(ms(2), t0 + ms(120));
+	if(ac.overloaded(t0 + ms(121)) || ac.onDequeue(ms(30), t0 + ms(121))) {
+		failFlag = true;
+		Log::testFail(TAG, "still overloaded after a fast one");
+	}
+
+	// a long idle time is no standing queue
+	AdmissionController idle({ 5, 100, 1000 });
+	if(idle.onDequeue(ms(30), t0 + chrono::seconds(10)) || idle.overloaded(t0 + chrono::seconds(10))) {
+		failFlag = true;
+		Log::testFail(TAG, "first request after idle time");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * never more than maxInflight slots, however many threads ask
+*/
+void testInflight() {
+	const string TAG = "testInflight";
+	bool failFlag = false;
+
+	AdmissionController ac({ 5, 100, 3 });
+	{
+		AdmissionController::Slot a = ac.admit(false);
+		AdmissionController::Slot b = ac.admit(false);
+		AdmissionController::Slot c = ac.admit(false);
+		AdmissionController::Slot d = ac.admit(false);
+		AdmissionController::Slot late = ac.admit(true);
+		if(!a || !b || !c || d || late || ac.inflight() != 3 || ac.shed() != 2) {
+			failFlag = true;
+			Log::testFail(TAG, "single thread");
+		}
+		AdmissionController::Slot moved(move(a));
+		b = move(moved);
+		if(ac.inflight() != 2 || !b) {
+			failFlag = true;
+			Log::testFail(TAG, "moved slots");
+		}
+	}
+	if(ac.inflight() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(ac.inflight(), " slots not given back"));
+	}
+
+	atomic<size_t> most(0), current(0);
+	vector<thread> threads;
+	for(int i = 0; i < 8; i++) {
+		threads.push_back(thread([&]() {
+			for(int j = 0; j < 10000; j++) {
+				AdmissionController::Slot s = ac.admit(false);
+				if(!s) { continue; }
+				const size_t n = ++current;
+				size_t m = most;
+				while(n > m && !most.compare_exchange_weak(m, n)) {}
+				current--;
+			}
+		}));
+	}
+	for(auto& t : threads) { t.join(); }
+	if(most > 3 || ac.inflight() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(most.load(), " slots at once"));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testQueueDelay();
+	testInflight();
+}
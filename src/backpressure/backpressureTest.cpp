@@ -0,0 +1,281 @@
+#include <sys/socket.h>
+
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include "membudget.hpp"
+#include "boundedpipe.hpp"
+
+using namespace zq29;
+using namespace std;
+
+string pattern(const size_t len, const char seed) {
+	string s(len, 0);
+	for(size_t i = 0; i < len; i++) { s[i] = (char)(seed + i * 7 + i / 251); }
+	return s;
+}
+
+/*
+ * a socketpair with small kernel buffers, so they can't hide much
+*/
+bool smallPair(int fds[2]) {
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) { return false; }
+	const int size = 16 * 1024;
+	for(int i = 0; i < 2; i++) {
+		setsockopt(fds[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt(fds[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	return true;
+}
+
+void sendAll(const int fd, const string& s, atomic<size_t>& sent) {
+	while(sent < s.size()) {
+		const ssize_t n = send(fd, s.data() + sent, min((size_t)4096, s.size() - sent), MSG_NOSIGNAL);
+		if(n <= 0) { return; }
+		sent += n;
+	}
+}
+
+const BoundedPipe::Filter passAll = [](const char* data, const size_t len, bool& more) { return len; };
+
+void testMemoryBudget() {
+	const string TAG = "testMemoryBudget";
+	bool failFlag = false;
+
+	MemoryBudget budget(100);
+	if(!budget.tryReserve(60) || budget.tryReserve(41) || !budget.tryReserve(40) || budget.tryReserve(1)
+		|| budget.used() != 100 || budget.refused() != 2) {
+		failFlag = true;
+		Log::testFail(TAG, "single thread");
+	}
+	budget.release(100);
+	if(budget.tryReserve(101) || budget.used() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, "more than the limit");
+	}
+
+	// many threads, never more than the limit
+	MemoryBudget shared(1000);
+	atomic<size_t> granted(0);
+	vector<thread> threads;
+	for(int i = 0; i < 8; i++) {
+		threads.push_back(thread([&]() {
+			for(int j = 0; j < 1000; j++) {
+				if(shared.tryReserve(1)) { granted++; }
+			}
+		}));
+	}
+	for(auto& t : threads) { t.join(); }
+	if(granted != 1000 || shared.used() != 1000) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(granted.load(), " granted"));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * a fast server and a client that stops reading for a while:
+ * the pipe never holds more than the high watermark, and the server
+ * has to wait too
+*/
+void testWatermarks() {
+	const string TAG = "testWatermarks";
+	bool failFlag = false;
+
+	int server[2], client[2];
+	if(!smallPair(server) || !smallPair(client)) {
+		Log::testFail(TAG, "cannot make sockets");
+		return;
+	}
+	const string data = pattern(8 * 1024 * 1024 + 13, 'a');
+	MemoryBudget budget(1024 * 1024 * 1024);
+	const size_t high = 128 * 1024;
+
+	atomic<size_t> sent(0);
+	thread origin([&]() {
+		sendAll(server[1], data, sent);
+		close(server[1]);
+	});
+	BoundedPipe::Result result = BoundedPipe::FROM_FAILED;
+	size_t peak = 0;
+	thread relay([&]() {
+		BoundedPipe pipe(server[0], client[1], { high, high / 4 }, budget, 32 * 1024);
+		result = pipe.run(passAll);
+		peak = pipe.peak();
+		close(client[1]);
+	});
+
+	// the client is away for a while
+	this_thread::sleep_for(chrono::milliseconds(200));
+	const size_t sentWhileAway = sent;
+	string got;
+	char buf[65536];
+	ssize_t n;
+	while((n = recv(client[0], buf, sizeof(buf), 0)) > 0) { got.append(buf, n); }
+	origin.join();
+	relay.join();
+
+	if(result != BoundedPipe::FROM_CLOSED || got != data) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("result ", result, ", got ", got.size(), " of ", data.size(), " bytes"));
+	}
+	if(peak > high || sentWhileAway > 1024 * 1024) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("peak ", peak, ", the server sent ", sentWhileAway, " bytes meanwhile"));
+	}
+	if(budget.used() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(budget.used(), " bytes still reserved"));
+	}
+
+	close(server[0]);
+	close(client[0]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * two pipes and budget for one chunk: both get there, one at a time
+*/
+void testBudget() {
+	const string TAG = "testBudget";
+	bool failFlag = false;
+
+	const size_t chunk = 16 * 1024;
+	MemoryBudget budget(chunk);
+	atomic<size_t> good(0), starved(0);
+	vector<thread> threads;
+	for(int i = 0; i < 2; i++) {
+		threads.push_back(thread([&, i]() {
+			int server[2], client[2];
+			if(!smallPair(server) || !smallPair(client)) { return; }
+			const string data = pattern(1024 * 1024 + i, 'a' + i);
+			atomic<size_t> sent(0);
+			thread origin([&]() {
+				sendAll(server[1], data, sent);
+				close(server[1]);
+			});
+			thread relay([&]() {
+				BoundedPipe pipe(server[0], client[1], { 4 * chunk, chunk }, budget, chunk);
+				pipe.run(passAll);
+				starved += pipe.starved();
+				close(client[1]);
+			});
+			string got;
+			char buf[4096];
+			ssize_t n;
+			while((n = recv(client[0], buf, sizeof(buf), 0)) > 0) { got.append(buf, n); }
+			origin.join();
+			relay.join();
+			if(got == data) { good++; }
+			close(server[0]);
+			close(client[0]);
+		}));
+	}
+	for(auto& t : threads) { t.join(); }
+
+	if(good != 2 || budget.used() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(good.load(), " pipes done, ", budget.used(), " bytes still reserved"));
+	}
+	if(starved == 0 || budget.refused() == 0) {
+		failFlag = true;
+		Log::testFail(TAG, "nobody had to wait for the budget");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * the filter ends it in the middle of a read, the rest is not forwarded
+*/
+void testFilter() {
+	const string TAG = "testFilter";
+	bool failFlag = false;
+
+	int server[2], client[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, server) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, client) < 0) {
+		Log::testFail(TAG, "cannot make sockets");
+		return;
+	}
+	const string data = pattern(100000, 'x');
+	const size_t wanted = 70000;
+	atomic<size_t> sent(0);
+	sendAll(server[1], data, sent); // fits in the socket buffer
+	MemoryBudget budget(1024 * 1024);
+	size_t seen = 0;
+	BoundedPipe pipe(server[0], client[1], { 64 * 1024, 16 * 1024 }, budget, 8 * 1024);
+	string got;
+	thread reader([&]() {
+		char buf[4096];
+		ssize_t n;
+		while((n = recv(client[0], buf, sizeof(buf), 0)) > 0) { got.append(buf, n); }
+	});
+	const BoundedPipe::Result result = pipe.run([&](const char* d, const size_t len, bool& more) {
+		const size_t used = min(len, wanted - seen);
+		seen += used;
+		more = seen < wanted;
+		return used;
+	});
+	close(client[1]);
+	reader.join();
+	if(result != BoundedPipe::DONE || got != data.substr(0, wanted)) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("result ", result, ", got ", got.size(), " bytes"));
+	}
+
+	close(server[0]); close(server[1]); close(client[0]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * a server that stops sending: the pipe gives up after its read timeout,
+ * but not while it's the client that is slow
+*/
+void testReadTimeout() {
+	const string TAG = "testReadTimeout";
+	bool failFlag = false;
+
+	int server[2], client[2];
+	if(!smallPair(server) || !smallPair(client)) {
+		Log::testFail(TAG, "cannot make sockets");
+		return;
+	}
+	MemoryBudget budget(1024 * 1024);
+	const string data = pattern(200000, 't');
+	atomic<size_t> sent(0);
+	thread writer([&]() { sendAll(server[1], data, sent); }); // then silence
+	size_t got = 0;
+	thread reader([&]() {
+		char buf[4096];
+		this_thread::sleep_for(chrono::milliseconds(150)); // longer than the timeout
+		ssize_t n;
+		while((n = recv(client[0], buf, sizeof(buf), 0)) > 0) { got += n; }
+	});
+	BoundedPipe pipe(server[0], client[1], { 32 * 1024, 8 * 1024 }, budget, 8 * 1024, 100);
+	const auto start = chrono::steady_clock::now();
+	const BoundedPipe::Result result = pipe.run(passAll);
+	const int err = errno;
+	const auto took = chrono::steady_clock::now() - start;
+	close(client[1]);
+	writer.join();
+	reader.join();
+	if(result != BoundedPipe::FROM_FAILED || err != ETIMEDOUT || got != data.size()
+		|| took < chrono::milliseconds(250) || took > chrono::seconds(2)) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("result ", result, ", ", strerror(err), ", ", got, " bytes through after ",
+			chrono::duration_cast<chrono::milliseconds>(took).count(), "ms"));
+	}
+
+	close(server[0]); close(server[1]); close(client[0]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testMemoryBudget();
+	testWatermarks();
+	testBudget();
+	testFilter();
+	testReadTimeout();
+}
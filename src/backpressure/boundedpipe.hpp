@@ -0,0 +1,248 @@
+#ifndef ZQ29_BOUNDEDPIPE
+#define ZQ29_BOUNDEDPIPE
+
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+
+#include "../log.hpp"
+#include "../bufferpool/bufferpool.hpp"
+#include "../eventloop/fiber.hpp"
+#include "membudget.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * moves bytes from one socket to another, reading ahead of a slow
+	 * writer, but only so far
+	 *
+	 * once `high` bytes wait to be written, `from` is not read any more
+	 * until they are down to `low`, so a slow client holds its server
+	 * back instead of filling our memory, and a fast one is never
+	 * waiting for a read to finish before the next write
+	 *
+	 * the bytes wait in chunks from the BufferPool, each chunk is
+	 * reserved from a MemoryBudget shared by all pipes first, when the
+	 * budget is used up a pipe keeps writing what it has and reads again
+	 * once a reservation fits
+	 *
+	 * the sockets may be blocking or not, every call is non-blocking,
+	 * waits like the async* functions of fiber.hpp
+	 * a `from` that sends nothing for readTimeoutMs while the pipe
+	 * wants to read fails it, a server that stalls can't hold it forever
+	*/
+	class BoundedPipe {
+	public:
+		struct Watermarks {
+			size_t high;
+			size_t low;
+		};
+		/*
+		 * DONE: the filter said no more, and all of it is written
+		 * FROM_CLOSED: EOF from `from`, and all of it is written
+		 * FROM_FAILED, TO_FAILED: a socket failed, some bytes may be lost,
+		 *                         FROM_FAILED with errno ETIMEDOUT on a timeout
+		*/
+		enum Result { DONE, FROM_CLOSED, FROM_FAILED, TO_FAILED };
+
+		/*
+		 * called with every read from `from`, before it is queued
+		 * returns how many of the len bytes go on to `to` (the rest are
+		 * dropped), and sets more to false when nothing else should be read
+		*/
+		typedef function<size_t(const char* data, const size_t len, bool& more)> Filter;
+
+		static const size_t DEFAULT_CHUNK = 64 * 1024;
+		static const int BUDGET_RETRY_MS = 5;
+
+		/*
+		 * readTimeoutMs < 0 means no timeout
+		*/
+		BoundedPipe(const int from, const int to, const Watermarks& marks, MemoryBudget& budget,
+			const size_t chunkSize = DEFAULT_CHUNK, const int readTimeoutMs = -1);
+		~BoundedPipe();
+		BoundedPipe(const BoundedPipe& rhs) = delete;
+		BoundedPipe& operator=(const BoundedPipe& rhs) = delete;
+
+		/*
+		 * run until one of the results above, rethrows what filter throws
+		*/
+		Result run(const Filter& filter);
+
+		/*
+		 * the most bytes that were waiting at once, and the reads that had
+		 * to wait for the budget, for tests and stats
+		*/
+		size_t peak() const;
+		size_t starved() const;
+
+	private:
+		struct Chunk {
+			BufferPool::Buffer buffer;
+			size_t head, tail; // of the bytes not written yet
+		};
+
+		const int from;
+		const int to;
+		const Watermarks marks;
+		MemoryBudget& budget;
+		const size_t chunkSize;
+		const int readTimeoutMs;
+		deque<Chunk> chunks;
+		size_t buffered;
+		size_t peakBuffered;
+		size_t starvedCount;
+
+		/*
+		 * room to read into at the back, false if the budget is used up
+		*/
+		bool makeRoom();
+		void dropFront();
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// BoundedPipe Implementation /////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	BoundedPipe::BoundedPipe(const int from, const int to, const Watermarks& marks, MemoryBudget& budget,
+		const size_t chunkSize, const int readTimeoutMs) :
+		from(from), to(to), marks(marks), budget(budget),
+		chunkSize(max((size_t)1, min(chunkSize, marks.high))), readTimeoutMs(readTimeoutMs),
+		buffered(0), peakBuffered(0), starvedCount(0) {}
+
+	BoundedPipe::~BoundedPipe() {
+		while(!chunks.empty()) { dropFront(); }
+	}
+
+	size_t BoundedPipe::peak() const { return peakBuffered; }
+	size_t BoundedPipe::starved() const { return starvedCount; }
+
+	bool BoundedPipe::makeRoom() {
+		if(!chunks.empty() && chunks.back().tail < chunks.back().buffer.capacity()) { return true; }
+		if(!budget.tryReserve(chunkSize)) {
+			starvedCount++;
+			return false;
+		}
+		Chunk c;
+		c.buffer = BufferPool::acquire(chunkSize);
+		c.head = c.tail = 0;
+		chunks.push_back(move(c));
+		return true;
+	}
+
+	void BoundedPipe::dropFront() {
+		chunks.pop_front();
+		budget.release(chunkSize);
+	}
+
+	BoundedPipe::Result BoundedPipe::run(const Filter& filter) {
+		bool more = true;
+		bool eof = false;
+		bool paused = false;
+		// since when `from` was asked for bytes and sent none
+		chrono::steady_clock::time_point quietSince = chrono::steady_clock::now();
+		while(true) {
+			bool progress = false;
+
+			// write as much as the socket takes
+			while(!chunks.empty()) {
+				Chunk& c = chunks.front();
+				if(c.head == c.tail) {
+					if(chunks.size() > 1) {
+						dropFront();
+						continue;
+					}
+					c.head = c.tail = 0; // the last one is kept for the next read
+					break;
+				}
+				const ssize_t n = send(to, c.buffer.data() + c.head, c.tail - c.head, MSG_NOSIGNAL | MSG_DONTWAIT);
+				if(n > 0) {
+					c.head += n;
+					buffered -= n;
+					progress = true;
+					continue;
+				}
+				if(n < 0 && errno == EINTR) { continue; }
+				if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+				return TO_FAILED;
+			}
+			if(!more && buffered == 0) {
+				return eof ? FROM_CLOSED : DONE;
+			}
+
+			if(buffered >= marks.high) {
+				paused = true;
+			} else if(buffered <= marks.low) {
+				paused = false;
+			}
+
+			// read, unless too much is waiting already
+			bool starvedNow = false;
+			if(more && !paused) {
+				if(!makeRoom()) {
+					starvedNow = true;
+				} else {
+					Chunk& c = chunks.back();
+					const size_t room = min(c.buffer.capacity() - c.tail, marks.high - buffered);
+					const ssize_t n = recv(from, c.buffer.data() + c.tail, room, MSG_DONTWAIT);
+					if(n >= 0) { quietSince = chrono::steady_clock::now(); }
+					if(n > 0) {
+						const size_t used = filter(c.buffer.data() + c.tail, n, more);
+						c.tail += used;
+						buffered += used;
+						peakBuffered = max(peakBuffered, buffered);
+						progress = true;
+					} else if(n == 0) {
+						more = false;
+						eof = true;
+						progress = true;
+					} else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+						return FROM_FAILED;
+					}
+				}
+			}
+			if(progress) { continue; }
+
+			// nothing moved, wait for whatever can move next
+			vector<pair<int, uint32_t>> fds;
+			if(buffered > 0) {
+				fds.push_back(make_pair(to, (uint32_t)EPOLLOUT));
+			}
+			int timeoutMs = starvedNow ? BUDGET_RETRY_MS : -1;
+			if(more && !paused && !starvedNow) {
+				fds.push_back(make_pair(from, (uint32_t)(EPOLLIN | EPOLLRDHUP)));
+				if(readTimeoutMs >= 0) {
+					timeoutMs = readTimeoutMs - (int)chrono::duration_cast<chrono::milliseconds>(
+						chrono::steady_clock::now() - quietSince).count();
+					if(timeoutMs <= 0) {
+						errno = ETIMEDOUT;
+						return FROM_FAILED;
+					}
+				}
+			} else {
+				quietSince = chrono::steady_clock::now(); // not waiting for `from`
+			}
+			if(fds.empty()) {
+				asyncSleep(BUDGET_RETRY_MS); // nothing to write, and no budget to read
+				continue;
+			}
+			asyncWaitAny(fds, timeoutMs);
+		}
+	}
+
+}
+	using zq29Inner::BoundedPipe;
+}
+
+#endif
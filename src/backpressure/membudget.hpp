@@ -0,0 +1,74 @@
+#ifndef ZQ29_MEMBUDGET
+#define ZQ29_MEMBUDGET
+
+#include <atomic>
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * a cap on bytes held across all connections, shared by all threads
+	 *
+	 * whoever wants to hold more bytes reserves them first, and gives
+	 * them back once they are gone, nothing is allocated here
+	 * a reservation either fits entirely or fails, it never blocks
+	*/
+	class MemoryBudget {
+	public:
+		MemoryBudget(const size_t limit);
+		MemoryBudget(const MemoryBudget& rhs) = delete;
+		MemoryBudget& operator=(const MemoryBudget& rhs) = delete;
+
+		bool tryReserve(const size_t n);
+		void release(const size_t n);
+
+		size_t used() const;
+		size_t limit() const;
+		/*
+		 * reservations that did not fit, since the start
+		*/
+		size_t refused() const;
+
+	private:
+		const size_t cap;
+		atomic<size_t> usedBytes;
+		atomic<size_t> refusedCount;
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// MemoryBudget Implementation ////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	MemoryBudget::MemoryBudget(const size_t limit) : cap(limit), usedBytes(0), refusedCount(0) {}
+
+	bool MemoryBudget::tryReserve(const size_t n) {
+		size_t current = usedBytes.load(memory_order_relaxed);
+		do {
+			if(n > cap || current > cap - n) {
+				refusedCount.fetch_add(1, memory_order_relaxed);
+				return false;
+			}
+		} while(!usedBytes.compare_exchange_weak(current, current + n, memory_order_relaxed));
+		return true;
+	}
+
+	void MemoryBudget::release(const size_t n) {
+		usedBytes.fetch_sub(n, memory_order_relaxed);
+	}
+
+	size_t MemoryBudget::used() const { return usedBytes.load(memory_order_relaxed); }
+	size_t MemoryBudget::limit() const { return cap; }
+	size_t MemoryBudget::refused() const { return refusedCount.load(memory_order_relaxed); }
+
+}
+	using zq29Inner::MemoryBudget;
+}
+
+#endif
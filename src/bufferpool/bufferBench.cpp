@@ -0,0 +1,98 @@
+/*
+ * This file:
+ * reads bytes from a socket the way recvAppend used to (a new 16M buffer
+ * per recv, copied twice) and with a pooled 64K buffer, and prints the
+ * throughput and how many allocations each one made
+ *
+ * usage: ./bufferBench [MB]
+*/
+#include <sys/socket.h>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "bufferpool.hpp"
+#include "../eventloop/fiber.hpp"
+
+using namespace zq29;
+using namespace std;
+
+size_t legacyAllocations = 0;
+
+/*
+ * what recvAppend used to do
+*/
+int legacyRecvAppend(const int socketFd, vector<char>& buffer) {
+	const size_t bufferSize = 16 * 1024 * 1024;
+	shared_ptr<char[]> charbuffer(new char[bufferSize]);
+	legacyAllocations += 2; // charbuffer and temp below
+	int len = asyncRecv(socketFd, charbuffer.get(), bufferSize);
+	if(len <= 0) { return len; }
+	const vector<char> temp(charbuffer.get(), charbuffer.get() + len);
+	buffer.insert(buffer.end(), temp.begin(), temp.end());
+	return len;
+}
+
+/*
+ * total bytes from a writer thread, read with reader until EOF
+*/
+void run(const string& name, const size_t total, const function<size_t(int)>& reader,
+	const function<size_t()>& allocations) {
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) { return; }
+	thread writer([&]() {
+		vector<char> chunk(256 * 1024, 'x');
+		size_t sent = 0;
+		while(sent < total) {
+			const ssize_t n = send(fds[1], chunk.data(), min(chunk.size(), total - sent), MSG_NOSIGNAL);
+			if(n <= 0) { break; }
+			sent += n;
+		}
+		close(fds[1]);
+	});
+	const size_t allocationsBefore = allocations();
+	const auto start = chrono::steady_clock::now();
+	const size_t received = reader(fds[0]);
+	const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	writer.join();
+	close(fds[0]);
+	if(received != total) {
+		cerr << "received " << received << " bytes, expected " << total << endl;
+	}
+	cout << name << received / 1048576.0 / seconds << " MB/s, "
+		<< allocations() - allocationsBefore << " allocations" << endl;
+}
+
+int main(int argc, char** argv) {
+	const size_t mb = argc > 1 ? atoi(argv[1]) : 1024;
+	const size_t total = mb * 1024 * 1024;
+	cout << "reading " << mb << " MB each way" << endl;
+
+	// both hand every read on, like relayStatus, instead of keeping it all
+	run("legacy 16M: ", total, [](int fd) {
+		size_t received = 0;
+		vector<char> buffer;
+		int len;
+		while((len = legacyRecvAppend(fd, buffer)) > 0) {
+			received += len;
+			buffer.clear();
+		}
+		return received;
+	}, []() { return legacyAllocations; });
+	run("pooled 64K: ", total, [](int fd) {
+		size_t received = 0;
+		ssize_t len;
+		do {
+			BufferPool::Buffer buffer = BufferPool::acquire(64 * 1024);
+			len = asyncRecv(fd, buffer.data(), buffer.capacity());
+			if(len > 0) { received += len; }
+		} while(len > 0);
+		return received;
+	}, []() {
+		const BufferPool::Stats s = BufferPool::stats();
+		return s.slabs + s.oversize;
+	});
+}
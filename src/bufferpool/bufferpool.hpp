@@ -0,0 +1,262 @@
+#ifndef ZQ29_BUFFERPOOL
+#define ZQ29_BUFFERPOOL
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * I/O buffers of a few fixed sizes, carved out of big slabs,
+	 * so reading from a socket never costs a malloc
+	 *
+	 * a request is rounded up to the next class (4K, 16K, 64K, 256K),
+	 * anything bigger is a plain allocation, counted as oversize
+	 *
+	 * every thread keeps its own free lists, acquire and release take no
+	 * lock unless a thread runs out, or has more than one slab's worth
+	 * slabs are never given back, they live as long as the process, so
+	 * a buffer may be released by any thread, it goes to that thread's list
+	 * the excess of a list, and the lists of an exiting thread, go to a
+	 * shared list, where the next thread that runs out finds them, so a
+	 * thread that only releases can't hoard buffers another one needs
+	*/
+	class BufferPool {
+	public:
+		static const size_t CLASS_COUNT = 4;
+		static const size_t MIN_CLASS_SIZE = 4 * 1024; // each class is 4 times the one before
+		static const size_t SLAB_SIZE = 1024 * 1024;
+
+		/*
+		 * owns one buffer until it is released or destroyed, move-only
+		*/
+		class Buffer {
+		public:
+			Buffer();
+			~Buffer();
+			Buffer(Buffer&& rhs);
+			Buffer& operator=(Buffer&& rhs);
+			Buffer(const Buffer& rhs) = delete;
+			Buffer& operator=(const Buffer& rhs) = delete;
+
+			char* data() const;
+			size_t capacity() const;
+			bool empty() const;
+			/*
+			 * back to the pool, the buffer is empty afterwards
+			*/
+			void release();
+
+		private:
+			friend class BufferPool;
+			Buffer(char* ptr, const size_t cap, const int cls);
+
+			char* ptr;
+			size_t cap;
+			int cls; // -1 if oversize
+		};
+
+		/*
+		 * a buffer of at least size bytes, its content is garbage
+		*/
+		static Buffer acquire(const size_t size);
+
+		/*
+		 * process-wide counters, since the start
+		*/
+		struct Stats {
+			size_t acquired; // buffers handed out
+			size_t reused; // of them, from a free list
+			size_t slabs; // slabs allocated
+			size_t slabBytes;
+			size_t oversize; // plain allocations above the largest class
+		};
+		static Stats stats();
+
+		static size_t classSize(const int cls);
+
+	private:
+		/*
+		 * -1 if size is above the largest class
+		*/
+		static int classOf(const size_t size);
+		static void release(char* ptr, const int cls);
+		/*
+		 * the most buffers of cls a thread keeps, one slab's worth
+		*/
+		static size_t perThread(const int cls);
+
+		struct ThreadCache {
+			vector<char*> free[CLASS_COUNT];
+			~ThreadCache();
+		};
+		static ThreadCache& cache();
+
+		static mutex sharedMutex;
+		static vector<char*> shared[CLASS_COUNT];
+		static vector<unique_ptr<char[]>> slabs;
+
+		static atomic<size_t> acquiredCount;
+		static atomic<size_t> reusedCount;
+		static atomic<size_t> slabCount;
+		static atomic<size_t> slabByteCount;
+		static atomic<size_t> oversizeCount;
+	};
+	mutex BufferPool::sharedMutex;
+	vector<char*> BufferPool::shared[BufferPool::CLASS_COUNT];
+	vector<unique_ptr<char[]>> BufferPool::slabs;
+	atomic<size_t> BufferPool::acquiredCount(0);
+	atomic<size_t> BufferPool::reusedCount(0);
+	atomic<size_t> BufferPool::slabCount(0);
+	atomic<size_t> BufferPool::slabByteCount(0);
+	atomic<size_t> BufferPool::oversizeCount(0);
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Buffer Implementation //////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	BufferPool::Buffer::Buffer() : ptr(nullptr), cap(0), cls(-1) {}
+
+	BufferPool::Buffer::Buffer(char* ptr, const size_t cap, const int cls) :
+		ptr(ptr), cap(cap), cls(cls) {}
+
+	BufferPool::Buffer::~Buffer() {
+		release();
+	}
+
+	BufferPool::Buffer::Buffer(Buffer&& rhs) : ptr(rhs.ptr), cap(rhs.cap), cls(rhs.cls) {
+		rhs.ptr = nullptr;
+		rhs.cap = 0;
+	}
+
+	BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& rhs) {
+		if(this != &rhs) {
+			release();
+			ptr = rhs.ptr;
+			cap = rhs.cap;
+			cls = rhs.cls;
+			rhs.ptr = nullptr;
+			rhs.cap = 0;
+		}
+		return *this;
+	}
+
+	char* BufferPool::Buffer::data() const { return ptr; }
+	size_t BufferPool::Buffer::capacity() const { return cap; }
+	bool BufferPool::Buffer::empty() const { return ptr == nullptr; }
+
+	void BufferPool::Buffer::release() {
+		if(ptr == nullptr) { return; }
+		BufferPool::release(ptr, cls);
+		ptr = nullptr;
+		cap = 0;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// BufferPool Implementation //////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	BufferPool::ThreadCache::~ThreadCache() {
+		lock_guard<mutex> lock(sharedMutex);
+		for(size_t i = 0; i < CLASS_COUNT; i++) {
+			shared[i].insert(shared[i].end(), free[i].begin(), free[i].end());
+		}
+	}
+
+	BufferPool::ThreadCache& BufferPool::cache() {
+		static thread_local ThreadCache c;
+		return c;
+	}
+
+	size_t BufferPool::classSize(const int cls) {
+		return MIN_CLASS_SIZE << (2 * cls);
+	}
+
+	size_t BufferPool::perThread(const int cls) {
+		return SLAB_SIZE / classSize(cls);
+	}
+
+	int BufferPool::classOf(const size_t size) {
+		for(size_t i = 0; i < CLASS_COUNT; i++) {
+			if(size <= classSize(i)) { return (int)i; }
+		}
+		return -1;
+	}
+
+	BufferPool::Buffer BufferPool::acquire(const size_t size) {
+		acquiredCount.fetch_add(1, memory_order_relaxed);
+		const int cls = classOf(size);
+		if(cls < 0) {
+			oversizeCount.fetch_add(1, memory_order_relaxed);
+			return Buffer(new char[size], size, -1);
+		}
+
+		vector<char*>& free = cache().free[cls];
+		if(!free.empty()) {
+			reusedCount.fetch_add(1, memory_order_relaxed);
+		} else {
+			lock_guard<mutex> lock(sharedMutex);
+			if(!shared[cls].empty()) {
+				// up to half a slab's worth, not to come back for each one
+				reusedCount.fetch_add(1, memory_order_relaxed);
+				const size_t n = min(shared[cls].size(), max(perThread(cls) / 2, (size_t)1));
+				free.insert(free.end(), shared[cls].end() - n, shared[cls].end());
+				shared[cls].resize(shared[cls].size() - n);
+			} else {
+				// a new slab, cut into buffers of this class
+				const size_t bufferSize = classSize(cls);
+				slabs.push_back(unique_ptr<char[]>(new char[SLAB_SIZE]));
+				slabCount.fetch_add(1, memory_order_relaxed);
+				slabByteCount.fetch_add(SLAB_SIZE, memory_order_relaxed);
+				for(size_t offset = 0; offset + bufferSize <= SLAB_SIZE; offset += bufferSize) {
+					free.push_back(slabs.back().get() + offset);
+				}
+			}
+		}
+		char* const ptr = free.back();
+		free.pop_back();
+		return Buffer(ptr, classSize(cls), cls);
+	}
+
+	void BufferPool::release(char* ptr, const int cls) {
+		if(cls < 0) {
+			delete[] ptr;
+			return;
+		}
+		vector<char*>& free = cache().free[cls];
+		free.push_back(ptr);
+		if(free.size() > perThread(cls)) {
+			// keep half, the oldest ones go where other threads find them
+			const size_t n = free.size() - perThread(cls) / 2;
+			lock_guard<mutex> lock(sharedMutex);
+			shared[cls].insert(shared[cls].end(), free.begin(), free.begin() + n);
+			free.erase(free.begin(), free.begin() + n);
+		}
+	}
+
+	BufferPool::Stats BufferPool::stats() {
+		Stats s;
+		s.acquired = acquiredCount.load(memory_order_relaxed);
+		s.reused = reusedCount.load(memory_order_relaxed);
+		s.slabs = slabCount.load(memory_order_relaxed);
+		s.slabBytes = slabByteCount.load(memory_order_relaxed);
+		s.oversize = oversizeCount.load(memory_order_relaxed);
+		return s;
+	}
+
+}
+	using zq29Inner::BufferPool;
+}
+
+#endif
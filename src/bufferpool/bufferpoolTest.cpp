@@ -0,0 +1,186 @@
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <thread>
+
+#include "bufferpool.hpp"
+
+using namespace zq29;
+using namespace std;
+
+void testSizeClasses() {
+	const string TAG = "testSizeClasses";
+	bool failFlag = false;
+
+	const vector<pair<size_t, size_t>> cases = {
+		{ 1, 4 * 1024 },
+		{ 4 * 1024, 4 * 1024 },
+		{ 4 * 1024 + 1, 16 * 1024 },
+		{ 64 * 1024, 64 * 1024 },
+		{ 200 * 1024, 256 * 1024 },
+		{ 256 * 1024 + 1, 256 * 1024 + 1 } // oversize, exactly what was asked
+	};
+	const BufferPool::Stats before = BufferPool::stats();
+	for(auto const& c : cases) {
+		BufferPool::Buffer b = BufferPool::acquire(c.first);
+		if(b.empty() || b.capacity() != c.second) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("asked ", c.first, ", got ", b.capacity()));
+		}
+		memset(b.data(), 'x', b.capacity());
+	}
+	const BufferPool::Stats after = BufferPool::stats();
+	if(after.acquired - before.acquired != cases.size() || after.oversize - before.oversize != 1) {
+		failFlag = true;
+		Log::testFail(TAG, "counters");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+void testReuse() {
+	const string TAG = "testReuse";
+	bool failFlag = false;
+
+	// one at a time, the same buffer again and again
+	const BufferPool::Stats before = BufferPool::stats();
+	for(int i = 0; i < 1000; i++) {
+		BufferPool::Buffer b = BufferPool::acquire(64 * 1024);
+		b.data()[0] = (char)i;
+	}
+	BufferPool::Stats after = BufferPool::stats();
+	if(after.slabs - before.slabs > 1 || after.reused - before.reused < 999) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(after.slabs - before.slabs, " slabs, ", after.reused - before.reused, " reused"));
+	}
+
+	// many at once never overlap
+	vector<BufferPool::Buffer> held;
+	for(int i = 0; i < 40; i++) {
+		held.push_back(BufferPool::acquire(16 * 1024));
+		memset(held.back().data(), 'a' + i % 26, held.back().capacity());
+	}
+	for(int i = 0; i < 40; i++) {
+		for(size_t j = 0; j < held[i].capacity(); j++) {
+			if(held[i].data()[j] != 'a' + i % 26) {
+				failFlag = true;
+				Log::testFail(TAG, Log::msg("buffer ", i, " was overwritten"));
+				break;
+			}
+		}
+	}
+
+	// moves hand the buffer over, release empties it
+	BufferPool::Buffer moved(move(held[0]));
+	if(!held[0].empty() || moved.empty()) {
+		failFlag = true;
+		Log::testFail(TAG, "move");
+	}
+	moved.release();
+	if(!moved.empty() || moved.capacity() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, "release");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * buffers released on another thread, and left behind by a thread that exited
+*/
+void testThreads() {
+	const string TAG = "testThreads";
+	bool failFlag = false;
+
+	vector<BufferPool::Buffer> fromThread;
+	thread t([&fromThread]() {
+		for(int i = 0; i < 8; i++) { fromThread.push_back(BufferPool::acquire(256 * 1024)); }
+	});
+	t.join();
+	fromThread.clear(); // released here, on the main thread
+
+	// a thread that only releases, then exits, leaves its lists behind
+	BufferPool::Buffer b = BufferPool::acquire(4 * 1024);
+	thread releaser([&b]() { b.release(); });
+	releaser.join();
+
+	const BufferPool::Stats before = BufferPool::stats();
+	thread user([]() {
+		BufferPool::Buffer again = BufferPool::acquire(4 * 1024);
+		memset(again.data(), 0, again.capacity());
+	});
+	user.join();
+	for(int i = 0; i < 8; i++) {
+		fromThread.push_back(BufferPool::acquire(256 * 1024));
+	}
+	const BufferPool::Stats after = BufferPool::stats();
+	if(after.slabs != before.slabs || after.reused - before.reused != 9) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(after.slabs - before.slabs, " new slabs, ",
+			after.reused - before.reused, " reused"));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * one thread only acquires, another only releases, both keep running:
+ * the releaser must not hoard what the acquirer needs
+*/
+void testCrossThreads() {
+	const string TAG = "testCrossThreads";
+	bool failFlag = false;
+
+	const int ROUNDS = 5000;
+	const size_t IN_FLIGHT = 16;
+	mutex m;
+	condition_variable cv;
+	deque<BufferPool::Buffer> handed;
+	bool done = false;
+
+	const BufferPool::Stats before = BufferPool::stats();
+	thread releaser([&]() {
+		unique_lock<mutex> lock(m);
+		while(true) {
+			cv.wait(lock, [&]() { return !handed.empty() || done; });
+			if(handed.empty()) { return; }
+			BufferPool::Buffer b = move(handed.front());
+			handed.pop_front();
+			lock.unlock();
+			cv.notify_all();
+			b.release();
+			lock.lock();
+		}
+	});
+	thread acquirer([&]() {
+		for(int i = 0; i < ROUNDS; i++) {
+			BufferPool::Buffer b = BufferPool::acquire(16 * 1024);
+			memset(b.data(), i, b.capacity());
+			unique_lock<mutex> lock(m);
+			cv.wait(lock, [&]() { return handed.size() < IN_FLIGHT; });
+			handed.push_back(move(b));
+			cv.notify_all();
+		}
+		lock_guard<mutex> lock(m);
+		done = true;
+		cv.notify_all();
+	});
+	acquirer.join();
+	releaser.join();
+	const BufferPool::Stats after = BufferPool::stats();
+	// 16 in flight and a slab's worth kept by each thread fit in a few slabs
+	if(after.slabs - before.slabs > 3) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(after.slabs - before.slabs, " new slabs for ", ROUNDS, " buffers"));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testSizeClasses();
+	testReuse();
+	testThreads();
+	testCrossThreads();
+}
@@ -1,6 +1,9 @@
 #ifndef ZQ29_CACHE
 #define ZQ29_CACHE
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
 #include <filesystem> // C++ 17 required
 #include <thread>
 #include <mutex>
@@ -56,9 +59,28 @@ namespace zq29Inner {
 		 * if id already exists, override
 		 * you should make id an valid filename, 
 		 * or you will get exceptions, or worse, undefined behaviors
+		 *
+		 * msg goes to a hidden file first, which is then renamed over id,
+		 * so whoever has the old file open keeps reading the old content
 		*/
 		void save(const string& id, const string& msg) const;
 
+		/*
+		 * save in two steps, so the rename can happen at a time of your
+		 * choosing: stage writes the hidden file, commit renames it over id
+		 * staged: the hidden file of that id is renamed instead, if given
+		*/
+		void stage(const string& id, const string& msg) const;
+		void commit(const string& id, const string& staged = noid) const;
+
+		/*
+		 * stage a message that comes in pieces, write them to the returned fd
+		 * and close it, then commit the file or discard it
+		 * openStaged throws if the hidden file can't be made
+		*/
+		int openStaged(const string& id) const;
+		void discard(const string& id) const;
+
 		/*
 		 * return the 1st found id with the same content as msg
 		 * if msg not existing in the cache, return noid
@@ -125,11 +147,16 @@ namespace zq29Inner {
 	}
 
 	void Cache::save(const string& id, const string& msg) const {
+		stage(id, msg);
+		commit(id);
+	}
+
+	void Cache::stage(const string& id, const string& msg) const {
 		newWdirIfNone();
 		ofstream ofs;
-		fs::path newEntry(wdir);
-		newEntry += "/" + id;
-		ofs.open(newEntry);
+		fs::path tempEntry(wdir);
+		tempEntry += "/." + id + ".part";
+		ofs.open(tempEntry);
 		if(!ofs) {
 			throw CacheException(Log::msg("on save, failed to open file <", id, ">"));
 		}
@@ -137,6 +164,36 @@ namespace zq29Inner {
 		ofs.close();
 	}
 
+	int Cache::openStaged(const string& id) const {
+		newWdirIfNone();
+		fs::path tempEntry(wdir);
+		tempEntry += "/." + id + ".part";
+		const int fd = open(tempEntry.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(fd < 0) {
+			throw CacheException(Log::msg("on save, failed to open file <", id, ">, ", strerror(errno)));
+		}
+		return fd;
+	}
+
+	void Cache::discard(const string& id) const {
+		fs::path tempEntry(wdir);
+		tempEntry += "/." + id + ".part";
+		error_code ec;
+		fs::remove(tempEntry, ec);
+	}
+
+	void Cache::commit(const string& id, const string& staged) const {
+		fs::path newEntry(wdir);
+		newEntry += "/" + id;
+		fs::path tempEntry(wdir);
+		tempEntry += "/." + (staged == noid ? id : staged) + ".part";
+		try {
+			fs::rename(tempEntry, newEntry);
+		} catch(const fs::filesystem_error& e) {
+			throw CacheException(e.what());
+		}
+	}
+
 	string Cache::getIdByMsg(const string& msg) const {
 		if(!is_directory(wdir)) { return noid; }
 		for(auto const& file : fs::directory_iterator(wdir)) {
@@ -164,17 +221,12 @@ namespace zq29Inner {
 	}
 
 	void Cache::remove(const string& id) {
-		if(!is_directory(wdir)) { return; }
-		for(auto const& file : fs::directory_iterator(wdir)) {
-			if(!is_regular_file(file.path())) { continue; }
-			if(id == file.path().filename()) {
-				try {
-					fs::remove(file.path());
-				} catch(const fs::filesystem_error& e) {
-					throw CacheException(e.what());
-				}
-				break;
-			}
+		fs::path filename(wdir);
+		filename += "/" + id;
+		try {
+			fs::remove(filename);
+		} catch(const fs::filesystem_error& e) {
+			throw CacheException(e.what());
 		}
 	}
 
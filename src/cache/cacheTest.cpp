@@ -1,13 +1,52 @@
+#include <sys/socket.h>
+
+#include <atomic>
 #include <iostream>
 #include <fstream>
+#include <thread>
 
 #include "cache.hpp"
 #include "httpproxycache.hpp"
+#include "cachewriter.hpp"
+#include "collapser.hpp"
+#include "../eventloop/fiber.hpp"
 
 using namespace zq29;
 using namespace std;
 namespace fs = std::filesystem;	
 
+/*
+ * the body of a stored response, read from its file
+*/
+string storedBody(const HTTPProxyCache::StoredResponse& stored) {
+	string s(stored.bodyLength(), 0);
+	if(pread(stored.fd(), &s[0], s.size(), stored.bodyOffset()) != (ssize_t)s.size()) { return ""; }
+	return s;
+}
+
+/*
+ * a GET for url, with the Host it names
+*/
+HTTPRequest getRequest(const string& url) {
+	HTTPRequest::RequestLine rl;
+	rl.method = "GET";
+	rl.requestTarget = url;
+	rl.httpVersion = "HTTP/1.1";
+	const size_t host = url.find("://") + 3;
+	return HTTPRequest(rl, { { "Host", url.substr(host, url.find('/', host) - host) } }, "");
+}
+
+/*
+ * a 200 OK with body, fresh for 10 minutes
+*/
+HTTPStatus okResponse(const string& body) {
+	HTTPStatus::StatusLine sl;
+	sl.httpVersion = "HTTP/1.1";
+	sl.statusCode = "200";
+	sl.reasonPhrase = "OK";
+	return HTTPStatus(sl, { { "Content-Length", to_string(body.size()) }, { "Cache-Control", "max-age=600" } }, body);
+}
+
 void testCacheBasic() {
 	const string TAG = "testCacheBasic";
 	bool failFlag = false;
@@ -143,11 +182,427 @@ void testFreshness() {
 	HTTPSemantics::isCacheable(req, resp);
 }
 
+void testCacheWriter() {
+	const string TAG = "testCacheWriter";
+	bool failFlag = false;
+
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	HTTPStatus head = okResponse("0123456789");
+	head.messageBody.clear(); // the body goes through the writer
+
+	// complete, in pieces
+	{
+		CacheWriter writer(cache, getRequest("http://writer.test/complete"), head, cache.offerId(), 1024);
+		writer.write("01234", 5);
+		writer.write("56789", 5);
+		if(writer.commit() == Cache::noid) {
+			failFlag = true;
+			Log::testFail(TAG, "complete response not saved");
+		}
+		const auto saved = cache.getStaByReq(getRequest("http://writer.test/complete").requestLine);
+		const string body = saved.stored == nullptr ? "" : storedBody(*saved.stored);
+		if(saved.id == Cache::noid || body != "0123456789") {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("saved body <", body, ">"));
+		}
+	}
+
+	// cut in the middle, or too large
+	{
+		CacheWriter writer(cache, getRequest("http://writer.test/cut"), head, cache.offerId(), 1024);
+		writer.write("01234", 5);
+	}
+	CacheWriter large(cache, getRequest("http://writer.test/large"), head, cache.offerId(), 8);
+	large.write("01234", 5);
+	large.write("56789", 5);
+	if(large.collecting() || large.commit() != Cache::noid) {
+		failFlag = true;
+		Log::testFail(TAG, "too large response saved");
+	}
+	for(const char* target : { "http://writer.test/cut", "http://writer.test/large" }) {
+		if(cache.getStaByReq(getRequest(target).requestLine).id != Cache::noid) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("<", target, "> is in the cache"));
+		}
+	}
+	// what they had written so far is gone too
+	for(auto const& file : fs::directory_iterator(cache.getWdir())) {
+		if(file.path().filename().string()[0] == '.') {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("<", file.path().filename(), "> left behind"));
+		}
+	}
+
+	// not cacheable at all, nothing is kept
+	HTTPStatus noStore(head);
+	noStore.headerFields.insert(make_pair("Cache-Control", "no-store"));
+	CacheWriter uncacheable(cache, getRequest("http://writer.test/no-store"), noStore, cache.offerId(), 1024);
+	if(uncacheable.collecting()) {
+		failFlag = true;
+		Log::testFail(TAG, "collecting a no-store response");
+	}
+	if(uncacheable.commit() != Cache::noid) {
+		failFlag = true;
+		Log::testFail(TAG, "a no-store response was reported as saved");
+	}
+
+	// followers of a flight whose response was not saved ask the server
+	// themselves, so they must not be told it's in the cache
+	Collapser collapser;
+	Collapser::Ticket leader = collapser.join("GET http://writer.test/collapsed HTTP/1.1");
+	Collapser::Ticket ticket = collapser.join("GET http://writer.test/collapsed HTTP/1.1");
+	Collapser::Flight::State got = Collapser::Flight::PENDING;
+	thread follower([&]() {
+		Collapser::Follower f(ticket.flight());
+		got = f.waitForHead();
+	});
+	{
+		CacheWriter writer(cache, getRequest("http://writer.test/collapsed"), noStore, cache.offerId(), 1024);
+		writer.write("0123456789", 10);
+		// as the proxy's relayStatus does once the body is complete
+		leader.flight()->finish(writer.commit() != Cache::noid ? Collapser::Flight::CACHED : Collapser::Flight::FAILED);
+	}
+	follower.join();
+	if(got != Collapser::Flight::FAILED) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("a follower of a no-store response got state ", got));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * a hit is sent as the stored head and the body from the file,
+ * and keeps its file even when the entry is replaced meanwhile
+*/
+void testStoredResponse() {
+	const string TAG = "testStoredResponse";
+	bool failFlag = false;
+
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	const HTTPRequest req = getRequest("http://stored.test/big");
+	string body(3 * 1024 * 1024 + 7, 0);
+	for(size_t i = 0; i < body.size(); i++) { body[i] = (char)(i * 7 + i / 251); }
+	const HTTPStatus sta = okResponse(body);
+	cache.save(req, sta);
+
+	const auto result = cache.constructResponse(req);
+	if(result.action != 0 || result.stored == nullptr) {
+		Log::testFail(TAG, Log::msg("action ", result.action, ", not a hit"));
+		return;
+	}
+	const HTTPProxyCache::StoredResponse& stored = *result.stored;
+	if(stored.head() != sta.headerToStr() || (size_t)stored.bodyOffset() != stored.head().size()
+		|| stored.bodyLength() != body.size() || !result.resp.messageBody.empty()) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("head of ", stored.head().size(), " bytes, body of ",
+			stored.bodyLength(), " at ", stored.bodyOffset()));
+	}
+
+	// what the client gets
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		Log::testFail(TAG, "cannot make sockets");
+		return;
+	}
+	string got;
+	thread reader([&]() {
+		char buf[65536];
+		ssize_t n;
+		while((n = recv(fds[1], buf, sizeof(buf), 0)) > 0) { got.append(buf, n); }
+	});
+	asyncSend(fds[0], stored.head().data(), stored.head().size());
+	if(asyncSendFile(fds[0], stored.fd(), stored.bodyOffset(), stored.bodyLength()) != (ssize_t)body.size()) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("asyncSendFile: ", strerror(errno)));
+	}
+	close(fds[0]);
+	reader.join();
+	close(fds[1]);
+	if(got != sta.toStr()) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("client got ", got.size(), " bytes, expected ", sta.toStr().size()));
+	}
+
+	// replaced while still open
+	const HTTPStatus newer = okResponse("new");
+	cache.save(req, newer);
+	if(storedBody(stored) != body) {
+		failFlag = true;
+		Log::testFail(TAG, "an open entry changed under its reader");
+	}
+	const auto again = cache.constructResponse(req);
+	if(again.stored == nullptr || storedBody(*again.stored) != "new") {
+		failFlag = true;
+		Log::testFail(TAG, "the replaced entry is not served");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * lookups go through the index: keys are normalized, a rebuilt index
+ * finds what was saved, removed entries are gone from disk too
+*/
+void testIndex() {
+	const string TAG = "testIndex";
+	bool failFlag = false;
+
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	const HTTPRequest req = getRequest("http://index.test/Path?q=A");
+	const HTTPRequest::RequestLine& rl = req.requestLine;
+	const HTTPStatus sta = okResponse("index");
+	const string id = cache.save(req, sta);
+
+	HTTPRequest::RequestLine upper = rl;
+	upper.requestTarget = "HTTP://INDEX.TEST/Path?q=A";
+	HTTPRequest::RequestLine otherPath = rl;
+	otherPath.requestTarget = "http://index.test/path?q=A";
+	if(cache.getStaByReq(upper).id != id || cache.getStaByReq(otherPath).id != HTTPProxyCache::noid) {
+		failFlag = true;
+		Log::testFail(TAG, "scheme and host are case-insensitive, the path is not");
+	}
+
+	// as after a restart, with the leftover of an interrupted save
+	const string part = cache.getWdir() + "/.interrupted.part";
+	ofstream(part) << "half a response";
+	const size_t entries = cache.usedEntries();
+	cache.buildIndex();
+	auto res = cache.getStaByReq(rl);
+	if(res.id != id || res.stored == nullptr || storedBody(*res.stored) != "index" || res.respTime == 0
+		|| cache.usedEntries() != entries
+		|| cache.shardOf(HTTPProxyCache::cacheKey(rl)).entries.at(HTTPProxyCache::cacheKey(rl)).size != sta.toStr().size()) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("rebuilt index found <", res.id, ">, not <", id, ">"));
+	}
+	if(fs::exists(part)) {
+		failFlag = true;
+		Log::testFail(TAG, "leftover of an interrupted save not removed");
+	}
+
+	if(!cache.removeByReq(rl) || cache.removeByReq(rl) || cache.getStaByReq(rl).id != HTTPProxyCache::noid
+		|| fs::exists(cache.getWdir() + "/" + cache.getReqName(id))
+		|| fs::exists(cache.getWdir() + "/" + cache.getStaName(id))) {
+		failFlag = true;
+		Log::testFail(TAG, "removeByReq");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * readers on many keys while one of them is saved over and over:
+ * a reader never misses it, and always gets a head and body of one save
+*/
+void testShardedIndex() {
+	const string TAG = "testShardedIndex";
+	bool failFlag = false;
+
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	auto request = [](const int k) { return getRequest(Log::msg("http://shards.test/", k)); };
+	auto response = [](const size_t len) { return okResponse(string(len, 'x')); };
+	const int KEYS = 32;
+	for(int k = 0; k < KEYS; k++) { cache.save(request(k), response(10 + k)); }
+
+	atomic<bool> done(false);
+	atomic<size_t> bad(0), reads(0);
+	vector<thread> readers;
+	for(int i = 0; i < 4; i++) {
+		readers.push_back(thread([&, i]() {
+			for(int j = 0; !done; j++) {
+				const int k = (i + j) % KEYS;
+				const auto res = cache.getStaByReq(request(k).requestLine);
+				reads++;
+				if(res.id == HTTPProxyCache::noid || res.stored == nullptr
+					|| res.stored->head().find(Log::msg("Content-Length: ", res.stored->bodyLength(), "\r\n")) == string::npos
+					|| storedBody(*res.stored) != string(res.stored->bodyLength(), 'x')) {
+					bad++;
+				}
+			}
+		}));
+	}
+	for(size_t len = 1; len <= 300; len++) { cache.save(request(0), response(len)); }
+	done = true;
+	for(auto& t : readers) { t.join(); }
+
+	if(bad != 0 || reads == 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(bad.load(), " of ", reads.load(), " reads were wrong"));
+	}
+	for(int k = 0; k < KEYS; k++) { cache.removeByReq(request(k).requestLine); }
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * the least recently used entries go once the cache is above its high
+ * watermark, down to the low one, and their files go soon after
+*/
+void testEviction() {
+	const string TAG = "testEviction";
+	bool failFlag = false;
+
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	const HTTPStatus sta = okResponse(string(100, 'e'));
+	const size_t size = sta.toStr().size();
+	auto request = [](const int k) { return getRequest(Log::msg("http://evict.test/", k)); };
+
+	// at most one entry, down to none: everything goes
+	cache.setCapacity({ 0, 1, 100, 0 });
+	if(cache.usedEntries() != 0 || cache.usedBytes() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(cache.usedEntries(), " entries of ", cache.usedBytes(), " bytes left"));
+	}
+
+	const size_t evictedBefore = cache.evicted();
+	cache.setCapacity({ 10 * size, 0, 100, 50 });
+	vector<string> ids;
+	for(int k = 0; k < 10; k++) { ids.push_back(cache.save(request(k), sta)); }
+	cache.getStaByReq(request(0).requestLine); // 0 is used, 1 is the least recently used now
+	if(cache.usedBytes() != 10 * size || cache.evicted() != evictedBefore) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("evicted below the high watermark, ", cache.usedBytes(), " bytes left"));
+	}
+	cache.save(request(10), sta);
+	if(cache.usedBytes() != 5 * size || cache.usedEntries() != 5 || cache.evicted() != evictedBefore + 6) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(cache.usedEntries(), " entries of ", cache.usedBytes(), " bytes left"));
+	}
+	for(int k = 0; k <= 10; k++) {
+		const bool kept = cache.getStaByReq(request(k).requestLine).id != HTTPProxyCache::noid;
+		if(kept != (k == 0 || k >= 7)) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg(k, (kept ? " kept" : " evicted")));
+		}
+	}
+
+	const string evictedFile = cache.getWdir() + "/" + cache.getStaName(ids[1]);
+	for(int i = 0; i < 100 && fs::exists(evictedFile); i++) { this_thread::sleep_for(chrono::milliseconds(10)); }
+	if(fs::exists(evictedFile) || !fs::exists(cache.getWdir() + "/" + cache.getStaName(ids[0]))) {
+		failFlag = true;
+		Log::testFail(TAG, "files of evicted entries not removed");
+	}
+
+	cache.setCapacity({ 0, 0, 100, 100 });
+	for(int k = 0; k <= 10; k++) { cache.removeByReq(request(k).requestLine); }
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * a full cache with TinyLFU: a key asked for once doesn't get in, one
+ * asked for more often than the least recently used entry does
+*/
+void testTinyLfu() {
+	const string TAG = "testTinyLfu";
+	bool failFlag = false;
+
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	const HTTPStatus sta = okResponse("lfu!");
+	auto request = [](const string& k) { return getRequest("http://lfu.test/" + k); };
+	// what a client does: look, miss, fetch, save
+	auto ask = [&](const string& k, const int times) {
+		for(int i = 0; i < times; i++) { cache.constructResponse(request(k)); }
+		return cache.save(request(k), sta);
+	};
+
+	cache.setCapacity({ 0, 1, 100, 0 }); // empty it
+	cache.setCapacity({ 0, 4, 100, 75, true });
+	for(int k = 0; k < 4; k++) { ask(Log::msg("popular", k), 3); }
+	const size_t rejectedBefore = cache.rejected();
+	if(ask("once", 1) != HTTPProxyCache::noid) {
+		failFlag = true;
+		Log::testFail(TAG, "a rejected response was reported as saved");
+	}
+	if(cache.rejected() != rejectedBefore + 1 || cache.usedEntries() != 4
+		|| cache.getStaByReq(request("once").requestLine).id != HTTPProxyCache::noid) {
+		failFlag = true;
+		Log::testFail(TAG, "a one-hit wonder got in");
+	}
+	ask("rising", 5);
+	if(cache.rejected() != rejectedBefore + 1 || cache.getStaByReq(request("rising").requestLine).id == HTTPProxyCache::noid
+		|| cache.getStaByReq(request("popular0").requestLine).id != HTTPProxyCache::noid) {
+		failFlag = true;
+		Log::testFail(TAG, "a popular key was kept out");
+	}
+
+	cache.setCapacity({ 0, 0, 100, 100 });
+	for(int k = 0; k < 4; k++) { cache.removeByReq(request(Log::msg("popular", k)).requestLine); }
+	cache.removeByReq(request("rising").requestLine);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * a scan through a full cache: LRU lets it push out the entries that
+ * were used, S3-FIFO keeps them
+*/
+void testEvictionPolicy() {
+	const string TAG = "testEvictionPolicy";
+	bool failFlag = false;
+
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	const HTTPStatus sta = okResponse("scan");
+	auto request = [](const string& k) { return getRequest("http://policy.test/" + k); };
+
+	for(const string policy : { "lru", "s3fifo" }) {
+		cache.setCapacity({ 0, 1, 100, 0 }); // empty it
+		cache.setCapacity({ 0, 10, 100, 90, false, policy });
+		for(int k = 0; k < 10; k++) { cache.save(request(Log::msg("hot", k)), sta); }
+		for(int k = 0; k < 5; k++) { cache.getStaByReq(request(Log::msg("hot", k)).requestLine); }
+		for(int k = 0; k < 15; k++) { cache.save(request(Log::msg("scan", k)), sta); }
+		int kept = 0;
+		for(int k = 0; k < 5; k++) {
+			if(cache.getStaByReq(request(Log::msg("hot", k)).requestLine).id != HTTPProxyCache::noid) { kept++; }
+		}
+		if(cache.usedEntries() > 10 || kept != (policy == "lru" ? 0 : 5)) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg(policy, " kept ", kept, " used entries of ", cache.usedEntries()));
+		}
+	}
+
+	cache.setCapacity({ 0, 1, 100, 0, false, "nope" }); // falls back to lru, and empties it
+	if(cache.usedEntries() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, "unknown policy");
+	}
+	cache.setCapacity({ 0, 0, 100, 100 });
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * ids keep coming past a refill of the pool, none twice and none that
+ * a file in wdir already has
+*/
+void testOfferId() {
+	const string TAG = "testOfferId";
+	bool failFlag = false;
+
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	set<string> ids;
+	for(size_t i = 0; i < 250; i++) {
+		const string id = cache.offerId();
+		if(!ids.insert(id).second || fs::exists(fs::path(cache.getWdir()) / ("request_" + id))) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("id <", id, "> offered again or already in use"));
+			break;
+		}
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
 int main() {
 	testCacheBasic();
 	//testCacheRemoveAll();
 	testHTTPProxyCacheBasic();
 	testTime();
 	testGetStaByReq();
+	testCacheWriter();
+	testStoredResponse();
+	testIndex();
+	testShardedIndex();
+	testEviction();
+	testTinyLfu();
+	testEvictionPolicy();
+	testOfferId();
 	testFreshness();
 }
\ No newline at end of file
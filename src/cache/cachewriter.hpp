@@ -0,0 +1,186 @@
+#ifndef ZQ29_CACHEWRITER
+#define ZQ29_CACHEWRITER
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+
+#include "../log.hpp"
+#include "../httpparser/httpparser.hpp"
+#include "httpproxycache.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * collects a response while it is streamed to the client, and
+	 * saves it to the cache once all of it went through
+	 *
+	 * only bodies the cache would keep are collected (GET, 200, cacheable)
+	 * and only up to maxBytes, for anything else write() costs nothing
+	 * the head and body go straight to a staged file (Cache::openStaged),
+	 * so a writer holds no body in memory, whatever its size
+	 * nothing is saved unless commit() is called, a response that was
+	 * cut in the middle goes away with the writer, and its file too
+	*/
+	class CacheWriter {
+	public:
+		/*
+		 * head: the status without its body, as HTTPStatusParser::buildHead builds it
+		 * id: as for HTTPProxyCache::save
+		*/
+		CacheWriter(HTTPProxyCache& cache, const HTTPRequest& req, const HTTPStatus& head,
+			const string& id, const size_t maxBytes);
+		~CacheWriter();
+		CacheWriter(const CacheWriter& rhs) = delete;
+		CacheWriter& operator=(const CacheWriter& rhs) = delete;
+
+		/*
+		 * the next bytes of the body, as they came from the server
+		*/
+		void write(const char* data, const size_t len);
+
+		/*
+		 * the whole body has been written, save it if it is worth it
+		 * returns the id from HTTPProxyCache::save, noid if nothing was saved
+		*/
+		string commit();
+
+		/*
+		 * whether write() still keeps the bytes
+		*/
+		bool collecting() const;
+
+	private:
+		HTTPProxyCache& cache;
+		const HTTPRequest req;
+		const HTTPStatus status;
+		const string id;
+		const size_t maxBytes;
+		bool wanted;
+		bool tooLarge;
+		bool committed;
+		string staged; // the hidden file, noid if there is none
+		int fd; // of it, -1 once closed
+		size_t written; // to it, the head too
+		size_t bodyBytes;
+
+		static atomic<size_t> counter;
+
+		/*
+		 * write all of it to the file, false if it can't
+		*/
+		bool writeFile(const char* data, const size_t len);
+		/*
+		 * close and remove the file, nothing is collected any more
+		*/
+		void drop();
+	};
+	atomic<size_t> CacheWriter::counter(0);
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// CacheWriter Implementation /////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	CacheWriter::CacheWriter(HTTPProxyCache& cache, const HTTPRequest& req, const HTTPStatus& head,
+		const string& id, const size_t maxBytes) :
+		cache(cache), req(req), status(head), id(id), maxBytes(maxBytes),
+		wanted(false), tooLarge(false), committed(false), staged(Cache::noid), fd(-1), written(0), bodyBytes(0)
+	{
+		wanted = req.requestLine.method == "GET" && head.statusLine.statusCode == "200" &&
+			HTTPSemantics::isCacheable(req, head).isCacheable;
+		if(!wanted) { return; }
+		// unique across proxies sharing the directory, see ListenerHandoff
+		staged = Log::msg("writer_", getpid(), "_", counter++);
+		try {
+			fd = cache.openStaged(staged);
+		} catch(const exception& e) {
+			Log::warning(Log::msg("in CacheWriter: ", e.what()));
+			staged = Cache::noid;
+			wanted = false;
+			return;
+		}
+		const string h = head.headerToStr();
+		if(!writeFile(h.data(), h.size())) { drop(); }
+	}
+
+	CacheWriter::~CacheWriter() {
+		drop();
+	}
+
+	void CacheWriter::write(const char* data, const size_t len) {
+		if(!collecting()) { return; }
+		if(bodyBytes + len > maxBytes) {
+			tooLarge = true;
+			drop();
+			return;
+		}
+		bodyBytes += len;
+		if(!writeFile(data, len)) { drop(); }
+	}
+
+	string CacheWriter::commit() {
+		if(committed) { return Cache::noid; }
+		committed = true;
+		if(tooLarge) {
+			Log::proxy(Log::msg(
+				id, ": not cacheable because it is larger than ", maxBytes, " bytes"
+			));
+			return Cache::noid;
+		}
+		if(!wanted) {
+			// save() only logs why, the body does not matter there
+			return cache.save(req, status, id);
+		}
+		if(fd < 0) { return Cache::noid; } // the file failed
+		close(fd);
+		fd = -1;
+		const string name = staged;
+		staged = Cache::noid; // the cache has it now
+		return cache.saveStaged(req, status, name, written, id);
+	}
+
+	bool CacheWriter::collecting() const {
+		return wanted && !tooLarge && !committed && fd >= 0;
+	}
+
+	bool CacheWriter::writeFile(const char* data, size_t len) {
+		while(len > 0) {
+			const ssize_t n = ::write(fd, data, len);
+			if(n < 0 && errno == EINTR) { continue; }
+			if(n <= 0) {
+				Log::warning(Log::msg("in CacheWriter: cannot write <", staged, ">, ", strerror(errno)));
+				return false;
+			}
+			data += n;
+			len -= n;
+			written += n;
+		}
+		return true;
+	}
+
+	void CacheWriter::drop() {
+		if(fd >= 0) {
+			close(fd);
+			fd = -1;
+		}
+		if(staged != Cache::noid) {
+			cache.discard(staged);
+			staged = Cache::noid;
+		}
+	}
+
+}
+	using zq29Inner::CacheWriter;
+}
+
+#endif
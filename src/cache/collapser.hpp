@@ -0,0 +1,391 @@
+#ifndef ZQ29_COLLAPSER
+#define ZQ29_COLLAPSER
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../log.hpp"
+#include "../httpparser/httpparser.hpp"
+#include "../eventloop/fiber.hpp"
+#include "../backpressure/membudget.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * collapsed forwarding: concurrent misses (or revalidations) of the
+	 * same cache key go to the server once
+	 *
+	 * the first one to join() a key leads a Flight and fetches as usual,
+	 * the ones joining while it is in the air follow it, and get
+	 * LIVE:         the same response, streamed through the flight while
+	 *               the leader relays it to its own client
+	 *               (only for responses that will be cached and whose
+	 *               length is known and small enough to be kept whole,
+	 *               the body held for them is reserved from a budget)
+	 * CACHED:       the leader is done and the response should be in the
+	 *               cache now, look it up again
+	 * NOT_MODIFIED: the server said 304 to the leader's revalidation,
+	 *               serve what the cache had
+	 * FAILED:       uncacheable, an error, anything else, fetch yourself
+	 *
+	 * followers wait on an eventfd of their own, so they work in fibers
+	 * and on worker threads alike, for as long as they are willing to:
+	 * a leader stuck on a server that never answers must not hold them
+	*/
+	class Collapser {
+	public:
+		class Flight {
+		public:
+			enum State { PENDING, LIVE, CACHED, NOT_MODIFIED, FAILED };
+
+			Flight(Collapser& owner, const string& key);
+			~Flight();
+			Flight(const Flight& rhs) = delete;
+			Flight& operator=(const Flight& rhs) = delete;
+
+			/*
+			 * leader: hold bytes of budget for the body, before publishHead()
+			 * they are given back once the last follower let go of the flight
+			 * false if they do not fit, the flight should not go LIVE then
+			*/
+			bool reserve(MemoryBudget& budget, const size_t bytes);
+
+			/*
+			 * leader: the head of a response that followers get as it is,
+			 * its body follows with append()
+			*/
+			void publishHead(const HTTPStatus& head);
+			void append(const char* data, const size_t len);
+
+			/*
+			 * leader: done, nobody can join any more
+			 * for a LIVE flight, any state but FAILED means the body is
+			 * complete, FAILED means followers lost it in the middle
+			 * only the first call counts
+			*/
+			void finish(const State state);
+
+			/*
+			 * leader: whether anyone joined it as a follower
+			*/
+			bool hasFollowers() const;
+
+		private:
+			friend class Collapser;
+			friend class Follower;
+
+			Collapser& owner;
+			const string key;
+			mutable mutex mtx;
+			State st;
+			bool finished;
+			HTTPStatus head;
+			string body;
+			MemoryBudget* budget;
+			size_t reserved;
+			vector<int> waiters; // eventfds of followers
+			size_t followers; // joined, waiting or not
+
+			void wakeAll(); // with mtx held
+		};
+
+		/*
+		 * what join() gives, move-only
+		 * a leader that goes away without finish() fails its flight
+		*/
+		class Ticket {
+		public:
+			Ticket();
+			Ticket(const shared_ptr<Flight>& flight, const bool leader);
+			~Ticket();
+			Ticket(Ticket&& rhs);
+			Ticket& operator=(Ticket&& rhs);
+			Ticket(const Ticket& rhs) = delete;
+			Ticket& operator=(const Ticket& rhs) = delete;
+
+			bool leader() const;
+			/*
+			 * nullptr for an empty ticket
+			*/
+			const shared_ptr<Flight>& flight() const;
+
+		private:
+			shared_ptr<Flight> flt;
+			bool lead;
+		};
+
+		/*
+		 * the follower side of a flight
+		*/
+		class Follower {
+		public:
+			Follower(const shared_ptr<Flight>& flight);
+			~Follower();
+			Follower(const Follower& rhs) = delete;
+			Follower& operator=(const Follower& rhs) = delete;
+
+			/*
+			 * wait until the flight is no longer PENDING and return its state
+			 * for LIVE, head() is valid afterwards
+			 * PENDING if it still is after timeoutMs (< 0: no timeout)
+			*/
+			Flight::State waitForHead(const int timeoutMs = -1);
+			const HTTPStatus& head() const;
+
+			/*
+			 * copy up to len bytes of the body, from where the last read
+			 * stopped, into buf, waiting for them if needed
+			 * returns 0 once the body is complete, -1 if it was lost, or if
+			 * nothing came for timeoutMs (< 0: no timeout)
+			*/
+			ssize_t read(char* buf, const size_t len, const int timeoutMs = -1);
+
+		private:
+			const shared_ptr<Flight> flight;
+			int efd;
+			size_t offset;
+			HTTPStatus hd;
+
+			/*
+			 * for a wake up, with no lock held, until deadline (if any)
+			 * returns false once the deadline passed
+			*/
+			typedef chrono::steady_clock Clock;
+			bool wait(const bool hasDeadline, const Clock::time_point deadline);
+		};
+
+		/*
+		 * lead a new flight for key, or follow the one in the air
+		*/
+		Ticket join(const string& key);
+
+		/*
+		 * flights in the air
+		*/
+		size_t size() const;
+
+	private:
+		mutable mutex mtx;
+		unordered_map<string, shared_ptr<Flight>> flights;
+
+		void remove(const string& key, const Flight* flight);
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Flight Implementation //////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	Collapser::Flight::Flight(Collapser& owner, const string& key) :
+		owner(owner), key(key), st(PENDING), finished(false), budget(nullptr), reserved(0), followers(0) {}
+
+	Collapser::Flight::~Flight() {
+		if(budget != nullptr) { budget->release(reserved); }
+	}
+
+	bool Collapser::Flight::reserve(MemoryBudget& b, const size_t bytes) {
+		lock_guard<mutex> lock(mtx);
+		if(budget != nullptr || !b.tryReserve(bytes)) { return false; }
+		budget = &b;
+		reserved = bytes;
+		return true;
+	}
+
+	void Collapser::Flight::publishHead(const HTTPStatus& h) {
+		lock_guard<mutex> lock(mtx);
+		if(st != PENDING) { return; }
+		head = h;
+		st = LIVE;
+		wakeAll();
+	}
+
+	void Collapser::Flight::append(const char* data, const size_t len) {
+		if(len == 0) { return; }
+		lock_guard<mutex> lock(mtx);
+		if(st != LIVE || finished) { return; }
+		body.append(data, len);
+		wakeAll();
+	}
+
+	void Collapser::Flight::finish(const State state) {
+		{
+			lock_guard<mutex> lock(mtx);
+			if(finished) { return; }
+			finished = true;
+			if(st == PENDING) {
+				st = state == PENDING || state == LIVE ? FAILED : state;
+			} else if(state == FAILED) {
+				st = FAILED; // the body was cut, followers drop it too
+			}
+			wakeAll();
+		}
+		owner.remove(key, this);
+	}
+
+	bool Collapser::Flight::hasFollowers() const {
+		lock_guard<mutex> lock(mtx);
+		return followers > 0;
+	}
+
+	void Collapser::Flight::wakeAll() {
+		const uint64_t one = 1;
+		for(const int efd : waiters) {
+			if(::write(efd, &one, sizeof(one)) < 0) {} // counter full, it's awake anyway
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Ticket Implementation //////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	Collapser::Ticket::Ticket() : flt(nullptr), lead(false) {}
+
+	Collapser::Ticket::Ticket(const shared_ptr<Flight>& flight, const bool leader) :
+		flt(flight), lead(leader) {}
+
+	Collapser::Ticket::~Ticket() {
+		if(flt != nullptr && lead) { flt->finish(Flight::FAILED); }
+	}
+
+	Collapser::Ticket::Ticket(Ticket&& rhs) : flt(move(rhs.flt)), lead(rhs.lead) {
+		rhs.flt = nullptr;
+		rhs.lead = false;
+	}
+
+	Collapser::Ticket& Collapser::Ticket::operator=(Ticket&& rhs) {
+		if(this != &rhs) {
+			if(flt != nullptr && lead) { flt->finish(Flight::FAILED); }
+			flt = move(rhs.flt);
+			lead = rhs.lead;
+			rhs.flt = nullptr;
+			rhs.lead = false;
+		}
+		return *this;
+	}
+
+	bool Collapser::Ticket::leader() const { return lead; }
+	const shared_ptr<Collapser::Flight>& Collapser::Ticket::flight() const { return flt; }
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Follower Implementation ////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	Collapser::Follower::Follower(const shared_ptr<Flight>& flight) :
+		flight(flight), efd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), offset(0)
+	{
+		if(efd < 0) {
+			Log::warning(Log::msg("in Follower: eventfd failed, ", strerror(errno)));
+			return;
+		}
+		lock_guard<mutex> lock(flight->mtx);
+		flight->waiters.push_back(efd);
+	}
+
+	Collapser::Follower::~Follower() {
+		if(efd < 0) { return; }
+		{
+			lock_guard<mutex> lock(flight->mtx);
+			auto& w = flight->waiters;
+			w.erase(std::remove(w.begin(), w.end(), efd), w.end());
+		}
+		close(efd);
+	}
+
+	bool Collapser::Follower::wait(const bool hasDeadline, const Clock::time_point deadline) {
+		int timeoutMs = -1;
+		if(hasDeadline) {
+			const auto left = chrono::ceil<chrono::milliseconds>(deadline - Clock::now()).count();
+			if(left <= 0) { return false; }
+			timeoutMs = (int)left;
+		}
+		if(efd < 0) {
+			asyncSleep(timeoutMs < 0 ? 10 : min(timeoutMs, 10)); // no eventfd, poll the flight instead
+			return true;
+		}
+		asyncWaitAny({ make_pair(efd, (uint32_t)EPOLLIN) }, timeoutMs);
+		uint64_t count;
+		if(::read(efd, &count, sizeof(count)) < 0) {} // EAGAIN, nothing to reset
+		return true;
+	}
+
+	Collapser::Flight::State Collapser::Follower::waitForHead(const int timeoutMs) {
+		const Clock::time_point deadline = Clock::now() + chrono::milliseconds(timeoutMs);
+		while(true) {
+			{
+				lock_guard<mutex> lock(flight->mtx);
+				if(flight->st != Flight::PENDING) {
+					if(flight->st == Flight::LIVE) { hd = flight->head; }
+					return flight->st;
+				}
+			}
+			if(!wait(timeoutMs >= 0, deadline)) { return Flight::PENDING; }
+		}
+	}
+
+	const HTTPStatus& Collapser::Follower::head() const { return hd; }
+
+	ssize_t Collapser::Follower::read(char* buf, const size_t len, const int timeoutMs) {
+		const Clock::time_point deadline = Clock::now() + chrono::milliseconds(timeoutMs);
+		while(true) {
+			{
+				lock_guard<mutex> lock(flight->mtx);
+				if(flight->st == Flight::FAILED) { return -1; }
+				const size_t available = flight->body.size() - offset;
+				if(available > 0) {
+					const size_t n = min(available, len);
+					memcpy(buf, flight->body.data() + offset, n);
+					offset += n;
+					return n;
+				}
+				if(flight->finished) { return 0; }
+			}
+			if(!wait(timeoutMs >= 0, deadline)) { return -1; }
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Collapser Implementation ///////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	Collapser::Ticket Collapser::join(const string& key) {
+		lock_guard<mutex> lock(mtx);
+		auto it = flights.find(key);
+		if(it != flights.end()) {
+			lock_guard<mutex> flightLock(it->second->mtx);
+			it->second->followers++;
+			return Ticket(it->second, false);
+		}
+		shared_ptr<Flight> flight(new Flight(*this, key));
+		flights[key] = flight;
+		return Ticket(flight, true);
+	}
+
+	size_t Collapser::size() const {
+		lock_guard<mutex> lock(mtx);
+		return flights.size();
+	}
+
+	void Collapser::remove(const string& key, const Flight* flight) {
+		lock_guard<mutex> lock(mtx);
+		auto it = flights.find(key);
+		if(it != flights.end() && it->second.get() == flight) {
+			flights.erase(it);
+		}
+	}
+
+}
+	using zq29Inner::Collapser;
+}
+
+#endif
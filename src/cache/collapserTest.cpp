@@ -0,0 +1,275 @@
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include "collapser.hpp"
+#include "../eventloop/eventloop.hpp"
+
+using namespace zq29;
+using namespace std;
+
+HTTPStatus okHead(const size_t length) {
+	HTTPStatus::StatusLine sl;
+	sl.httpVersion = "HTTP/1.1";
+	sl.statusCode = "200";
+	sl.reasonPhrase = "OK";
+	return HTTPStatus(sl, { { "Content-Length", to_string(length) } }, "");
+}
+
+/*
+ * everything a follower gets, "" if it was not LIVE or the body was lost
+*/
+string follow(const shared_ptr<Collapser::Flight>& flight) {
+	Collapser::Follower follower(flight);
+	if(follower.waitForHead() != Collapser::Flight::LIVE) { return ""; }
+	string s = follower.head().headerToStr();
+	char buf[100];
+	ssize_t n;
+	while((n = follower.read(buf, sizeof(buf))) > 0) { s.append(buf, n); }
+	return n == 0 ? s : "";
+}
+
+/*
+ * one leader, followers on threads joining before and in the middle
+*/
+void testLive() {
+	const string TAG = "testLive";
+	bool failFlag = false;
+
+	Collapser collapser;
+	Collapser::Ticket leader = collapser.join("GET http://a.com/ HTTP/1.1");
+	string body;
+	for(int i = 0; i < 1000; i++) { body += to_string(i); }
+	const string expected = okHead(body.size()).headerToStr() + body;
+
+	atomic<size_t> good(0);
+	vector<thread> threads;
+	auto const addFollower = [&]() {
+		Collapser::Ticket t = collapser.join("GET http://a.com/ HTTP/1.1");
+		if(t.leader()) { return; }
+		threads.push_back(thread([&good, &expected](shared_ptr<Collapser::Flight> f) {
+			if(follow(f) == expected) { good++; }
+		}, t.flight()));
+	};
+	for(int i = 0; i < 8; i++) { addFollower(); }
+	if(!leader.leader() || collapser.size() != 1 || !leader.flight()->hasFollowers()) {
+		failFlag = true;
+		Log::testFail(TAG, "no single leader");
+	}
+	if(collapser.join("GET http://b.com/ HTTP/1.1").flight()->hasFollowers()) {
+		failFlag = true;
+		Log::testFail(TAG, "a flight nobody joined has followers");
+	}
+
+	leader.flight()->publishHead(okHead(body.size()));
+	for(size_t i = 0; i < body.size(); i += 97) {
+		leader.flight()->append(body.data() + i, min((size_t)97, body.size() - i));
+		if(i == 97 * 5) { for(int j = 0; j < 8; j++) { addFollower(); } }
+		this_thread::sleep_for(chrono::microseconds(200));
+	}
+	leader.flight()->finish(Collapser::Flight::CACHED);
+	for(auto& t : threads) { t.join(); }
+
+	if(good != 16) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(good.load(), " of 16 followers got the response"));
+	}
+	if(collapser.size() != 0 || !collapser.join("GET http://a.com/ HTTP/1.1").leader()) {
+		failFlag = true;
+		Log::testFail(TAG, "the flight is still there");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * flights that followers can't stream
+*/
+void testOutcomes() {
+	const string TAG = "testOutcomes";
+	bool failFlag = false;
+
+	Collapser collapser;
+	const vector<Collapser::Flight::State> states = {
+		Collapser::Flight::CACHED, Collapser::Flight::NOT_MODIFIED, Collapser::Flight::FAILED
+	};
+	for(auto const state : states) {
+		Collapser::Ticket leader = collapser.join("k");
+		Collapser::Ticket ticket = collapser.join("k");
+		Collapser::Flight::State got = Collapser::Flight::PENDING;
+		thread t([&]() {
+			Collapser::Follower follower(ticket.flight());
+			got = follower.waitForHead();
+		});
+		this_thread::sleep_for(chrono::milliseconds(5));
+		leader.flight()->finish(state);
+		t.join();
+		if(got != state) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("got state ", got, ", expected ", state));
+		}
+	}
+
+	// a leader that goes away
+	{
+		Collapser::Ticket ticket;
+		{
+			Collapser::Ticket leader = collapser.join("k");
+			ticket = collapser.join("k");
+		}
+		Collapser::Follower follower(ticket.flight());
+		if(follower.waitForHead() != Collapser::Flight::FAILED || collapser.size() != 0) {
+			failFlag = true;
+			Log::testFail(TAG, "abandoned flight");
+		}
+	}
+
+	// cut in the middle, after the follower got part of it
+	{
+		Collapser::Ticket leader = collapser.join("k");
+		Collapser::Ticket ticket = collapser.join("k");
+		leader.flight()->publishHead(okHead(10));
+		leader.flight()->append("01234", 5);
+		Collapser::Follower follower(ticket.flight());
+		char buf[16];
+		const bool gotHead = follower.waitForHead() == Collapser::Flight::LIVE;
+		const ssize_t first = follower.read(buf, sizeof(buf));
+		leader.flight()->finish(Collapser::Flight::FAILED);
+		if(!gotHead || first != 5 || follower.read(buf, sizeof(buf)) != -1) {
+			failFlag = true;
+			Log::testFail(TAG, "cut flight");
+		}
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * followers as fibers on one loop, the leader on another thread
+*/
+void testFibers() {
+	const string TAG = "testFibers";
+	bool failFlag = false;
+
+	Collapser collapser;
+	Collapser::Ticket leader = collapser.join("k");
+	const string body(100000, 'x');
+	const string expected = okHead(body.size()).headerToStr() + body;
+
+	EventLoop loop;
+	size_t good = 0, finished = 0;
+	const size_t N = 32;
+	for(size_t i = 0; i < N; i++) {
+		shared_ptr<Collapser::Flight> flight = collapser.join("k").flight();
+		Fiber::spawn(loop, [&, flight]() {
+			if(follow(flight) == expected) { good++; }
+			if(++finished == N) { loop.stop(); }
+		});
+	}
+	thread leaderThread([&]() {
+		this_thread::sleep_for(chrono::milliseconds(10));
+		leader.flight()->publishHead(okHead(body.size()));
+		for(size_t i = 0; i < body.size(); i += 4096) {
+			leader.flight()->append(body.data() + i, min((size_t)4096, body.size() - i));
+		}
+		leader.flight()->finish(Collapser::Flight::CACHED);
+	});
+	loop.runAfter(2000, [&loop]() { loop.stop(); }); // in case something hangs
+	loop.run();
+	leaderThread.join();
+
+	if(good != N) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(good, " of ", N, " fibers got the response"));
+	}
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * a leader that never gets anywhere: followers give up after their
+ * deadline, on the head and in the middle of the body
+*/
+void testDeadlines() {
+	const string TAG = "testDeadlines";
+	bool failFlag = false;
+
+	Collapser collapser;
+	Collapser::Ticket leader = collapser.join("k");
+	Collapser::Ticket ticket = collapser.join("k");
+	{
+		Collapser::Follower follower(ticket.flight());
+		const auto start = chrono::steady_clock::now();
+		const Collapser::Flight::State state = follower.waitForHead(50);
+		const auto waited = chrono::steady_clock::now() - start;
+		if(state != Collapser::Flight::PENDING || waited < chrono::milliseconds(50) || waited > chrono::seconds(1)) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("state ", state, " after waiting for the head"));
+		}
+	}
+
+	leader.flight()->publishHead(okHead(10));
+	leader.flight()->append("01234", 5);
+	{
+		Collapser::Follower follower(ticket.flight());
+		char buf[16];
+		const bool gotHead = follower.waitForHead(50) == Collapser::Flight::LIVE;
+		const ssize_t first = follower.read(buf, sizeof(buf), 50);
+		const auto start = chrono::steady_clock::now();
+		const ssize_t second = follower.read(buf, sizeof(buf), 50);
+		const auto waited = chrono::steady_clock::now() - start;
+		if(!gotHead || first != 5 || second != -1 || waited < chrono::milliseconds(50)) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("read ", first, " then ", second, " bytes of a stalled body"));
+		}
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * the body a LIVE flight keeps is charged to a budget until the flight
+ * is gone, and a flight whose body does not fit can't reserve it
+*/
+void testBudget() {
+	const string TAG = "testBudget";
+	bool failFlag = false;
+
+	MemoryBudget budget(100);
+	Collapser collapser;
+	{
+		Collapser::Ticket leader = collapser.join("a");
+		Collapser::Ticket ticket = collapser.join("a");
+		const shared_ptr<Collapser::Flight> kept = ticket.flight();
+		if(!leader.flight()->reserve(budget, 60) || budget.used() != 60) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg(budget.used(), " bytes used after reserving 60"));
+		}
+		Collapser::Ticket other = collapser.join("b");
+		if(other.flight()->reserve(budget, 60) || budget.used() != 60) {
+			failFlag = true;
+			Log::testFail(TAG, "a body that does not fit was reserved");
+		}
+		leader.flight()->publishHead(okHead(60));
+		leader.flight()->finish(Collapser::Flight::CACHED);
+		leader = Collapser::Ticket();
+		ticket = Collapser::Ticket();
+		if(budget.used() != 60) {
+			failFlag = true;
+			Log::testFail(TAG, "the budget was released while a follower still held the flight");
+		}
+	}
+	if(budget.used() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(budget.used(), " bytes still used after the flights are gone"));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testLive();
+	testOutcomes();
+	testFibers();
+	testDeadlines();
+	testBudget();
+}
@@ -0,0 +1,101 @@
+/*
+ * This file:
+ * runs every EvictionPolicy over the same trace and prints, for each,
+ * how many operations a second it does, its hit ratio, and how many
+ * bytes of heap it holds per key, once right after being filled and
+ * once after the trace, ghost lists included
+ *
+ * an operation is what HTTPProxyCache does for a request: access() on
+ * a hit, insert() on a miss, then victim() and evicted() while it's over
+ * capacity, keys are URLs of ~25 bytes, their copies in the policy are
+ * part of the memory
+ *
+ * usage: ./evictionBench [capacity] [requests]
+*/
+#include <malloc.h>
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include "evictionpolicy.hpp"
+
+using namespace zq29;
+using namespace std;
+
+/*
+ * heap bytes in use
+*/
+size_t liveBytes() {
+	return mallinfo2().uordblks;
+}
+
+/*
+ * Zipf(s) over `objects` keys, with a scan of never seen keys now and then
+*/
+vector<string> makeTrace(const size_t n, const size_t objects, const double s) {
+	mt19937_64 rng(29);
+	vector<double> cdf(objects);
+	double sum = 0;
+	for(size_t i = 0; i < objects; i++) {
+		sum += 1 / pow(i + 1, s);
+		cdf[i] = sum;
+	}
+	uniform_real_distribution<double> uniform(0, 1);
+	vector<string> trace;
+	trace.reserve(n);
+	for(size_t i = 0; i < n; i++) {
+		if(i % 100000 < 10000) { // a scan, 10% of the time
+			trace.push_back(Log::msg("http://scan.test/", i));
+		} else {
+			const size_t k = lower_bound(cdf.begin(), cdf.end(), uniform(rng) * sum) - cdf.begin();
+			trace.push_back(Log::msg("http://bench.test/", k));
+		}
+	}
+	return trace;
+}
+
+void run(const string& name, const size_t capacity, const vector<string>& trace) {
+	// memory: filled with capacity keys
+	size_t before = liveBytes();
+	unique_ptr<EvictionPolicy> policy = EvictionPolicy::create(name, capacity);
+	for(size_t i = 0; i < capacity; i++) { policy->insert(Log::msg("http://fill.test/", 1000000 + i)); }
+	const double filled = (double)(liveBytes() - before) / capacity;
+	policy.reset();
+
+	before = liveBytes();
+	policy = EvictionPolicy::create(name, capacity);
+	size_t hits = 0;
+	string victim;
+	const auto start = chrono::steady_clock::now();
+	for(const string& key : trace) {
+		if(policy->contains(key)) {
+			policy->access(key);
+			hits++;
+			continue;
+		}
+		policy->insert(key);
+		while(policy->size() > capacity && policy->victim(victim)) { policy->evicted(victim); }
+	}
+	const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	const double steady = (double)(liveBytes() - before) / policy->size();
+
+	cout << left << setw(10) << name << right << fixed << setprecision(2)
+		<< setw(12) << trace.size() / seconds / 1e6
+		<< setw(11) << (double)hits / trace.size() * 100 << "%"
+		<< setprecision(1) << setw(12) << filled << setw(12) << steady << endl;
+}
+
+int main(int argc, char** argv) {
+	const size_t capacity = argc > 1 ? stoul(argv[1]) : 100000;
+	const size_t requests = argc > 2 ? stoul(argv[2]) : 5000000;
+	const vector<string> trace = makeTrace(requests, 10 * capacity, 0.9);
+	cout << requests << " requests, Zipf 0.9 over " << 10 * capacity << " keys with scans, "
+		<< capacity << " entries" << endl;
+	cout << left << setw(10) << "policy" << right << setw(12) << "Mops/s" << setw(12) << "hit ratio"
+		<< setw(12) << "B/key fill" << setw(12) << "B/key run" << endl;
+	for(const string& name : EvictionPolicy::names()) { run(name, capacity, trace); }
+	return EXIT_SUCCESS;
+}
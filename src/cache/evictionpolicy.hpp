@@ -0,0 +1,550 @@
+#ifndef ZQ29_EVICTIONPOLICY
+#define ZQ29_EVICTIONPOLICY
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * decides which entry goes first when the cache has to make room
+	 *
+	 * the cache tells it what happens to its keys, and asks it for a
+	 * victim when it is full, how full is up to the cache, capacity is
+	 * only what a policy sizes its queues and ghost lists by
+	 *
+	 * every operation is O(1), amortized for S3FIFOPolicy::victim
+	 * NOT thread-safe, HTTPProxyCache holds a mutex around it
+	*/
+	class EvictionPolicy {
+	public:
+		virtual ~EvictionPolicy() {}
+
+		/*
+		 * a key was added to the cache
+		*/
+		virtual void insert(const string& key) = 0;
+
+		/*
+		 * a key in the cache was used, unknown keys are ignored
+		*/
+		virtual void access(const string& key) = 0;
+
+		/*
+		 * a key left the cache, but not because it was evicted
+		*/
+		virtual void erase(const string& key) = 0;
+
+		/*
+		 * the key to evict next, false if the cache is empty
+		 * it stays until evicted() is called, asking again gives the same
+		*/
+		virtual bool victim(string& key) = 0;
+
+		/*
+		 * the victim was evicted
+		*/
+		virtual void evicted(const string& key) = 0;
+
+		virtual bool contains(const string& key) const = 0;
+		/*
+		 * keys in the cache, what a policy remembers of evicted ones is not counted
+		*/
+		virtual size_t size() const = 0;
+		virtual string name() const = 0;
+
+		/*
+		 * one of names(), nullptr for anything else
+		*/
+		static unique_ptr<EvictionPolicy> create(const string& name, const size_t capacity);
+		static vector<string> names();
+	};
+
+	/*
+	 * a key in one of the queues of a policy
+	 * the map of the policy owns the nodes and the queues only link them,
+	 * so a key costs a single allocation (two if it's too long for SSO)
+	*/
+	struct PolicyNode {
+		const string* key;
+		PolicyNode* prev;
+		PolicyNode* next;
+		uint8_t queue;
+		uint8_t freq; // S3FIFOPolicy only
+	};
+
+	/*
+	 * a doubly linked list of nodes, the newest at the front
+	*/
+	class PolicyQueue {
+	public:
+		PolicyQueue();
+		PolicyQueue(const PolicyQueue& rhs) = delete;
+		PolicyQueue& operator=(const PolicyQueue& rhs) = delete;
+
+		void pushFront(PolicyNode* node);
+		void unlink(PolicyNode* node);
+		PolicyNode* back() const; // nullptr if empty
+		size_t size() const;
+
+	private:
+		PolicyNode sentinel;
+		size_t count;
+	};
+
+	/*
+	 * what the policies below have in common: every key they know is in
+	 * exactly one of their queues, the ones in ghost queues were evicted
+	*/
+	class QueuedPolicy : public EvictionPolicy {
+	public:
+		bool contains(const string& key) const override;
+		size_t size() const override;
+
+	protected:
+		static const uint8_t MAX_QUEUES = 4;
+		PolicyQueue queues[MAX_QUEUES];
+
+		QueuedPolicy(const uint8_t ghostQueues = 0);
+
+		PolicyNode* find(const string& key);
+		PolicyNode* resident(const string& key);
+		PolicyNode* add(const string& key, const uint8_t queue);
+		/*
+		 * to the front of queue, which can be the one it's in
+		*/
+		void move(PolicyNode* node, const uint8_t queue);
+		void drop(PolicyNode* node);
+		bool isGhost(const uint8_t queue) const;
+
+	private:
+		unordered_map<string, PolicyNode> nodes;
+		const uint8_t ghostMask;
+	};
+
+	/*
+	 * least recently used goes first
+	*/
+	class LRUPolicy : public QueuedPolicy {
+	public:
+		LRUPolicy();
+		void insert(const string& key) override;
+		void access(const string& key) override;
+		void erase(const string& key) override;
+		bool victim(string& key) override;
+		void evicted(const string& key) override;
+		string name() const override;
+	};
+
+	/*
+	 * segmented LRU: new keys go to a probation segment, and to the
+	 * protected one (80% of capacity) once they are used again, victims
+	 * come from probation first, so a scan can't flush what is popular
+	*/
+	class SLRUPolicy : public QueuedPolicy {
+	public:
+		SLRUPolicy(const size_t capacity);
+		void insert(const string& key) override;
+		void access(const string& key) override;
+		void erase(const string& key) override;
+		bool victim(string& key) override;
+		void evicted(const string& key) override;
+		string name() const override;
+
+	private:
+		enum { PROBATION, PROTECTED };
+		const size_t protectedCapacity;
+	};
+
+	/*
+	 * adaptive replacement cache
+	 * ref: https://www.usenix.org/conference/fast-03/arc-self-tuning-low-overhead-replacement-cache
+	 *
+	 * T1 holds keys used once, T2 keys used again, B1 and B2 remember the
+	 * ones evicted from each, and a miss in either of them moves the
+	 * target size p of T1 towards where the hit would have been
+	*/
+	class ARCPolicy : public QueuedPolicy {
+	public:
+		ARCPolicy(const size_t capacity);
+		void insert(const string& key) override;
+		void access(const string& key) override;
+		void erase(const string& key) override;
+		bool victim(string& key) override;
+		void evicted(const string& key) override;
+		string name() const override;
+
+		size_t target() const;
+
+	private:
+		enum { T1, T2, B1, B2 };
+		const size_t c;
+		size_t p;
+		/*
+		 * T1 + B1 and all four together stay within c and 2c
+		*/
+		void trimGhosts();
+	};
+
+	/*
+	 * S3-FIFO, three FIFO queues
+	 * ref: https://dl.acm.org/doi/10.1145/3600006.3613147
+	 *
+	 * new keys go to a small queue (10% of capacity), those used while
+	 * there move on to the main queue, the others are evicted right away
+	 * and remembered in a ghost queue, from where a new insert goes to
+	 * main directly, main evicts in FIFO order, but gives keys used since
+	 * their last turn (up to 3 times) another one
+	*/
+	class S3FIFOPolicy : public QueuedPolicy {
+	public:
+		S3FIFOPolicy(const size_t capacity);
+		void insert(const string& key) override;
+		void access(const string& key) override;
+		void erase(const string& key) override;
+		bool victim(string& key) override;
+		void evicted(const string& key) override;
+		string name() const override;
+
+	private:
+		enum { SMALL, MAIN, GHOST };
+		static const uint8_t MAX_FREQ = 3;
+		const size_t smallCapacity;
+		const size_t ghostCapacity;
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// EvictionPolicy Implementation //////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	unique_ptr<EvictionPolicy> EvictionPolicy::create(const string& name, const size_t capacity) {
+		if(name == "lru") { return unique_ptr<EvictionPolicy>(new LRUPolicy()); }
+		if(name == "slru") { return unique_ptr<EvictionPolicy>(new SLRUPolicy(capacity)); }
+		if(name == "arc") { return unique_ptr<EvictionPolicy>(new ARCPolicy(capacity)); }
+		if(name == "s3fifo") { return unique_ptr<EvictionPolicy>(new S3FIFOPolicy(capacity)); }
+		return nullptr;
+	}
+
+	vector<string> EvictionPolicy::names() {
+		return { "lru", "slru", "arc", "s3fifo" };
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// PolicyQueue Implementation /////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	PolicyQueue::PolicyQueue() : count(0) {
+		sentinel.key = nullptr;
+		sentinel.prev = &sentinel;
+		sentinel.next = &sentinel;
+	}
+
+	void PolicyQueue::pushFront(PolicyNode* node) {
+		node->prev = &sentinel;
+		node->next = sentinel.next;
+		sentinel.next->prev = node;
+		sentinel.next = node;
+		count++;
+	}
+
+	void PolicyQueue::unlink(PolicyNode* node) {
+		node->prev->next = node->next;
+		node->next->prev = node->prev;
+		node->prev = node->next = nullptr;
+		count--;
+	}
+
+	PolicyNode* PolicyQueue::back() const {
+		return count == 0 ? nullptr : sentinel.prev;
+	}
+
+	size_t PolicyQueue::size() const { return count; }
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// QueuedPolicy Implementation ////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	QueuedPolicy::QueuedPolicy(const uint8_t ghostQueues) : ghostMask(ghostQueues) {}
+
+	bool QueuedPolicy::isGhost(const uint8_t queue) const {
+		return ghostMask & (1 << queue);
+	}
+
+	PolicyNode* QueuedPolicy::find(const string& key) {
+		auto it = nodes.find(key);
+		return it == nodes.end() ? nullptr : &it->second;
+	}
+
+	PolicyNode* QueuedPolicy::resident(const string& key) {
+		PolicyNode* node = find(key);
+		return node == nullptr || isGhost(node->queue) ? nullptr : node;
+	}
+
+	bool QueuedPolicy::contains(const string& key) const {
+		auto it = nodes.find(key);
+		return it != nodes.end() && !isGhost(it->second.queue);
+	}
+
+	size_t QueuedPolicy::size() const {
+		size_t n = 0;
+		for(uint8_t q = 0; q < MAX_QUEUES; q++) {
+			if(!isGhost(q)) { n += queues[q].size(); }
+		}
+		return n;
+	}
+
+	PolicyNode* QueuedPolicy::add(const string& key, const uint8_t queue) {
+		auto it = nodes.emplace(key, PolicyNode()).first;
+		PolicyNode* node = &it->second;
+		node->key = &it->first;
+		node->queue = queue;
+		node->freq = 0;
+		queues[queue].pushFront(node);
+		return node;
+	}
+
+	void QueuedPolicy::move(PolicyNode* node, const uint8_t queue) {
+		queues[node->queue].unlink(node);
+		node->queue = queue;
+		queues[queue].pushFront(node);
+	}
+
+	void QueuedPolicy::drop(PolicyNode* node) {
+		queues[node->queue].unlink(node);
+		nodes.erase(nodes.find(*node->key));
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// LRUPolicy Implementation ///////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	LRUPolicy::LRUPolicy() {}
+
+	void LRUPolicy::insert(const string& key) {
+		PolicyNode* node = find(key);
+		if(node != nullptr) {
+			move(node, 0);
+		} else {
+			add(key, 0);
+		}
+	}
+
+	void LRUPolicy::access(const string& key) {
+		PolicyNode* node = find(key);
+		if(node != nullptr) { move(node, 0); }
+	}
+
+	void LRUPolicy::erase(const string& key) {
+		PolicyNode* node = find(key);
+		if(node != nullptr) { drop(node); }
+	}
+
+	bool LRUPolicy::victim(string& key) {
+		const PolicyNode* node = queues[0].back();
+		if(node == nullptr) { return false; }
+		key = *node->key;
+		return true;
+	}
+
+	void LRUPolicy::evicted(const string& key) { erase(key); }
+
+	string LRUPolicy::name() const { return "lru"; }
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// SLRUPolicy Implementation //////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	SLRUPolicy::SLRUPolicy(const size_t capacity) :
+		protectedCapacity(max(capacity / 10 * 8, (size_t)1)) {}
+
+	void SLRUPolicy::insert(const string& key) {
+		if(find(key) != nullptr) {
+			access(key);
+		} else {
+			add(key, PROBATION);
+		}
+	}
+
+	void SLRUPolicy::access(const string& key) {
+		PolicyNode* node = find(key);
+		if(node == nullptr) { return; }
+		move(node, PROTECTED);
+		if(queues[PROTECTED].size() > protectedCapacity) {
+			move(queues[PROTECTED].back(), PROBATION);
+		}
+	}
+
+	void SLRUPolicy::erase(const string& key) {
+		PolicyNode* node = find(key);
+		if(node != nullptr) { drop(node); }
+	}
+
+	bool SLRUPolicy::victim(string& key) {
+		const PolicyNode* node = queues[PROBATION].back();
+		if(node == nullptr) { node = queues[PROTECTED].back(); }
+		if(node == nullptr) { return false; }
+		key = *node->key;
+		return true;
+	}
+
+	void SLRUPolicy::evicted(const string& key) { erase(key); }
+
+	string SLRUPolicy::name() const { return "slru"; }
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// ARCPolicy Implementation ///////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	ARCPolicy::ARCPolicy(const size_t capacity) :
+		QueuedPolicy((1 << B1) | (1 << B2)),
+		c(max(capacity, (size_t)1)),
+		p(0) {}
+
+	void ARCPolicy::insert(const string& key) {
+		PolicyNode* node = find(key);
+		if(node == nullptr) {
+			add(key, T1);
+			trimGhosts();
+		} else if(node->queue == B1) { // would have been a hit with a bigger T1
+			p = min(c, p + max(queues[B2].size() / queues[B1].size(), (size_t)1));
+			move(node, T2);
+		} else if(node->queue == B2) { // and here with a bigger T2
+			const size_t delta = max(queues[B1].size() / queues[B2].size(), (size_t)1);
+			p = p > delta ? p - delta : 0;
+			move(node, T2);
+		} else {
+			move(node, T2);
+		}
+	}
+
+	void ARCPolicy::access(const string& key) {
+		PolicyNode* node = resident(key);
+		if(node != nullptr) { move(node, T2); }
+	}
+
+	void ARCPolicy::erase(const string& key) {
+		PolicyNode* node = find(key);
+		if(node != nullptr) { drop(node); }
+	}
+
+	bool ARCPolicy::victim(string& key) {
+		const PolicyNode* node = nullptr;
+		if(queues[T1].size() > 0 && (queues[T1].size() > p || queues[T2].size() == 0)) {
+			node = queues[T1].back();
+		} else {
+			node = queues[T2].back();
+		}
+		if(node == nullptr) { return false; }
+		key = *node->key;
+		return true;
+	}
+
+	void ARCPolicy::evicted(const string& key) {
+		PolicyNode* node = resident(key);
+		if(node == nullptr) { return; }
+		move(node, node->queue == T1 ? B1 : B2);
+		trimGhosts();
+	}
+
+	void ARCPolicy::trimGhosts() {
+		while(queues[T1].size() + queues[B1].size() > c && queues[B1].size() > 0) {
+			drop(queues[B1].back());
+		}
+		while(queues[T1].size() + queues[T2].size() + queues[B1].size() + queues[B2].size() > 2 * c
+			&& queues[B2].size() > 0) {
+			drop(queues[B2].back());
+		}
+	}
+
+	size_t ARCPolicy::target() const { return p; }
+
+	string ARCPolicy::name() const { return "arc"; }
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// S3FIFOPolicy Implementation ////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	S3FIFOPolicy::S3FIFOPolicy(const size_t capacity) :
+		QueuedPolicy(1 << GHOST),
+		smallCapacity(max(capacity / 10, (size_t)1)),
+		ghostCapacity(max(capacity - min(capacity, capacity / 10), (size_t)1)) {}
+
+	void S3FIFOPolicy::insert(const string& key) {
+		PolicyNode* node = find(key);
+		if(node == nullptr) {
+			add(key, SMALL);
+		} else if(node->queue == GHOST) {
+			move(node, MAIN);
+			node->freq = 0;
+		} else {
+			access(key);
+		}
+	}
+
+	void S3FIFOPolicy::access(const string& key) {
+		PolicyNode* node = resident(key);
+		if(node != nullptr && node->freq < MAX_FREQ) { node->freq++; }
+	}
+
+	void S3FIFOPolicy::erase(const string& key) {
+		PolicyNode* node = find(key);
+		if(node != nullptr) { drop(node); }
+	}
+
+	bool S3FIFOPolicy::victim(string& key) {
+		// every turn moves a key out of small or takes a use off one in
+		// main, so this ends after at most small + 3 * main turns, and
+		// the next call starts where this one stopped
+		while(true) {
+			PolicyNode* node;
+			if(queues[SMALL].size() > 0 && (queues[SMALL].size() >= smallCapacity || queues[MAIN].size() == 0)) {
+				node = queues[SMALL].back();
+				if(node->freq > 0) {
+					move(node, MAIN);
+					node->freq = 0;
+					continue;
+				}
+			} else if(queues[MAIN].size() > 0) {
+				node = queues[MAIN].back();
+				if(node->freq > 0) {
+					node->freq--;
+					move(node, MAIN);
+					continue;
+				}
+			} else {
+				return false;
+			}
+			key = *node->key;
+			return true;
+		}
+	}
+
+	void S3FIFOPolicy::evicted(const string& key) {
+		PolicyNode* node = resident(key);
+		if(node == nullptr) { return; }
+		if(node->queue == MAIN) {
+			drop(node);
+			return;
+		}
+		move(node, GHOST);
+		while(queues[GHOST].size() > ghostCapacity) { drop(queues[GHOST].back()); }
+	}
+
+	string S3FIFOPolicy::name() const { return "s3fifo"; }
+
+}
+	using zq29Inner::EvictionPolicy;
+	using zq29Inner::LRUPolicy;
+	using zq29Inner::SLRUPolicy;
+	using zq29Inner::ARCPolicy;
+	using zq29Inner::S3FIFOPolicy;
+}
+
+#endif
@@ -0,0 +1,199 @@
+#include <iostream>
+#include <set>
+
+#include "evictionpolicy.hpp"
+
+using namespace zq29;
+using namespace std;
+
+string evictOne(EvictionPolicy& policy) {
+	string key;
+	if(!policy.victim(key)) { return ""; }
+	policy.evicted(key);
+	return key;
+}
+
+/*
+ * what every policy must do, whatever it evicts first
+*/
+void testContract() {
+	const string TAG = "testContract";
+	bool failFlag = false;
+
+	for(const string& name : EvictionPolicy::names()) {
+		unique_ptr<EvictionPolicy> policy = EvictionPolicy::create(name, 50);
+		if(policy == nullptr || policy->name() != name) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("cannot create <", name, ">"));
+			continue;
+		}
+		for(int i = 0; i < 100; i++) { policy->insert(Log::msg("k", i)); }
+		for(int i = 0; i < 100; i += 3) { policy->access(Log::msg("k", i)); }
+		for(int i = 0; i < 100; i += 10) { policy->erase(Log::msg("k", i)); }
+		policy->access("unknown");
+		policy->erase("unknown");
+		if(policy->size() != 90 || policy->contains("k10") || !policy->contains("k11")) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg(name, ": size ", policy->size()));
+		}
+
+		string first, again;
+		policy->victim(first);
+		policy->victim(again);
+		if(first != again || !policy->contains(first)) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg(name, ": victim <", first, "> then <", again, ">"));
+		}
+		set<string> evicted;
+		string key;
+		while(!(key = evictOne(*policy)).empty()) {
+			if(!evicted.insert(key).second || policy->contains(key)) {
+				failFlag = true;
+				Log::testFail(TAG, Log::msg(name, ": <", key, "> evicted twice"));
+				break;
+			}
+		}
+		if(evicted.size() != 90 || policy->size() != 0 || policy->victim(key)) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg(name, ": evicted ", evicted.size(), ", ", policy->size(), " left"));
+		}
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+void testLRU() {
+	const string TAG = "testLRU";
+	bool failFlag = false;
+
+	LRUPolicy policy;
+	policy.insert("a");
+	policy.insert("b");
+	policy.insert("c");
+	policy.access("a");
+	if(evictOne(policy) != "b" || evictOne(policy) != "c" || evictOne(policy) != "a") {
+		failFlag = true;
+		Log::testFail(TAG, "not least recently used first");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * keys used twice survive a scan of keys used once
+*/
+void testSLRU() {
+	const string TAG = "testSLRU";
+	bool failFlag = false;
+
+	SLRUPolicy policy(10);
+	for(int i = 0; i < 8; i++) {
+		policy.insert(Log::msg("hot", i));
+		policy.access(Log::msg("hot", i));
+	}
+	for(int i = 0; i < 100; i++) {
+		policy.insert(Log::msg("scan", i));
+		while(policy.size() > 10) { evictOne(policy); }
+	}
+	for(int i = 0; i < 8; i++) {
+		if(!policy.contains(Log::msg("hot", i))) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("hot", i, " flushed by the scan"));
+		}
+	}
+	// a ninth protected key pushes the oldest one back to probation
+	policy.insert("hot8");
+	policy.access("hot8");
+	if(evictOne(policy) != "scan98" || evictOne(policy) != "scan99" || evictOne(policy) != "hot0") {
+		failFlag = true;
+		Log::testFail(TAG, "protected segment over its capacity");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * a miss in a ghost list moves the target where the hit would have been
+*/
+void testARC() {
+	const string TAG = "testARC";
+	bool failFlag = false;
+
+	ARCPolicy policy(4);
+	for(const string k : { "a", "b", "c", "d" }) { policy.insert(k); }
+	policy.access("d");
+	if(evictOne(policy) != "a" || policy.contains("a") || policy.size() != 3) {
+		failFlag = true;
+		Log::testFail(TAG, "T1 not evicted first");
+	}
+	policy.insert("a"); // in B1: T1 should have been bigger
+	if(policy.target() != 1 || !policy.contains("a")) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("target ", policy.target(), " after a hit in B1"));
+	}
+	// T1 is {c, b}, above the target, so it gives, until it's at the target
+	if(evictOne(policy) != "b") {
+		failFlag = true;
+		Log::testFail(TAG, "victim not from T1");
+	}
+	const string fromT2 = evictOne(policy);
+	if(fromT2 != "d" || !policy.contains("c")) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("<", fromT2, "> evicted instead of the oldest of T2"));
+	}
+	policy.insert("d"); // in B2: T2 should have been bigger
+	if(policy.target() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("target ", policy.target(), " after a hit in B2"));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * keys used once leave quickly, keys used in the small queue move on,
+ * and a key back from the ghost queue goes to main
+*/
+void testS3FIFO() {
+	const string TAG = "testS3FIFO";
+	bool failFlag = false;
+
+	S3FIFOPolicy policy(10); // small queue of 1
+	policy.insert("used");
+	policy.access("used");
+	policy.insert("once");
+	if(evictOne(policy) != "once") {
+		failFlag = true;
+		Log::testFail(TAG, "a key used once was not the first to go");
+	}
+	policy.insert("other");
+	policy.insert("once"); // back from the ghost queue, to main
+	if(evictOne(policy) != "other" || evictOne(policy) != "used" || evictOne(policy) != "once") {
+		failFlag = true;
+		Log::testFail(TAG, "wrong order from main");
+	}
+
+	// main gives used keys another turn
+	S3FIFOPolicy main(10);
+	for(const string k : { "x", "y" }) {
+		main.insert(k);
+		main.access(k);
+		string victim;
+		main.victim(victim); // both move on to main
+	}
+	main.access("x");
+	if(evictOne(main) != "y" || evictOne(main) != "x") {
+		failFlag = true;
+		Log::testFail(TAG, "a key used in main did not get another turn");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testContract();
+	testLRU();
+	testSLRU();
+	testARC();
+	testS3FIFO();
+}
@@ -0,0 +1,180 @@
+#ifndef ZQ29_FREQUENCYSKETCH
+#define ZQ29_FREQUENCYSKETCH
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * how often each key was asked for lately, approximately, in a fixed
+	 * amount of memory: the frequency filter of TinyLFU
+	 * ref: https://arxiv.org/abs/1512.00727
+	 *
+	 * count-min sketch: DEPTH 4-bit counters per key, picked by hash out of
+	 * one table, a key's count is the smallest of them, collisions only
+	 * ever make it bigger
+	 * doorkeeper: a Bloom filter in front, the first time a key is seen it
+	 * only goes there, so keys seen once (most of them) cost no counter
+	 * aging: after sampleSize records all counters are halved and the
+	 * doorkeeper is cleared, so what was popular long ago fades out
+	 *
+	 * thread-safe, counters are updated with atomics and nothing blocks
+	 * but a reset, a record racing with one may get lost, which is fine
+	 * for an estimate
+	*/
+	class FrequencySketch {
+	public:
+		static const size_t DEPTH = 4;
+		static const uint64_t MAX_COUNT = 15;
+
+		/*
+		 * sized for about capacity keys, the size of the cache
+		 * 8 bytes of counters and 4 bytes of doorkeeper per key, which
+		 * sees up to 10 times as many keys before it is cleared
+		*/
+		FrequencySketch(const size_t capacity);
+		FrequencySketch(const FrequencySketch& rhs) = delete;
+		FrequencySketch& operator=(const FrequencySketch& rhs) = delete;
+
+		/*
+		 * the key with hash h was asked for once more
+		*/
+		void record(const uint64_t h);
+
+		/*
+		 * how often the key with hash h was asked for, 0 to MAX_COUNT + 1
+		*/
+		size_t estimate(const uint64_t h) const;
+
+		/*
+		 * times it was aged since the start
+		*/
+		size_t resets() const;
+
+	private:
+		const size_t counterMask;    // counters - 1, 16 in a word
+		const size_t doorkeeperMask; // doorkeeper bits - 1, 64 in a word
+		const size_t sampleSize;
+		unique_ptr<atomic<uint64_t>[]> table;
+		unique_ptr<atomic<uint64_t>[]> doorkeeper;
+		atomic<size_t> additions;
+		atomic<size_t> resetCount;
+		mutex resetMutex;
+
+		static size_t powerOfTwo(const size_t n);
+		/*
+		 * the i-th index derived from h, well mixed
+		*/
+		static uint64_t spread(const uint64_t h, const size_t i);
+
+		bool doorkeeperContains(const uint64_t h) const;
+		/*
+		 * returns false if every bit was set already
+		*/
+		bool doorkeeperPut(const uint64_t h);
+		void reset();
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// FrequencySketch Implementation /////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	FrequencySketch::FrequencySketch(const size_t capacity) :
+		counterMask(powerOfTwo(capacity) * 16 - 1),
+		doorkeeperMask(powerOfTwo(capacity) * 32 - 1),
+		sampleSize(10 * powerOfTwo(capacity)),
+		table(new atomic<uint64_t>[powerOfTwo(capacity)]),
+		doorkeeper(new atomic<uint64_t>[powerOfTwo(capacity) / 2]),
+		additions(0),
+		resetCount(0)
+	{
+		for(size_t i = 0; i <= counterMask / 16; i++) { table[i].store(0, memory_order_relaxed); }
+		for(size_t i = 0; i <= doorkeeperMask / 64; i++) { doorkeeper[i].store(0, memory_order_relaxed); }
+	}
+
+	size_t FrequencySketch::powerOfTwo(const size_t n) {
+		size_t p = 16;
+		while(p < n) { p <<= 1; }
+		return p;
+	}
+
+	uint64_t FrequencySketch::spread(const uint64_t h, const size_t i) {
+		// splitmix64 finalizer, a different seed per index
+		uint64_t x = h + (i + 1) * 0x9E3779B97F4A7C15ULL;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+		return x ^ (x >> 31);
+	}
+
+	bool FrequencySketch::doorkeeperContains(const uint64_t h) const {
+		for(size_t i = 0; i < 2; i++) {
+			const uint64_t bit = spread(h, DEPTH + i) & doorkeeperMask;
+			if(!(doorkeeper[bit / 64].load(memory_order_relaxed) & (1ULL << (bit % 64)))) { return false; }
+		}
+		return true;
+	}
+
+	bool FrequencySketch::doorkeeperPut(const uint64_t h) {
+		bool added = false;
+		for(size_t i = 0; i < 2; i++) {
+			const uint64_t bit = spread(h, DEPTH + i) & doorkeeperMask;
+			const uint64_t old = doorkeeper[bit / 64].fetch_or(1ULL << (bit % 64), memory_order_relaxed);
+			if(!(old & (1ULL << (bit % 64)))) { added = true; }
+		}
+		return added;
+	}
+
+	void FrequencySketch::record(const uint64_t h) {
+		if(!doorkeeperPut(h)) {
+			for(size_t i = 0; i < DEPTH; i++) {
+				const uint64_t counter = spread(h, i) & counterMask;
+				atomic<uint64_t>& word = table[counter / 16];
+				const size_t shift = (counter % 16) * 4;
+				uint64_t old = word.load(memory_order_relaxed);
+				while(((old >> shift) & MAX_COUNT) < MAX_COUNT
+					&& !word.compare_exchange_weak(old, old + (1ULL << shift), memory_order_relaxed)) {}
+			}
+		}
+		if(additions.fetch_add(1, memory_order_relaxed) + 1 == sampleSize) { reset(); }
+	}
+
+	size_t FrequencySketch::estimate(const uint64_t h) const {
+		uint64_t count = MAX_COUNT;
+		for(size_t i = 0; i < DEPTH; i++) {
+			const uint64_t counter = spread(h, i) & counterMask;
+			const uint64_t word = table[counter / 16].load(memory_order_relaxed);
+			count = min(count, (word >> ((counter % 16) * 4)) & MAX_COUNT);
+		}
+		return count + (doorkeeperContains(h) ? 1 : 0);
+	}
+
+	void FrequencySketch::reset() {
+		lock_guard<mutex> resetLock(resetMutex);
+		for(size_t i = 0; i <= counterMask / 16; i++) {
+			uint64_t old = table[i].load(memory_order_relaxed);
+			while(!table[i].compare_exchange_weak(old, (old >> 1) & 0x7777777777777777ULL, memory_order_relaxed)) {}
+		}
+		for(size_t i = 0; i <= doorkeeperMask / 64; i++) { doorkeeper[i].store(0, memory_order_relaxed); }
+		additions.fetch_sub(sampleSize / 2, memory_order_relaxed);
+		resetCount.fetch_add(1, memory_order_relaxed);
+	}
+
+	size_t FrequencySketch::resets() const { return resetCount.load(memory_order_relaxed); }
+
+}
+	using zq29Inner::FrequencySketch;
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "frequencysketch.hpp"
+
+using namespace zq29;
+using namespace std;
+
+uint64_t key(const string& s) { return hash<string>()(s); }
+
+void testEstimate() {
+	const string TAG = "testEstimate";
+	bool failFlag = false;
+
+	FrequencySketch sketch(1024);
+	for(int i = 0; i < 5; i++) { sketch.record(key("popular")); }
+	sketch.record(key("once"));
+	if(sketch.estimate(key("popular")) != 5 || sketch.estimate(key("once")) != 1
+		|| sketch.estimate(key("never")) > 1) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("estimates ", sketch.estimate(key("popular")), ", ",
+			sketch.estimate(key("once")), ", ", sketch.estimate(key("never"))));
+	}
+	for(int i = 0; i < 100; i++) { sketch.record(key("popular")); }
+	if(sketch.estimate(key("popular")) != FrequencySketch::MAX_COUNT + 1) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("saturated at ", sketch.estimate(key("popular"))));
+	}
+
+	// most keys seen once hardly count for the others
+	size_t wrong = 0;
+	for(int i = 0; i < 1000; i++) { sketch.record(key(Log::msg("tail", i))); }
+	for(int i = 0; i < 1000; i++) {
+		if(sketch.estimate(key(Log::msg("tail", i))) > 2) { wrong++; }
+	}
+	if(wrong > 50) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(wrong, " of 1000 keys seen once look popular"));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * after 10 records per key of capacity, counts are halved
+*/
+void testAging() {
+	const string TAG = "testAging";
+	bool failFlag = false;
+
+	FrequencySketch sketch(64);
+	for(int i = 0; i < 15; i++) { sketch.record(key("old")); }
+	if(sketch.resets() != 0 || sketch.estimate(key("old")) != 15) {
+		failFlag = true;
+		Log::testFail(TAG, "before aging");
+	}
+	for(int i = 0; i < 640 - 15; i++) { sketch.record(key(Log::msg("new", i))); }
+	const size_t aged = sketch.estimate(key("old"));
+	if(sketch.resets() != 1 || aged < 7 || aged > 9) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(sketch.resets(), " resets, estimate ", aged));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+void testConcurrent() {
+	const string TAG = "testConcurrent";
+	bool failFlag = false;
+
+	FrequencySketch sketch(1024);
+	vector<thread> threads;
+	for(int i = 0; i < 4; i++) {
+		threads.push_back(thread([&, i]() {
+			for(int j = 0; j < 1000; j++) {
+				sketch.record(key("shared"));
+				sketch.record(key(Log::msg("own", i, "-", j % 4)));
+			}
+		}));
+	}
+	for(auto& t : threads) { t.join(); }
+	if(sketch.estimate(key("shared")) != FrequencySketch::MAX_COUNT + 1
+		|| sketch.estimate(key("own0-0")) != FrequencySketch::MAX_COUNT + 1) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("estimate ", sketch.estimate(key("shared"))));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testEstimate();
+	testAging();
+	testConcurrent();
+}
@@ -1,9 +1,14 @@
 #ifndef ZQ29_HTTPPROXYCACHE
 #define ZQ29_HTTPPROXYCACHE
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <filesystem> // C++ 17 required
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <stdexcept>
 #include <fstream>
 #include <streambuf>
@@ -11,10 +16,16 @@
 #include <assert.h>
 #include <ctime>
 #include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
 
 #include "../log.hpp"
 #include "cache.hpp"
+#include "frequencysketch.hpp"
+#include "evictionpolicy.hpp"
 #include "../httpparser/httpparser.hpp"
+#include "../threadpool/threadpool.hpp"
 
 namespace zq29 {
 namespace zq29Inner {
@@ -99,7 +110,26 @@ namespace zq29Inner {
 	 * this class follows the Singleton design pattern 
 	 * ref: https://stackoverflow.com/questions/1008019/c-singleton-design-pattern
 	 *
+	 * every entry is known in memory by its cacheKey, so a lookup is a
+	 * hash probe and opens the response file only, the index is built from
+	 * the request files on start, and kept in sync by save and removeByReq
+	 *
+	 * the index is split into INDEX_SHARDS shards by key hash, each with
+	 * its own locks, so hits on different keys don't wait for each other,
+	 * and a save waits only for the ones in its shard:
+	 *   a lookup holds the shard's reader lock until the response file is
+	 *   open, so its entry and file belong together
+	 *   a save writes its files first (Cache::stage) and takes the writer
+	 *   lock only to rename them in place and update the entry
 	 *
+	 * with a Capacity set, entries are evicted once the cache gets above
+	 * its high watermark, until it is below the low one, in the order of
+	 * an EvictionPolicy, their files are removed in the background
+	 * the policy sees every hit, but through a buffer per shard, so hits
+	 * take its lock once per ACCESS_BUFFER of them
+	 * with tinyLfu too, a new entry that would make the cache evict gets
+	 * in only if it's asked for more often than the entry it would push
+	 * out (TinyLFU), so one-hit wonders don't flush popular entries
 	*/
 	class HTTPProxyCache : public Cache {
 	public:
@@ -113,15 +143,98 @@ namespace zq29Inner {
 		*/
 		string offerId();
 
+		/*
+		 * a cached response as it is on disk: the head, exactly as it was
+		 * stored, and where the body is in the (still open) file
+		 *
+		 * the file stays open until the last copy of the shared_ptr is gone,
+		 * replacing the entry meanwhile does not touch it (see Cache::save),
+		 * so head and body always belong together
+		*/
+		class StoredResponse {
+		public:
+			~StoredResponse();
+			StoredResponse(const StoredResponse& rhs) = delete;
+			StoredResponse& operator=(const StoredResponse& rhs) = delete;
+
+			int fd() const;
+			const string& head() const; // status line and header fields, with the empty line
+			off_t bodyOffset() const;
+			size_t bodyLength() const;
+
+		private:
+			friend class HTTPProxyCache;
+			StoredResponse(const int fd);
+
+			const int file_fd;
+			string headStr;
+			off_t offset;
+			size_t length;
+		};
+
 		/*
 		 * save request and response
 		 * if it's not a GET & 200 OK combination, then do nothing
 		 * if it's not cacheable, do nothing
 		 * if request already exists, then update
-		 * return the id assigned to them
+		 * return the id assigned to them, noid if nothing was saved (not
+		 * GET & 200 OK, not cacheable, or not admitted, see Capacity)
 		*/
 		string save(const HTTPRequest& req, const HTTPStatus& sta, const string& prevId = noid);
 
+		/*
+		 * like save, for a response the caller wrote itself, head and body,
+		 * to the file it staged under staged (see Cache::openStaged), size
+		 * bytes in all, head has no body
+		 * the staged file becomes the response file, or is discarded if
+		 * nothing is saved
+		*/
+		string saveStaged(const HTTPRequest& req, const HTTPStatus& head, const string& staged, const size_t size,
+			const string& prevId = noid);
+
+		/*
+		 * forget the entry of requestLine and remove its files
+		 * returns false if there was none
+		*/
+		bool removeByReq(const HTTPRequest::RequestLine& requestLine);
+
+		/*
+		 * how big the cache may get, 0 for no limit
+		 * eviction starts above highWatermark percent of maxBytes or
+		 * maxEntries, and stops below lowWatermark percent of both
+		 * tinyLfu: admit new entries by frequency, see FrequencySketch
+		 * policy: one of EvictionPolicy::names(), LRU if it's none
+		*/
+		struct Capacity {
+			size_t maxBytes;
+			size_t maxEntries;
+			size_t highWatermark;
+			size_t lowWatermark;
+			bool tinyLfu = false;
+			string policy = "lru";
+		};
+		/*
+		 * no limit (and LRU) until it's called, evicts right away if needed
+		 * a new policy starts with the entries in no particular order
+		 * NOT thread-safe, call it before the cache is used
+		*/
+		void setCapacity(const Capacity& capacity);
+
+		/*
+		 * bytes of response files, and entries, in the cache
+		 * request files are not counted, they are tiny
+		*/
+		size_t usedBytes() const;
+		size_t usedEntries() const;
+		/*
+		 * entries evicted since the start
+		*/
+		size_t evicted() const;
+		/*
+		 * new entries TinyLFU kept out since the start
+		*/
+		size_t rejected() const;
+
 		/*
 		 * implemented according to https://tools.ietf.org/html/rfc7234#section-4
 		 * 
@@ -141,11 +254,17 @@ namespace zq29Inner {
 			 * 
 			*/
 			int action;
-			HTTPStatus resp;
+			HTTPStatus resp; // without its body, which is in stored
+			shared_ptr<StoredResponse> stored; // set along with resp, for action 0 and 2
 			HTTPRequest validationReq;
 			string id; // if not exists, noid
 		};
-		ConsRespResult constructResponse(const HTTPRequest& req);
+		/*
+		 * record: count req in the frequencies TinyLFU admits by, and as
+		 * a use of the entry it finds, as a client asked for it, only
+		 * save() looks without counting
+		*/
+		ConsRespResult constructResponse(const HTTPRequest& req, const bool record = true);
 
 	public: // TODO: for testing
 
@@ -165,16 +284,120 @@ namespace zq29Inner {
 		string getReqName(const string& id) const;
 		string getStaName(const string& id) const;
 
-		mutex cacheWriteMutex;
+		/*
+		 * what the index knows about an entry
+		 * respTime: when the response was stored, the mtime of its request file
+		 * size: of the response file, head and body
+		*/
+		struct IndexEntry {
+			string id;
+			time_t respTime;
+			size_t size;
+		};
+
+		/*
+		 * entries: guarded by lock
+		 * writeMutex: one save, remove or eviction at a time, so saves of
+		 * one key agree on its id, held while files are written, readers go on
+		 * accesses: hits not told to the policy yet, guarded by accessMutex,
+		 * as hits hold the reader lock only
+		*/
+		struct IndexShard {
+			unordered_map<string, IndexEntry> entries;
+			mutable shared_mutex lock;
+			mutex writeMutex;
+			vector<string> accesses;
+			mutex accessMutex;
+		};
+		static const size_t INDEX_SHARDS = 64;
+		IndexShard shards[INDEX_SHARDS];
+		IndexShard& shardOf(const string& key);
+		static uint64_t keyHash(const string& key);
+
+		atomic<size_t> bytes;
+		atomic<size_t> entryCount;
+		atomic<size_t> evictedCount;
+		atomic<size_t> rejectedCount;
+
+		/*
+		 * one for the whole cache, so it orders entries across shards,
+		 * guarded by policyMutex
+		 * lock order: a shard's locks, then policyMutex
+		*/
+		unique_ptr<EvictionPolicy> policy;
+		mutex policyMutex;
+		static const size_t ACCESS_BUFFER = 64;
+
+		/*
+		 * with the shard's writeMutex and writer lock held
+		 * evicted: tell the policy it was evicted, not just removed
+		*/
+		void indexInsert(IndexShard& shard, const string& key, const IndexEntry& entry);
+		IndexEntry indexErase(IndexShard& shard, const unordered_map<string, IndexEntry>::iterator& it,
+			const bool evicted = false);
+		/*
+		 * a hit, with the shard's reader lock held
+		*/
+		void touch(IndexShard& shard, const string& key);
+		/*
+		 * tell the policy about the hits buffered in shard
+		*/
+		void drainAccesses(IndexShard& shard);
+
+		size_t highBytes, lowBytes, highEntries, lowEntries; // 0: no limit
+		bool aboveHigh() const;
+		bool aboveLow() const;
+
+		/*
+		 * evict until below the low watermark, if above the high one
+		 * one thread at a time, the others go on
+		*/
+		mutex evictMutex;
+		void evictIfNeeded();
+
+		/*
+		 * the shard with the entry the policy would evict next, and its
+		 * key, nullptr if the cache is empty
+		*/
+		IndexShard* nextVictim(string& key);
+
+		/*
+		 * whether a new entry of size bytes for key gets in
+		 * with the shard's writeMutex held
+		*/
+		unique_ptr<FrequencySketch> sketch;
+		bool admit(const string& key, const size_t size);
+
+		/*
+		 * removes files of evicted entries in the background
+		*/
+		static const size_t REMOVER_QUEUE = 4096;
+		WorkerPool remover;
+		void removeFiles(const string& id);
+
+		/*
+		 * what the index is keyed by: method, target and version of the
+		 * request line, with the scheme and host of an absolute target in
+		 * lower case
+		*/
+		static string cacheKey(const HTTPRequest::RequestLine& requestLine);
+
+		/*
+		 * (re)build the index from the request files in wdir
+		 * leftovers of interrupted saves are removed on the way
+		*/
+		void buildIndex();
 
 		/*
 		 * maintains a pool of available ids
 		*/
 		set<string> idPool;
 		mutex idPoolMutex;
+		// the largest id ever put in the pool, ids offered but not saved yet are not on disk
+		size_t maxPooledId = 0;
 
 		/*
-		 * find more available ids
+		 * find more available ids, after maxPooledId
 		 * NOT thread-safe
 		 * and we may get ids that are already in use,
 		 * which can be due to attacking or running out
@@ -184,30 +407,55 @@ namespace zq29Inner {
 		void updateIdPool(const size_t expectedCount = 100);
 
 		/*
-		 * if the wdir already exists, restore from it
+		 * the largest id of the files in wdir, 0 if none
+		 * reads the whole directory, only for restore()
+		*/
+		size_t scanMaxId() const;
+
+		/*
+		 * if the wdir already exists, restore from it, ids and index
 		 * this can only be called by constructor and 
 		 * thus thread-safe
 		*/
 		void restore();
 
 		/*
-		 * get HTTP status string by HTTP request's first line
+		 * get HTTP status string by HTTP request's first line, see cacheKey
 		 * return HTTPStatus() when no match or faild to parse match
 		 * which is rare but possiily because of modification of files
 		 *
 		 * exception: no throw (but may throw when system lib fails which is rare)
 		 *
 		 * only when if id != noid, the result is valid! because of the exception thing
+		 *
+		 * record: as a use of the entry, for eviction
+		 *
+		 * only the head is read and parsed, s has no body, read it from stored
 		*/
 		struct GetStaResult {
 			string id;
 			HTTPStatus s;
+			shared_ptr<StoredResponse> stored;
 			time_t respTime;
 		};
-		GetStaResult getStaByReq(const HTTPRequest::RequestLine& requestLine) const;
+		GetStaResult getStaByReq(const HTTPRequest::RequestLine& requestLine, const bool record = true);
+
+		/*
+		 * open the response with id and parse its head into head
+		 * returns nullptr if there is none, or it is broken
+		*/
+		static const size_t MAX_STORED_HEAD_SIZE = 64 * 1024;
+		shared_ptr<StoredResponse> openSta(const string& id, HTTPStatus& head) const;
 
 		HTTPRequest buildValidationRequest(const HTTPRequest& req, const HTTPStatus& sta) const;
 
+		/*
+		 * save and saveStaged, the response file is staged already if
+		 * staged is not noid, and written from sta otherwise
+		*/
+		string store(const HTTPRequest& req, const HTTPStatus& sta, const string& staged, const size_t stagedSize,
+			const string& prevId);
+
 	};
 	bool HTTPProxyCache::initd = false;
 
@@ -410,6 +658,21 @@ namespace zq29Inner {
 
 
 
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// StoredResponse Implementation //////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	HTTPProxyCache::StoredResponse::StoredResponse(const int fd) :
+		file_fd(fd), offset(0), length(0) {}
+
+	HTTPProxyCache::StoredResponse::~StoredResponse() {
+		close(file_fd);
+	}
+
+	int HTTPProxyCache::StoredResponse::fd() const { return file_fd; }
+	const string& HTTPProxyCache::StoredResponse::head() const { return headStr; }
+	off_t HTTPProxyCache::StoredResponse::bodyOffset() const { return offset; }
+	size_t HTTPProxyCache::StoredResponse::bodyLength() const { return length; }
+
 	/////////////////////////////////////////////////////////////////////////////////
 	//////////////////////////// HTTPProxyCache Implementation //////////////////////
 	/////////////////////////////////////////////////////////////////////////////////
@@ -436,36 +699,69 @@ namespace zq29Inner {
 	}
 
 	string HTTPProxyCache::save(const HTTPRequest& req, const HTTPStatus& sta, const string& prevId) {
+		return store(req, sta, noid, 0, prevId);
+	}
+
+	string HTTPProxyCache::saveStaged(const HTTPRequest& req, const HTTPStatus& head, const string& staged,
+		const size_t size, const string& prevId) {
+		return store(req, head, staged, size, prevId);
+	}
+
+	string HTTPProxyCache::store(const HTTPRequest& req, const HTTPStatus& sta, const string& staged,
+		const size_t stagedSize, const string& prevId) {
 		assert(idPool.size() > 0);
 		
 		if(req.requestLine.method != "GET" || sta.statusLine.statusCode != "200") {
+			if(staged != noid) { Cache::discard(staged); }
 			return noid;
 		}
 
-		lock_guard<mutex> cacheWriteLock(cacheWriteMutex);
-		auto result = getStaByReq(req.requestLine);
+		const string key = cacheKey(req.requestLine);
+		IndexShard& shard = shardOf(key);
+		unique_lock<mutex> writeLock(shard.writeMutex);
+		string existing = noid;
+		{
+			shared_lock<shared_mutex> readLock(shard.lock);
+			auto it = shard.entries.find(key);
+			if(it != shard.entries.end()) { existing = it->second.id; }
+		}
 		// if already exists, update
 		string id = noid;
-		if(result.id != noid) { 
+		if(existing != noid) { 
 			if(prevId != noid) {
 				Log::warning("called save() with unnecessary prevId argument");
 			}
-			id = result.id;
+			id = existing;
 		} else if(prevId != noid) {
 			id = prevId;
 		} else {
-			id = *(idPool.begin());
-			idPool.erase(idPool.begin());
-			if(idPool.size() == 0) { updateIdPool(); }
+			id = offerId();
 		}
 		
 		auto detRes = HTTPSemantics::isCacheable(req, sta);
 		if(detRes.isCacheable) {
-			Cache::save(getReqName(id), req.toStr());
-			Cache::save(getStaName(id), sta.toStr());
+			const string staStr = staged == noid ? sta.toStr() : "";
+			const size_t size = staged == noid ? staStr.size() : stagedSize;
+			if(existing == noid && !admit(key, size)) {
+				Log::proxy(Log::msg(
+					id, ": not cached because it is asked for less often than what it would evict"
+				));
+				if(staged != noid) { Cache::discard(staged); }
+				return noid;
+			}
+			Cache::stage(getReqName(id), req.toStr());
+			if(staged == noid) { Cache::stage(getStaName(id), staStr); }
+			{
+				unique_lock<shared_mutex> lock(shard.lock);
+				Cache::commit(getReqName(id));
+				Cache::commit(getStaName(id), staged);
+				indexInsert(shard, key, IndexEntry{ id, time(0), size });
+			}
+			writeLock.unlock();
+			evictIfNeeded();
 
 			// for log
-			auto const fooRes = constructResponse(req);
+			auto const fooRes = constructResponse(req, false);
 			if(fooRes.action == 2) {
 				Log::proxy(Log::msg(
 					id, ": cached, but requires re-validation"
@@ -494,15 +790,198 @@ namespace zq29Inner {
 				id, ": not cacheable because ",
 				detRes.reason
 			));
+			if(staged != noid) { Cache::discard(staged); }
+			return noid;
 		}
 
 		return id;
 	}
 
-	HTTPProxyCache::ConsRespResult HTTPProxyCache::constructResponse(const HTTPRequest& req) {
+	bool HTTPProxyCache::removeByReq(const HTTPRequest::RequestLine& requestLine) {
+		const string key = cacheKey(requestLine);
+		IndexShard& shard = shardOf(key);
+		lock_guard<mutex> writeLock(shard.writeMutex);
+		string id;
+		{
+			unique_lock<shared_mutex> lock(shard.lock);
+			auto it = shard.entries.find(key);
+			if(it == shard.entries.end()) { return false; }
+			id = indexErase(shard, it).id;
+		}
+		Cache::remove(getReqName(id));
+		Cache::remove(getStaName(id));
+		return true;
+	}
+
+	void HTTPProxyCache::setCapacity(const Capacity& capacity) {
+		const size_t high = min(capacity.highWatermark, (size_t)100);
+		const size_t low = min(capacity.lowWatermark, high);
+		highBytes = capacity.maxBytes / 100 * high + capacity.maxBytes % 100 * high / 100;
+		lowBytes = capacity.maxBytes / 100 * low + capacity.maxBytes % 100 * low / 100;
+		highEntries = capacity.maxEntries * high / 100;
+		lowEntries = capacity.maxEntries * low / 100;
+		if(capacity.maxBytes > 0 && highBytes == 0) { highBytes = 1; }
+		if(capacity.maxEntries > 0 && highEntries == 0) { highEntries = 1; }
+		// without an entry limit, guess from the bytes, at 64K an entry
+		const size_t keys = capacity.maxEntries > 0 ? capacity.maxEntries : capacity.maxBytes / (64 * 1024) + 1;
+		sketch.reset(capacity.tinyLfu && (capacity.maxBytes > 0 || capacity.maxEntries > 0) ?
+			new FrequencySketch(keys) : nullptr);
+
+		unique_ptr<EvictionPolicy> chosen = EvictionPolicy::create(capacity.policy, keys);
+		if(chosen == nullptr) {
+			Log::warning(Log::msg("unknown cache policy <", capacity.policy, ">, using lru"));
+			chosen = EvictionPolicy::create("lru", keys);
+		}
+		for(IndexShard& shard : shards) {
+			shared_lock<shared_mutex> lock(shard.lock);
+			lock_guard<mutex> accessLock(shard.accessMutex);
+			shard.accesses.clear();
+			for(const auto& kv : shard.entries) { chosen->insert(kv.first); }
+		}
+		{
+			lock_guard<mutex> policyLock(policyMutex);
+			policy.swap(chosen);
+		}
+		evictIfNeeded();
+	}
+
+	size_t HTTPProxyCache::usedBytes() const { return bytes.load(memory_order_relaxed); }
+	size_t HTTPProxyCache::usedEntries() const { return entryCount.load(memory_order_relaxed); }
+	size_t HTTPProxyCache::evicted() const { return evictedCount.load(memory_order_relaxed); }
+	size_t HTTPProxyCache::rejected() const { return rejectedCount.load(memory_order_relaxed); }
+
+	bool HTTPProxyCache::aboveHigh() const {
+		return (highBytes > 0 && usedBytes() > highBytes)
+			|| (highEntries > 0 && usedEntries() > highEntries);
+	}
+
+	bool HTTPProxyCache::aboveLow() const {
+		return (highBytes > 0 && usedBytes() > lowBytes)
+			|| (highEntries > 0 && usedEntries() > lowEntries);
+	}
+
+	void HTTPProxyCache::indexInsert(IndexShard& shard, const string& key, const IndexEntry& entry) {
+		auto it = shard.entries.find(key);
+		if(it != shard.entries.end()) {
+			bytes -= it->second.size;
+			it->second = entry;
+		} else {
+			shard.entries.emplace(key, entry);
+			entryCount++;
+		}
+		bytes += entry.size;
+		lock_guard<mutex> policyLock(policyMutex);
+		policy->insert(key);
+	}
+
+	HTTPProxyCache::IndexEntry HTTPProxyCache::indexErase(IndexShard& shard,
+		const unordered_map<string, IndexEntry>::iterator& it, const bool evicted) {
+		const IndexEntry entry = it->second;
+		{
+			lock_guard<mutex> policyLock(policyMutex);
+			if(evicted) {
+				policy->evicted(it->first);
+			} else {
+				policy->erase(it->first);
+			}
+		}
+		shard.entries.erase(it);
+		bytes -= entry.size;
+		entryCount--;
+		return entry;
+	}
+
+	void HTTPProxyCache::touch(IndexShard& shard, const string& key) {
+		{
+			lock_guard<mutex> accessLock(shard.accessMutex);
+			shard.accesses.push_back(key);
+			if(shard.accesses.size() < ACCESS_BUFFER) { return; }
+		}
+		drainAccesses(shard);
+	}
+
+	void HTTPProxyCache::drainAccesses(IndexShard& shard) {
+		vector<string> accesses;
+		{
+			lock_guard<mutex> accessLock(shard.accessMutex);
+			if(shard.accesses.empty()) { return; }
+			accesses.swap(shard.accesses);
+			shard.accesses.reserve(ACCESS_BUFFER);
+		}
+		lock_guard<mutex> policyLock(policyMutex);
+		for(const string& key : accesses) { policy->access(key); }
+	}
+
+	void HTTPProxyCache::evictIfNeeded() {
+		if(!aboveHigh()) { return; }
+		unique_lock<mutex> evictLock(evictMutex, try_to_lock);
+		if(!evictLock.owns_lock()) { return; } // someone is at it already
+		size_t count = 0, freed = 0;
+		while(aboveLow()) {
+			string key;
+			IndexShard* shard = nextVictim(key);
+			if(shard == nullptr) { break; }
+			string id;
+			{
+				lock_guard<mutex> writeLock(shard->writeMutex);
+				unique_lock<shared_mutex> lock(shard->lock);
+				auto it = shard->entries.find(key);
+				if(it == shard->entries.end()) { // removed meanwhile, the policy knows, but make sure
+					lock_guard<mutex> policyLock(policyMutex);
+					policy->erase(key);
+					continue;
+				}
+				const IndexEntry entry = indexErase(*shard, it, true);
+				id = entry.id;
+				freed += entry.size;
+			}
+			count++;
+			if(!remover.trySubmit([this, id]() { removeFiles(id); })) {
+				removeFiles(id);
+			}
+		}
+		evictedCount += count;
+		Log::proxy(Log::msg("(no-id): NOTE cache evicted ", count, " entries of ", freed, " bytes by ", policy->name(),
+			", now ", usedBytes(), " bytes in ", usedEntries(), " entries"));
+	}
+
+	HTTPProxyCache::IndexShard* HTTPProxyCache::nextVictim(string& key) {
+		for(IndexShard& shard : shards) { drainAccesses(shard); }
+		lock_guard<mutex> policyLock(policyMutex);
+		if(!policy->victim(key)) { return nullptr; }
+		return &shardOf(key);
+	}
+
+	bool HTTPProxyCache::admit(const string& key, const size_t size) {
+		if(sketch == nullptr) { return true; }
+		if((highBytes == 0 || usedBytes() + size <= highBytes)
+			&& (highEntries == 0 || usedEntries() + 1 <= highEntries)) {
+			return true; // there is room, nothing to evict
+		}
+		string victim;
+		if(nextVictim(victim) == nullptr) { return true; }
+		if(sketch->estimate(keyHash(key)) > sketch->estimate(keyHash(victim))) { return true; }
+		rejectedCount++;
+		return false;
+	}
+
+	void HTTPProxyCache::removeFiles(const string& id) {
+		try {
+			Cache::remove(getReqName(id));
+			Cache::remove(getStaName(id));
+		} catch(const CacheException& e) {
+			Log::warning(Log::msg("while removing evicted <", id, ">: ", e.what()));
+		}
+	}
+
+	HTTPProxyCache::ConsRespResult HTTPProxyCache::constructResponse(const HTTPRequest& req, const bool record) {
 		ConsRespResult result;
-		const GetStaResult r = getStaByReq(req.requestLine);
+		if(record && sketch != nullptr && req.requestLine.method == "GET") {
+			sketch->record(keyHash(cacheKey(req.requestLine)));
+		}
+		const GetStaResult r = getStaByReq(req.requestLine, record);
 		result.id = r.id;
+		result.stored = r.stored;
 		const HTTPStatus& resp = r.s;
 		const time_t respTime = r.respTime;
 
@@ -540,6 +1019,7 @@ namespace zq29Inner {
 			if(e.first == "Cache-Control" && e.second == "no-cache") {
 				Log::debug("in constructResponse: response has 'no-cache'");
 				result.action = 2;
+				result.resp = resp;
 				result.validationReq = buildValidationRequest(req, resp);
 				return result;
 			}
@@ -556,6 +1036,7 @@ namespace zq29Inner {
 		} else {
 			Log::debug("in constructResponse: rule 6.2 go re-validation");
 			result.action = 2;
+			result.resp = resp;
 			result.validationReq = buildValidationRequest(req, resp);
 			return result;
 		}
@@ -566,7 +1047,14 @@ namespace zq29Inner {
 	}
 
 	HTTPProxyCache::HTTPProxyCache(const fs::path& p) :
-		Cache(p)
+		Cache(p),
+		bytes(0),
+		entryCount(0),
+		evictedCount(0),
+		rejectedCount(0),
+		policy(EvictionPolicy::create("lru", 0)),
+		highBytes(0), lowBytes(0), highEntries(0), lowEntries(0),
+		remover(1, REMOVER_QUEUE)
 	{
 		restore();
 		initd = true;
@@ -586,84 +1074,184 @@ namespace zq29Inner {
 	}
 
 	void HTTPProxyCache::updateIdPool(const size_t expectedCount) {
-		if(!is_directory(wdir)) {
-			throw CacheException("wdir not available");
-		}
-		size_t maxId = 0;
-		for(auto const& file : fs::directory_iterator(wdir)) {
-			if(!is_regular_file(file.path())) { continue; }
-			stringstream ss;
-			ss << getIdByFilename(file.path().filename());
-			size_t temp;
-			ss >> temp;
-			maxId = max(maxId, temp);
-		}
-
+		const size_t maxId = maxPooledId;
 		for(size_t i = 1; i <= expectedCount; i++) {
 			// overflow! attack or runnnig out of id
 			if(maxId + i < maxId) {
 				removeAll();
+				for(IndexShard& shard : shards) {
+					unique_lock<shared_mutex> lock(shard.lock);
+					while(!shard.entries.empty()) { indexErase(shard, shard.entries.begin()); }
+				}
 				idPool.clear();
 				for(size_t j = 0; j < expectedCount; j++) {
 					stringstream ss;
 					ss << j;
 					idPool.insert(ss.str());
 				}
+				maxPooledId = expectedCount - 1;
 				return;
 			}
 
 			stringstream ss;
 			ss << maxId + i;
 			idPool.insert(ss.str());
+			maxPooledId = maxId + i;
 		}
 	}
 
+	size_t HTTPProxyCache::scanMaxId() const {
+		if(!is_directory(wdir)) {
+			throw CacheException("wdir not available");
+		}
+		size_t maxId = 0;
+		for(auto const& file : fs::directory_iterator(wdir)) {
+			if(!is_regular_file(file.path())) { continue; }
+			stringstream ss;
+			ss << getIdByFilename(file.path().filename());
+			size_t temp;
+			ss >> temp;
+			maxId = max(maxId, temp);
+		}
+		return maxId;
+	}
+
 	void HTTPProxyCache::restore() {
 		assert(!initd);
+		// ids on disk are only learnt here, every later one comes from the pool
+		maxPooledId = max(maxPooledId, scanMaxId());
 		updateIdPool();
+		buildIndex();
 	}
 
-	HTTPProxyCache::GetStaResult HTTPProxyCache::getStaByReq(const HTTPRequest::RequestLine& requestLine) const {
-		GetStaResult result;
-		result.id = noid;
-		result.s = HTTPStatus();
-		result.respTime = 0;
+	string HTTPProxyCache::cacheKey(const HTTPRequest::RequestLine& requestLine) {
+		string target = requestLine.requestTarget;
+		const size_t schemeEnd = target.find("://");
+		if(schemeEnd != string::npos) {
+			const size_t hostEnd = min(target.find('/', schemeEnd + 3), target.size());
+			transform(target.begin(), target.begin() + hostEnd, target.begin(), ::tolower);
+		}
+		return requestLine.method + " " + target + " " + requestLine.httpVersion;
+	}
 
-		if(!is_directory(wdir)) { return result; }
-		stringstream ss;
-		ss << requestLine.method << " " 
-			<< requestLine.requestTarget << " "
-			<< requestLine.httpVersion;
-		const string requestLineStr = ss.str();
-		for(auto const& file : fs::directory_iterator(wdir)) {
-			if(!is_regular_file(file.path())) { continue; }
-			ifstream ifs(file.path());
-			string str;
-			getline(ifs, str);
-			ifs.close();
-			if(str[str.length() - 1] == '\r') {
-				str = str.substr(0, str.length() - 1); // get rid of '\r'
-			}
-			if(str == requestLineStr) {
-				const string id = getIdByFilename(file.path().filename());
-				if(id == noid) { return result; }
-				//fs::file_time_type t;
+	HTTPProxyCache::IndexShard& HTTPProxyCache::shardOf(const string& key) {
+		return shards[keyHash(key) % INDEX_SHARDS];
+	}
+
+	uint64_t HTTPProxyCache::keyHash(const string& key) {
+		return hash<string>()(key);
+	}
+
+	void HTTPProxyCache::buildIndex() {
+		unordered_map<string, IndexEntry> built;
+		if(is_directory(wdir)) {
+			for(auto const& file : fs::directory_iterator(wdir)) {
+				if(!is_regular_file(file.path())) { continue; }
+				const string filename = file.path().filename();
+				if(filename[0] == '.') { // an interrupted save
+					error_code ec;
+					fs::remove(file.path(), ec);
+					continue;
+				}
+				if(filename.compare(0, REQ_ID_PREFIX.size() + DELIM.size(), REQ_ID_PREFIX + DELIM) != 0) { continue; }
+				const string id = getIdByFilename(filename);
+				ifstream ifs(file.path());
+				string line;
+				getline(ifs, line);
+				ifs.close();
+				HTTPRequest::RequestLine requestLine;
+				stringstream ss(line);
+				ss >> requestLine.method >> requestLine.requestTarget >> requestLine.httpVersion;
+				if(!ss || id == noid) { continue; }
 				try {
-					const auto ftime = fs::last_write_time(file.path());
-					result.respTime = toTimeT(ftime);
-					result.s = buildStatusFromStr(getMsgById(getStaName(id)));
-					result.id = id;
-					return result;
+					fs::path staPath(wdir);
+					staPath += "/" + getStaName(id);
+					const size_t size = fs::file_size(staPath);
+					const time_t respTime = toTimeT(fs::last_write_time(file.path()));
+					IndexEntry& entry = built[cacheKey(requestLine)];
+					if(entry.id == noid || entry.respTime < respTime) { // the newest one wins
+						entry = IndexEntry{ id, respTime, size };
+					}
 				} catch(const fs::filesystem_error& e) {
-					Log::warning(Log::msg("While fetching resp in cache: ", e.what()));
-					return result;
+					Log::debug(Log::msg("in buildIndex(): skip <", filename, ">, ", e.what()));
 				}
-				
 			}
 		}
+		for(IndexShard& shard : shards) {
+			unique_lock<shared_mutex> lock(shard.lock);
+			while(!shard.entries.empty()) { indexErase(shard, shard.entries.begin()); }
+		}
+		// the oldest first, so the policy takes them as the least recently used
+		vector<pair<string, IndexEntry>> sorted(built.begin(), built.end());
+		sort(sorted.begin(), sorted.end(), [](const pair<string, IndexEntry>& a, const pair<string, IndexEntry>& b) {
+			return a.second.respTime < b.second.respTime;
+		});
+		for(const auto& kv : sorted) {
+			IndexShard& shard = shardOf(kv.first);
+			unique_lock<shared_mutex> lock(shard.lock);
+			indexInsert(shard, kv.first, kv.second);
+		}
+	}
+
+	HTTPProxyCache::GetStaResult HTTPProxyCache::getStaByReq(const HTTPRequest::RequestLine& requestLine, const bool record) {
+		GetStaResult result;
+		result.id = noid;
+		result.s = HTTPStatus();
+		result.respTime = 0;
+
+		const string key = cacheKey(requestLine);
+		IndexShard& shard = shardOf(key);
+		shared_lock<shared_mutex> lock(shard.lock);
+		auto it = shard.entries.find(key);
+		if(it == shard.entries.end()) { return result; }
+		result.respTime = it->second.respTime;
+		result.stored = openSta(it->second.id, result.s);
+		if(result.stored != nullptr) {
+			result.id = it->second.id;
+			if(record) { touch(shard, key); }
+		}
 		return result;
 	}
 
+	shared_ptr<HTTPProxyCache::StoredResponse> HTTPProxyCache::openSta(const string& id, HTTPStatus& head) const {
+		fs::path filename(wdir);
+		filename += "/" + getStaName(id);
+		const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) { return nullptr; }
+		shared_ptr<StoredResponse> stored(new StoredResponse(fd));
+
+		// read no further than the empty line, the body stays on disk
+		string& str = stored->headStr;
+		size_t headEnd = string::npos;
+		char chunk[4096];
+		while(headEnd == string::npos && str.size() < MAX_STORED_HEAD_SIZE) {
+			const ssize_t n = pread(fd, chunk, sizeof(chunk), str.size());
+			if(n <= 0) { break; }
+			const size_t from = str.size() < 3 ? 0 : str.size() - 3;
+			str.append(chunk, n);
+			headEnd = str.find("\r\n\r\n", from);
+		}
+		struct stat st;
+		if(headEnd == string::npos || fstat(fd, &st) < 0) {
+			Log::warning(Log::msg("in openSta(): cannot read the head of <", getStaName(id), ">"));
+			return nullptr;
+		}
+		str.resize(headEnd + 4);
+		stored->offset = str.size();
+		stored->length = st.st_size - str.size();
+
+		try {
+			HTTPStatusParser p;
+			p.setBuffer(vector<char>(str.begin(), str.end()));
+			head = p.buildHead();
+		} catch(const exception& e) {
+			Log::debug(e.what());
+			head = HTTPStatus();
+			return nullptr;
+		}
+		return stored;
+	}
+
 	HTTPRequest HTTPProxyCache::buildValidationRequest(const HTTPRequest& req, const HTTPStatus& sta) const {
 		HTTPRequest result(req);
 		auto const headerFields = result.headerFields;
@@ -0,0 +1,128 @@
+/*
+ * This file:
+ * replays a trace of requests through a cache of a given number of
+ * entries, once with LRU alone and once with LRU behind the TinyLFU
+ * filter of HTTPProxyCache::save, and prints the hit ratio of each
+ *
+ * without a file, synthetic traces are used: a Zipf-popular set of URLs
+ * mixed with a long tail of URLs asked for only once
+ * a trace file has one key (a URL) per line, e.g. from the proxy log:
+ *   grep -o 'GET [^ ]*' proxy.log | cut -d' ' -f2 > trace.txt
+ *
+ * usage: ./tinylfuBench [trace file] [capacity]
+*/
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "frequencysketch.hpp"
+
+using namespace zq29;
+using namespace std;
+
+/*
+ * the entries of HTTPProxyCache, without the files
+*/
+class Simulation {
+public:
+	Simulation(const size_t capacity, const bool tinyLfu) :
+		capacity(capacity), sketch(tinyLfu ? new FrequencySketch(capacity) : nullptr), hits(0), requests(0) {}
+
+	void request(const string& key) {
+		requests++;
+		const uint64_t h = hash<string>()(key);
+		if(sketch != nullptr) { sketch->record(h); }
+		auto it = positions.find(key);
+		if(it != positions.end()) {
+			hits++;
+			lru.splice(lru.begin(), lru, it->second);
+			return;
+		}
+		// a miss, fetched and saved
+		if(lru.size() >= capacity) {
+			const string& victim = lru.back();
+			if(sketch != nullptr && sketch->estimate(h) <= sketch->estimate(hash<string>()(victim))) { return; }
+			positions.erase(victim);
+			lru.pop_back();
+		}
+		lru.push_front(key);
+		positions[key] = lru.begin();
+	}
+
+	double hitRatio() const { return requests == 0 ? 0 : (double)hits / requests; }
+
+private:
+	const size_t capacity;
+	unique_ptr<FrequencySketch> sketch;
+	list<string> lru;
+	unordered_map<string, list<string>::iterator> positions;
+	size_t hits, requests;
+};
+
+/*
+ * n requests, a share of them for `objects` URLs with Zipf(s) popularity,
+ * the rest for URLs never seen before
+*/
+vector<string> synthetic(const size_t n, const size_t objects, const double s, const double oneHitShare) {
+	mt19937_64 rng(29);
+	vector<double> cdf(objects);
+	double sum = 0;
+	for(size_t i = 0; i < objects; i++) {
+		sum += 1 / pow(i + 1, s);
+		cdf[i] = sum;
+	}
+	uniform_real_distribution<double> uniform(0, 1);
+	vector<string> trace;
+	trace.reserve(n);
+	for(size_t i = 0; i < n; i++) {
+		if(uniform(rng) < oneHitShare) {
+			trace.push_back(Log::msg("http://tail.test/", i));
+		} else {
+			const size_t k = lower_bound(cdf.begin(), cdf.end(), uniform(rng) * sum) - cdf.begin();
+			trace.push_back(Log::msg("http://popular.test/", k));
+		}
+	}
+	return trace;
+}
+
+void run(const string& name, const vector<string>& trace, const size_t capacity) {
+	Simulation lru(capacity, false), tinyLfu(capacity, true);
+	for(const string& key : trace) {
+		lru.request(key);
+		tinyLfu.request(key);
+	}
+	cout << left << setw(36) << name << right << setw(10) << capacity << fixed << setprecision(2)
+		<< setw(10) << lru.hitRatio() * 100 << "%" << setw(10) << tinyLfu.hitRatio() * 100 << "%" << endl;
+}
+
+int main(int argc, char** argv) {
+	cout << left << setw(36) << "trace" << right << setw(10) << "entries"
+		<< setw(11) << "LRU" << setw(11) << "TinyLFU" << endl;
+	if(argc > 1) {
+		ifstream ifs(argv[1]);
+		if(!ifs) {
+			cerr << "cannot open " << argv[1] << endl;
+			return EXIT_FAILURE;
+		}
+		vector<string> trace;
+		string line;
+		while(getline(ifs, line)) {
+			if(!line.empty()) { trace.push_back(line); }
+		}
+		run(argv[1], trace, argc > 2 ? stoul(argv[2]) : 1000);
+		return EXIT_SUCCESS;
+	}
+	for(const double oneHitShare : { 0.0, 0.3, 0.6 }) {
+		const vector<string> trace = synthetic(2000000, 100000, 0.9, oneHitShare);
+		for(const size_t capacity : { 1000, 10000 }) {
+			run(Log::msg("zipf 0.9, ", (int)(oneHitShare * 100), "% one-hit wonders"), trace, capacity);
+		}
+	}
+	return EXIT_SUCCESS;
+}
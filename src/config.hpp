@@ -0,0 +1,439 @@
+/*
+ * This file:
+ * holds every tunable knob of the proxy in one place,
+ * each of them can be overridden by an environment variable
+*/
+#ifndef ZQ29_CONFIG
+#define ZQ29_CONFIG
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+	using namespace std;
+
+	class Config {
+	public:
+		/*
+		 * what to do with a new request when the worker queue is full
+		 * REJECT_503: reply with a canned 503 and close the connection
+		 * PAUSE_ACCEPT: stop calling accept() until the queue drains,
+		 *               so new connections wait in the kernel backlog
+		*/
+		enum OverloadPolicy { REJECT_503, PAUSE_ACCEPT };
+
+		/*
+		 * PROXY_SHARDS, number of listening sockets, default 1
+		 * with N > 1, N SO_REUSEPORT listeners are opened, each one with
+		 * its own event loop thread and worker pool, pinned to a core
+		 * workers and queueCapacity are split between the shards
+		*/
+		size_t shards;
+
+		/*
+		 * PROXY_WORKERS, number of handler threads
+		 * handlers block on upstream I/O, so by default we run
+		 * several of them per core
+		*/
+		size_t workers;
+
+		/*
+		 * PROXY_QUEUE_CAPACITY, max number of requests waiting for a worker
+		*/
+		size_t queueCapacity;
+
+		/*
+		 * PROXY_OVERLOAD, "503" or "pause"
+		*/
+		OverloadPolicy overloadPolicy;
+
+		/*
+		 * PROXY_IO_BACKEND, "epoll" or "io_uring", default epoll
+		 * io_uring falls back to epoll if the kernel does not support it
+		 * only the event loops use it, handlers still do blocking I/O
+		*/
+		bool ioUring;
+
+		/*
+		 * PROXY_HANDLERS, "threads" or "fibers", default threads
+		 * threads: handlers run in the worker pools, one blocked thread per request
+		 * fibers: handlers run as fibers on the event loops, workers is unused
+		*/
+		bool fibers;
+
+		/*
+		 * PROXY_MAX_FIBERS, max number of requests in flight with fibers,
+		 * split between the shards, the overload policy applies above it
+		*/
+		size_t maxFibers;
+
+		/*
+		 * PROXY_KEEPALIVE_TIMEOUT_MS, how long a client connection may wait
+		 * for its next request (or its first one) before it is closed
+		*/
+		size_t keepAliveTimeout;
+
+		/*
+		 * PROXY_UPSTREAM_MAX_IDLE, idle connections kept per origin server
+		 * PROXY_UPSTREAM_IDLE_TIMEOUT_MS, how long they are kept
+		*/
+		size_t upstreamMaxIdle;
+		size_t upstreamIdleTimeout;
+
+		/*
+		 * PROXY_DNS_TTL_MS, how long resolved names are cached
+		 * PROXY_DNS_NEGATIVE_TTL_MS, same for names that do not exist
+		 * PROXY_DNS_HOSTS_FILE, resolve names from this file (/etc/hosts
+		 * format) instead of getaddrinfo, empty by default
+		*/
+		size_t dnsTtl;
+		size_t dnsNegativeTtl;
+		string dnsHostsFile;
+
+		/*
+		 * PROXY_CONNECT_ATTEMPT_DELAY_MS, how long to wait for an address
+		 * of an origin server before trying the next one in parallel
+		 * PROXY_CONNECT_TIMEOUT_MS, when to give up on one address
+		*/
+		size_t connectAttemptDelay;
+		size_t connectTimeout;
+
+		/*
+		 * PROXY_UPSTREAM_READ_TIMEOUT_MS, how long a server may keep us
+		 * waiting for the head of a response, or for the next bytes of its
+		 * body, before the request fails
+		 * followers of a collapsed request give up on its leader after as
+		 * long (plus PROXY_CONNECT_TIMEOUT_MS for the head), and fetch it
+		 * themselves
+		*/
+		size_t upstreamReadTimeout;
+
+		/*
+		 * PROXY_TUNNEL, how CONNECT tunnels move bytes, "splice" or "copy"
+		 * splice: through a pipe with splice(2), no copy to user space
+		 * copy: recv and send through a 64K buffer
+		*/
+		bool tunnelSplice;
+
+		/*
+		 * PROXY_TUNNEL_BUFFER, max bytes buffered per direction of a tunnel
+		 * PROXY_TUNNEL_IDLE_TIMEOUT_MS, a tunnel where nothing moved for
+		 * that long is closed
+		*/
+		size_t tunnelBuffer;
+		size_t tunnelIdleTimeout;
+
+		/*
+		 * PROXY_CACHE_MAX_OBJECT, bytes of body a response may have to be
+		 * cached, bigger ones are streamed to the client but not kept
+		*/
+		size_t cacheMaxObject;
+
+		/*
+		 * PROXY_CACHE_MAX_BYTES, PROXY_CACHE_MAX_ENTRIES, how big the cache
+		 * directory may get, in bytes of responses and in entries
+		 * PROXY_CACHE_HIGH_WATERMARK, PROXY_CACHE_LOW_WATERMARK, percent of
+		 * those, the least recently used entries are evicted once the cache
+		 * is above the high one, until it is below the low one
+		*/
+		size_t cacheMaxBytes;
+		size_t cacheMaxEntries;
+		size_t cacheHighWatermark;
+		size_t cacheLowWatermark;
+
+		/*
+		 * PROXY_CACHE_TINYLFU, "on" or "off", default on
+		 * a full cache takes a new response only if it's asked for more
+		 * often than the one it would evict, see FrequencySketch
+		*/
+		bool cacheTinyLfu;
+
+		/*
+		 * PROXY_CACHE_POLICY, lru, slru, arc or s3fifo, default lru
+		 * the order full caches evict in, see EvictionPolicy
+		*/
+		string cacheEvictionPolicy;
+
+		/*
+		 * PROXY_COLLAPSE, "on" or "off", default on
+		 * concurrent misses and revalidations of one URL go to the
+		 * server once, the others wait for that one, see Collapser
+		*/
+		bool collapse;
+
+		/*
+		 * PROXY_RELAY_HIGH_WATERMARK, PROXY_RELAY_LOW_WATERMARK, bytes of a
+		 * response waiting for a slow client, when the server is no
+		 * longer / again read from, see BoundedPipe
+		 * PROXY_MEMORY_BUDGET, the most bytes waiting like that in all
+		 * connections together
+		*/
+		size_t relayHighWatermark;
+		size_t relayLowWatermark;
+		size_t memoryBudget;
+
+		/*
+		 * PROXY_ADMISSION, "on" or "off", default on
+		 * when the proxy is overloaded, cache hits are still served but
+		 * requests that would go to a server get a fast 503, see
+		 * AdmissionController
+		 * PROXY_CODEL_TARGET_MS, PROXY_CODEL_INTERVAL_MS, how long a request
+		 * may wait for a handler, and for how long that may be exceeded
+		 * before the proxy counts as overloaded
+		 * PROXY_MAX_INFLIGHT, the most requests going to servers at once
+		 * PROXY_RETRY_AFTER_S, the Retry-After of those 503s
+		*/
+		bool admission;
+		size_t codelTarget;
+		size_t codelInterval;
+		size_t maxInflight;
+		size_t retryAfter;
+
+		/*
+		 * PROXY_DRAIN_TIMEOUT_MS, after SIGTERM (or a handoff) no connection
+		 * is accepted, and requests and tunnels in flight have that long
+		 * to finish before the proxy exits anyway
+		 * PROXY_HANDOFF_PATH, a Unix socket where a new proxy, started by
+		 * hand or by SIGUSR2, takes the listening sockets over, see
+		 * ListenerHandoff, empty (off) by default
+		*/
+		size_t drainTimeout;
+		string handoffPath;
+
+		Config();
+
+		/*
+		 * defaults overridden by whatever is set in the environment
+		 * bad values are reported and ignored
+		*/
+		static Config fromEnv();
+
+	private:
+		static size_t cores();
+		static bool readSize(const char* name, size_t& out);
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Config Implementation //////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	Config::Config() :
+		shards(1),
+		workers(8 * cores()),
+		queueCapacity(1024),
+		overloadPolicy(REJECT_503),
+		ioUring(false),
+		fibers(false),
+		maxFibers(4096),
+		keepAliveTimeout(15000),
+		upstreamMaxIdle(8),
+		upstreamIdleTimeout(30000),
+		dnsTtl(60000),
+		dnsNegativeTtl(5000),
+		connectAttemptDelay(250),
+		connectTimeout(10000),
+		upstreamReadTimeout(30000),
+		tunnelSplice(true),
+		tunnelBuffer(64 * 1024),
+		tunnelIdleTimeout(600000),
+		cacheMaxObject(32 * 1024 * 1024),
+		cacheMaxBytes(1024 * 1024 * 1024),
+		cacheMaxEntries(100000),
+		cacheHighWatermark(95),
+		cacheLowWatermark(90),
+		cacheTinyLfu(true),
+		cacheEvictionPolicy("lru"),
+		collapse(true),
+		relayHighWatermark(256 * 1024),
+		relayLowWatermark(64 * 1024),
+		memoryBudget(256 * 1024 * 1024),
+		admission(true),
+		codelTarget(20),
+		codelInterval(200),
+		maxInflight(1024),
+		retryAfter(1),
+		drainTimeout(30000)
+	{}
+
+	size_t Config::cores() {
+		const size_t n = thread::hardware_concurrency();
+		return n > 0 ? n : 1;
+	}
+
+	bool Config::readSize(const char* name, size_t& out) {
+		const char* value = getenv(name);
+		if(value == nullptr) { return false; }
+		stringstream ss;
+		ss << value;
+		long long temp = -1;
+		string foo;
+		ss >> temp;
+		if(!ss || ss >> foo || temp <= 0) {
+			Log::warning(Log::msg("ignore ", name, "=<", value, ">, expected a positive integer"));
+			return false;
+		}
+		out = (size_t)temp;
+		return true;
+	}
+
+	Config Config::fromEnv() {
+		Config c;
+		readSize("PROXY_SHARDS", c.shards);
+		readSize("PROXY_WORKERS", c.workers);
+		readSize("PROXY_QUEUE_CAPACITY", c.queueCapacity);
+		readSize("PROXY_MAX_FIBERS", c.maxFibers);
+		readSize("PROXY_KEEPALIVE_TIMEOUT_MS", c.keepAliveTimeout);
+		readSize("PROXY_UPSTREAM_MAX_IDLE", c.upstreamMaxIdle);
+		readSize("PROXY_UPSTREAM_IDLE_TIMEOUT_MS", c.upstreamIdleTimeout);
+		readSize("PROXY_DNS_TTL_MS", c.dnsTtl);
+		readSize("PROXY_DNS_NEGATIVE_TTL_MS", c.dnsNegativeTtl);
+		readSize("PROXY_CONNECT_ATTEMPT_DELAY_MS", c.connectAttemptDelay);
+		readSize("PROXY_CONNECT_TIMEOUT_MS", c.connectTimeout);
+		readSize("PROXY_UPSTREAM_READ_TIMEOUT_MS", c.upstreamReadTimeout);
+		readSize("PROXY_TUNNEL_BUFFER", c.tunnelBuffer);
+		readSize("PROXY_TUNNEL_IDLE_TIMEOUT_MS", c.tunnelIdleTimeout);
+		readSize("PROXY_CACHE_MAX_OBJECT", c.cacheMaxObject);
+		readSize("PROXY_CACHE_MAX_BYTES", c.cacheMaxBytes);
+		readSize("PROXY_CACHE_MAX_ENTRIES", c.cacheMaxEntries);
+		readSize("PROXY_CACHE_HIGH_WATERMARK", c.cacheHighWatermark);
+		readSize("PROXY_CACHE_LOW_WATERMARK", c.cacheLowWatermark);
+		readSize("PROXY_RELAY_HIGH_WATERMARK", c.relayHighWatermark);
+		readSize("PROXY_RELAY_LOW_WATERMARK", c.relayLowWatermark);
+		readSize("PROXY_MEMORY_BUDGET", c.memoryBudget);
+		readSize("PROXY_CODEL_TARGET_MS", c.codelTarget);
+		readSize("PROXY_CODEL_INTERVAL_MS", c.codelInterval);
+		readSize("PROXY_MAX_INFLIGHT", c.maxInflight);
+		readSize("PROXY_RETRY_AFTER_S", c.retryAfter);
+		readSize("PROXY_DRAIN_TIMEOUT_MS", c.drainTimeout);
+		if(c.relayLowWatermark >= c.relayHighWatermark) {
+			Log::warning(Log::msg("ignore relay watermarks ", c.relayLowWatermark, " >= ",
+				c.relayHighWatermark, ", the low one must be lower"));
+			c.relayHighWatermark = Config().relayHighWatermark;
+			c.relayLowWatermark = Config().relayLowWatermark;
+		}
+		if(c.cacheLowWatermark >= c.cacheHighWatermark || c.cacheHighWatermark > 100) {
+			Log::warning(Log::msg("ignore cache watermarks ", c.cacheLowWatermark, "% and ",
+				c.cacheHighWatermark, "%, the low one must be lower, and neither above 100"));
+			c.cacheHighWatermark = Config().cacheHighWatermark;
+			c.cacheLowWatermark = Config().cacheLowWatermark;
+		}
+
+		const char* hostsFile = getenv("PROXY_DNS_HOSTS_FILE");
+		if(hostsFile != nullptr) {
+			c.dnsHostsFile = hostsFile;
+		}
+
+		const char* handoffPath = getenv("PROXY_HANDOFF_PATH");
+		if(handoffPath != nullptr) {
+			c.handoffPath = handoffPath;
+		}
+
+		const char* overload = getenv("PROXY_OVERLOAD");
+		if(overload != nullptr) {
+			const string s(overload);
+			if(s == "503") {
+				c.overloadPolicy = REJECT_503;
+			} else if(s == "pause") {
+				c.overloadPolicy = PAUSE_ACCEPT;
+			} else {
+				Log::warning(Log::msg("ignore PROXY_OVERLOAD=<", s, ">, expected 503 or pause"));
+			}
+		}
+
+		const char* backend = getenv("PROXY_IO_BACKEND");
+		if(backend != nullptr) {
+			const string s(backend);
+			if(s == "epoll") {
+				c.ioUring = false;
+			} else if(s == "io_uring") {
+				c.ioUring = true;
+			} else {
+				Log::warning(Log::msg("ignore PROXY_IO_BACKEND=<", s, ">, expected epoll or io_uring"));
+			}
+		}
+
+		const char* handlers = getenv("PROXY_HANDLERS");
+		if(handlers != nullptr) {
+			const string s(handlers);
+			if(s == "threads") {
+				c.fibers = false;
+			} else if(s == "fibers") {
+				c.fibers = true;
+			} else {
+				Log::warning(Log::msg("ignore PROXY_HANDLERS=<", s, ">, expected threads or fibers"));
+			}
+		}
+
+		const char* tunnel = getenv("PROXY_TUNNEL");
+		if(tunnel != nullptr) {
+			const string s(tunnel);
+			if(s == "splice") {
+				c.tunnelSplice = true;
+			} else if(s == "copy") {
+				c.tunnelSplice = false;
+			} else {
+				Log::warning(Log::msg("ignore PROXY_TUNNEL=<", s, ">, expected splice or copy"));
+			}
+		}
+
+		const char* collapse = getenv("PROXY_COLLAPSE");
+		if(collapse != nullptr) {
+			const string s(collapse);
+			if(s == "on") {
+				c.collapse = true;
+			} else if(s == "off") {
+				c.collapse = false;
+			} else {
+				Log::warning(Log::msg("ignore PROXY_COLLAPSE=<", s, ">, expected on or off"));
+			}
+		}
+
+		const char* admission = getenv("PROXY_ADMISSION");
+		if(admission != nullptr) {
+			const string s(admission);
+			if(s == "on") {
+				c.admission = true;
+			} else if(s == "off") {
+				c.admission = false;
+			} else {
+				Log::warning(Log::msg("ignore PROXY_ADMISSION=<", s, ">, expected on or off"));
+			}
+		}
+
+		const char* tinyLfu = getenv("PROXY_CACHE_TINYLFU");
+		if(tinyLfu != nullptr) {
+			const string s(tinyLfu);
+			if(s == "on") {
+				c.cacheTinyLfu = true;
+			} else if(s == "off") {
+				c.cacheTinyLfu = false;
+			} else {
+				Log::warning(Log::msg("ignore PROXY_CACHE_TINYLFU=<", s, ">, expected on or off"));
+			}
+		}
+
+		const char* policy = getenv("PROXY_CACHE_POLICY");
+		if(policy != nullptr) {
+			const string s(policy);
+			if(s == "lru" || s == "slru" || s == "arc" || s == "s3fifo") {
+				c.cacheEvictionPolicy = s;
+			} else {
+				Log::warning(Log::msg("ignore PROXY_CACHE_POLICY=<", s, ">, expected lru, slru, arc or s3fifo"));
+			}
+		}
+		return c;
+	}
+
+}
+	using zq29Inner::Config;
+}
+
+#endif
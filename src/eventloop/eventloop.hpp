@@ -0,0 +1,407 @@
+#ifndef ZQ29_EVENTLOOP
+#define ZQ29_EVENTLOOP
+
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "../log.hpp"
+#include "poller.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * an edge-triggered reactor on top of a Poller (epoll or io_uring)
+	 *
+	 * every fd is watched with EPOLLET, which means a callback is only called
+	 * when the state of the fd CHANGES, so the callback MUST drain the fd
+	 * (recv/accept until EAGAIN), otherwise it will never be notified again
+	 *
+	 * accept/recvOnce/sendThenClose are the completion style alternative:
+	 * the loop does the syscall and calls back with the result, with io_uring
+	 * that saves the readiness round trip and batches the syscalls
+	 *
+	 * nothing but post() and stop() is thread-safe, the rest should only be
+	 * called from the thread running run()
+	*/
+	class EventLoop {
+	public:
+		/*
+		 * events: EPOLLIN, EPOLLOUT, EPOLLRDHUP, EPOLLERR, EPOLLHUP ...
+		*/
+		typedef function<void(uint32_t events)> Callback;
+		/*
+		 * fd: the accepted connection, or -errno
+		*/
+		typedef function<void(int fd)> AcceptCallback;
+		/*
+		 * len: number of bytes in data, 0 on EOF, or -errno
+		 * data is only valid during the call
+		*/
+		typedef function<void(const char* data, ssize_t len)> RecvCallback;
+		typedef uint64_t TimerId;
+
+		class EventLoopException : public exception {
+		private:
+			const string msg;
+		public:
+			EventLoopException(const string& msg);
+			const char* what() const throw() override;
+		};
+
+		/*
+		 * preferIoUring: use io_uring if the kernel supports it, epoll otherwise
+		*/
+		EventLoop(const bool preferIoUring = false);
+		~EventLoop();
+		EventLoop(const EventLoop& rhs) = delete;
+		EventLoop& operator=(const EventLoop& rhs) = delete;
+
+		/*
+		 * watch fd, EPOLLET is always added to events
+		 * the loop does NOT own fd, remove it before closing it
+		*/
+		void add(const int fd, const uint32_t events, const Callback& cb);
+		void modify(const int fd, const uint32_t events);
+		void remove(const int fd);
+
+		/*
+		 * call cb for every connection accepted on listen_fd until cancelAccept
+		 * accepted fds are non-blocking and close-on-exec
+		 * a connection the backend accepted before the cancel took effect
+		 * still goes to cb, even after cancelAccept returned
+		*/
+		void accept(const int listen_fd, const AcceptCallback& cb);
+		void cancelAccept(const int listen_fd);
+
+		/*
+		 * call cb once, when something was received from fd
+		 * cancelRecv before closing fd if cb has not been called yet
+		*/
+		void recvOnce(const int fd, const RecvCallback& cb);
+		void cancelRecv(const int fd);
+
+		/*
+		 * send data without blocking, then close fd, nothing is reported
+		 * meant for canned replies like 400 or 503, not for large payloads
+		*/
+		void sendThenClose(const int fd, const string& data);
+
+		/*
+		 * "epoll" or "io_uring"
+		*/
+		string backendName() const;
+
+		/*
+		 * call fn once, in about ms milliseconds
+		 * the id stays valid until fn is called or the timer is cancelled
+		*/
+		TimerId runAfter(const int ms, const function<void()>& fn);
+		/*
+		 * does nothing if the timer already fired
+		*/
+		void cancelTimer(const TimerId id);
+
+		/*
+		 * thread-safe
+		 * run fn in the loop thread as soon as possible
+		*/
+		void post(const function<void()>& fn);
+
+		/*
+		 * block the calling thread and dispatch events until stop() is called
+		*/
+		void run();
+
+		/*
+		 * thread-safe
+		*/
+		void stop();
+
+	private:
+		unique_ptr<Poller> poller;
+		int wakeup_fd; // eventfd, written by post() and stop()
+		atomic<bool> running;
+
+		/*
+		 * shared_ptr so a callback can safely remove its own fd
+		*/
+		unordered_map<int, shared_ptr<Callback>> callbacks;
+		unordered_map<int, shared_ptr<AcceptCallback>> acceptCallbacks;
+		/*
+		 * cancelled accepts whose last completion has not come yet
+		*/
+		struct RetiredAccept {
+			shared_ptr<AcceptCallback> cb;
+			size_t pending;
+		};
+		unordered_map<int, RetiredAccept> retiredAccepts;
+		unordered_map<int, RecvCallback> recvCallbacks;
+
+		/*
+		 * ordered by deadline, the id breaks ties
+		*/
+		typedef chrono::steady_clock Clock;
+		map<pair<Clock::time_point, TimerId>, function<void()>> timers;
+		unordered_map<TimerId, Clock::time_point> timerDeadlines;
+		TimerId nextTimerId;
+
+		mutex postedMutex;
+		vector<function<void()>> posted;
+
+		void wakeup();
+		void runPosted();
+		int nextTimeout() const;
+		void runTimers();
+	};
+
+	/*
+	 * set or clear O_NONBLOCK on fd
+	 * returns false on failure
+	*/
+	bool setNonBlocking(const int fd, const bool nonBlocking = true);
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// EventLoop Implementation ///////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	EventLoop::EventLoopException::EventLoopException(const string& msg) : msg(msg) {}
+	const char* EventLoop::EventLoopException::what() const throw() { return msg.c_str(); }
+
+	EventLoop::EventLoop(const bool preferIoUring) :
+		poller(createPoller(preferIoUring)), running(false), nextTimerId(1)
+	{
+		wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(wakeup_fd < 0) {
+			throw EventLoopException(Log::msg("eventfd failed: ", strerror(errno)));
+		}
+		try {
+			poller->add(wakeup_fd, EPOLLIN);
+		} catch(const Poller::PollerException& e) {
+			close(wakeup_fd);
+			throw EventLoopException(Log::msg("failed to watch eventfd: ", e.what()));
+		}
+	}
+
+	EventLoop::~EventLoop() {
+		poller.reset();
+		close(wakeup_fd);
+	}
+
+	void EventLoop::add(const int fd, const uint32_t events, const Callback& cb) {
+		try {
+			poller->add(fd, events | EPOLLET);
+		} catch(const Poller::PollerException& e) {
+			throw EventLoopException(Log::msg("failed to add fd <", fd, ">: ", e.what()));
+		}
+		callbacks[fd] = make_shared<Callback>(cb);
+	}
+
+	void EventLoop::modify(const int fd, const uint32_t events) {
+		try {
+			poller->modify(fd, events | EPOLLET);
+		} catch(const Poller::PollerException& e) {
+			throw EventLoopException(Log::msg("failed to modify fd <", fd, ">: ", e.what()));
+		}
+	}
+
+	void EventLoop::remove(const int fd) {
+		poller->remove(fd);
+		callbacks.erase(fd);
+	}
+
+	void EventLoop::accept(const int listen_fd, const AcceptCallback& cb) {
+		try {
+			poller->accept(listen_fd);
+		} catch(const Poller::PollerException& e) {
+			throw EventLoopException(Log::msg("failed to accept on fd <", listen_fd, ">: ", e.what()));
+		}
+		acceptCallbacks[listen_fd] = make_shared<AcceptCallback>(cb);
+	}
+
+	void EventLoop::cancelAccept(const int listen_fd) {
+		auto it = acceptCallbacks.find(listen_fd);
+		if(it == acceptCallbacks.end()) { return; }
+		poller->cancelAccept(listen_fd);
+		RetiredAccept& r = retiredAccepts[listen_fd];
+		r.cb = it->second;
+		r.pending++;
+		acceptCallbacks.erase(it);
+	}
+
+	void EventLoop::recvOnce(const int fd, const RecvCallback& cb) {
+		try {
+			poller->recv(fd);
+		} catch(const Poller::PollerException& e) {
+			throw EventLoopException(Log::msg("failed to recv on fd <", fd, ">: ", e.what()));
+		}
+		recvCallbacks[fd] = cb;
+	}
+
+	void EventLoop::cancelRecv(const int fd) {
+		poller->cancelRecv(fd);
+		recvCallbacks.erase(fd);
+	}
+
+	void EventLoop::sendThenClose(const int fd, const string& data) {
+		poller->sendThenClose(fd, data);
+	}
+
+	string EventLoop::backendName() const {
+		return poller->name();
+	}
+
+	EventLoop::TimerId EventLoop::runAfter(const int ms, const function<void()>& fn) {
+		const TimerId id = nextTimerId++;
+		const Clock::time_point deadline = Clock::now() + chrono::milliseconds(max(ms, 0));
+		timers[make_pair(deadline, id)] = fn;
+		timerDeadlines[id] = deadline;
+		return id;
+	}
+
+	void EventLoop::cancelTimer(const TimerId id) {
+		auto it = timerDeadlines.find(id);
+		if(it == timerDeadlines.end()) { return; }
+		timers.erase(make_pair(it->second, id));
+		timerDeadlines.erase(it);
+	}
+
+	int EventLoop::nextTimeout() const {
+		if(timers.empty()) { return -1; }
+		const auto left = timers.begin()->first.first - Clock::now();
+		if(left <= Clock::duration::zero()) { return 0; }
+		// round up, waking up early would only spin
+		return (int)chrono::duration_cast<chrono::milliseconds>(left + chrono::milliseconds(1) - Clock::duration(1)).count();
+	}
+
+	void EventLoop::runTimers() {
+		const Clock::time_point now = Clock::now();
+		// timers added by a callback are due after now, they wait for the next round
+		while(!timers.empty() && timers.begin()->first.first <= now) {
+			const function<void()> fn = move(timers.begin()->second);
+			timerDeadlines.erase(timers.begin()->first.second);
+			timers.erase(timers.begin());
+			fn();
+		}
+	}
+
+	void EventLoop::post(const function<void()>& fn) {
+		{
+			lock_guard<mutex> lck(postedMutex);
+			posted.push_back(fn);
+		}
+		wakeup();
+	}
+
+	void EventLoop::wakeup() {
+		const uint64_t one = 1;
+		// EAGAIN means the counter is already non-zero, the loop will wake up anyway
+		if(write(wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			Log::warning(Log::msg("in EventLoop::wakeup(): ", strerror(errno)));
+		}
+	}
+
+	void EventLoop::runPosted() {
+		vector<function<void()>> fns;
+		{
+			lock_guard<mutex> lck(postedMutex);
+			fns.swap(posted);
+		}
+		for(auto const& fn : fns) {
+			fn();
+		}
+	}
+
+	void EventLoop::run() {
+		vector<PollerEvent> events;
+		running = true;
+		while(running) {
+			events.clear();
+			try {
+				poller->wait(events, nextTimeout());
+			} catch(const Poller::PollerException& e) {
+				throw EventLoopException(e.what());
+			}
+			for(auto const& e : events) {
+				if(e.kind == PollerEvent::READY) {
+					if(e.fd == wakeup_fd) {
+						uint64_t foo;
+						while(read(wakeup_fd, &foo, sizeof(foo)) > 0) {}
+						continue;
+					}
+					// removed by an earlier callback in this round
+					auto it = callbacks.find(e.fd);
+					if(it == callbacks.end()) { continue; }
+					const shared_ptr<Callback> cb = it->second;
+					(*cb)(e.events);
+				} else if(e.kind == PollerEvent::ACCEPTED) {
+					auto rit = retiredAccepts.find(e.fd);
+					if(e.res == -ECANCELED) { // a cancelled accept is over
+						if(rit != retiredAccepts.end() && --rit->second.pending == 0) { retiredAccepts.erase(rit); }
+						continue;
+					}
+					shared_ptr<AcceptCallback> cb;
+					auto it = acceptCallbacks.find(e.fd);
+					if(it != acceptCallbacks.end()) {
+						cb = it->second;
+					} else if(rit != retiredAccepts.end() && e.res >= 0) {
+						cb = rit->second.cb; // accepted right before cancelAccept, still a client
+					}
+					if(cb == nullptr) {
+						if(e.res >= 0) { close(e.res); }
+						continue;
+					}
+					(*cb)(e.res);
+				} else {
+					auto it = recvCallbacks.find(e.fd);
+					if(it != recvCallbacks.end()) {
+						// one-shot, and cb may ask for the next recv
+						const RecvCallback cb = move(it->second);
+						recvCallbacks.erase(it);
+						cb(e.data, e.res);
+					}
+					poller->release(e);
+				}
+			}
+			runTimers();
+			runPosted();
+		}
+	}
+
+	void EventLoop::stop() {
+		running = false;
+		wakeup();
+	}
+
+	bool setNonBlocking(const int fd, const bool nonBlocking) {
+		const int flags = fcntl(fd, F_GETFL, 0);
+		if(flags < 0) { return false; }
+		const int newFlags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+		return fcntl(fd, F_SETFL, newFlags) == 0;
+	}
+
+}
+	using zq29Inner::EventLoop;
+	using zq29Inner::setNonBlocking;
+}
+
+#endif
@@ -0,0 +1,450 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+#include <thread>
+
+#include "eventloop.hpp"
+#include "fiber.hpp"
+
+using namespace zq29;
+using namespace std;
+
+/*
+ * a listening socket on a random port of 127.0.0.1
+*/
+int listenLocal(sockaddr_in& addr) {
+	const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if(fd < 0 || bind(fd, (sockaddr*)&addr, len) < 0 || listen(fd, 16) < 0
+		|| getsockname(fd, (sockaddr*)&addr, &len) < 0) {
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * accept a connection, receive "ping" from it, answer "pong" and close it
+*/
+void testEventLoop(const bool ioUring) {
+	const string TAG = Log::msg("testEventLoop, ", ioUring ? "io_uring" : "epoll");
+	bool failFlag = false;
+
+	EventLoop loop(ioUring);
+	sockaddr_in addr;
+	const int listen_fd = listenLocal(addr);
+	if(listen_fd < 0) {
+		Log::testFail(TAG, "cannot listen");
+		return;
+	}
+
+	string received;
+	loop.accept(listen_fd, [&](int client_fd) {
+		if(client_fd < 0) {
+			loop.stop();
+			return;
+		}
+		loop.cancelAccept(listen_fd);
+		loop.recvOnce(client_fd, [&, client_fd](const char* data, ssize_t len) {
+			if(len > 0) { received.assign(data, len); }
+			loop.sendThenClose(client_fd, "pong");
+			loop.stop();
+		});
+	});
+
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		Log::testFail(TAG, "cannot connect");
+		close(fd);
+		close(listen_fd);
+		return;
+	}
+	send(fd, "ping", 4, 0);
+	loop.run();
+
+	if(received != "ping") {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("received <", received, ">, expected <ping>"));
+	}
+
+	// sendThenClose is only submitted by now, the next round completes it
+	loop.post([&loop]() { loop.stop(); });
+	loop.run();
+
+	char buf[16];
+	ssize_t len = 0, n;
+	while((n = recv(fd, buf + len, sizeof(buf) - len, 0)) > 0) { len += n; }
+	if(string(buf, len) != "pong") {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("got <", string(buf, len), ">, expected <pong> then EOF"));
+	}
+
+	// post from another thread
+	bool ran = false;
+	thread t([&loop, &ran]() {
+		loop.post([&loop, &ran]() {
+			ran = true;
+			loop.stop();
+		});
+	});
+	loop.run();
+	t.join();
+	if(!ran) {
+		failFlag = true;
+		Log::testFail(TAG, "posted function was not run");
+	}
+
+	close(fd);
+	close(listen_fd);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * connections queued before the loop runs are accepted in one go, the
+ * first callback cancels the accept, the others are still served
+*/
+void testLateAccept(const bool ioUring) {
+	const string TAG = Log::msg("testLateAccept, ", ioUring ? "io_uring" : "epoll");
+	bool failFlag = false;
+
+	EventLoop loop(ioUring);
+	sockaddr_in addr;
+	const int listen_fd = listenLocal(addr);
+	if(listen_fd < 0) {
+		Log::testFail(TAG, "cannot listen");
+		return;
+	}
+
+	const size_t CLIENTS = 3;
+	vector<int> fds;
+	for(size_t i = 0; i < CLIENTS; i++) {
+		const int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+			failFlag = true;
+			Log::testFail(TAG, "cannot connect");
+		}
+		fds.push_back(fd);
+	}
+
+	size_t accepted = 0;
+	loop.accept(listen_fd, [&](int client_fd) {
+		if(client_fd < 0) { return; }
+		if(accepted++ == 0) { loop.cancelAccept(listen_fd); }
+		loop.sendThenClose(client_fd, "hi");
+	});
+	loop.runAfter(100, [&loop]() { loop.stop(); });
+	loop.run();
+
+	size_t served = 0;
+	for(const int fd : fds) {
+		char buf[4];
+		if(recv(fd, buf, sizeof(buf), 0) == 2 && string(buf, 2) == "hi") { served++; }
+		close(fd);
+	}
+	if(served != CLIENTS) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(accepted, " accepted and ", served, " served of ", CLIENTS));
+	}
+
+	close(listen_fd);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * the edge-triggered side: a callback is called once per change, it
+ * drains the fd and hears again only when more arrives
+ * and a stream larger than one read comes whole through recvOnce
+ * re-armed after each call, with no new edge in between
+*/
+void testEdgeTriggered(const bool ioUring) {
+	const string TAG = Log::msg("testEdgeTriggered, ", ioUring ? "io_uring" : "epoll");
+	bool failFlag = false;
+
+	EventLoop loop(ioUring);
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+		Log::testFail(TAG, "cannot create a socketpair");
+		return;
+	}
+
+	string drained;
+	size_t calls = 0;
+	loop.add(sv[0], EPOLLIN, [&](uint32_t events) {
+		calls++;
+		char buf[4];
+		ssize_t n;
+		while((n = recv(sv[0], buf, sizeof(buf), 0)) > 0) { drained.append(buf, n); }
+		loop.stop();
+	});
+	send(sv[1], "0123456789", 10, 0); // more than one recv in the callback
+	loop.run();
+	if(drained != "0123456789" || calls != 1) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("first edge: <", drained, "> in ", calls, " calls"));
+	}
+	loop.runAfter(20, [&loop]() { loop.stop(); }); // nothing new, no call
+	loop.run();
+	send(sv[1], "abc", 3, 0);
+	loop.run();
+	if(drained != "0123456789abc" || calls != 2) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("second edge: <", drained, "> in ", calls, " calls"));
+	}
+	loop.remove(sv[0]);
+
+	// all of it is there before the first recvOnce, several reads take it
+	const string big(1024 * 1024, 'x');
+	thread writer([&]() {
+		setNonBlocking(sv[1], false);
+		size_t sent = 0;
+		while(sent < big.size()) {
+			const ssize_t n = send(sv[1], big.data() + sent, big.size() - sent, 0);
+			if(n <= 0) { break; }
+			sent += n;
+		}
+		shutdown(sv[1], SHUT_WR);
+	});
+	size_t received = 0, reads = 0;
+	function<void(const char*, ssize_t)> onRecv = [&](const char* data, ssize_t len) {
+		if(len <= 0) {
+			loop.stop();
+			return;
+		}
+		received += len;
+		reads++;
+		loop.recvOnce(sv[0], onRecv);
+	};
+	loop.recvOnce(sv[0], onRecv);
+	loop.runAfter(5000, [&loop]() { loop.stop(); }); // in case something hangs
+	loop.run();
+	writer.join();
+	if(received != big.size() || reads < 2) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("received ", received, " of ", big.size(), " bytes in ", reads, " reads"));
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * timers fire in deadline order, cancelled ones never, and one added by
+ * a timer callback waits for its own deadline
+*/
+void testTimers(const bool ioUring) {
+	const string TAG = Log::msg("testTimers, ", ioUring ? "io_uring" : "epoll");
+	bool failFlag = false;
+
+	EventLoop loop(ioUring);
+	string order;
+	const auto start = chrono::steady_clock::now();
+	chrono::steady_clock::duration chainedAt(0);
+	loop.runAfter(30, [&]() { order += "c"; });
+	loop.runAfter(10, [&]() {
+		order += "a";
+		loop.runAfter(40, [&]() {
+			order += "d";
+			chainedAt = chrono::steady_clock::now() - start;
+			loop.stop();
+		});
+	});
+	const EventLoop::TimerId cancelled = loop.runAfter(20, [&]() { order += "x"; });
+	loop.runAfter(20, [&]() { order += "b"; });
+	loop.cancelTimer(cancelled);
+	loop.runAfter(2000, [&loop]() { loop.stop(); }); // in case something hangs
+	loop.run();
+
+	if(order != "abcd") {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("fired in order <", order, ">, expected <abcd>"));
+	}
+	if(chainedAt < chrono::milliseconds(50)) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("chained timer fired after ",
+			chrono::duration_cast<chrono::milliseconds>(chainedAt).count(), "ms, expected 50ms at least"));
+	}
+	loop.cancelTimer(cancelled); // long gone, nothing happens
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * two fibers on one thread talk through a socketpair, one of them
+ * waits inside a catch block while the other one throws
+*/
+void testFiber() {
+	const string TAG = "testFiber";
+	bool failFlag = false;
+
+	EventLoop loop;
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+		Log::testFail(TAG, "socketpair failed");
+		return;
+	}
+
+	vector<string> trace;
+	int finished = 0;
+	Fiber::spawn(loop, [&]() {
+		char buf[16];
+		const ssize_t len = asyncRecv(sv[0], buf, sizeof(buf));
+		trace.push_back(string(buf, len > 0 ? len : 0));
+		try {
+			throw runtime_error("first");
+		} catch(const exception& e) {
+			asyncSleep(20);
+			trace.push_back(e.what());
+		}
+		if(++finished == 2) { loop.stop(); }
+	});
+	Fiber::spawn(loop, [&]() {
+		asyncSleep(5);
+		asyncSend(sv[1], "ping", 4);
+		try {
+			throw runtime_error("second");
+		} catch(const exception& e) {
+			trace.push_back(e.what());
+		}
+		// nothing will ever come, time out
+		char buf[16];
+		if(asyncRecv(sv[1], buf, sizeof(buf), 30) < 0 && errno == ETIMEDOUT) {
+			trace.push_back("timeout");
+		}
+		if(++finished == 2) { loop.stop(); }
+	});
+	loop.runAfter(1000, [&loop]() { loop.stop(); }); // in case something hangs
+	loop.run();
+
+	// the 2nd fiber does not wait between send and throw
+	const vector<string> expected = { "second", "ping", "first", "timeout" };
+	if(finished != 2 || trace != expected) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("unexpected order, ", trace.size(), " steps, ", finished, " fibers finished"));
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * waiting on a fd the loop refuses leaves none of the others watched,
+ * they can be waited on again right away
+*/
+void testWaitAnyFailure() {
+	const string TAG = "testWaitAnyFailure";
+	bool failFlag = false;
+
+	EventLoop loop; // epoll, which checks the fd when it is added
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+		Log::testFail(TAG, "socketpair failed");
+		return;
+	}
+
+	bool threw = false;
+	int again = 0;
+	Fiber::spawn(loop, [&]() {
+		try {
+			asyncWaitAny({ make_pair(sv[0], (uint32_t)EPOLLIN), make_pair(-1, (uint32_t)EPOLLIN) });
+		} catch(const exception& e) {
+			threw = true;
+		}
+		try {
+			again = asyncWaitAny({ make_pair(sv[0], (uint32_t)EPOLLIN) }, 20);
+		} catch(const exception& e) {
+			again = -2;
+		}
+		loop.stop();
+	});
+	loop.runAfter(1000, [&loop]() { loop.stop(); }); // in case something hangs
+	loop.run();
+
+	if(!threw || again != -1) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(threw ? "threw" : "did not throw", ", then waiting again got ", again));
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * many pieces, some empty, more than the socket takes at once, so
+ * writes stop in the middle of a piece and have to pick it up from there
+*/
+void testSendv() {
+	const string TAG = "testSendv";
+	bool failFlag = false;
+
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+		Log::testFail(TAG, "socketpair failed");
+		return;
+	}
+	const int sndbuf = 4096;
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	vector<string> pieces;
+	string expected;
+	for(int i = 0; i < 2000; i++) {
+		pieces.push_back(string(i % 7 == 0 ? 0 : (i * 37) % 3001, (char)('a' + i % 26)));
+		expected += pieces.back();
+	}
+	vector<iovec> iov;
+	for(auto const& p : pieces) {
+		iovec v;
+		v.iov_base = (void*)p.data();
+		v.iov_len = p.size();
+		iov.push_back(v);
+	}
+	const vector<iovec> before = iov;
+
+	string got;
+	thread reader([&]() {
+		char buf[1000];
+		while(got.size() < expected.size()) {
+			const ssize_t n = asyncRecv(sv[1], buf, sizeof(buf), 2000);
+			if(n <= 0) { break; }
+			got.append(buf, n);
+		}
+	});
+	const ssize_t sent = asyncSendv(sv[0], iov.data(), iov.size(), 2000);
+	reader.join();
+
+	if(sent != (ssize_t)expected.size() || got != expected) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("sent ", sent, ", received ", got.size(), " of ", expected.size(), " bytes"));
+	}
+	for(size_t i = 0; i < iov.size(); i++) {
+		if(iov[i].iov_base != before[i].iov_base || iov[i].iov_len != before[i].iov_len) {
+			failFlag = true;
+			Log::testFail(TAG, "iov was changed");
+			break;
+		}
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testEventLoop(false);
+	testEventLoop(true); // falls back to epoll without io_uring
+	testLateAccept(false);
+	testLateAccept(true);
+	testEdgeTriggered(false);
+	testEdgeTriggered(true);
+	testTimers(false);
+	testTimers(true);
+	testFiber();
+	testWaitAnyFailure();
+	testSendv();
+}
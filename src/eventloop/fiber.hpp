@@ -0,0 +1,445 @@
+#ifndef ZQ29_FIBER
+#define ZQ29_FIBER
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <cxxabi.h>
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "../log.hpp"
+#include "eventloop.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * a stackful coroutine running on the thread of an EventLoop
+	 *
+	 * a fiber runs until it waits for something (see the async* functions
+	 * below), then the loop goes on with other fds and fibers, and resumes
+	 * it once the thing happened, so blocking-style code like
+	 *     connect, send, recv, recv, recv
+	 * keeps its shape while thousands of them share one thread
+	 *
+	 * everything here must be called from the loop thread
+	*/
+	class Fiber {
+	public:
+		typedef function<void()> Body;
+
+		static const size_t DEFAULT_STACK_SIZE = 256 * 1024;
+
+		class FiberException : public exception {
+		private:
+			const string msg;
+		public:
+			FiberException(const string& msg);
+			const char* what() const throw() override;
+		};
+
+		/*
+		 * start body in a new fiber, soon, not right now
+		 * the fiber deletes itself when body returns
+		 * exceptions thrown by body are logged and ignored
+		*/
+		static void spawn(EventLoop& loop, const Body& body, const size_t stackSize = DEFAULT_STACK_SIZE);
+
+		/*
+		 * the fiber running on this thread, nullptr outside of fibers
+		*/
+		static Fiber* current();
+
+		EventLoop& loop();
+
+		/*
+		 * from inside the fiber: give control back to the loop
+		 * returns after someone called wake()
+		*/
+		void suspend();
+
+		/*
+		 * from the loop, outside of any fiber: continue a suspended fiber
+		 * until it suspends again or finishes, this may delete the fiber
+		*/
+		void wake();
+
+		~Fiber();
+		Fiber(const Fiber& rhs) = delete;
+		Fiber& operator=(const Fiber& rhs) = delete;
+
+	private:
+		EventLoop& lp;
+		Body body;
+		ucontext_t ctx;
+		ucontext_t callerCtx;
+		void* stack;
+		size_t stackSize;
+		bool finished;
+
+		/*
+		 * the C++ runtime keeps the exceptions being handled in a per-thread
+		 * list, a fiber suspended inside a catch block needs its own one
+		 * layout of __cxa_eh_globals from the Itanium C++ ABI
+		*/
+		struct EhGlobals {
+			void* caughtExceptions;
+			unsigned int uncaughtExceptions;
+		};
+		EhGlobals eh;
+		void swapEhGlobals();
+
+		static thread_local Fiber* running;
+
+		Fiber(EventLoop& loop, const Body& body, const size_t stackSize);
+		static void trampoline(const unsigned int hi, const unsigned int lo);
+	};
+
+	/*
+	 * waiting helpers
+	 *
+	 * inside a fiber, they suspend the fiber and let the loop run
+	 * anywhere else, they block the calling thread with poll(2)
+	 * so the same handler code works on worker threads and in fibers
+	 *
+	 * timeoutMs < 0 means no timeout
+	*/
+
+	/*
+	 * wait until one of fds is ready for its events (EPOLLIN, EPOLLOUT ...)
+	 * returns the index of the ready fd, -1 on timeout
+	*/
+	int asyncWaitAny(const vector<pair<int, uint32_t>>& fds, const int timeoutMs = -1);
+
+	/*
+	 * connect fd (any blocking mode, which is restored) to addr
+	 * returns 0 or -1 with errno set, ETIMEDOUT on timeout
+	*/
+	int asyncConnect(const int fd, const sockaddr* addr, const socklen_t addrLen, const int timeoutMs = -1);
+
+	/*
+	 * like recv(2), without blocking the loop
+	 * returns -1 with errno ETIMEDOUT on timeout
+	*/
+	ssize_t asyncRecv(const int fd, void* buf, const size_t len, const int timeoutMs = -1);
+
+	/*
+	 * send everything, like a loop of send(2) with MSG_NOSIGNAL
+	 * returns len, or -1 with errno set
+	*/
+	ssize_t asyncSend(const int fd, const void* buf, const size_t len, const int timeoutMs = -1);
+
+	/*
+	 * send all of iov, in order, like a loop of writev(2)
+	 * (sendmsg(2), for MSG_NOSIGNAL), what is sent partially is picked
+	 * up where it stopped, iov itself is not changed
+	 * returns the number of bytes, or -1 with errno set
+	*/
+	ssize_t asyncSendv(const int fd, const iovec* iov, const size_t iovcnt, const int timeoutMs = -1);
+
+	/*
+	 * send count bytes of in_fd, starting at offset, with sendfile(2),
+	 * so they go from the page cache to the socket without being copied here
+	 * returns count, or -1 with errno set, EIO if the file is shorter
+	*/
+	ssize_t asyncSendFile(const int fd, const int in_fd, off_t offset, const size_t count, const int timeoutMs = -1);
+
+	void asyncSleep(const int ms);
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Fiber Implementation ///////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	thread_local Fiber* Fiber::running = nullptr;
+
+	Fiber::FiberException::FiberException(const string& msg) : msg(msg) {}
+	const char* Fiber::FiberException::what() const throw() { return msg.c_str(); }
+
+	Fiber::Fiber(EventLoop& loop, const Body& body, const size_t stackSize) :
+		lp(loop), body(body), stackSize(stackSize), finished(false), eh{ nullptr, 0 }
+	{
+		// one more page, left inaccessible, so an overflow crashes right away
+		const size_t page = sysconf(_SC_PAGESIZE);
+		this->stackSize = (stackSize + page - 1) / page * page + page;
+		stack = mmap(NULL, this->stackSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if(stack == MAP_FAILED) {
+			throw FiberException(Log::msg("failed to allocate a fiber stack: ", strerror(errno)));
+		}
+		mprotect(stack, page, PROT_NONE);
+
+		getcontext(&ctx);
+		ctx.uc_stack.ss_sp = stack;
+		ctx.uc_stack.ss_size = this->stackSize;
+		ctx.uc_link = &callerCtx;
+		// makecontext only passes ints
+		const uintptr_t self = (uintptr_t)this;
+		makecontext(&ctx, (void(*)())&Fiber::trampoline, 2,
+			(unsigned int)(self >> 32), (unsigned int)(self & 0xffffffff));
+	}
+
+	Fiber::~Fiber() {
+		munmap(stack, stackSize);
+	}
+
+	void Fiber::trampoline(const unsigned int hi, const unsigned int lo) {
+		Fiber* const self = (Fiber*)(((uintptr_t)hi << 32) | (uintptr_t)lo);
+		// an exception must not unwind past the fiber's stack
+		try {
+			self->body();
+		} catch(const exception& e) {
+			Log::warning(Log::msg("in Fiber: exception ignored, what(): ", e.what()));
+		} catch(...) {
+			Log::warning("in Fiber: unknown exception ignored");
+		}
+		self->body = Body();
+		self->finished = true;
+		// returning switches to uc_link, back in wake()
+	}
+
+	void Fiber::spawn(EventLoop& loop, const Body& body, const size_t stackSize) {
+		Fiber* const fiber = new Fiber(loop, body, stackSize);
+		// never start a fiber from inside another one
+		loop.post([fiber]() { fiber->wake(); });
+	}
+
+	Fiber* Fiber::current() {
+		return running;
+	}
+
+	EventLoop& Fiber::loop() {
+		return lp;
+	}
+
+	void Fiber::suspend() {
+		if(running != this) {
+			throw FiberException("suspend() called outside of the fiber");
+		}
+		running = nullptr;
+		swapcontext(&ctx, &callerCtx);
+		running = this;
+	}
+
+	void Fiber::wake() {
+		if(running != nullptr) {
+			throw FiberException("wake() called inside a fiber");
+		}
+		running = this;
+		swapEhGlobals();
+		swapcontext(&callerCtx, &ctx);
+		swapEhGlobals();
+		running = nullptr;
+		if(finished) {
+			delete this;
+		}
+	}
+
+	void Fiber::swapEhGlobals() {
+		EhGlobals* const g = (EhGlobals*)abi::__cxa_get_globals();
+		swap(*g, eh);
+	}
+
+	int asyncWaitAny(const vector<pair<int, uint32_t>>& fds, const int timeoutMs) {
+		Fiber* const self = Fiber::current();
+		if(self == nullptr) {
+			vector<pollfd> pfds;
+			for(auto const& p : fds) {
+				pfds.push_back(pollfd{ p.first, (short)p.second, 0 });
+			}
+			while(true) {
+				const int n = poll(pfds.data(), pfds.size(), timeoutMs);
+				if(n < 0 && errno == EINTR) { continue; }
+				if(n <= 0) { return -1; }
+				break;
+			}
+			for(size_t i = 0; i < pfds.size(); i++) {
+				if(pfds[i].revents != 0) { return i; }
+			}
+			return -1;
+		}
+
+		EventLoop& loop = self->loop();
+		// the first of the callbacks to run wakes the fiber up
+		int ready = -1;
+		bool woken = false;
+		size_t added = 0;
+		try {
+			for(; added < fds.size(); added++) {
+				loop.add(fds[added].first, fds[added].second, [self, i = added, &ready, &woken](uint32_t events) {
+					if(woken) { return; }
+					woken = true;
+					ready = i;
+					self->wake();
+				});
+			}
+		} catch(...) {
+			// the callbacks point into this frame, none may outlive it
+			for(size_t i = 0; i < added; i++) {
+				loop.remove(fds[i].first);
+			}
+			throw;
+		}
+		EventLoop::TimerId timer = 0;
+		if(timeoutMs >= 0) {
+			timer = loop.runAfter(timeoutMs, [self, &woken]() {
+				if(woken) { return; }
+				woken = true;
+				self->wake();
+			});
+		}
+		self->suspend();
+		if(timeoutMs >= 0) { loop.cancelTimer(timer); }
+		for(auto const& p : fds) {
+			loop.remove(p.first);
+		}
+		return ready;
+	}
+
+	int asyncConnect(const int fd, const sockaddr* addr, const socklen_t addrLen, const int timeoutMs) {
+		const int flags = fcntl(fd, F_GETFL, 0);
+		if(flags < 0) { return -1; }
+		if(!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) { return -1; }
+
+		int ret = connect(fd, addr, addrLen);
+		if(ret < 0 && errno == EINPROGRESS) {
+			if(asyncWaitAny({ make_pair(fd, (uint32_t)EPOLLOUT) }, timeoutMs) < 0) {
+				errno = ETIMEDOUT;
+			} else {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				ret = err == 0 ? 0 : -1;
+				errno = err;
+			}
+		}
+
+		const int savedErrno = errno;
+		fcntl(fd, F_SETFL, flags);
+		errno = savedErrno;
+		return ret;
+	}
+
+	ssize_t asyncRecv(const int fd, void* buf, const size_t len, const int timeoutMs) {
+		while(true) {
+			const ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+			if(n >= 0) { return n; }
+			if(errno == EINTR) { continue; }
+			if(errno != EAGAIN && errno != EWOULDBLOCK) { return -1; }
+			if(asyncWaitAny({ make_pair(fd, (uint32_t)(EPOLLIN | EPOLLRDHUP)) }, timeoutMs) < 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+	}
+
+	ssize_t asyncSend(const int fd, const void* buf, const size_t len, const int timeoutMs) {
+		size_t sent = 0;
+		while(sent < len) {
+			const ssize_t n = send(fd, (const char*)buf + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(n >= 0) {
+				sent += n;
+				continue;
+			}
+			if(errno == EINTR) { continue; }
+			if(errno != EAGAIN && errno != EWOULDBLOCK) { return -1; }
+			if(asyncWaitAny({ make_pair(fd, (uint32_t)EPOLLOUT) }, timeoutMs) < 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+		return sent;
+	}
+
+	ssize_t asyncSendv(const int fd, const iovec* iov, const size_t iovcnt, const int timeoutMs) {
+		vector<iovec> left(iov, iov + iovcnt);
+		size_t first = 0; // left[first] is the first one not sent completely
+		size_t sent = 0;
+		while(true) {
+			while(first < left.size() && left[first].iov_len == 0) { first++; }
+			if(first == left.size()) { return sent; }
+
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &left[first];
+			msg.msg_iovlen = min(left.size() - first, (size_t)IOV_MAX);
+			ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(n >= 0) {
+				sent += n;
+				for(; first < left.size() && (size_t)n >= left[first].iov_len; first++) {
+					n -= left[first].iov_len;
+				}
+				if(n > 0) {
+					left[first].iov_base = (char*)left[first].iov_base + n;
+					left[first].iov_len -= n;
+				}
+				continue;
+			}
+			if(errno == EINTR) { continue; }
+			if(errno != EAGAIN && errno != EWOULDBLOCK) { return -1; }
+			if(asyncWaitAny({ make_pair(fd, (uint32_t)EPOLLOUT) }, timeoutMs) < 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+	}
+
+	ssize_t asyncSendFile(const int fd, const int in_fd, off_t offset, const size_t count, const int timeoutMs) {
+		size_t sent = 0;
+		while(sent < count) {
+			const ssize_t n = sendfile(fd, in_fd, &offset, count - sent);
+			if(n > 0) {
+				sent += n;
+				continue;
+			}
+			if(n == 0) {
+				errno = EIO;
+				return -1;
+			}
+			if(errno == EINTR) { continue; }
+			if(errno != EAGAIN && errno != EWOULDBLOCK) { return -1; }
+			if(asyncWaitAny({ make_pair(fd, (uint32_t)EPOLLOUT) }, timeoutMs) < 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+		return sent;
+	}
+
+	void asyncSleep(const int ms) {
+		Fiber* const self = Fiber::current();
+		if(self == nullptr) {
+			usleep((useconds_t)ms * 1000);
+			return;
+		}
+		self->loop().runAfter(ms, [self]() { self->wake(); });
+		self->suspend();
+	}
+
+}
+	using zq29Inner::Fiber;
+	using zq29Inner::asyncWaitAny;
+	using zq29Inner::asyncConnect;
+	using zq29Inner::asyncRecv;
+	using zq29Inner::asyncSend;
+	using zq29Inner::asyncSendv;
+	using zq29Inner::asyncSendFile;
+	using zq29Inner::asyncSleep;
+}
+
+#endif
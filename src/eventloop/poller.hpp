@@ -0,0 +1,789 @@
+#ifndef ZQ29_POLLER
+#define ZQ29_POLLER
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+// multishot accept and provided buffer rings came with linux 5.19
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(__NR_io_uring_setup)
+#define ZQ29_HAVE_IO_URING 1
+#endif
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * something that happened on a fd, reported by Poller::wait
+	*/
+	struct PollerEvent {
+		enum Kind {
+			READY,    // fd watched with add() is ready, see events
+			ACCEPTED, // listening fd accepted a connection, res is the new fd or -errno,
+			          // -ECANCELED once a cancelled accept is over
+			RECEIVED  // recv() completed, res is the number of bytes (0 on EOF) or -errno
+		};
+		Kind kind;
+		int fd;
+		uint32_t events;
+		int res;
+		const char* data; // RECEIVED only, valid until release()
+		int bufferId;     // RECEIVED only, for release()
+	};
+
+	/*
+	 * the I/O backend of an EventLoop
+	 *
+	 * it offers two styles of operations
+	 * 1. readiness: add/modify/remove, edge-triggered
+	 * 2. completion: accept/recv/sendThenClose, the backend does the
+	 *    syscall and reports the result
+	 *
+	 * a fd is used in one style at a time, and nothing here is thread-safe
+	*/
+	class Poller {
+	public:
+		class PollerException : public exception {
+		private:
+			const string msg;
+		public:
+			PollerException(const string& msg);
+			const char* what() const throw() override;
+		};
+
+		virtual ~Poller() {}
+		virtual string name() const = 0;
+
+		virtual void add(const int fd, const uint32_t events) = 0;
+		virtual void modify(const int fd, const uint32_t events) = 0;
+		virtual void remove(const int fd) = 0;
+
+		/*
+		 * keep accepting (SOCK_NONBLOCK | SOCK_CLOEXEC) on listen_fd until cancelAccept
+		 * connections accepted before the cancel took effect may still be
+		 * reported after it, then one ACCEPTED -ECANCELED says nothing more will
+		*/
+		virtual void accept(const int listen_fd) = 0;
+		virtual void cancelAccept(const int listen_fd) = 0;
+
+		/*
+		 * receive once from fd into a buffer owned by the poller
+		 * cancelRecv MUST be called before closing fd if a recv is in flight
+		*/
+		virtual void recv(const int fd) = 0;
+		virtual void cancelRecv(const int fd) = 0;
+
+		/*
+		 * best effort: send data, then close fd whatever happened
+		 * fd must not be watched or have a recv in flight
+		*/
+		virtual void sendThenClose(const int fd, const string& data) = 0;
+
+		/*
+		 * block until something happens or timeoutMs (-1 for ever) elapses
+		 * appends what happened to out
+		*/
+		virtual void wait(vector<PollerEvent>& out, const int timeoutMs) = 0;
+
+		/*
+		 * give the buffer of a RECEIVED event back
+		*/
+		virtual void release(const PollerEvent& e) = 0;
+	};
+
+	/*
+	 * epoll(7) backend
+	 * completion style operations are emulated with readiness + syscalls
+	*/
+	class EpollPoller : public Poller {
+	public:
+		EpollPoller();
+		~EpollPoller();
+
+		string name() const override;
+
+		void add(const int fd, const uint32_t events) override;
+		void modify(const int fd, const uint32_t events) override;
+		void remove(const int fd) override;
+
+		void accept(const int listen_fd) override;
+		void cancelAccept(const int listen_fd) override;
+
+		void recv(const int fd) override;
+		void cancelRecv(const int fd) override;
+
+		void sendThenClose(const int fd, const string& data) override;
+
+		void wait(vector<PollerEvent>& out, const int timeoutMs) override;
+		void release(const PollerEvent& e) override;
+
+	private:
+		enum Mode { WATCH, ACCEPT, RECV };
+		struct Entry {
+			Mode mode;
+			bool armed; // RECV only, a recv was asked for and not reported yet
+		};
+		int epoll_fd;
+		unordered_map<int, Entry> entries;
+
+		// fds to try right away, an edge may have been consumed already
+		vector<int> tryAccept;
+		vector<int> tryRecv;
+		// cancelled accepts, to report as over
+		vector<int> cancelledAccepts;
+
+		static const size_t BUFFER_SIZE = 64 * 1024;
+		vector<unique_ptr<char[]>> buffers;
+		vector<int> freeBuffers;
+
+		void ctl(const int op, const int fd, const uint32_t events);
+		void doAccept(const int fd, vector<PollerEvent>& out);
+		void doRecv(const int fd, vector<PollerEvent>& out);
+	};
+
+#ifdef ZQ29_HAVE_IO_URING
+	/*
+	 * io_uring(7) backend, talks to the kernel with raw syscalls
+	 *
+	 * - every operation is queued in the submission ring and submitted
+	 *   in one batch by the io_uring_enter that waits for completions
+	 * - readiness uses multishot poll, which fires on every wakeup just like EPOLLET
+	 * - accept is multishot, one submission for many connections
+	 * - recv picks a buffer from a provided buffer ring, so no buffer is
+	 *   pinned by an idle connection
+	 * - sendThenClose is a send hard-linked to a close
+	 *
+	 * the constructor throws if the kernel lacks any of the above
+	*/
+	class UringPoller : public Poller {
+	public:
+		UringPoller(const unsigned entries = 1024);
+		~UringPoller();
+
+		string name() const override;
+
+		void add(const int fd, const uint32_t events) override;
+		void modify(const int fd, const uint32_t events) override;
+		void remove(const int fd) override;
+
+		void accept(const int listen_fd) override;
+		void cancelAccept(const int listen_fd) override;
+
+		void recv(const int fd) override;
+		void cancelRecv(const int fd) override;
+
+		void sendThenClose(const int fd, const string& data) override;
+
+		void wait(vector<PollerEvent>& out, const int timeoutMs) override;
+		void release(const PollerEvent& e) override;
+
+	private:
+		/*
+		 * user_data layout: [ 8 bits op | 24 bits generation | 32 bits fd ]
+		 * a generation identifies one registration of a fd, so completions
+		 * of a cancelled operation are never reported for a reused fd number
+		*/
+		enum Op { OP_IGNORE = 0, OP_POLL, OP_ACCEPT, OP_RECV, OP_SEND };
+		static uint64_t makeUserData(const Op op, const uint32_t gen, const int fd);
+
+		struct Registration {
+			uint32_t gen;
+			uint32_t events; // OP_POLL only
+		};
+		unordered_map<int, Registration> polls;
+		unordered_map<int, Registration> accepts;
+		unordered_map<int, Registration> recvs;
+		uint32_t nextGen;
+
+		// payloads of sendThenClose, alive until the send completes
+		unordered_map<uint32_t, string> sends;
+		uint32_t nextSendId;
+
+		int ring_fd;
+		unsigned sqEntries;
+		void* sqPtr;
+		size_t sqSize;
+		void* cqPtr;
+		size_t cqSize;
+		io_uring_sqe* sqes;
+		size_t sqesSize;
+		unsigned* sqHead;
+		unsigned* sqTail;
+		unsigned* sqMask;
+		unsigned* sqArray;
+		unsigned sqLocalTail;
+		unsigned* cqHead;
+		unsigned* cqTail;
+		unsigned* cqMask;
+		io_uring_cqe* cqes;
+
+		// provided buffer ring for recv
+		static const unsigned short BUFFER_GROUP = 0;
+		static const unsigned BUFFER_COUNT = 256;
+		static const unsigned BUFFER_SIZE = 16 * 1024;
+		io_uring_buf_ring* bufRing;
+		size_t bufRingSize;
+		char* bufMem;
+		unsigned short bufTail;
+
+		void cleanup();
+		io_uring_sqe* getSqe();
+		void enter(const unsigned minComplete, const int timeoutMs);
+		void armPoll(const int fd, Registration& r);
+		void armAccept(const int fd, Registration& r);
+		void armRecv(const int fd, Registration& r);
+		void cancel(const uint64_t userData);
+		void recycle(const unsigned short bid);
+		void handle(const io_uring_cqe& cqe, vector<PollerEvent>& out);
+	};
+#endif
+
+	/*
+	 * io_uring if asked for and available, epoll otherwise
+	*/
+	unique_ptr<Poller> createPoller(const bool preferIoUring);
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Poller Implementation //////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	Poller::PollerException::PollerException(const string& msg) : msg(msg) {}
+	const char* Poller::PollerException::what() const throw() { return msg.c_str(); }
+
+	unique_ptr<Poller> createPoller(const bool preferIoUring) {
+#ifdef ZQ29_HAVE_IO_URING
+		if(preferIoUring) {
+			try {
+				return unique_ptr<Poller>(new UringPoller());
+			} catch(const Poller::PollerException& e) {
+				Log::warning(Log::msg("io_uring not available, fall back to epoll: ", e.what()));
+			}
+		}
+#else
+		if(preferIoUring) {
+			Log::warning("built without io_uring support, fall back to epoll");
+		}
+#endif
+		return unique_ptr<Poller>(new EpollPoller());
+	}
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// EpollPoller Implementation /////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	EpollPoller::EpollPoller() {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if(epoll_fd < 0) {
+			throw PollerException(Log::msg("epoll_create1 failed: ", strerror(errno)));
+		}
+	}
+
+	EpollPoller::~EpollPoller() {
+		close(epoll_fd);
+	}
+
+	string EpollPoller::name() const { return "epoll"; }
+
+	void EpollPoller::ctl(const int op, const int fd, const uint32_t events) {
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events | EPOLLET;
+		ev.data.fd = fd;
+		if(epoll_ctl(epoll_fd, op, fd, &ev) < 0) {
+			throw PollerException(Log::msg("epoll_ctl failed on fd <", fd, ">: ", strerror(errno)));
+		}
+	}
+
+	void EpollPoller::add(const int fd, const uint32_t events) {
+		ctl(EPOLL_CTL_ADD, fd, events);
+		entries[fd] = Entry{ WATCH, false };
+	}
+
+	void EpollPoller::modify(const int fd, const uint32_t events) {
+		ctl(EPOLL_CTL_MOD, fd, events);
+	}
+
+	void EpollPoller::remove(const int fd) {
+		// the fd may have been closed already, which removes it from epoll
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		entries.erase(fd);
+	}
+
+	void EpollPoller::accept(const int listen_fd) {
+		ctl(EPOLL_CTL_ADD, listen_fd, EPOLLIN);
+		entries[listen_fd] = Entry{ ACCEPT, false };
+		tryAccept.push_back(listen_fd);
+	}
+
+	void EpollPoller::cancelAccept(const int listen_fd) {
+		auto it = entries.find(listen_fd);
+		if(it == entries.end() || it->second.mode != ACCEPT) { return; }
+		remove(listen_fd);
+		cancelledAccepts.push_back(listen_fd);
+	}
+
+	void EpollPoller::recv(const int fd) {
+		auto it = entries.find(fd);
+		if(it == entries.end()) {
+			ctl(EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLRDHUP);
+			it = entries.insert(make_pair(fd, Entry{ RECV, false })).first;
+		}
+		it->second.armed = true;
+		tryRecv.push_back(fd);
+	}
+
+	void EpollPoller::cancelRecv(const int fd) {
+		remove(fd);
+	}
+
+	void EpollPoller::sendThenClose(const int fd, const string& data) {
+		send(fd, data.c_str(), data.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(fd);
+	}
+
+	void EpollPoller::doAccept(const int fd, vector<PollerEvent>& out) {
+		// edge-triggered, accept until EAGAIN
+		while(true) {
+			const int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(client_fd < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+				if(errno == EINTR || errno == ECONNABORTED) { continue; }
+			}
+			out.push_back(PollerEvent{ PollerEvent::ACCEPTED, fd, 0,
+				client_fd < 0 ? -errno : client_fd, nullptr, -1 });
+			if(client_fd < 0) { return; }
+		}
+	}
+
+	void EpollPoller::doRecv(const int fd, vector<PollerEvent>& out) {
+		if(freeBuffers.empty()) {
+			freeBuffers.push_back(buffers.size());
+			buffers.push_back(unique_ptr<char[]>(new char[BUFFER_SIZE]));
+		}
+		const int bid = freeBuffers.back();
+		char* const buf = buffers[bid].get();
+		ssize_t len;
+		do {
+			len = ::recv(fd, buf, BUFFER_SIZE, 0);
+		} while(len < 0 && errno == EINTR);
+		if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return; // wait for the next edge
+		}
+		freeBuffers.pop_back();
+		entries[fd].armed = false;
+		out.push_back(PollerEvent{ PollerEvent::RECEIVED, fd, 0,
+			len < 0 ? -errno : (int)len, buf, bid });
+	}
+
+	void EpollPoller::wait(vector<PollerEvent>& out, const int timeoutMs) {
+		for(const int fd : cancelledAccepts) {
+			out.push_back(PollerEvent{ PollerEvent::ACCEPTED, fd, 0, -ECANCELED, nullptr, -1 });
+		}
+		cancelledAccepts.clear();
+		vector<int> fds;
+		fds.swap(tryAccept);
+		for(const int fd : fds) {
+			auto it = entries.find(fd);
+			if(it != entries.end() && it->second.mode == ACCEPT) { doAccept(fd, out); }
+		}
+		fds.clear();
+		fds.swap(tryRecv);
+		for(const int fd : fds) {
+			auto it = entries.find(fd);
+			if(it != entries.end() && it->second.mode == RECV && it->second.armed) { doRecv(fd, out); }
+		}
+
+		static const int MAX_EVENTS = 256;
+		epoll_event events[MAX_EVENTS];
+		const int n = epoll_wait(epoll_fd, events, MAX_EVENTS, out.empty() ? timeoutMs : 0);
+		if(n < 0) {
+			if(errno == EINTR) { return; }
+			throw PollerException(Log::msg("epoll_wait failed: ", strerror(errno)));
+		}
+		for(int i = 0; i < n; i++) {
+			const int fd = events[i].data.fd;
+			auto it = entries.find(fd);
+			if(it == entries.end()) { continue; }
+			if(it->second.mode == WATCH) {
+				out.push_back(PollerEvent{ PollerEvent::READY, fd, events[i].events, 0, nullptr, -1 });
+			} else if(it->second.mode == ACCEPT) {
+				doAccept(fd, out);
+			} else if(it->second.armed) {
+				doRecv(fd, out);
+			}
+		}
+	}
+
+	void EpollPoller::release(const PollerEvent& e) {
+		if(e.kind == PollerEvent::RECEIVED && e.bufferId >= 0) {
+			freeBuffers.push_back(e.bufferId);
+		}
+	}
+
+
+
+
+
+#ifdef ZQ29_HAVE_IO_URING
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// UringPoller Implementation /////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	UringPoller::UringPoller(const unsigned entries) :
+		nextGen(1), nextSendId(0),
+		ring_fd(-1), sqPtr(MAP_FAILED), cqPtr(MAP_FAILED), sqes((io_uring_sqe*)MAP_FAILED),
+		bufRing((io_uring_buf_ring*)MAP_FAILED), bufMem(nullptr), bufTail(0)
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+		if(ring_fd < 0) {
+			throw PollerException(Log::msg("io_uring_setup failed: ", strerror(errno)));
+		}
+		if(!(p.features & IORING_FEAT_EXT_ARG)) {
+			cleanup();
+			throw PollerException("kernel too old, IORING_FEAT_EXT_ARG missing");
+		}
+
+		sqEntries = p.sq_entries;
+		sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		const bool singleMmap = p.features & IORING_FEAT_SINGLE_MMAP;
+		if(singleMmap) {
+			sqSize = cqSize = max(sqSize, cqSize);
+		}
+		sqPtr = mmap(0, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if(sqPtr == MAP_FAILED) {
+			cleanup();
+			throw PollerException(Log::msg("failed to map the submission ring: ", strerror(errno)));
+		}
+		if(singleMmap) {
+			cqPtr = sqPtr;
+		} else {
+			cqPtr = mmap(0, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+			if(cqPtr == MAP_FAILED) {
+				cleanup();
+				throw PollerException(Log::msg("failed to map the completion ring: ", strerror(errno)));
+			}
+		}
+		sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe*)mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if(sqes == MAP_FAILED) {
+			cleanup();
+			throw PollerException(Log::msg("failed to map the submission entries: ", strerror(errno)));
+		}
+
+		char* const sq = (char*)sqPtr;
+		sqHead = (unsigned*)(sq + p.sq_off.head);
+		sqTail = (unsigned*)(sq + p.sq_off.tail);
+		sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+		sqArray = (unsigned*)(sq + p.sq_off.array);
+		sqLocalTail = *sqTail;
+		char* const cq = (char*)cqPtr;
+		cqHead = (unsigned*)(cq + p.cq_off.head);
+		cqTail = (unsigned*)(cq + p.cq_off.tail);
+		cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+		// provided buffer ring, its memory must be page aligned
+		bufRingSize = BUFFER_COUNT * sizeof(io_uring_buf);
+		bufRing = (io_uring_buf_ring*)mmap(0, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(bufRing == MAP_FAILED) {
+			cleanup();
+			throw PollerException(Log::msg("failed to map the buffer ring: ", strerror(errno)));
+		}
+		io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uint64_t)bufRing;
+		reg.ring_entries = BUFFER_COUNT;
+		reg.bgid = BUFFER_GROUP;
+		if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			cleanup();
+			throw PollerException(Log::msg("failed to register the buffer ring: ", strerror(errno)));
+		}
+		bufMem = new char[(size_t)BUFFER_COUNT * BUFFER_SIZE];
+		for(unsigned i = 0; i < BUFFER_COUNT; i++) {
+			recycle(i);
+		}
+	}
+
+	UringPoller::~UringPoller() {
+		cleanup();
+	}
+
+	void UringPoller::cleanup() {
+		if(bufRing != MAP_FAILED) { munmap(bufRing, bufRingSize); }
+		if(sqes != MAP_FAILED) { munmap(sqes, sqesSize); }
+		if(cqPtr != MAP_FAILED && cqPtr != sqPtr) { munmap(cqPtr, cqSize); }
+		if(sqPtr != MAP_FAILED) { munmap(sqPtr, sqSize); }
+		if(ring_fd >= 0) { close(ring_fd); }
+		delete[] bufMem;
+		bufRing = (io_uring_buf_ring*)MAP_FAILED;
+		sqes = (io_uring_sqe*)MAP_FAILED;
+		cqPtr = sqPtr = MAP_FAILED;
+		ring_fd = -1;
+		bufMem = nullptr;
+	}
+
+	string UringPoller::name() const { return "io_uring"; }
+
+	uint64_t UringPoller::makeUserData(const Op op, const uint32_t gen, const int fd) {
+		return ((uint64_t)op << 56) | ((uint64_t)(gen & 0xffffff) << 32) | (uint32_t)fd;
+	}
+
+	io_uring_sqe* UringPoller::getSqe() {
+		if(sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+			// full, submit what we have without waiting
+			enter(0, 0);
+			if(sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+				throw PollerException("submission ring is full");
+			}
+		}
+		const unsigned index = sqLocalTail & *sqMask;
+		io_uring_sqe* const sqe = &sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqArray[index] = index;
+		sqLocalTail++;
+		return sqe;
+	}
+
+	void UringPoller::enter(const unsigned minComplete, const int timeoutMs) {
+		__atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+		const unsigned toSubmit = sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+
+		unsigned flags = 0;
+		__kernel_timespec ts;
+		io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		if(minComplete > 0) {
+			flags |= IORING_ENTER_GETEVENTS;
+			if(timeoutMs >= 0) {
+				ts.tv_sec = timeoutMs / 1000;
+				ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+				arg.ts = (uint64_t)&ts;
+			}
+		}
+		flags |= IORING_ENTER_EXT_ARG;
+		if(toSubmit == 0 && minComplete == 0) { return; }
+		const int ret = syscall(__NR_io_uring_enter, ring_fd, toSubmit, minComplete, flags, &arg, sizeof(arg));
+		if(ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+			throw PollerException(Log::msg("io_uring_enter failed: ", strerror(errno)));
+		}
+	}
+
+	void UringPoller::armPoll(const int fd, Registration& r) {
+		io_uring_sqe* const sqe = getSqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		// poll(2) and epoll(7) share the same bits, but poll has no notion of EPOLLET
+		sqe->poll32_events = r.events & ~(EPOLLET | EPOLLONESHOT);
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = makeUserData(OP_POLL, r.gen, fd);
+	}
+
+	void UringPoller::armAccept(const int fd, Registration& r) {
+		io_uring_sqe* const sqe = getSqe();
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = fd;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = makeUserData(OP_ACCEPT, r.gen, fd);
+	}
+
+	void UringPoller::armRecv(const int fd, Registration& r) {
+		io_uring_sqe* const sqe = getSqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->len = BUFFER_SIZE;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUFFER_GROUP;
+		sqe->user_data = makeUserData(OP_RECV, r.gen, fd);
+	}
+
+	void UringPoller::cancel(const uint64_t userData) {
+		io_uring_sqe* const sqe = getSqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = userData;
+		sqe->user_data = makeUserData(OP_IGNORE, 0, -1);
+	}
+
+	void UringPoller::add(const int fd, const uint32_t events) {
+		Registration& r = polls[fd];
+		r.gen = nextGen++;
+		r.events = events;
+		armPoll(fd, r);
+	}
+
+	void UringPoller::modify(const int fd, const uint32_t events) {
+		auto it = polls.find(fd);
+		if(it == polls.end()) {
+			throw PollerException(Log::msg("modify unknown fd <", fd, ">"));
+		}
+		cancel(makeUserData(OP_POLL, it->second.gen, fd));
+		it->second.gen = nextGen++;
+		it->second.events = events;
+		armPoll(fd, it->second);
+	}
+
+	void UringPoller::remove(const int fd) {
+		auto it = polls.find(fd);
+		if(it == polls.end()) { return; }
+		cancel(makeUserData(OP_POLL, it->second.gen, fd));
+		polls.erase(it);
+	}
+
+	void UringPoller::accept(const int listen_fd) {
+		Registration& r = accepts[listen_fd];
+		r.gen = nextGen++;
+		armAccept(listen_fd, r);
+	}
+
+	void UringPoller::cancelAccept(const int listen_fd) {
+		auto it = accepts.find(listen_fd);
+		if(it == accepts.end()) { return; }
+		cancel(makeUserData(OP_ACCEPT, it->second.gen, listen_fd));
+		accepts.erase(it);
+	}
+
+	void UringPoller::recv(const int fd) {
+		Registration& r = recvs[fd];
+		r.gen = nextGen++;
+		armRecv(fd, r);
+	}
+
+	void UringPoller::cancelRecv(const int fd) {
+		auto it = recvs.find(fd);
+		if(it == recvs.end()) { return; }
+		// the in-flight recv holds a reference to the socket, closing
+		// the fd alone would not release it
+		cancel(makeUserData(OP_RECV, it->second.gen, fd));
+		recvs.erase(it);
+	}
+
+	void UringPoller::sendThenClose(const int fd, const string& data) {
+		const uint32_t id = nextSendId++;
+		const string& payload = (sends[id] = data);
+
+		io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)payload.c_str();
+		sqe->len = payload.length();
+		sqe->msg_flags = MSG_NOSIGNAL;
+		// hard link: close even if the send fails
+		sqe->flags = IOSQE_IO_HARDLINK;
+		sqe->user_data = makeUserData(OP_SEND, 0, (int)id);
+
+		sqe = getSqe();
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = fd;
+		sqe->user_data = makeUserData(OP_IGNORE, 0, -1);
+	}
+
+	void UringPoller::recycle(const unsigned short bid) {
+		// not bufRing->bufs, in C++ __DECLARE_FLEX_ARRAY shifts it by the size of an empty struct
+		io_uring_buf* const buf = (io_uring_buf*)bufRing + (bufTail & (BUFFER_COUNT - 1));
+		buf->addr = (uint64_t)(bufMem + (size_t)bid * BUFFER_SIZE);
+		buf->len = BUFFER_SIZE;
+		buf->bid = bid;
+		bufTail++;
+		__atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+	}
+
+	void UringPoller::handle(const io_uring_cqe& cqe, vector<PollerEvent>& out) {
+		const Op op = (Op)(cqe.user_data >> 56);
+		const uint32_t gen = (cqe.user_data >> 32) & 0xffffff;
+		const int fd = (int)(uint32_t)cqe.user_data;
+		const bool more = cqe.flags & IORING_CQE_F_MORE;
+
+		if(op == OP_POLL) {
+			auto it = polls.find(fd);
+			if(it == polls.end() || it->second.gen != gen) { return; } // stale
+			if(cqe.res >= 0) {
+				out.push_back(PollerEvent{ PollerEvent::READY, fd, (uint32_t)cqe.res, 0, nullptr, -1 });
+			} else if(cqe.res != -ECANCELED) {
+				out.push_back(PollerEvent{ PollerEvent::READY, fd, EPOLLERR, 0, nullptr, -1 });
+			}
+			if(!more) { armPoll(fd, it->second); }
+		} else if(op == OP_ACCEPT) {
+			auto it = accepts.find(fd);
+			const bool current = (it != accepts.end() && it->second.gen == gen);
+			// a connection accepted right before a cancel is still a connection
+			if(cqe.res >= 0 || (current && cqe.res != -ECANCELED)) {
+				out.push_back(PollerEvent{ PollerEvent::ACCEPTED, fd, 0, cqe.res, nullptr, -1 });
+			}
+			if(current && !more) {
+				armAccept(fd, it->second);
+			} else if(!more) { // the last completion of a cancelled accept
+				out.push_back(PollerEvent{ PollerEvent::ACCEPTED, fd, 0, -ECANCELED, nullptr, -1 });
+			}
+		} else if(op == OP_RECV) {
+			const int bid = (cqe.flags & IORING_CQE_F_BUFFER) ? (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+			auto it = recvs.find(fd);
+			if(it == recvs.end() || it->second.gen != gen) { // stale
+				if(bid >= 0) { recycle(bid); }
+				return;
+			}
+			if(cqe.res == -ENOBUFS) { // every buffer is in use, try again
+				armRecv(fd, it->second);
+				return;
+			}
+			recvs.erase(it);
+			out.push_back(PollerEvent{ PollerEvent::RECEIVED, fd, 0, cqe.res,
+				bid >= 0 ? bufMem + (size_t)bid * BUFFER_SIZE : nullptr, bid });
+		} else if(op == OP_SEND) {
+			sends.erase((uint32_t)fd);
+		}
+	}
+
+	void UringPoller::wait(vector<PollerEvent>& out, const int timeoutMs) {
+		const bool ready = *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		enter(ready ? 0 : 1, timeoutMs);
+
+		unsigned head = *cqHead;
+		while(head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+			const io_uring_cqe cqe = cqes[head & *cqMask];
+			head++;
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+			handle(cqe, out);
+		}
+	}
+
+	void UringPoller::release(const PollerEvent& e) {
+		if(e.kind == PollerEvent::RECEIVED && e.bufferId >= 0) {
+			recycle(e.bufferId);
+		}
+	}
+#endif
+
+}
+	using zq29Inner::Poller;
+	using zq29Inner::PollerEvent;
+	using zq29Inner::createPoller;
+}
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef ZQ29_HANDOFF
+#define ZQ29_HANDOFF
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * hands the listening sockets of a running proxy over to its
+	 * replacement, so a restart refuses no connection
+	 *
+	 * the running one serves a Unix socket at a known path, a new one
+	 * connects to it first thing and gets the listeners with SCM_RIGHTS:
+	 *   new                          old
+	 *   takeOver() -- connect -->
+	 *              <-- give() ----   the listeners
+	 *   starts accepting on them     keeps accepting too
+	 *   confirm()  -- 1 byte ---->   stops accepting, drains
+	 * both processes share the very same sockets, connections waiting in
+	 * their backlog are accepted by whoever is first, none is lost
+	 * if the new one dies before confirm(), the old one just goes on
+	*/
+	class ListenerHandoff {
+	public:
+		static const size_t MAX_FDS = 64;
+		static const int TIMEOUT_MS = 5000;
+
+		/*
+		 * a non-blocking listening Unix socket at path, replacing whatever
+		 * file is there, so take over first
+		 * returns -1 on failure
+		*/
+		static int listen(const string& path);
+
+		/*
+		 * old: send fds over conn, an accepted connection
+		*/
+		static bool give(const int conn, const vector<int>& fds);
+
+		/*
+		 * new: the listeners of the proxy serving path, close-on-exec
+		 * empty if there is none (no file, or a stale one) or it failed
+		 * conn: to confirm() on once the listeners are in use, -1 if empty
+		*/
+		static vector<int> takeOver(const string& path, int& conn);
+
+		/*
+		 * new: tell the old one to stop accepting, closes conn
+		*/
+		static bool confirm(const int conn);
+
+	private:
+		static bool address(const string& path, sockaddr_un& addr);
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// ListenerHandoff Implementation /////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	bool ListenerHandoff::address(const string& path, sockaddr_un& addr) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(path.empty() || path.size() >= sizeof(addr.sun_path)) {
+			Log::warning(Log::msg("in ListenerHandoff: bad socket path <", path, ">"));
+			return false;
+		}
+		memcpy(addr.sun_path, path.c_str(), path.size());
+		return true;
+	}
+
+	int ListenerHandoff::listen(const string& path) {
+		sockaddr_un addr;
+		if(!address(path, addr)) { return -1; }
+		const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(fd < 0) {
+			Log::warning(Log::msg("in ListenerHandoff: socket failed, ", strerror(errno)));
+			return -1;
+		}
+		unlink(path.c_str());
+		if(bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(fd, 4) < 0) {
+			Log::warning(Log::msg("in ListenerHandoff: cannot listen on <", path, ">, ", strerror(errno)));
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	bool ListenerHandoff::give(const int conn, const vector<int>& fds) {
+		if(fds.empty() || fds.size() > MAX_FDS) { return false; }
+		uint32_t count = fds.size();
+		iovec iov = { &count, sizeof(count) };
+		vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()), 0);
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+		memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+		ssize_t n;
+		do {
+			n = sendmsg(conn, &msg, MSG_NOSIGNAL);
+		} while(n < 0 && errno == EINTR);
+		if(n != (ssize_t)sizeof(count)) {
+			Log::warning(Log::msg("in ListenerHandoff: cannot send listeners, ", n < 0 ? strerror(errno) : "short write"));
+			return false;
+		}
+		return true;
+	}
+
+	vector<int> ListenerHandoff::takeOver(const string& path, int& conn) {
+		conn = -1;
+		vector<int> fds;
+		sockaddr_un addr;
+		if(!address(path, addr)) { return fds; }
+		const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd < 0) { return fds; }
+		if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+			// ENOENT, ECONNREFUSED: nobody is serving there
+			Log::debug(Log::msg("in ListenerHandoff: nothing to take over at <", path, ">, ", strerror(errno)));
+			close(fd);
+			return fds;
+		}
+		timeval tv = { TIMEOUT_MS / 1000, (TIMEOUT_MS % 1000) * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		uint32_t count = 0;
+		iovec iov = { &count, sizeof(count) };
+		vector<char> control(CMSG_SPACE(sizeof(int) * MAX_FDS), 0);
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		ssize_t n;
+		do {
+			n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+		} while(n < 0 && errno == EINTR);
+
+		for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) { continue; }
+			const size_t k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const int* const data = (const int*)CMSG_DATA(cmsg);
+			fds.insert(fds.end(), data, data + k);
+		}
+		if(n != (ssize_t)sizeof(count) || (msg.msg_flags & MSG_CTRUNC) || fds.size() != count || fds.empty()) {
+			Log::warning(Log::msg("in ListenerHandoff: bad handoff from <", path, ">, got ", fds.size(), " fds"));
+			for(const int l : fds) { close(l); }
+			fds.clear();
+			close(fd);
+			return fds;
+		}
+		conn = fd;
+		return fds;
+	}
+
+	bool ListenerHandoff::confirm(const int conn) {
+		const char ok = 1;
+		const bool sent = send(conn, &ok, 1, MSG_NOSIGNAL) == 1;
+		close(conn);
+		return sent;
+	}
+
+}
+	using zq29Inner::ListenerHandoff;
+}
+
+#endif
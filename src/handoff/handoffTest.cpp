@@ -0,0 +1,148 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <thread>
+
+#include "handoff.hpp"
+
+using namespace zq29;
+using namespace std;
+
+const string PATH = "/tmp/zq29-handoffTest.sock";
+
+/*
+ * a listening TCP socket on a free port of localhost
+*/
+int tcpListener(uint16_t& port) {
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if(fd < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0
+		|| getsockname(fd, (sockaddr*)&addr, &len) < 0) {
+		return -1;
+	}
+	port = ntohs(addr.sin_port);
+	return fd;
+}
+
+int connectTo(const uint16_t port) {
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * the whole exchange, with a connection waiting in the backlog while
+ * the listeners change hands
+*/
+void testHandoff() {
+	const string TAG = "testHandoff";
+	bool failFlag = false;
+
+	uint16_t port1, port2;
+	const int l1 = tcpListener(port1), l2 = tcpListener(port2);
+	const int server = ListenerHandoff::listen(PATH);
+	if(l1 < 0 || l2 < 0 || server < 0) {
+		Log::testFail(TAG, "cannot listen");
+		return;
+	}
+	const int waiting = connectTo(port1); // nobody accepted it yet
+
+	bool confirmed = false;
+	thread old([&]() {
+		int conn;
+		do {
+			conn = accept(server, nullptr, nullptr);
+		} while(conn < 0 && errno == EAGAIN);
+		if(conn < 0 || !ListenerHandoff::give(conn, { l1, l2 })) { return; }
+		char c;
+		confirmed = recv(conn, &c, 1, 0) == 1;
+		close(conn);
+		// the old one lets go of its copies
+		close(l1);
+		close(l2);
+	});
+
+	int conn;
+	const vector<int> fds = ListenerHandoff::takeOver(PATH, conn);
+	if(fds.size() != 2 || conn < 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("took over ", fds.size(), " listeners"));
+	} else {
+		if(!(fcntl(fds[0], F_GETFD) & FD_CLOEXEC)) {
+			failFlag = true;
+			Log::testFail(TAG, "listener not close-on-exec");
+		}
+		ListenerHandoff::confirm(conn);
+		old.join();
+		const int accepted = accept(fds[0], nullptr, nullptr);
+		const int client2 = connectTo(port2);
+		const int accepted2 = accept(fds[1], nullptr, nullptr);
+		if(!confirmed || accepted < 0 || client2 < 0 || accepted2 < 0
+			|| send(waiting, "x", 1, 0) != 1) {
+			failFlag = true;
+			Log::testFail(TAG, "the listeners don't work after the handoff");
+		}
+		char c = 0;
+		if(recv(accepted, &c, 1, 0) != 1 || c != 'x') {
+			failFlag = true;
+			Log::testFail(TAG, "lost the connection in the backlog");
+		}
+		close(accepted); close(accepted2); close(client2);
+		for(const int fd : fds) { close(fd); }
+	}
+	if(old.joinable()) { old.join(); }
+
+	close(waiting);
+	close(server);
+	unlink(PATH.c_str());
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * nothing to take over: no file, or a file nobody listens on
+*/
+void testNobody() {
+	const string TAG = "testNobody";
+	bool failFlag = false;
+
+	unlink(PATH.c_str());
+	int conn;
+	if(!ListenerHandoff::takeOver(PATH, conn).empty() || conn != -1) {
+		failFlag = true;
+		Log::testFail(TAG, "no file");
+	}
+
+	close(ListenerHandoff::listen(PATH)); // leaves a stale file
+	if(!ListenerHandoff::takeOver(PATH, conn).empty() || conn != -1) {
+		failFlag = true;
+		Log::testFail(TAG, "stale file");
+	}
+	const int again = ListenerHandoff::listen(PATH);
+	if(again < 0) {
+		failFlag = true;
+		Log::testFail(TAG, "cannot replace a stale file");
+	}
+
+	close(again);
+	unlink(PATH.c_str());
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testHandoff();
+	testNobody();
+}
@@ -1,6 +1,9 @@
 #ifndef ZQ29_HTTPPARSER
 #define ZQ29_HTTPPARSER
 
+#include <sys/uio.h>
+
+#include <algorithm>
 #include <set>
 #include <tuple>
 #include <vector>
@@ -245,6 +248,11 @@ namespace zq29Inner {
 	namespace utils {
 		bool isDigit(char c);
 
+		/*
+		 * case-insensitive string comparison, for field names and tokens
+		*/
+		bool iequals(const string& a, const string& b);
+
 		/*
 		 * as the name suggests, parse a non-negative
 		 * hex number string to an integer
@@ -273,6 +281,36 @@ namespace zq29Inner {
 		HTTPMessage(const set<pair<string, string>>& h, const string& m);
 
 		virtual string toStr() const = 0;
+
+		/*
+		 * request line or status line, with its CRLF
+		*/
+		virtual string startLineToStr() const = 0;
+
+		/*
+		 * the header fields, each with its CRLF, and the empty line
+		*/
+		string headerBlockToStr() const;
+
+		/*
+		 * the message cut into the pieces writev(2) takes: start line,
+		 * header block and body, nothing is concatenated
+		 * the body is not copied, it points into the message, which
+		 * must outlive this and stay as it is
+		*/
+		struct Serialized {
+			string startLine;
+			string headerBlock;
+			const char* body;
+			size_t bodyLength;
+
+			/*
+			 * points into this object (and the message), empty pieces are left out
+			*/
+			vector<iovec> iov() const;
+			size_t size() const;
+		};
+		Serialized serialize() const;
 	};
 
 
@@ -292,6 +330,7 @@ namespace zq29Inner {
 			const set<pair<string, string>>& h, const string& m);
 
 		virtual string toStr() const override;
+		virtual string startLineToStr() const override;
 		bool operator==(const HTTPRequest& rhs) const;
 
 		RequestLine requestLine;
@@ -314,6 +353,7 @@ namespace zq29Inner {
 			const set<pair<string, string>>& h, const string& m);
 
 		virtual string toStr() const override;
+		virtual string startLineToStr() const override;
 		string headerToStr() const;
 		bool operator==(const HTTPStatus& rhs) const;
 
@@ -383,6 +423,11 @@ namespace zq29Inner {
 		*/
 		void parseHeaderFields();
 
+		/*
+		 * whether the buffer holds the empty line that ends the header fields
+		*/
+		bool hasCompleteHead() const;
+
 		/*
 		 * a helper function to parse message body
 		 * when the final encoding of header field
@@ -457,6 +502,14 @@ namespace zq29Inner {
 		*/
 		HTTPRequest build();
 
+		/*
+		 * like build(), but stops after the header fields, the message
+		 * body is left in the buffer, see BodyFramer
+		 * if the buffer does not hold the whole head yet, throw an
+		 * HTTPParserException and leave the buffer as it is
+		*/
+		HTTPRequest buildHead();
+
 		/*
 		 * static methods help parse member into more fields
 		 * e.g. parse requestLine.requestTarget in to authority-form,
@@ -539,6 +592,83 @@ namespace zq29Inner {
 		 * on failure, throw exceptions
 		*/
 		HTTPStatus build();
+
+		/*
+		 * like build(), but stops after the header fields, so the message
+		 * body (or what has arrived of it) is what's left in the buffer,
+		 * use BodyFramer to find where it ends
+		 *
+		 * if the buffer does not hold the whole head yet, throw an
+		 * HTTPParserException and leave the buffer as it is
+		*/
+		HTTPStatus buildHead();
+	};
+
+
+
+	/*
+	 * finds the end of a message body in a stream of bytes without keeping
+	 * them, so the body can be forwarded while it arrives
+	 * see section 3.3.3 for the length, section 4.1 for chunks
+	 *
+	 * NONE:        no body at all
+	 * LENGTH:      Content-Length bytes
+	 * CHUNKED:     up to the last chunk and the trailer, framing included,
+	 *              as HTTPParser keeps it in messageBody
+	 * UNTIL_CLOSE: everything until the connection is closed
+	*/
+	class BodyFramer {
+	public:
+		enum Kind { NONE, LENGTH, CHUNKED, UNTIL_CLOSE };
+
+		BodyFramer(const Kind kind = NONE, const size_t length = 0);
+
+		/*
+		 * the framing of a status built by HTTPStatusParser
+		 * throws HTTPBadMessageException if Content-Length is invalid
+		*/
+		static BodyFramer forStatus(const HTTPStatus& sta, const bool isRespToCONNECT = false);
+
+		/*
+		 * the framing of a request built by HTTPRequestParser
+		 * throws HTTP400Exception if Content-Length is invalid, or
+		 * Transfer-Encoding does not end with chunked (section 3.3.3 rule 3)
+		*/
+		static BodyFramer forRequest(const HTTPRequest& req);
+
+		/*
+		 * returns how many of the len bytes belong to the body,
+		 * less than len only if the body ends within them
+		 * throws HTTPBadMessageException on broken chunks
+		*/
+		size_t feed(const char* data, const size_t len);
+
+		/*
+		 * the whole body went through feed(), never true for UNTIL_CLOSE
+		*/
+		bool done() const;
+		Kind kind() const;
+
+		/*
+		 * LENGTH: body bytes not fed yet, 0 for the other kinds
+		*/
+		size_t remaining() const;
+
+	private:
+		enum ChunkState { CHUNK_SIZE, CHUNK_SIZE_LF, CHUNK_DATA, CHUNK_DATA_CR, CHUNK_DATA_LF,
+			TRAILER, TRAILER_LF, FINISHED };
+		// [BROKEN]: longer chunk-size lines (with extensions) are rejected
+		static const size_t MAX_LINE = 4096;
+
+		/*
+		 * section 3.3.3 rule 4 & 5, NONE if there is no Content-Length
+		*/
+		static BodyFramer fromContentLength(const HTTPMessage& msg);
+
+		Kind knd;
+		size_t left; // LENGTH: body bytes, CHUNKED: bytes of the current chunk
+		ChunkState state;
+		string line; // chunk-size line or trailer line so far
 	};
 
 
@@ -555,6 +685,18 @@ namespace zq29Inner {
 
 		string getHTTP502HTMLStr(const string& error);
 
+		/*
+		 * with a Retry-After of that many seconds, if not 0
+		*/
+		string getHTTP503HTMLStr(const string& error, const size_t retryAfter = 0);
+
+		/*
+		 * the proxy closes the connection after these two
+		*/
+		string getHTTP413HTMLStr(const string& error);
+
+		string getHTTP431HTMLStr(const string& error);
+
 		/*
 		 * hack the status HTML string, add "<h1>zq29 HTTP Cache Proxy</h1>"
 		 * if no <body> tag, do nothing
@@ -570,6 +712,33 @@ namespace zq29Inner {
 		 * exception guarantee: no throw
 		*/
 		HTTPStatus buildStatusFromStr(const string& str);
+
+		/*
+		 * whether a field named fieldName (case-insensitive) has token in
+		 * its comma separated value (case-insensitive), like "Connection: close"
+		*/
+		bool hasHeaderToken(const HTTPMessage& msg, const string& fieldName, const string& token);
+
+		/*
+		 * whether the client wants the connection to stay open after req
+		 * HTTP/1.1 does unless it says "close"
+		 * [BROKEN]: HTTP/1.0 never does, we don't send "Connection: keep-alive" back
+		*/
+		bool wantsKeepAlive(const HTTPRequest& req);
+
+		/*
+		 * whether the connection can carry another message after resp,
+		 * which means resp does not say "close" and ends by itself
+		 * (no body, Content-Length or chunked), not at the end of the connection
+		*/
+		bool allowsKeepAlive(const HTTPStatus& resp);
+
+		/*
+		 * remove the fields that only make sense for one connection
+		 * (Connection, Proxy-Connection, Keep-Alive), before forwarding msg
+		 * [BROKEN]: fields listed in Connection are kept
+		*/
+		void removeHopByHopFields(HTTPMessage& msg);
 	}
 
 
@@ -585,6 +754,14 @@ namespace zq29Inner {
 		return (c >= '0' && c <= '9');
 	}
 
+	bool utils::iequals(const string& a, const string& b) {
+		if(a.length() != b.length()) { return false; }
+		for(size_t i = 0; i < a.length(); i++) {
+			if(tolower(a[i]) != tolower(b[i])) { return false; }
+		}
+		return true;
+	}
+
 	int utils::nonNegHexStrToInt(const string& s) {
 		int i = -1;   
 		stringstream ss;
@@ -608,6 +785,51 @@ namespace zq29Inner {
 	HTTPMessage::HTTPMessage(const set<pair<string, string>>& h, const string& m) : 
 		headerFields(h), messageBody(m) {}
 
+	string HTTPMessage::headerBlockToStr() const {
+		size_t len = 2;
+		for(auto const& e : headerFields) {
+			len += e.first.size() + e.second.size() + 4;
+		}
+		string s;
+		s.reserve(len);
+		for(auto const& e : headerFields) {
+			s.append(e.first).append(": ").append(e.second).append("\r\n");
+		}
+		s.append("\r\n");
+		return s;
+	}
+
+	HTTPMessage::Serialized HTTPMessage::serialize() const {
+		Serialized result;
+		result.startLine = startLineToStr();
+		result.headerBlock = headerBlockToStr();
+		result.body = messageBody.data();
+		result.bodyLength = messageBody.size();
+		return result;
+	}
+
+	vector<iovec> HTTPMessage::Serialized::iov() const {
+		vector<iovec> result;
+		result.reserve(3);
+		const pair<const char*, size_t> pieces[] = {
+			{ startLine.data(), startLine.size() },
+			{ headerBlock.data(), headerBlock.size() },
+			{ body, bodyLength }
+		};
+		for(auto const& p : pieces) {
+			if(p.second == 0) { continue; }
+			iovec v;
+			v.iov_base = (void*)p.first;
+			v.iov_len = p.second;
+			result.push_back(v);
+		}
+		return result;
+	}
+
+	size_t HTTPMessage::Serialized::size() const {
+		return startLine.size() + headerBlock.size() + bodyLength;
+	}
+
 
 
 	/////////////////////////////////////////////////////////////////////////////////
@@ -634,17 +856,15 @@ namespace zq29Inner {
 		HTTPMessage(h, m), requestLine(r) {}
 
 	string HTTPRequest::toStr() const {
-		stringstream ss;
-		ss << requestLine.method << " "
-			<< requestLine.requestTarget << " "
-			<< requestLine.httpVersion << "\r\n";
-		for(auto const& e : headerFields) {
-			ss << e.first << ": "
-				<< e.second << "\r\n";
-		}
-		ss << "\r\n";
-		ss << messageBody;
-		return ss.str();
+		const Serialized s = serialize();
+		string result;
+		result.reserve(s.size());
+		result.append(s.startLine).append(s.headerBlock).append(messageBody);
+		return result;
+	}
+
+	string HTTPRequest::startLineToStr() const {
+		return requestLine.toStr() + "\r\n";
 	}
 
 	bool HTTPRequest::operator==(const HTTPRequest& rhs) const {
@@ -676,30 +896,19 @@ namespace zq29Inner {
 		HTTPMessage(h, m), statusLine(s) {}
 
 	string HTTPStatus::toStr() const {
-		stringstream ss;
-		ss << statusLine.httpVersion << " "
-			<< statusLine.statusCode << " "
-			<< statusLine.reasonPhrase << "\r\n";
-		for(auto const& e : headerFields) {
-			ss << e.first << ": "
-				<< e.second << "\r\n";
-		}
-		ss << "\r\n";
-		ss << messageBody;
-		return ss.str();
+		const Serialized s = serialize();
+		string result;
+		result.reserve(s.size());
+		result.append(s.startLine).append(s.headerBlock).append(messageBody);
+		return result;
+	}
+
+	string HTTPStatus::startLineToStr() const {
+		return statusLine.toStr() + "\r\n";
 	}
 
 	string HTTPStatus::headerToStr() const {
-		stringstream ss;
-		ss << statusLine.httpVersion << " "
-			<< statusLine.statusCode << " "
-			<< statusLine.reasonPhrase << "\r\n";
-		for(auto const& e : headerFields) {
-			ss << e.first << ": "
-				<< e.second << "\r\n";
-		}
-		ss << "\r\n";
-		return ss.str();
+		return startLineToStr() + headerBlockToStr();
 	}
 
 	bool HTTPStatus::operator==(const HTTPStatus& rhs) const {
@@ -757,9 +966,11 @@ namespace zq29Inner {
 		return count;
 	}
 	void HTTPParser::eraseHeaerFieldByName(const string& name) {
-		for(auto e = headerFields.begin(); e != headerFields.end(); e++) {
+		for(auto e = headerFields.begin(); e != headerFields.end();) {
 			if((*e).first == name) {
-				headerFields.erase(e);
+				headerFields.erase(e++);
+			} else {
+				++e;
 			}
 		}
 	}
@@ -885,6 +1096,9 @@ namespace zq29Inner {
 				body << line << "\r\n";
 			}
 		}
+		// [BROKEN]: the empty line after the trailer may be missing,
+		// but the body we keep always has it
+		body << "\r\n";
 
 		// [BROKEN]: we won't set Content-Length, instead we keep the message as it is
 		messageBody = body.str();
@@ -985,6 +1199,11 @@ namespace zq29Inner {
 		parseCacheControl();
 	}
 
+	bool HTTPParser::hasCompleteHead() const {
+		const char crlf2[] = "\r\n\r\n";
+		return search(buffer.begin(), buffer.end(), crlf2, crlf2 + 4) != buffer.end();
+	}
+
 	void HTTPParser::clear() {
 		buffer.clear();
 		headerFields.clear();
@@ -1125,6 +1344,19 @@ namespace zq29Inner {
 		return req;
 	}
 
+	HTTPRequest HTTPRequestParser::buildHead() {
+		if(!hasCompleteHead()) {
+			throw HTTPParserException("the head is not complete yet");
+		}
+		parseRequestLine();
+		parseHeaderFields(); // from parent class
+		// as parseMessageBody does, section 3.3.3 rule 3
+		if(getHeaderFieldByName("Transfer-Encoding") != headerFields.end()) {
+			eraseHeaerFieldByName("Content-Length");
+		}
+		return HTTPRequest(requestLine, headerFields, "");
+	}
+
 	HTTPRequestParser::AuthorityForm HTTPRequestParser::parseAuthorityForm(const string& str, bool isConnect) {
 		AuthorityForm af;
 		const size_t sp = str.find(':');
@@ -1335,6 +1567,188 @@ namespace zq29Inner {
 		return result;
 	}
 
+	HTTPStatus HTTPStatusParser::buildHead() {
+		if(!hasCompleteHead()) {
+			throw HTTPParserException("the head is not complete yet");
+		}
+		parseStatusLine();
+		parseHeaderFields(); // from parent class
+		// as parseMessageBody does, section 3.3.3 rule 3
+		if(getHeaderFieldByName("Transfer-Encoding") != headerFields.end()) {
+			eraseHeaerFieldByName("Content-Length");
+		}
+		return HTTPStatus(statusLine, headerFields, "");
+	}
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// BodyFramer Implementation //////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	BodyFramer::BodyFramer(const Kind kind, const size_t length) :
+		knd(kind), left(length), state(CHUNK_SIZE) {}
+
+	BodyFramer BodyFramer::forStatus(const HTTPStatus& sta, const bool isRespToCONNECT) {
+		const string& code = sta.statusLine.statusCode;
+		// rule 1 & 2
+		if(code.empty() || code[0] == '1' || code == "204" || code == "304" ||
+			(isRespToCONNECT && code[0] == '2')) {
+			return BodyFramer(NONE);
+		}
+		// rule 3
+		for(auto const& e : sta.headerFields) {
+			if(!utils::iequals(e.first, "Transfer-Encoding")) { continue; }
+			stringstream ss;
+			ss << e.second;
+			string finalEncoding;
+			while(ss >> finalEncoding) {}
+			return BodyFramer(utils::iequals(finalEncoding, "chunked") ? CHUNKED : UNTIL_CLOSE);
+		}
+		// rule 4 & 5
+		for(auto const& e : sta.headerFields) {
+			if(utils::iequals(e.first, "Content-Length")) { return fromContentLength(sta); }
+		}
+		// rule 7
+		return BodyFramer(UNTIL_CLOSE);
+	}
+
+	BodyFramer BodyFramer::forRequest(const HTTPRequest& req) {
+		// rule 3
+		for(auto const& e : req.headerFields) {
+			if(!utils::iequals(e.first, "Transfer-Encoding")) { continue; }
+			stringstream ss;
+			ss << e.second;
+			string finalEncoding;
+			while(ss >> finalEncoding) {}
+			if(!utils::iequals(finalEncoding, "chunked")) {
+				throw HTTPRequestParser::HTTP400Exception("final encoding is NOT chunked for "\
+					"'Transfer-Encoding' for request, close connection");
+			}
+			return BodyFramer(CHUNKED);
+		}
+		// rule 4 & 5, or rule 6: no body
+		try {
+			return fromContentLength(req);
+		} catch(const HTTPParser::HTTPBadMessageException& e) {
+			throw HTTPRequestParser::HTTP400Exception(e.what());
+		}
+	}
+
+	BodyFramer BodyFramer::fromContentLength(const HTTPMessage& msg) {
+		string contentLengthStr;
+		size_t count = 0;
+		for(auto const& e : msg.headerFields) {
+			if(utils::iequals(e.first, "Content-Length")) {
+				contentLengthStr = e.second;
+				count++;
+			}
+		}
+		if(count == 0) { return BodyFramer(NONE); }
+		if(count > 1) {
+			throw HTTPParser::HTTPBadMessageException("message contains multiple Content-Length fields");
+		}
+		stringstream ss;
+		size_t contentLength = 0;
+		ss << contentLengthStr;
+		if(contentLengthStr.empty() || contentLengthStr.find_first_not_of("0123456789") != string::npos ||
+			!(ss >> contentLength)) {
+			throw HTTPParser::HTTPBadMessageException(Log::msg(
+				"invalid Content-Length field <", contentLengthStr, ">"
+			));
+		}
+		return contentLength == 0 ? BodyFramer(NONE) : BodyFramer(LENGTH, contentLength);
+	}
+
+	size_t BodyFramer::feed(const char* data, const size_t len) {
+		if(knd == NONE) { return 0; }
+		if(knd == UNTIL_CLOSE) { return len; }
+		if(knd == LENGTH) {
+			const size_t n = min(left, len);
+			left -= n;
+			return n;
+		}
+
+		size_t i = 0;
+		while(i < len && state != FINISHED) {
+			if(state == CHUNK_DATA) {
+				const size_t n = min(left, len - i);
+				left -= n;
+				i += n;
+				if(left == 0) { state = CHUNK_DATA_CR; }
+				continue;
+			}
+			const char c = data[i++];
+			switch(state) {
+			case CHUNK_SIZE:
+			case TRAILER:
+				if(c == '\r') {
+					state = state == CHUNK_SIZE ? CHUNK_SIZE_LF : TRAILER_LF;
+				} else if(c == '\n' || line.size() >= MAX_LINE) {
+					throw HTTPParser::HTTPBadMessageException("while parsing chunked message, bad line");
+				} else {
+					line += c;
+				}
+				break;
+			case CHUNK_SIZE_LF: {
+				if(c != '\n') {
+					throw HTTPParser::HTTPBadMessageException("while parsing chunked message, expected LF");
+				}
+				stringstream ss;
+				ss << line.substr(0, line.find(';'));
+				string chunkSizeStr;
+				ss >> chunkSizeStr;
+				const int chunkSize = utils::nonNegHexStrToInt(chunkSizeStr);
+				if(chunkSize == -1) {
+					throw HTTPParser::HTTPBadMessageException("while parsing chunked message,"\
+						" failed to recognize chunk size");
+				}
+				line.clear();
+				left = chunkSize;
+				state = chunkSize == 0 ? TRAILER : CHUNK_DATA;
+				break;
+			}
+			case CHUNK_DATA_CR:
+			case CHUNK_DATA_LF:
+				if(c != (state == CHUNK_DATA_CR ? '\r' : '\n')) {
+					throw HTTPParser::HTTPBadMessageException("while parsing chunked message,"\
+						" expected CR LF at the end of the chunk data");
+				}
+				state = state == CHUNK_DATA_CR ? CHUNK_DATA_LF : CHUNK_SIZE;
+				break;
+			case TRAILER_LF:
+				if(c != '\n') {
+					throw HTTPParser::HTTPBadMessageException("while parsing chunked message, expected LF");
+				}
+				state = line.empty() ? FINISHED : TRAILER;
+				line.clear();
+				break;
+			default:
+				break;
+			}
+		}
+		return i;
+	}
+
+	bool BodyFramer::done() const {
+		switch(knd) {
+		case NONE: return true;
+		case LENGTH: return left == 0;
+		case CHUNKED: return state == FINISHED;
+		default: return false;
+		}
+	}
+
+	BodyFramer::Kind BodyFramer::kind() const {
+		return knd;
+	}
+
+	size_t BodyFramer::remaining() const {
+		return knd == LENGTH ? left : 0;
+	}
+
 
 
 
@@ -1383,6 +1797,72 @@ namespace zq29Inner {
 		return resp.toStr();
 	}
 
+	string sc::getHTTP503HTMLStr(const string& error, const size_t retryAfter) {
+		const string html = "<!DOCTYPE html PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"\
+			"<html><head><meta http-equiv=\"Content-Type\" content=\"text/html\">\n"\
+			"<title>503 Service Unavailable</title>\n</head><body><h1>503 Service Unavailable</h1>\n<p>" +
+			error + "</p>\n<hr><address>zq29 HTTP Cache Proxy</address></body></html>\n";
+
+		HTTPStatus::StatusLine sl;
+		sl.httpVersion = "HTTP/1.1";
+		sl.statusCode = "503";
+		sl.reasonPhrase = "Service Unavailable";
+
+		set<pair<string, string>> headers;
+		stringstream ss;
+		ss << html.length();
+		headers.insert(make_pair("Content-Length", ss.str()));
+		headers.insert(make_pair("Connection", "close"));
+		if(retryAfter > 0) {
+			headers.insert(make_pair("Retry-After", to_string(retryAfter)));
+		}
+
+		HTTPStatus resp(sl, headers, html);
+		return resp.toStr();
+	}
+
+	string sc::getHTTP413HTMLStr(const string& error) {
+		const string html = "<!DOCTYPE html PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"\
+			"<html><head><meta http-equiv=\"Content-Type\" content=\"text/html\">\n"\
+			"<title>413 Payload Too Large</title>\n</head><body><h1>413 Payload Too Large</h1>\n<p>" +
+			error + "</p>\n<hr><address>zq29 HTTP Cache Proxy</address></body></html>\n";
+
+		HTTPStatus::StatusLine sl;
+		sl.httpVersion = "HTTP/1.1";
+		sl.statusCode = "413";
+		sl.reasonPhrase = "Payload Too Large";
+
+		set<pair<string, string>> headers;
+		stringstream ss;
+		ss << html.length();
+		headers.insert(make_pair("Content-Length", ss.str()));
+		headers.insert(make_pair("Connection", "close"));
+
+		HTTPStatus resp(sl, headers, html);
+		return resp.toStr();
+	}
+
+	string sc::getHTTP431HTMLStr(const string& error) {
+		const string html = "<!DOCTYPE html PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\n"\
+			"<html><head><meta http-equiv=\"Content-Type\" content=\"text/html\">\n"\
+			"<title>431 Request Header Fields Too Large</title>\n</head><body><h1>431 Request Header Fields Too Large</h1>\n<p>" +
+			error + "</p>\n<hr><address>zq29 HTTP Cache Proxy</address></body></html>\n";
+
+		HTTPStatus::StatusLine sl;
+		sl.httpVersion = "HTTP/1.1";
+		sl.statusCode = "431";
+		sl.reasonPhrase = "Request Header Fields Too Large";
+
+		set<pair<string, string>> headers;
+		stringstream ss;
+		ss << html.length();
+		headers.insert(make_pair("Content-Length", ss.str()));
+		headers.insert(make_pair("Connection", "close"));
+
+		HTTPStatus resp(sl, headers, html);
+		return resp.toStr();
+	}
+
 	string sc::hackStatusHTML(string html) {
 		size_t sp = html.find("<body>");
 		if(sp == string::npos) { return html; }
@@ -1392,6 +1872,51 @@ namespace zq29Inner {
 		return html;
 	}
 
+	bool sc::hasHeaderToken(const HTTPMessage& msg, const string& fieldName, const string& token) {
+		for(auto const& field : msg.headerFields) {
+			if(!utils::iequals(field.first, fieldName)) { continue; }
+			stringstream ss(field.second);
+			string value;
+			while(getline(ss, value, ',')) {
+				const size_t begin = value.find_first_not_of(" \t");
+				const size_t end = value.find_last_not_of(" \t");
+				if(begin != string::npos && utils::iequals(value.substr(begin, end - begin + 1), token)) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	bool sc::wantsKeepAlive(const HTTPRequest& req) {
+		if(req.requestLine.httpVersion != "HTTP/1.1") { return false; }
+		return !hasHeaderToken(req, "Connection", "close") &&
+			!hasHeaderToken(req, "Proxy-Connection", "close");
+	}
+
+	bool sc::allowsKeepAlive(const HTTPStatus& resp) {
+		if(hasHeaderToken(resp, "Connection", "close")) { return false; }
+		const string& code = resp.statusLine.statusCode;
+		if(code.empty()) { return false; }
+		if(code[0] == '1' || code == "204" || code == "304") { return true; }
+		if(hasHeaderToken(resp, "Transfer-Encoding", "chunked")) { return true; }
+		for(auto const& field : resp.headerFields) {
+			if(utils::iequals(field.first, "Content-Length")) { return true; }
+		}
+		return false;
+	}
+
+	void sc::removeHopByHopFields(HTTPMessage& msg) {
+		for(auto it = msg.headerFields.begin(); it != msg.headerFields.end();) {
+			if(utils::iequals(it->first, "Connection") || utils::iequals(it->first, "Proxy-Connection") ||
+				utils::iequals(it->first, "Keep-Alive")) {
+				msg.headerFields.erase(it++);
+			} else {
+				++it;
+			}
+		}
+	}
+
 	HTTPStatus sc::buildStatusFromStr(const string& str) {
 		try {
 			vector<char> buffer(str.begin(), str.end());
@@ -1412,6 +1937,7 @@ namespace zq29Inner {
 	using zq29Inner::HTTPParser;
 	using zq29Inner::HTTPRequestParser;
 	using zq29Inner::HTTPStatusParser;
+	using zq29Inner::BodyFramer;
 
 	using namespace zq29Inner::utils;
 	using namespace zq29Inner::sc;
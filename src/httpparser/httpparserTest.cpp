@@ -639,6 +639,255 @@ void testSplitAndStrip() {
 	if(!failFlag) { Log::testSuccess(TAG); }
 }
 
+void testKeepAlive() {
+	const string TAG = "testKeepAlive";
+	bool failFlag = false;
+
+	auto const req = [](const string& version, const set<pair<string, string>>& h)->HTTPRequest {
+		HTTPRequest::RequestLine rl;
+		rl.method = "GET";
+		rl.requestTarget = "http://a.com/";
+		rl.httpVersion = version;
+		return HTTPRequest(rl, h, "");
+	};
+	auto const resp = [](const string& code, const set<pair<string, string>>& h)->HTTPStatus {
+		HTTPStatus::StatusLine sl;
+		sl.httpVersion = "HTTP/1.1";
+		sl.statusCode = code;
+		sl.reasonPhrase = "Foo";
+		return HTTPStatus(sl, h, "");
+	};
+
+	const vector<pair<bool, bool>> cases = {
+		{ wantsKeepAlive(req("HTTP/1.1", {})), true },
+		{ wantsKeepAlive(req("HTTP/1.1", { { "Connection", "Close" } })), false },
+		{ wantsKeepAlive(req("HTTP/1.1", { { "Proxy-Connection", "foo, close" } })), false },
+		{ wantsKeepAlive(req("HTTP/1.0", { { "Connection", "keep-alive" } })), false },
+		{ allowsKeepAlive(resp("200", { { "Content-Length", "0" } })), true },
+		{ allowsKeepAlive(resp("200", { { "Transfer-Encoding", "gzip, chunked" } })), true },
+		{ allowsKeepAlive(resp("304", {})), true },
+		{ allowsKeepAlive(resp("200", {})), false },
+		{ allowsKeepAlive(resp("200", { { "Content-Length", "0" }, { "connection", "close" } })), false },
+		// field names are case-insensitive
+		{ allowsKeepAlive(resp("200", { { "content-length", "0" } })), true },
+		{ allowsKeepAlive(resp("200", { { "transfer-encoding", "Chunked" } })), true }
+	};
+	for(size_t i = 0; i < cases.size(); i++) {
+		if(cases[i].first != cases[i].second) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("case ", i));
+		}
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+void testStreamingStatus() {
+	const string TAG = "testStreamingStatus";
+	bool failFlag = false;
+
+	// the head alone, then the body piece by piece
+	const string head = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n";
+	const string body = "4\r\nWiki\r\n5;ext=1\r\npedia\r\n0\r\nExpires: never\r\n\r\n";
+	const string next = "HTTP/1.1 304 Not Modified\r\n\r\n";
+	HTTPStatusParser p;
+	p.setBuffer(buildCharVec(head.substr(0, head.size() - 1)));
+	try {
+		p.buildHead();
+		failFlag = true;
+		Log::testFail(TAG, "built an incomplete head");
+	} catch(const HTTPParser::HTTPParserException& e) {}
+	if(p.getBuffer().size() != head.size() - 1) {
+		failFlag = true;
+		Log::testFail(TAG, "incomplete head was consumed");
+	}
+
+	p.setBuffer(buildCharVec(head + body.substr(0, 7)));
+	const HTTPStatus sta = p.buildHead();
+	if(sta.statusLine.statusCode != "200" || buildStrFromCharVec(p.getBuffer()) != body.substr(0, 7) ||
+		sta.headerFields.count(make_pair("Content-Length", "3")) != 0) {
+		failFlag = true;
+		Log::testFail(TAG, "buildHead");
+	}
+	BodyFramer framer = BodyFramer::forStatus(sta);
+	const string stream = body + next;
+	size_t total = 0;
+	for(size_t step : { (size_t)1, (size_t)3, stream.size() }) {
+		framer = BodyFramer::forStatus(sta);
+		total = 0;
+		for(size_t i = 0; i < stream.size() && !framer.done(); i += step) {
+			const size_t len = min(step, stream.size() - i);
+			const size_t used = framer.feed(stream.data() + i, len);
+			total += used;
+			if(used < len && !framer.done()) {
+				failFlag = true;
+				Log::testFail(TAG, "stopped before the end of the body");
+			}
+		}
+		if(!framer.done() || total != body.size()) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("chunked body in steps of ", step, ", got ", total, " bytes"));
+		}
+	}
+
+	// the other kinds
+	auto const resp = [](const string& code, const set<pair<string, string>>& h)->HTTPStatus {
+		HTTPStatus::StatusLine sl;
+		sl.httpVersion = "HTTP/1.1";
+		sl.statusCode = code;
+		sl.reasonPhrase = "Foo";
+		return HTTPStatus(sl, h, "");
+	};
+	framer = BodyFramer::forStatus(resp("200", { { "Content-Length", "5" } }));
+	if(framer.kind() != BodyFramer::LENGTH || framer.feed("abc", 3) != 3 || framer.done() ||
+		framer.feed("defg", 4) != 2 || !framer.done()) {
+		failFlag = true;
+		Log::testFail(TAG, "Content-Length");
+	}
+	if(!BodyFramer::forStatus(resp("304", { { "Content-Length", "5" } })).done() ||
+		BodyFramer::forStatus(resp("200", { { "Transfer-Encoding", "gzip" } })).kind() != BodyFramer::UNTIL_CLOSE ||
+		BodyFramer::forStatus(resp("200", {})).kind() != BodyFramer::UNTIL_CLOSE) {
+		failFlag = true;
+		Log::testFail(TAG, "no body, or until close");
+	}
+	// field names are case-insensitive, as they come from some servers
+	HTTPStatusParser lower;
+	lower.setBuffer(buildCharVec("HTTP/1.1 200 OK\r\ntransfer-encoding: gzip, Chunked\r\n\r\n"));
+	if(BodyFramer::forStatus(lower.buildHead()).kind() != BodyFramer::CHUNKED ||
+		BodyFramer::forStatus(resp("200", { { "content-length", "5" } })).kind() != BodyFramer::LENGTH ||
+		BodyFramer::forStatus(resp("200", { { "CONTENT-LENGTH", "5" } })).remaining() != 5) {
+		failFlag = true;
+		Log::testFail(TAG, "lowercase field names");
+	}
+	try {
+		BodyFramer::forStatus(resp("200", { { "Content-Length", "5" }, { "content-length", "6" } }));
+		failFlag = true;
+		Log::testFail(TAG, "accepted two Content-Length fields in different cases");
+	} catch(const HTTPParser::HTTPBadMessageException& e) {}
+	for(const string& bad : { string("-1"), string("1x"), string("") }) {
+		try {
+			BodyFramer::forStatus(resp("200", { { "Content-Length", bad } }));
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("accepted Content-Length <", bad, ">"));
+		} catch(const HTTPParser::HTTPBadMessageException& e) {}
+	}
+	for(const string& bad : { string("zz\r\n"), string("4\r\nWikiX\r\n"), string("4\nWiki") }) {
+		try {
+			BodyFramer(BodyFramer::CHUNKED).feed(bad.data(), bad.size());
+			failFlag = true;
+			Log::testFail(TAG, "accepted broken chunks");
+		} catch(const HTTPParser::HTTPBadMessageException& e) {}
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+void testStreamingRequest() {
+	const string TAG = "testStreamingRequest";
+	bool failFlag = false;
+
+	const string head = "POST http://a.com/ HTTP/1.1\r\nHost: a.com\r\nTransfer-Encoding: chunked\r\n\r\n";
+	const string body = "3\r\nabc\r\n0\r\n\r\n";
+	const string next = "GET http://a.com/ HTTP/1.1\r\n\r\n";
+	HTTPRequestParser p;
+	p.setBuffer(buildCharVec(head + body.substr(0, 4)));
+	const HTTPRequest req = p.buildHead();
+	if(req.requestLine.method != "POST" || buildStrFromCharVec(p.getBuffer()) != body.substr(0, 4)) {
+		failFlag = true;
+		Log::testFail(TAG, "buildHead");
+	}
+	BodyFramer framer = BodyFramer::forRequest(req);
+	const string stream = body.substr(4) + next;
+	if(framer.feed(body.data(), 4) != 4 || framer.feed(stream.data(), stream.size()) != body.size() - 4 ||
+		!framer.done()) {
+		failFlag = true;
+		Log::testFail(TAG, "chunked body");
+	}
+
+	// build() keeps the whole chunked body, the last empty line included
+	p.setBuffer(buildCharVec(head + body + next));
+	if(p.build().messageBody != body || buildStrFromCharVec(p.getBuffer()) != next) {
+		failFlag = true;
+		Log::testFail(TAG, "build");
+	}
+
+	auto const post = [](const set<pair<string, string>>& h)->HTTPRequest {
+		HTTPRequest::RequestLine rl;
+		rl.method = "POST";
+		rl.requestTarget = "http://a.com/";
+		rl.httpVersion = "HTTP/1.1";
+		return HTTPRequest(rl, h, "");
+	};
+	if(BodyFramer::forRequest(post({})).kind() != BodyFramer::NONE ||
+		BodyFramer::forRequest(post({ { "Content-Length", "7" } })).kind() != BodyFramer::LENGTH) {
+		failFlag = true;
+		Log::testFail(TAG, "no body, or Content-Length");
+	}
+	if(BodyFramer::forRequest(post({ { "transfer-encoding", "chunked" } })).kind() != BodyFramer::CHUNKED ||
+		BodyFramer::forRequest(post({ { "content-length", "7" } })).remaining() != 7) {
+		failFlag = true;
+		Log::testFail(TAG, "lowercase field names");
+	}
+	for(auto const& h : { make_pair(string("Transfer-Encoding"), string("gzip")),
+		make_pair(string("Content-Length"), string("x")), make_pair(string("transfer-encoding"), string("gzip")) }) {
+		try {
+			BodyFramer::forRequest(post({ h }));
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("accepted <", h.first, ": ", h.second, ">"));
+		} catch(const HTTPRequestParser::HTTP400Exception& e) {}
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * the pieces of serialize() make up toStr(), and the body is not a copy
+*/
+void testSerialize() {
+	const string TAG = "testSerialize";
+	bool failFlag = false;
+
+	HTTPStatus::StatusLine sl;
+	sl.httpVersion = "HTTP/1.1";
+	sl.statusCode = "200";
+	sl.reasonPhrase = "OK";
+	const HTTPStatus sta(sl, { { "Content-Length", "5" }, { "Via", "zq29" } }, "hello");
+	HTTPRequest::RequestLine rl;
+	rl.method = "POST";
+	rl.requestTarget = "http://a.com/";
+	rl.httpVersion = "HTTP/1.1";
+	const HTTPRequest req(rl, { { "Host", "a.com" } }, "x=1");
+	const HTTPRequest noBody(rl, {}, "");
+
+	const vector<pair<const HTTPMessage*, string>> cases = {
+		{ &sta, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nVia: zq29\r\n\r\nhello" },
+		{ &req, "POST http://a.com/ HTTP/1.1\r\nHost: a.com\r\n\r\nx=1" },
+		{ &noBody, "POST http://a.com/ HTTP/1.1\r\n\r\n" }
+	};
+	for(auto const& c : cases) {
+		const HTTPMessage::Serialized wire = c.first->serialize();
+		const vector<iovec> iov = wire.iov();
+		string joined;
+		for(auto const& v : iov) { joined.append((const char*)v.iov_base, v.iov_len); }
+		if(joined != c.second || c.first->toStr() != c.second || wire.size() != c.second.size()) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("got <", joined, ">"));
+		}
+		const size_t expectedCount = c.first->messageBody.empty() ? 2 : 3;
+		if(iov.size() != expectedCount ||
+			(expectedCount == 3 && iov[2].iov_base != (void*)c.first->messageBody.data())) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg(iov.size(), " pieces, or the body was copied"));
+		}
+	}
+	if(sta.headerToStr() != "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nVia: zq29\r\n\r\n") {
+		failFlag = true;
+		Log::testFail(TAG, "headerToStr");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
 int main() {
 	testHexParsing();
 	HTTPParserTest().doTest();
@@ -646,4 +895,8 @@ int main() {
 	HTTPStatusParserTest().doTest();
 	//proxyTest();
 	testSplitAndStrip();
+	testKeepAlive();
+	testStreamingStatus();
+	testStreamingRequest();
+	testSerialize();
 }
\ No newline at end of file
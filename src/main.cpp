@@ -4,21 +4,44 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <unistd.h>
 #include "httpparser/httpparser.hpp"
 #include "cache/httpproxycache.hpp"
+#include "cache/cachewriter.hpp"
+#include "cache/collapser.hpp"
+#include "eventloop/eventloop.hpp"
+#include "eventloop/fiber.hpp"
+#include "upstream/connpool.hpp"
+#include "upstream/resolver.hpp"
+#include "upstream/happyeyeballs.hpp"
+#include "tunnel/tunnelmanager.hpp"
+#include "bufferpool/bufferpool.hpp"
+#include "backpressure/boundedpipe.hpp"
+#include "admission/admission.hpp"
+#include "handoff/handoff.hpp"
+#include "threadpool/threadpool.hpp"
+#include "config.hpp"
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <memory>
+#include <unordered_map>
 
 #define BACKLOG 500
-#define RETRY 2000
+#define MAX_HEAD_SIZE (64 * 1024)
+#define MAX_LOOP_BODY_SIZE (64 * 1024) // of a request that is not a POST
+#define RELAY_BUFFER_SIZE (64 * 1024)
+#define DRAIN_POLL_MS 50
 
 using namespace zq29;
 using namespace std;
@@ -27,8 +50,88 @@ using namespace std;
 
 class Proxy {
 private:
-	int listen_fd;
 	char port_num[NI_MAXSERV];
+	const Config config;
+	UpstreamPool upstreams;
+	DnsCache dns;
+	Collapser collapser;
+	MemoryBudget relayBudget; // of every BoundedPipe
+	AdmissionController admission;
+	const vector<string> args; // of main, to start the next proxy
+	int signal_fd;
+	int handoff_fd; // -1 if there is none
+	bool drainingAll;
+
+	/*
+	 * buffer: what came after the head once there is one
+	 * searched: no head end before that
+	 * head: of the request, null until it is complete
+	 * framer: of its body, framed: bytes of the buffer it went through
+	*/
+	struct ClientConn {
+		vector<char> buffer;
+		size_t searched;
+		unique_ptr<HTTPRequest> head;
+		BodyFramer framer;
+		size_t framed;
+		EventLoop::TimerId idleTimer; // 0 if none
+		bool fresh; // no request from it yet
+	};
+
+	/*
+	 * a complete request, and whatever the client sent after it
+	 * queuedAt: when it was complete, its wait for a handler starts there
+	*/
+	struct PendingRequest {
+		int client_fd;
+		HTTPRequest req;
+		vector<char> leftover;
+		AdmissionController::Clock::time_point queuedAt;
+	};
+
+	/*
+	 * a listening socket with everything needed to serve it
+	 *
+	 * the event loop owns the listening socket and every client socket
+	 * until a complete request has been read from it, so idle clients
+	 * cost a few bytes of buffer instead of a thread
+	 *
+	 * handlers run in the shard's pool, or as fibers on the shard's loop,
+	 * see Config for the overload policy
+	 * CONNECT tunnels, once established, are relayed by the loop itself
+	 * under PAUSE_ACCEPT, requests that did not fit in the queue wait in
+	 * pendingRequests (in arrival order) and accept() is not called
+	 * until a worker or a fiber slot is free
+	 * requests that waited too long for one are shed once a handler picks
+	 * them up, see admitUpstream
+	 *
+	 * with more than one shard, every shard has its own SO_REUSEPORT
+	 * listener and the kernel spreads new connections over them
+	 *
+	 * a draining shard accepts nothing, and its loop stops once the last
+	 * handler, client and tunnel is gone, see drain
+	*/
+	struct Shard {
+		int listen_fd;
+		int core; // -1 if not pinned
+		EventLoop loop;
+		unique_ptr<TunnelManager> tunnels;
+		unordered_map<int, ClientConn> clients;
+		unique_ptr<WorkerPool> pool;
+		bool acceptPaused;
+		deque<PendingRequest> pendingRequests;
+		size_t fibers; // running handlers, fiber mode only
+		size_t maxFibers;
+		atomic<size_t> handlers; // running handlers, both modes
+		bool draining;
+		chrono::steady_clock::time_point drainDeadline;
+		bool drainedInTime;
+
+		Shard(const bool ioUring) :
+			listen_fd(-1), core(-1), loop(ioUring), acceptPaused(false), fibers(0), maxFibers(0),
+			handlers(0), draining(false), drainedInTime(true) {}
+	};
+	vector<unique_ptr<Shard>> shards;
 
 	string getPeerIpBySocket(const int socketFd) {
 		sockaddr_in sin;
@@ -42,14 +145,8 @@ private:
 	}
 
 	void sendAll(const int socketFd, const char* const buffer, const size_t len) {
-		size_t nSentBytes = 0;
-		while(nSentBytes < len) {
-			size_t tempN = send(socketFd, buffer + nSentBytes, len - nSentBytes, 0);
-			if(tempN < 0) {
-				throw runtime_error("failed to sendAll");
-				return;
-			}
-			nSentBytes += tempN;
+		if(asyncSend(socketFd, buffer, len) < 0) {
+			throw runtime_error(Log::msg("failed to sendAll: ", strerror(errno)));
 		}
 	}
 
@@ -58,88 +155,333 @@ private:
 		sendAll(socketFd, (char*)(&msg[0]), msg.length());
 	}
 
+	/*
+	 * like sendAll, for a message in pieces, see HTTPMessage::serialize
+	*/
+	void sendAllv(const int socketFd, const vector<iovec>& iov) {
+		if(asyncSendv(socketFd, iov.data(), iov.size()) < 0) {
+			throw runtime_error(Log::msg("failed to sendAllv: ", strerror(errno)));
+		}
+	}
+
+	/*
+	 * resolver of the config, getaddrinfo unless a hosts file is given
+	*/
+	static unique_ptr<Resolver> createResolver(const Config& c) {
+		if(!c.dnsHostsFile.empty()) {
+			try {
+				return unique_ptr<Resolver>(new HostsFileResolver(c.dnsHostsFile, c.dnsTtl));
+			} catch(const exception& e) {
+				Log::warning(Log::msg(e.what(), ", use getaddrinfo instead"));
+			}
+		}
+		return unique_ptr<Resolver>(new SystemResolver(c.dnsTtl));
+	}
+
 	int connectServer(const char* hostname, const char* port) {
-		int server_fd;
-		struct addrinfo hostInfo;
-		struct addrinfo* hostInfoList;
-		memset(&hostInfo, 0, sizeof(hostInfo));
-		hostInfo.ai_family = AF_UNSPEC; 
-		hostInfo.ai_socktype = SOCK_STREAM;
-		hostInfo.ai_flags = AI_NUMERICSERV;
-		if(getaddrinfo(hostname, port, &hostInfo, &hostInfoList) != 0) {
+		vector<SockAddr> addresses;
+		const int status = dns.lookup(hostname, port, addresses);
+		if(status != 0) {
+			Log::debug(Log::msg("cannot resolve <", hostname, ">, ", gai_strerror(status)));
 			return -1;
 		}
-		struct addrinfo* p;
-		for(p = hostInfoList; p != NULL; p = p->ai_next) {
-			server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-			if(server_fd < 0) {
+		const int server_fd = connectAny(addresses, config.connectAttemptDelay, config.connectTimeout);
+		if(server_fd < 0) {
+			Log::debug(Log::msg("cannot connect to <", hostname, ":", port, ">, ", strerror(errno)));
+		}
+		return server_fd;
+	}
+
+	/*
+	 * receive the head of a response, body is set to what came after it
+	 * the bytes go straight into one pooled buffer of MAX_HEAD_SIZE,
+	 * a head that does not fit in it is refused
+	 * interim 1xx responses are skipped, the client gets the final one
+	 * returns HTTPStatus() if the head is bad, too large, or never comes,
+	 * config.upstreamReadTimeout is how long it may take between two reads
+	*/
+	HTTPStatus recvHead(const int server_fd, vector<char>& body) {
+		const char crlf2[] = "\r\n\r\n";
+		BufferPool::Buffer buffer = BufferPool::acquire(MAX_HEAD_SIZE);
+		char* const data = buffer.data();
+		size_t used = 0;
+		size_t searched = 0; // no head end before that
+		while(true) {
+			const char* const end = search(data + searched, data + used, crlf2, crlf2 + 4);
+			if(end == data + used) {
+				if(used == buffer.capacity()) {
+					Log::warning("The response head is too large");
+					return HTTPStatus();
+				}
+				searched = used < 3 ? 0 : used - 3;
+				const ssize_t len = asyncRecv(server_fd, data + used, buffer.capacity() - used,
+					config.upstreamReadTimeout);
+				if(len <= 0) {
+					if(len < 0 && errno == ETIMEDOUT) { Log::warning("the server did not answer in time"); }
+					return HTTPStatus();
+				}
+				used += len;
 				continue;
 			}
-			if(connect(server_fd, p->ai_addr, p->ai_addrlen) < 0) {
-				continue;
+			const size_t headSize = end + 4 - data;
+			HTTPStatusParser staParser;
+			staParser.setBuffer(vector<char>(data, data + headSize));
+			HTTPStatus head;
+			try {
+				head = staParser.buildHead();
+			} catch(const exception& e) {
+				Log::debug(Log::msg("error in recvHead(): ", e.what()));
+				return HTTPStatus();
 			}
-			// here it means socket was created and successfully connected
-			// set result
-			freeaddrinfo(hostInfoList);
-			return server_fd;
+			memmove(data, data + headSize, used - headSize);
+			used -= headSize;
+			searched = 0;
+			const string& code = head.statusLine.statusCode;
+			if(code[0] == '1' && code != "101") { continue; }
+			body.assign(data, data + used);
+			return head;
 		}
-		freeaddrinfo(hostInfoList);
-		return -1; // this doesn't matter now
 	}
 
-	int recvAppend(const int socketFd, vector<char>& buffer) {
-		const size_t bufferSize = 16 * 1024 * 1024;
-		shared_ptr<char[]> charbuffer(new char[bufferSize]);
-		int len = recv(socketFd, charbuffer.get(), bufferSize, 0);
-		if(len <= 0) { return len; }
-		const vector<char> temp(charbuffer.get(), charbuffer.get() + len);
-		buffer.insert(buffer.end(), temp.begin(), temp.end());
-		return len;
+	/*
+	 * a connection to host:port, an idle one from the pool if allowPooled
+	*/
+	int connectUpstream(const char* host, const char* port, const bool allowPooled, bool& reused) {
+		if(allowPooled) {
+			const int fd = upstreams.acquire(host, port);
+			if(fd >= 0) {
+				reused = true;
+				return fd;
+			}
+		}
+		reused = false;
+		return connectServer(host, port);
 	}
 
-	HTTPRequest recvRequest(const int client_fd) {
-		HTTPRequestParser reqParser1st;
-		HTTPRequest req1st;
-		vector<char> buffer1st;
-		for(int _ = 0; _ < RETRY; _++) {
-			if(recvAppend(client_fd, buffer1st) < 0) { break; }
-			reqParser1st.setBuffer(buffer1st);
+	/*
+	 * server_fd is at a message boundary after resp,
+	 * keep it for the next request if the server agrees
+	*/
+	void releaseUpstream(const char* host, const char* port, const int server_fd, const HTTPStatus& resp) {
+		if(allowsKeepAlive(resp)) {
+			upstreams.release(host, port, server_fd);
+		} else {
+			close(server_fd);
+		}
+	}
+
+	/*
+	 * send req to the server and receive the head of the response,
+	 * body is set to whatever part of the body came with it,
+	 * relayStatus forwards the rest
+	 *
+	 * a pooled connection may have been closed by the server right before
+	 * we used it, in which case req is sent again on a new connection
+	 * and server_fd is updated, so only idempotent requests should use one
+	 *
+	 * throws if sending fails, returns HTTPStatus() if the response is bad
+	*/
+	HTTPStatus exchange(int& server_fd, const bool reused, const char* host, const char* port, HTTPRequest req,
+		vector<char>& body) {
+		removeHopByHopFields(req);
+		const HTTPMessage::Serialized wire = req.serialize();
+		if(reused) {
 			try {
-				req1st = reqParser1st.build();
-				return req1st;
-			}
-			catch(const HTTPParser::HTTPParserException& e) {}
-			catch(const HTTPStatusParser::StatusNotCompleteException& e) {}
-			catch(const exception& e) {
-				Log::debug(Log::msg("error in handleRequest(): ", e.what()));
-				throw;
+				sendAllv(server_fd, wire.iov());
+				const HTTPStatus status = recvHead(server_fd, body);
+				if(!(status == HTTPStatus())) { return status; }
+			} catch(const exception& e) {}
+			Log::debug("in exchange(): pooled connection is dead, retry on a new one");
+			close(server_fd);
+			server_fd = connectServer(host, port);
+			if(server_fd == -1) {
+				throw runtime_error("failed to connect to server");
 			}
 		}
-		return HTTPRequest();
+		sendAllv(server_fd, wire.iov());
+		return recvHead(server_fd, body);
 	}
 
-	HTTPStatus recvStatus(const int server_fd) {
-		HTTPStatusParser staParser;
-		HTTPStatus sta;
-		vector<char> buffer;
-		for(int _ = 0; _ < RETRY; _++) {
-			if(_ != 0 && _ % (RETRY / 10) == 0) {
-				Log::warning("We detected a very large response, please wait...");
+	/*
+	 * send head to the client, then its body as it comes from the server,
+	 * beginning with body, what exchange already got
+	 * the body goes through a BoundedPipe, a slow client holds the server
+	 * back at the watermarks of the config, every body byte also goes to
+	 * writer (if any), which commits once the body is complete
+	 * flight (if any) is told how it went, and gets the response too if
+	 * its followers can stream it, see Collapser
+	 * if the client goes away but the flight has followers, the rest of
+	 * the body is still read, for them and for the cache
+	 * a server that stops sending for config.upstreamReadTimeout fails it
+	 *
+	 * server_fd is closed, or pooled if the body ended at a message boundary
+	 * returns true if the client got a complete response that allows
+	 * its connection to carry another request
+	*/
+	bool relayStatus(const char* host, const char* port, const int server_fd, const int client_fd,
+		const HTTPStatus& head, const vector<char>& body, CacheWriter* writer, Collapser::Flight* flight = nullptr) {
+		BodyFramer framer;
+		try {
+			framer = BodyFramer::forStatus(head);
+		} catch(const exception& e) {
+			close(server_fd);
+			try {
+				sendAll(client_fd, getHTTP502HTMLStr(e.what()));
+			} catch(...) {}
+			return false;
+		}
+
+		// followers only stream bodies that will be kept whole anyway, and
+		// that the relay budget can hold while they are read
+		// the others wait for the cache, or for nothing if it won't be cached
+		bool live = false;
+		if(flight != nullptr) {
+			const bool cached = writer != nullptr && writer->collecting();
+			live = cached && (framer.kind() == BodyFramer::NONE ||
+				(framer.kind() == BodyFramer::LENGTH && framer.remaining() <= config.cacheMaxObject));
+			if(live && !flight->reserve(relayBudget, framer.kind() == BodyFramer::LENGTH ? framer.remaining() : 0)) {
+				Log::debug("in relayStatus(): no budget to stream the body to the followers");
+				live = false;
+			}
+			if(live) {
+				flight->publishHead(head);
+			} else if(!cached) {
+				flight->finish(Collapser::Flight::FAILED);
+			}
+		}
+
+		bool complete = false;
+		bool atBoundary = false;
+		bool clientLeft = false;
+		// every body byte the server sends goes through here first
+		auto const take = [&](const char* data, const size_t len) {
+			const size_t used = framer.feed(data, len);
+			if(used > 0 && writer != nullptr) { writer->write(data, used); }
+			if(live) { flight->append(data, used); }
+			if(framer.done()) {
+				complete = true;
+				atBoundary = used == len;
+			}
+			return used;
+		};
+		try {
+			// the head and what came with it in one go
+			const size_t used = take(body.data(), body.size());
+			const HTTPMessage::Serialized wire = head.serialize();
+			vector<iovec> iov = wire.iov();
+			if(used > 0) {
+				iovec v;
+				v.iov_base = (void*)body.data();
+				v.iov_len = used;
+				iov.push_back(v);
 			}
-			if(recvAppend(server_fd, buffer) < 0) { break; }
-			staParser.setBuffer(buffer);
 			try {
-				sta = staParser.build();
-				return sta;
+				sendAllv(client_fd, iov);
 			} catch(const exception& e) {
-				Log::debug(Log::msg("error in handleRequest(): ", e.what()));
+				clientLeft = true;
+				Log::debug(Log::msg("in relayStatus(): ", e.what()));
 			}
+
+			if(!complete && !clientLeft) {
+				BoundedPipe pipe(server_fd, client_fd,
+					{ config.relayHighWatermark, config.relayLowWatermark }, relayBudget, RELAY_BUFFER_SIZE,
+					config.upstreamReadTimeout);
+				const BoundedPipe::Result result = pipe.run([&](const char* data, const size_t len, bool& more) {
+					const size_t used = take(data, len);
+					more = !complete;
+					return used;
+				});
+				if(result == BoundedPipe::FROM_CLOSED && framer.kind() == BodyFramer::UNTIL_CLOSE) {
+					complete = true;
+				} else if(result == BoundedPipe::FROM_FAILED && errno == ETIMEDOUT) {
+					Log::warning("the server stalled in the middle of a response");
+				} else if(result == BoundedPipe::FROM_CLOSED || result == BoundedPipe::FROM_FAILED) {
+					Log::warning("the server went away in the middle of a response");
+				} else if(result == BoundedPipe::TO_FAILED) {
+					clientLeft = true;
+					Log::debug("in relayStatus(): the client went away");
+				}
+			}
+
+			// one client going away must not cut the response for the others
+			const bool shared = live || (writer != nullptr && writer->collecting());
+			if(clientLeft && !complete && shared && flight != nullptr && flight->hasFollowers()) {
+				Log::debug("in relayStatus(): finish the fetch for the followers");
+				BufferPool::Buffer buffer = BufferPool::acquire(RELAY_BUFFER_SIZE);
+				while(!complete) {
+					const ssize_t len = asyncRecv(server_fd, buffer.data(), buffer.capacity(), config.upstreamReadTimeout);
+					if(len == 0 && framer.kind() == BodyFramer::UNTIL_CLOSE) {
+						complete = true;
+					} else if(len <= 0) {
+						Log::warning("the server went away in the middle of a response");
+						break;
+					} else {
+						take(buffer.data(), len);
+					}
+				}
+			}
+		} catch(const exception& e) {
+			complete = false;
+			Log::debug(Log::msg("in relayStatus(): ", e.what()));
 		}
-		Log::warning("The response is bad or too large");
-		return HTTPStatus();
+
+		if(complete && atBoundary) {
+			releaseUpstream(host, port, server_fd, head);
+		} else {
+			close(server_fd);
+		}
+		if(!complete) {
+			if(flight != nullptr) { flight->finish(Collapser::Flight::FAILED); }
+			return false;
+		}
+		const string saved = writer != nullptr ? writer->commit() : Cache::noid;
+		if(flight != nullptr) {
+			flight->finish(live || saved != Cache::noid ? Collapser::Flight::CACHED : Collapser::Flight::FAILED);
+		}
+		return !clientLeft && allowsKeepAlive(head); // the client did not get it all otherwise
+	}
+
+	/*
+	 * send a cached response, its head as it was stored, then its body
+	 * straight from the file with sendfile, it never comes into our memory
+	 * throws if the client can't take it
+	*/
+	void sendStored(const int client_fd, const HTTPProxyCache::StoredResponse& stored) {
+		sendAll(client_fd, stored.head());
+		if(asyncSendFile(client_fd, stored.fd(), stored.bodyOffset(), stored.bodyLength()) < 0) {
+			throw runtime_error(Log::msg("failed to send a cached body: ", strerror(errno)));
+		}
+	}
+
+	/*
+	 * a request is about to go to a server, late if it waited too long
+	 * for its handler, see AdmissionController
+	 * returns false if it is not admitted, the client got a 503 then
+	 * slot: held by the request while it is in flight
+	*/
+	bool admitUpstream(const string& id, const int client_fd, const bool late, AdmissionController::Slot& slot) {
+		if(!config.admission) { return true; }
+		slot = admission.admit(late);
+		if(slot) { return true; }
+		Log::debug(Log::msg("in admitUpstream(): shed, ", admission.inflight(), " in flight, ",
+			late ? "waited too long" : "too many"));
+		try {
+			Log::proxy(Log::msg(
+				id, ": Responding \"",
+				"HTTP/1.1 503 Service Unavailable" ,"\""
+			));
+			sendAll(client_fd, getHTTP503HTMLStr("The proxy is overloaded, please retry later", config.retryAfter));
+		} catch(...) {}
+		return false;
 	}
 
-	void handleGET(const HTTPRequest& req, string id, const int client_fd, const string& reqLine, const string& peerIp) {
+	/*
+	 * handlers return true if they sent a complete response that
+	 * allows the client connection to carry another request
+	 * late: see admitUpstream
+	*/
+	bool handleGET(const HTTPRequest& req, string id, const int client_fd, const string& reqLine, const string& peerIp,
+		const bool late) {
 		auto consRespResult = HTTPProxyCache::getInstance().constructResponse(req);
 		if(consRespResult.id != Cache::noid) {
 			id = consRespResult.id; // override id
@@ -151,17 +493,127 @@ private:
 		));
 
 		if(consRespResult.action == 0) {
+			return serveFromCache(id, client_fd, consRespResult);
+		}
+
+		// misses and revalidations of one URL go to the server once
+		Collapser::Ticket ticket;
+		if(config.collapse) {
+			ticket = collapser.join(req.requestLine.toStr());
+			if(!ticket.leader()) {
+				return followFlight(req, id, client_fd, consRespResult, ticket.flight(), late);
+			}
+		}
+
+		// hits and followers are served whatever the load, the rest needs a server
+		AdmissionController::Slot slot;
+		if(!admitUpstream(id, client_fd, late, slot)) {
+			return false;
+		}
+		return fetchGET(req, id, client_fd, consRespResult, ticket.flight().get());
+	}
+
+	/*
+	 * action 0 of HTTPProxyCache::constructResponse
+	*/
+	bool serveFromCache(const string& id, const int client_fd, const HTTPProxyCache::ConsRespResult& consRespResult) {
+		Log::proxy(Log::msg(
+			id, ": in cache, valid"
+		));
+		Log::debug("in handleRequest(): Send back content from cache");
+		sendStored(client_fd, *consRespResult.stored);
+		Log::proxy(Log::msg(
+			id, ": Responding \"",
+			consRespResult.resp.statusLine.toStr(), "\""
+		));
+		return allowsKeepAlive(consRespResult.resp);
+	}
+
+	/*
+	 * another client is already fetching req, wait for it instead of
+	 * asking the server again, see Collapser
+	 * waiting holds no admission slot, only a fetch of its own does
+	 * a leader that gets no head for as long as it may take to connect and
+	 * read one is given up on, the request is fetched alone then
+	 * late: see admitUpstream
+	*/
+	bool followFlight(const HTTPRequest& req, const string& id, const int client_fd,
+		const HTTPProxyCache::ConsRespResult& consRespResult, const shared_ptr<Collapser::Flight>& flight,
+		const bool late) {
+		Log::proxy(Log::msg(
+			id, ": the same request is in flight, waiting for it"
+		));
+		auto const fetchAlone = [&](const HTTPProxyCache::ConsRespResult& result) {
+			AdmissionController::Slot slot;
+			if(!admitUpstream(id, client_fd, late, slot)) {
+				return false;
+			}
+			return fetchGET(req, id, client_fd, result, nullptr);
+		};
+		Collapser::Follower follower(flight);
+		switch(follower.waitForHead(config.connectTimeout + config.upstreamReadTimeout)) {
+		case Collapser::Flight::PENDING:
 			Log::proxy(Log::msg(
-				id, ": in cache, valid"
-			));
-			Log::debug("in handleRequest(): Send back content from cache");
-			const string respStr = consRespResult.resp.toStr();
-			sendAll(client_fd, respStr);
-			Log::proxy(Log::msg(
-				id, ": Responding \"",
-				consRespResult.resp.statusLine.toStr(), "\""
+				id, ": the request in flight is stuck, asking the server"
 			));
-		} else if(consRespResult.action == 1) {
+			return fetchAlone(consRespResult);
+		case Collapser::Flight::LIVE:
+			return relayFlight(id, client_fd, follower);
+		case Collapser::Flight::CACHED: {
+			const auto again = HTTPProxyCache::getInstance().constructResponse(req);
+			if(again.action == 0) {
+				return serveFromCache(id, client_fd, again);
+			}
+			return fetchAlone(again);
+		}
+		case Collapser::Flight::NOT_MODIFIED:
+			if(consRespResult.stored != nullptr) {
+				return serveFromCache(id, client_fd, consRespResult);
+			}
+			break;
+		default:
+			break;
+		}
+		Log::proxy(Log::msg(
+			id, ": nothing to share in flight, asking the server"
+		));
+		return fetchAlone(consRespResult);
+	}
+
+	/*
+	 * send the response that the leader of a flight is relaying
+	*/
+	bool relayFlight(const string& id, const int client_fd, Collapser::Follower& follower) {
+		const HTTPStatus& head = follower.head();
+		Log::proxy(Log::msg(
+			id, ": Responding \"",
+			head.statusLine.toStr() ,"\""
+		));
+		try {
+			sendAllv(client_fd, head.serialize().iov());
+			BufferPool::Buffer buffer = BufferPool::acquire(RELAY_BUFFER_SIZE);
+			while(true) {
+				const ssize_t len = follower.read(buffer.data(), buffer.capacity(), config.upstreamReadTimeout);
+				if(len == 0) { return allowsKeepAlive(head); }
+				if(len < 0) {
+					Log::warning("the response in flight was cut in the middle");
+					return false;
+				}
+				sendAll(client_fd, buffer.data(), len);
+			}
+		} catch(const exception& e) {
+			Log::debug(Log::msg("in relayFlight(): ", e.what()));
+		}
+		return false;
+	}
+
+	/*
+	 * action 1 and 2 of HTTPProxyCache::constructResponse
+	 * flight: the one this request leads, if any
+	*/
+	bool fetchGET(const HTTPRequest& req, const string& id, const int client_fd,
+		const HTTPProxyCache::ConsRespResult& consRespResult, Collapser::Flight* flight) {
+		if(consRespResult.action == 1) {
 			Log::proxy(Log::msg(
 				id, ": not in cache"
 			));
@@ -170,20 +622,23 @@ private:
 			HTTPRequestParser::AbsoluteForm af = HTTPRequestParser::parseAbsoluteForm(req);
 			const char* addr = af.authorityForm.host.c_str();
 			const char* port = af.authorityForm.port == "" ? "80" : af.authorityForm.port.c_str();
-			int server_fd = connectServer(addr, port);
+			bool reused = false;
+			int server_fd = connectUpstream(addr, port, true, reused);
 			if (server_fd == -1) {
 				Log::warning("failed to connect to server, ignore this request");
-				return;
+				return false;
 			}
 			
 			// contact server
+			HTTPStatus status;
+			vector<char> body;
 			try {
 				Log::proxy(Log::msg(
 					id, ": Requesting \"", 
 					req.requestLine.toStr(), 
 					"\" from ", addr
 				));
-				sendAll(server_fd, req.toStr());
+				status = exchange(server_fd, reused, addr, port, req, body);
 			} catch(const exception& e) {
 				close(server_fd);
 				try {
@@ -193,11 +648,10 @@ private:
 						"HTTP/1.1 502 Bad Gateway" ,"\""
 					));
 				} catch(...) {}
-				return;
+				return false;
 			}
 
 			// send response to client
-			const HTTPStatus status = recvStatus(server_fd);
 			Log::proxy(Log::msg(
 				id, ": Received \"",
 				status.statusLine.toStr(),
@@ -205,34 +659,23 @@ private:
 			));
 
 			if(status == HTTPStatus()) {
+				close(server_fd);
 				try {
 					sendAll(client_fd, getHTTP502HTMLStr("Received illegal response from server"));
 					Log::proxy(Log::msg(
 						id, ": Responding \"",
 						"HTTP/1.1 502 Bad Gateway" ,"\""
 					));
-				} catch(...) {
-					close(server_fd);
-				}
-				return;
+				} catch(...) {}
+				return false;
 			}
 
-			HTTPProxyCache::getInstance().save(req, status, id);
 			Log::proxy(Log::msg(
 				id, ": Responding \"",
 				status.statusLine.toStr() ,"\""
 			));
-			sendAll(client_fd, status.toStr());
-
-			// TODO
-			/*
-			while ((msg_len = recv(server_fd, response_buffer, sizeof(response_buffer), 0)) > 0) {
-				send(client_fd, response_buffer, msg_len, MSG_NOSIGNAL);
-			}
-			*/
-			//close(client_fd);
-			//close(server_fd);
-			close(server_fd);
+			CacheWriter writer(HTTPProxyCache::getInstance(), req, status, id, config.cacheMaxObject);
+			return relayStatus(addr, port, server_fd, client_fd, status, body, &writer, flight);
 
 		} else if(consRespResult.action == 2) {
 			Log::proxy(Log::msg(
@@ -242,19 +685,22 @@ private:
 			HTTPRequestParser::AbsoluteForm af = HTTPRequestParser::parseAbsoluteForm(req);
 			const char* addr = af.authorityForm.host.c_str();
 			const char* port = af.authorityForm.port == "" ? "80" : af.authorityForm.port.c_str();
-			int server_fd = connectServer(addr, port);
+			bool reused = false;
+			int server_fd = connectUpstream(addr, port, true, reused);
 			if (server_fd == -1) {
 				Log::warning("failed to connect to server, ignore this request");
-				return;
+				return false;
 			}
 			// send re-validation to server
+			HTTPStatus sta;
+			vector<char> body;
 			try {
 				Log::proxy(Log::msg(
 					id, ": Requesting \"", 
 					consRespResult.validationReq.requestLine.toStr(), 
 					"\" from ", addr
 				));
-				sendAll(server_fd, consRespResult.validationReq.toStr());
+				sta = exchange(server_fd, reused, addr, port, consRespResult.validationReq, body);
 			} catch(const exception& e) {
 				close(server_fd);
 				try {
@@ -263,14 +709,11 @@ private:
 						"HTTP/1.1 502 Bad Gateway" ,"\""
 					));
 					sendAll(client_fd, getHTTP502HTMLStr(e.what()));
-				} catch(...) {
-					close(client_fd);
-				}
-				return;
+				} catch(...) {}
+				return false;
 			}
 
 			// get reuslt from server
-			const HTTPStatus sta = recvStatus(server_fd);
 			Log::proxy(Log::msg(
 				id, ": Received \"",
 				sta.statusLine.toStr(),
@@ -284,59 +727,118 @@ private:
 						"HTTP/1.1 502 Bad Gateway" ,"\""
 					));
 					sendAll(client_fd, getHTTP502HTMLStr("while revalidating, we don't understand what server said"));
-				} catch(...) {
-					close(client_fd);
-				}
-				return;
+				} catch(...) {}
+				return false;
 			}
 
 			// result is either 304 or 200
 			if(sta.statusLine.statusCode == "200") {
-				HTTPProxyCache::getInstance().save(req, sta);
-				try {
-					Log::proxy(Log::msg(
-						id, ": Responding \"",
-						sta.statusLine.toStr() ,"\""
-					));
-					sendAll(client_fd, sta.toStr());
-				} catch(...) {
-					close(client_fd);
-					return;
-				}
+				Log::proxy(Log::msg(
+					id, ": Responding \"",
+					sta.statusLine.toStr() ,"\""
+				));
+				CacheWriter writer(HTTPProxyCache::getInstance(), req, sta, Cache::noid, config.cacheMaxObject);
+				return relayStatus(addr, port, server_fd, client_fd, sta, body, &writer, flight);
 			} else if(sta.statusLine.statusCode == "304") {
+				// no body, section 3.3.3 rule 1
+				if(body.empty()) {
+					releaseUpstream(addr, port, server_fd, sta);
+				} else {
+					close(server_fd);
+				}
+				if(flight != nullptr) { flight->finish(Collapser::Flight::NOT_MODIFIED); }
 				try {
 					Log::proxy(Log::msg(
 						id, ": Responding \"",
 						consRespResult.resp.statusLine.toStr() ,"\""
 					));
-					sendAll(client_fd, consRespResult.resp.toStr());
+					sendStored(client_fd, *consRespResult.stored);
 				} catch(...) {
-					close(client_fd);
-					return;
-				}	
+					return false;
+				}
+				return allowsKeepAlive(consRespResult.resp);
 			} else {
+				close(server_fd);
 				try {
 					Log::proxy(Log::msg(
 						id, ": Responding \"",
 						"HTTP/1.1 502 Bad Gateway" ,"\""
 					));
 					sendAll(client_fd, getHTTP502HTMLStr("while revalidating, server returned neither 200 nor 304"));
-				} catch(...) {
-					close(client_fd);
-					return;
+				} catch(...) {}
+				return false;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 * forward a request body from client_fd to server_fd as it arrives,
+	 * beginning with what the loop already read, in leftover
+	 * one read is buffered at most: the client is not read from until
+	 * the server took the bytes before, so a slow server slows the
+	 * client down instead of filling our memory
+	 *
+	 * leftover is set to what the client sent after the body
+	 * returns false if the client went away or sent a broken body,
+	 * throws if the server can't take it
+	*/
+	bool forwardBody(const int client_fd, const int server_fd, BodyFramer& framer, vector<char>& leftover) {
+		try {
+			const size_t used = framer.feed(leftover.data(), leftover.size());
+			sendAll(server_fd, leftover.data(), used);
+			leftover.erase(leftover.begin(), leftover.begin() + used);
+			BufferPool::Buffer buffer;
+			while(!framer.done()) {
+				if(buffer.empty()) { buffer = BufferPool::acquire(RELAY_BUFFER_SIZE); }
+				const ssize_t len = asyncRecv(client_fd, buffer.data(), buffer.capacity());
+				if(len <= 0) {
+					Log::debug("in forwardBody(): client left in the middle of the body");
+					return false;
 				}
+				const size_t used = framer.feed(buffer.data(), len);
+				sendAll(server_fd, buffer.data(), used);
+				leftover.assign(buffer.data() + used, buffer.data() + len);
 			}
+		} catch(const HTTPParser::HTTPBadMessageException& e) {
+			Log::warning(Log::msg("in forwardBody(): bad request body, ", e.what()));
+			return false;
 		}
+		return true;
 	}
 
-	void handlePOST(const HTTPRequest& req, const string& id, const int client_fd) {
+	/*
+	 * req is only the head, its body is forwarded while the client sends it
+	 * leftover: see forwardBody
+	*/
+	bool handlePOST(const HTTPRequest& req, const string& id, const int client_fd, vector<char>& leftover,
+		const bool late) {
+		AdmissionController::Slot slot;
+		if(!admitUpstream(id, client_fd, late, slot)) {
+			return false;
+		}
 		HTTPRequestParser::AbsoluteForm af = HTTPRequestParser::parseAbsoluteForm(req);
 		const char* addr = af.authorityForm.host.c_str();
 		const char* port = af.authorityForm.port == "" ? "80" : af.authorityForm.port.c_str();
-		int server_fd = connectServer(addr, port);
+		// POST is not idempotent, it can't be retried if a pooled connection is dead
+		bool reused = false;
+		int server_fd = connectUpstream(addr, port, false, reused);
 		if (server_fd == -1) {
 			Log::warning("failed to connect to server, ignore this request");
-			return;
+			return false;
+		}
+
+		BodyFramer framer = BodyFramer::forRequest(req); // checked by parseClient
+		HTTPRequest head(req);
+		removeHopByHopFields(head);
+		// we answer it ourselves, the server gets the body right away anyway
+		const bool expectsContinue = hasHeaderToken(head, "Expect", "100-continue");
+		for(auto it = head.headerFields.begin(); it != head.headerFields.end();) {
+			if(iequals(it->first, "Expect")) {
+				head.headerFields.erase(it++);
+			} else {
+				++it;
+			}
 		}
 		
 		// contact server
@@ -346,7 +848,7 @@ private:
 				req.requestLine.toStr(), 
 				"\" from ", addr
 			));
-			sendAll(server_fd, req.toStr());
+			sendAllv(server_fd, head.serialize().iov());
 		} catch(const exception& e) {
 			close(server_fd);
 			try {
@@ -356,52 +858,75 @@ private:
 				));
 				sendAll(client_fd, getHTTP502HTMLStr(e.what()));
 			} catch(...) {}
-			return;
+			return false;
+		}
+		if(expectsContinue && leftover.empty()) {
+			try {
+				sendAll(client_fd, "HTTP/1.1 100 Continue\r\n\r\n");
+			} catch(...) {
+				close(server_fd);
+				return false;
+			}
+		}
+		bool bodyForwarded = false;
+		try {
+			if(!forwardBody(client_fd, server_fd, framer, leftover)) {
+				close(server_fd);
+				return false;
+			}
+			bodyForwarded = true;
+		} catch(const exception& e) {
+			// the server may have answered early (413, say) and stopped reading
+			Log::debug(Log::msg("in handlePOST(): ", e.what(), ", look for an answer anyway"));
 		}
+		vector<char> body;
+		const HTTPStatus status = recvHead(server_fd, body);
 
 		// send response to client
-		const HTTPStatus status = recvStatus(server_fd);
 		Log::proxy(Log::msg(
 				id, ": Received \"",
 				status.statusLine.toStr(),
 				"\" from ", addr
 			));
 		if(status == HTTPStatus()) {
+			close(server_fd);
 			try {
 				Log::proxy(Log::msg(
 					id, ": Responding \"",
 					"HTTP/1.1 502 Bad Gateway" ,"\""
 				));
 				sendAll(client_fd, getHTTP502HTMLStr("Received illegal response from server"));
-			} catch(...) {
-				close(server_fd);
-			}
-			return;
+			} catch(...) {}
+			return false;
 		}
 
 		Log::proxy(Log::msg(
 			id, ": Responding \"",
 			status.statusLine.toStr() ,"\""
 		));
-		sendAll(client_fd, status.toStr());
-
-		// TODO
-		/*
-		while ((msg_len = recv(server_fd, response_buffer, sizeof(response_buffer), 0)) > 0) {
-			send(client_fd, response_buffer, msg_len, MSG_NOSIGNAL);
-		}
-		*/
-		//close(client_fd);
-		//close(server_fd);
-		close(server_fd);
+		// if the server answered before the whole body went through, the rest of
+		// it is still on its way from the client, this connection is lost
+		const bool keepAlive = relayStatus(addr, port, server_fd, client_fd, status, body, nullptr);
+		return keepAlive && bodyForwarded;
 	}
 
-	void handleConnect(const HTTPRequest& req, const string& id, const int client_fd) {
+	/*
+	 * hands client_fd over to the shard's TunnelManager once the tunnel
+	 * is established, client_fd is set to -1 then
+	 * leftover: what the client sent after the head, without waiting for
+	 * our 200, it goes to the server first
+	*/
+	bool handleConnect(Shard& shard, const HTTPRequest& req, const string& id, int& client_fd,
+		vector<char>& leftover, const bool late) {
+		AdmissionController::Slot slot; // until the tunnel is up, the loop relays it then
+		if(!admitUpstream(id, client_fd, late, slot)) {
+			return false;
+		}
 		auto const af = HTTPRequestParser::parseAuthorityForm(req);
 		const int server_fd = connectServer(af.host.c_str(), af.port.c_str());
 		if (server_fd == -1) {
 			Log::warning("in handleConnect(): failed to connect to server, ignore this request");
-			return;
+			return false;
 		}
 		try {
 			Log::proxy(Log::msg(
@@ -410,57 +935,40 @@ private:
 			));
 			sendAll(client_fd, "HTTP/1.1 200 OK\r\n\r\n");
 		} catch(const exception& e) {
-			close(client_fd);
+			close(server_fd);
 			Log::proxy(Log::msg(
 				id, ": Tunnel closed"
 			));
 			Log::warning("in handleConnect(): failed to return 200 to client");
-			return;
+			return false;
 		}
-
-		const size_t bufferSize = 1024;
-		char msg_buffer[bufferSize];
-		while(true) {
-			fd_set readfds;
-			FD_ZERO(&readfds);
-			FD_SET(server_fd, &readfds);
-			FD_SET(client_fd, &readfds);
-			select(max(server_fd, client_fd) + 1, &readfds, NULL, NULL, NULL);
-			int ready_fd; 
-			int other_fd;
-			if (FD_ISSET(server_fd, &readfds)) {  // first priority (terminating signal)
-				ready_fd = server_fd;
-				other_fd = client_fd;
-			}
-			else if (FD_ISSET(client_fd, &readfds)) {
-				ready_fd = client_fd;
-				other_fd = server_fd;
-			}
-			int msg_len = recv(ready_fd, msg_buffer, sizeof(msg_buffer), 0);
-			if (msg_len <= 0) {
-				break;
-			}
-			if (send(other_fd, msg_buffer, msg_len, MSG_NOSIGNAL) == -1) {
-				break;
-			}
+		try {
+			sendAll(server_fd, leftover.data(), leftover.size());
+			leftover.clear();
+		} catch(const exception& e) {
+			close(server_fd);
+			Log::proxy(Log::msg(
+				id, ": Tunnel closed"
+			));
+			Log::warning("in handleConnect(): failed to forward what came after the head");
+			return false;
 		}
-		Log::proxy(Log::msg(
-			id, ": Tunnel closed"
-		));	
-		close(client_fd);
-		close(server_fd);
-	}
 
-	void __handleRequest(const int client_fd) {
-		// recv the 1st request
-		const HTTPRequest req1st = recvRequest(client_fd);
-
-		if(req1st == HTTPRequest()) {
-			close(client_fd);
-			Log::debug("in handleRequest(): failed to get 1st request");
-			return;
-		}
+		const int fd = client_fd;
+		client_fd = -1;
+		shard.loop.post([&shard, id, fd, server_fd]() {
+			shard.tunnels->add(fd, server_fd, [id](size_t up, size_t down) {
+				Log::proxy(Log::msg(
+					id, ": Tunnel closed"
+				));	
+				Log::debug(Log::msg(id, ": ", up, " bytes up, ", down, " bytes down"));
+			});
+		});
+		return false;
+	}
 
+	bool __handleRequest(Shard& shard, int& client_fd, const HTTPRequest& req1st, vector<char>& leftover,
+		const bool late) {
 		// for log
 		const string peerIp = getPeerIpBySocket(client_fd);
 		const string id = HTTPProxyCache::getInstance().offerId();
@@ -472,32 +980,268 @@ private:
 		}
 
 		if(req1st.requestLine.method == "GET") {
-			handleGET(req1st, id, client_fd, req1st.requestLine.toStr(), peerIp);
+			return handleGET(req1st, id, client_fd, req1st.requestLine.toStr(), peerIp, late);
 		} else if(req1st.requestLine.method == "POST") {
-			handlePOST(req1st, id, client_fd);
+			return handlePOST(req1st, id, client_fd, leftover, late);
 		} else if(req1st.requestLine.method == "CONNECT") {
-			handleConnect(req1st, id, client_fd);
+			return handleConnect(shard, req1st, id, client_fd, leftover, late);
 		} else {
 			assert(false);
 		}
-
-		close(client_fd);
+		return false;
 	}
 
-	void handleRequest(const int client_fd) {
+	/*
+	 * handlers look blocking, so this runs in a worker thread or in a fiber
+	 * and it owns client_fd from now on, unless a handler passes it on
+	 *
+	 * if both sides agree to keep the connection open, client_fd goes back
+	 * to the shard's loop with leftover, the bytes the client sent after req
+	*/
+	void handleRequest(Shard& shard, const PendingRequest& pr) {
+		int client_fd = pr.client_fd;
+		const HTTPRequest& req = pr.req;
+		vector<char> leftover = pr.leftover;
+		// the queue ends here, see AdmissionController
+		const bool late = config.admission && admission.onDequeue(AdmissionController::Clock::now() - pr.queuedAt);
+		bool keepAlive = false;
 		try {
-			__handleRequest(client_fd);
+			keepAlive = __handleRequest(shard, client_fd, req, leftover, late) && wantsKeepAlive(req);
 		} catch(const exception& e) {
 			Log::warning(Log::msg("Exception ignored, what(): ", e.what()));
 		}
+		if(client_fd < 0) { return; }
+		if(!keepAlive) {
+			close(client_fd);
+			return;
+		}
+		shard.loop.post([this, &shard, client_fd, leftover]() {
+			adoptClient(shard, client_fd, leftover);
+		});
 	}
 
+	void onAccepted(Shard& shard, const int client_fd) {
+		if(client_fd < 0) {
+			Log::warning(Log::msg("in onAccepted(): cannot accept connection, ", strerror(-client_fd)));
+			return;
+		}
+		adoptClient(shard, client_fd, vector<char>(), true);
+	}
 
-public:
-	Proxy(const char * port) {
-		snprintf(port_num, sizeof(port_num), "%s", port);
+	/*
+	 * the loop owns client_fd again, serve the next pipelined request or wait
+	 * for it, at most config.keepAliveTimeout
+	 * fresh: just accepted, while draining it still gets its first request
+	 * served, a kept-alive connection with nothing pipelined is closed
+	*/
+	void adoptClient(Shard& shard, const int client_fd, const vector<char>& leftover, const bool fresh = false) {
+		if(shard.draining && leftover.empty() && !fresh) {
+			close(client_fd);
+			return;
+		}
+		setNonBlocking(client_fd);
+		ClientConn& conn = shard.clients[client_fd];
+		conn.buffer = leftover;
+		conn.searched = 0;
+		conn.head.reset();
+		conn.framed = 0;
+		conn.fresh = fresh;
+		conn.idleTimer = shard.loop.runAfter(config.keepAliveTimeout, [this, &shard, client_fd]() {
+			Log::debug("in adoptClient(): client idle for too long");
+			shard.clients[client_fd].idleTimer = 0;
+			closeClient(shard, client_fd);
+		});
+		if(leftover.empty() || !parseClient(shard, client_fd)) {
+			recvClient(shard, client_fd);
+		}
+	}
+
+	void recvClient(Shard& shard, const int client_fd) {
+		shard.loop.recvOnce(client_fd, [this, &shard, client_fd](const char* data, ssize_t len) {
+			onClientData(shard, client_fd, data, len);
+		});
 	}
-	void start() {
+
+	/*
+	 * the loop stops caring about client_fd, which is NOT closed
+	*/
+	void releaseClient(Shard& shard, const int client_fd) {
+		shard.loop.cancelRecv(client_fd);
+		auto it = shard.clients.find(client_fd);
+		if(it == shard.clients.end()) { return; }
+		if(it->second.idleTimer != 0) {
+			shard.loop.cancelTimer(it->second.idleTimer);
+		}
+		shard.clients.erase(it);
+	}
+
+	void closeClient(Shard& shard, const int client_fd) {
+		releaseClient(shard, client_fd);
+		close(client_fd);
+	}
+
+	void onClientData(Shard& shard, const int client_fd, const char* data, const ssize_t len) {
+		auto it = shard.clients.find(client_fd);
+		if(it == shard.clients.end()) { return; }
+		if(len <= 0) {
+			Log::debug("in onClientData(): client left before sending a complete request");
+			closeClient(shard, client_fd);
+			return;
+		}
+		vector<char>& buffer = it->second.buffer;
+		buffer.insert(buffer.end(), data, data + len);
+		if(!parseClient(shard, client_fd)) {
+			recvClient(shard, client_fd);
+		}
+	}
+
+	/*
+	 * returns false if the buffer does not hold a complete request yet
+	 *
+	 * a POST is complete once its head is, handlePOST forwards the body
+	 * while it arrives, other requests wait for their body, which must be
+	 * small: a head over MAX_HEAD_SIZE gets a 431, a body over
+	 * MAX_LOOP_BODY_SIZE a 413, and the connection is closed
+	*/
+	bool parseClient(Shard& shard, const int client_fd) {
+		ClientConn& conn = shard.clients[client_fd];
+		vector<char>& buffer = conn.buffer;
+		try {
+			if(conn.head == nullptr) {
+				const char crlf2[] = "\r\n\r\n";
+				const auto end = search(buffer.begin() + conn.searched, buffer.end(), crlf2, crlf2 + 4);
+				if(end == buffer.end()) {
+					if(buffer.size() > MAX_HEAD_SIZE) {
+						refuseClient(shard, client_fd, getHTTP431HTMLStr("The request head is too large"));
+						return true;
+					}
+					conn.searched = buffer.size() < 3 ? 0 : buffer.size() - 3;
+					return false;
+				}
+				if(end + 4 - buffer.begin() > MAX_HEAD_SIZE) {
+					refuseClient(shard, client_fd, getHTTP431HTMLStr("The request head is too large"));
+					return true;
+				}
+				HTTPRequestParser reqParser;
+				reqParser.setBuffer(vector<char>(buffer.begin(), end + 4));
+				HTTPRequest req = reqParser.buildHead();
+				conn.framer = BodyFramer::forRequest(req); // reject a bad framing right here
+				buffer.erase(buffer.begin(), end + 4);
+				if(req.requestLine.method == "POST") {
+					dispatch(shard, PendingRequest{ client_fd, req, buffer, AdmissionController::Clock::now() });
+					return true;
+				}
+				conn.head.reset(new HTTPRequest(req));
+				conn.framed = 0;
+			}
+			conn.framed += conn.framer.feed(buffer.data() + conn.framed, buffer.size() - conn.framed);
+			if(conn.framed + conn.framer.remaining() > MAX_LOOP_BODY_SIZE) {
+				refuseClient(shard, client_fd, getHTTP413HTMLStr("The request body is too large"));
+				return true;
+			}
+			if(!conn.framer.done()) { return false; }
+			HTTPRequest req = *conn.head;
+			req.messageBody.assign(buffer.begin(), buffer.begin() + conn.framed);
+			const vector<char> leftover(buffer.begin() + conn.framed, buffer.end());
+			dispatch(shard, PendingRequest{ client_fd, req, leftover, AdmissionController::Clock::now() });
+			return true;
+		}
+		catch(const HTTPParser::HTTPBadMessageException& e) {
+			Log::warning(Log::msg("in parseClient(): bad request, ", e.what()));
+			refuseClient(shard, client_fd, getHTTP400HTMLStr(e.what()));
+			return true;
+		}
+		catch(const HTTPParser::HTTPParserException& e) {
+			// the head is all there, so it can't be incomplete
+			Log::warning(Log::msg("in parseClient(): bad request head, ", e.what()));
+			refuseClient(shard, client_fd, getHTTP400HTMLStr("The request head is malformed"));
+			return true;
+		}
+	}
+
+	/*
+	 * answer a client whose request won't be served, then close it
+	*/
+	void refuseClient(Shard& shard, const int client_fd, const string& resp) {
+		releaseClient(shard, client_fd);
+		shard.loop.sendThenClose(client_fd, resp);
+	}
+
+	/*
+	 * hand a client with a complete request over to the shard's worker pool
+	*/
+	void dispatch(Shard& shard, const PendingRequest& pr) {
+		releaseClient(shard, pr.client_fd);
+		if(!config.fibers) {
+			// worker threads use blocking I/O
+			setNonBlocking(pr.client_fd, false);
+		}
+		if(!shard.pendingRequests.empty() || !submit(shard, pr)) {
+			onOverload(shard, pr);
+		}
+	}
+
+	bool submit(Shard& shard, const PendingRequest& pr) {
+		if(config.fibers) {
+			if(shard.fibers >= shard.maxFibers) { return false; }
+			shard.fibers++;
+			shard.handlers++;
+			Fiber::spawn(shard.loop, [this, &shard, pr]() {
+				handleRequest(shard, pr);
+				shard.handlers--;
+				shard.fibers--;
+				resumeAccept(shard);
+			});
+			return true;
+		}
+		shard.handlers++;
+		if(!shard.pool->trySubmit([this, &shard, pr]() {
+			handleRequest(shard, pr);
+			shard.handlers--;
+		})) {
+			shard.handlers--;
+			return false;
+		}
+		return true;
+	}
+
+	void onOverload(Shard& shard, const PendingRequest& pr) {
+		if(config.overloadPolicy == Config::REJECT_503) {
+			Log::warning("worker queue is full, reply 503");
+			shard.loop.sendThenClose(pr.client_fd, getHTTP503HTMLStr("The proxy is overloaded, please retry later",
+				config.retryAfter));
+			return;
+		}
+		shard.pendingRequests.push_back(pr);
+		if(!shard.acceptPaused) {
+			Log::warning("worker queue is full, stop accepting");
+			shard.acceptPaused = true;
+			shard.loop.cancelAccept(shard.listen_fd);
+		}
+	}
+
+	/*
+	 * called in the loop thread after a worker took a job out of a full queue,
+	 * or after a fiber finished
+	*/
+	void resumeAccept(Shard& shard) {
+		while(!shard.pendingRequests.empty()) {
+			if(!submit(shard, shard.pendingRequests.front())) {
+				return;
+			}
+			shard.pendingRequests.pop_front();
+		}
+		if(shard.acceptPaused && !shard.draining) {
+			Log::warning("worker queue has room again, resume accepting");
+			shard.acceptPaused = false;
+			startAccept(shard);
+		}
+	}
+
+	/*
+	 * returns a non-blocking listening socket
+	*/
+	int createListener(const bool reusePort) {
 		int status;
 		struct addrinfo host_info;
 		struct addrinfo *host_info_list;
@@ -514,7 +1258,7 @@ public:
 			exit(EXIT_FAILURE);
 		} // if
 
-		listen_fd = socket(host_info_list->ai_family, host_info_list->ai_socktype,
+		const int listen_fd = socket(host_info_list->ai_family, host_info_list->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
 									host_info_list->ai_protocol);
 		if (listen_fd == -1) {
 			cerr << "Error: cannot create socket" << endl;
@@ -523,7 +1267,15 @@ public:
 
 		int yes = 1;
 		status = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		if (reusePort) {
+			status = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+			if (status == -1) {
+				cerr << "Error: cannot set SO_REUSEPORT" << endl;
+				exit(EXIT_FAILURE);
+			} // if
+		}
 		status = bind(listen_fd, host_info_list->ai_addr, host_info_list->ai_addrlen);
+		freeaddrinfo(host_info_list);
 
 		if (status == -1) {
 			cerr << "Error: cannot bind socket" << endl;
@@ -535,25 +1287,334 @@ public:
 			cerr << "Error: cannot listen on socket" << endl;
 			exit(EXIT_FAILURE);
 		} // if
+		return listen_fd;
+	}
 
-		while(true) {
-			struct sockaddr_storage socket_addr;
-			socklen_t socket_addr_len = sizeof(socket_addr);
-			int client_fd;
-			client_fd = accept(listen_fd, (struct sockaddr *)&socket_addr, &socket_addr_len);
-			if (client_fd == -1) {
-				cerr << "Error: cannot accept connection on socket" << endl;
-				exit(EXIT_FAILURE);
-			} // if
-			std::thread t(&Proxy::handleRequest, this, client_fd);
-			t.detach();
+	void startAccept(Shard& shard) {
+		shard.loop.accept(shard.listen_fd, [this, &shard](int client_fd) {
+			onAccepted(shard, client_fd);
+		});
+	}
+
+	void runShard(Shard& shard) {
+		if(shard.core >= 0 && !pinToCore(pthread_self(), shard.core)) {
+			Log::warning(Log::msg("failed to pin shard to core ", shard.core));
 		}
-		freeaddrinfo(host_info_list);
-		close(listen_fd);
+		Log::verbose(Log::msg("shard on core ", shard.core, " uses ", shard.loop.backendName()));
+		startAccept(shard);
+		shard.loop.run();
+		if(shard.listen_fd >= 0) {
+			shard.loop.cancelAccept(shard.listen_fd);
+			close(shard.listen_fd);
+		}
+	}
+
+	/*
+	 * in the shard's loop thread
+	 * no connection is accepted any more, idle keep-alive ones are closed,
+	 * the others get config.drainTimeout to finish, then the loop stops
+	*/
+	void drain(Shard& shard) {
+		if(shard.draining) { return; }
+		shard.draining = true;
+		shard.drainDeadline = chrono::steady_clock::now() + chrono::milliseconds(config.drainTimeout);
+		if(!shard.acceptPaused) {
+			shard.loop.cancelAccept(shard.listen_fd);
+			shard.acceptPaused = true;
+		}
+		// a successor may hold it too, its backlog is theirs now
+		close(shard.listen_fd);
+		shard.listen_fd = -1;
+
+		vector<int> idle;
+		for(auto const& c : shard.clients) {
+			if(c.second.buffer.empty() && !c.second.fresh) { idle.push_back(c.first); }
+		}
+		for(const int fd : idle) {
+			closeClient(shard, fd);
+		}
+		checkDrained(shard);
+	}
+
+	void checkDrained(Shard& shard) {
+		const size_t busy = shard.handlers + shard.clients.size() + shard.tunnels->size() + shard.pendingRequests.size();
+		if(busy == 0) {
+			shard.loop.stop();
+			return;
+		}
+		if(chrono::steady_clock::now() >= shard.drainDeadline) {
+			Log::warning(Log::msg("drain timeout, ", busy, " requests, clients and tunnels cut"));
+			shard.drainedInTime = false;
+			shard.loop.stop();
+			return;
+		}
+		shard.loop.runAfter(DRAIN_POLL_MS, [this, &shard]() { checkDrained(shard); });
+	}
+
+	/*
+	 * in the first shard's loop thread, from now on
+	*/
+	void drainAll() {
+		if(drainingAll) { return; }
+		drainingAll = true;
+		if(handoff_fd >= 0) {
+			// the path is not unlinked, a successor may be listening there already
+			shards[0]->loop.cancelAccept(handoff_fd);
+			close(handoff_fd);
+			handoff_fd = -1;
+		}
+		for(auto& shard : shards) {
+			Shard* const sp = shard.get();
+			sp->loop.post([this, sp]() { drain(*sp); });
+		}
+	}
+
+	/*
+	 * SIGTERM and SIGUSR2 are blocked by main and read from signal_fd on
+	 * the first shard's loop, so is the next proxy asking for our
+	 * listeners on handoff_fd
+	 * predecessor: the proxy we took our listeners from, -1 if none
+	*/
+	void watchControl(const int predecessor) {
+		Shard& shard = *shards[0];
+		const sigset_t signals = controlSignals();
+		signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+		if(signal_fd < 0) {
+			Log::warning(Log::msg("in watchControl(): signalfd failed, ", strerror(errno)));
+		} else {
+			shard.loop.add(signal_fd, EPOLLIN, [this](uint32_t events) { onSignal(); });
+		}
+		if(!config.handoffPath.empty()) {
+			handoff_fd = ListenerHandoff::listen(config.handoffPath);
+			if(handoff_fd >= 0) {
+				shard.loop.accept(handoff_fd, [this](int conn) { onSuccessor(conn); });
+			}
+		}
+		if(predecessor >= 0) {
+			// it stops accepting once every shard of ours does
+			auto left = make_shared<atomic<size_t>>(shards.size());
+			for(auto& s : shards) {
+				s->loop.post([left, predecessor]() {
+					if(--*left == 0) { ListenerHandoff::confirm(predecessor); }
+				});
+			}
+		}
+	}
+
+	void onSignal() {
+		signalfd_siginfo info;
+		while(read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+			if(info.ssi_signo == SIGTERM) {
+				Log::warning("SIGTERM, draining");
+				drainAll();
+			} else if(info.ssi_signo == SIGUSR2) {
+				spawnSuccessor();
+			}
+		}
+	}
+
+	/*
+	 * SIGUSR2: start a new proxy from the same binary, with the same
+	 * arguments and environment, it takes our listeners over
+	*/
+	void spawnSuccessor() {
+		if(handoff_fd < 0) {
+			Log::warning("SIGUSR2 ignored, there is no PROXY_HANDOFF_PATH to hand the listeners over");
+			return;
+		}
+		// the binary itself, even if it was moved, under its own name
+		char binary[PATH_MAX];
+		const ssize_t len = readlink("/proc/self/exe", binary, sizeof(binary) - 1);
+		if(len <= 0) {
+			Log::warning(Log::msg("in spawnSuccessor(): cannot find the binary, ", strerror(errno)));
+			return;
+		}
+		binary[len] = 0;
+		vector<char*> argv;
+		for(auto const& a : args) {
+			argv.push_back(const_cast<char*>(a.c_str()));
+		}
+		argv.push_back(nullptr);
+		const pid_t pid = fork();
+		if(pid < 0) {
+			Log::warning(Log::msg("in spawnSuccessor(): fork failed, ", strerror(errno)));
+			return;
+		}
+		if(pid == 0) {
+			// only async-signal-safe calls until exec
+			const sigset_t signals = controlSignals();
+			sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+			signal(SIGCHLD, SIG_DFL);
+			execv(binary, argv.data());
+			_exit(127);
+		}
+		Log::warning(Log::msg("SIGUSR2, started a new proxy, pid ", pid));
+	}
+
+	void onSuccessor(const int conn) {
+		if(conn < 0) { return; }
+		if(drainingAll) {
+			close(conn);
+			return;
+		}
+		vector<int> fds;
+		for(auto const& shard : shards) {
+			fds.push_back(shard->listen_fd);
+		}
+		if(!ListenerHandoff::give(conn, fds)) {
+			close(conn);
+			return;
+		}
+		Log::warning("listening sockets handed over, waiting for the new proxy");
+		shards[0]->loop.recvOnce(conn, [this, conn](const char* data, ssize_t len) {
+			close(conn);
+			if(len <= 0) {
+				Log::warning("the new proxy went away, keep serving");
+				return;
+			}
+			Log::warning("the new proxy is accepting, draining");
+			drainAll();
+		});
+	}
+
+
+public:
+	Proxy(const char * port, const Config& c, const vector<string>& args) :
+		config(c),
+		upstreams(c.upstreamMaxIdle, c.upstreamIdleTimeout),
+		dns(createResolver(c), c.dnsNegativeTtl),
+		relayBudget(c.memoryBudget),
+		admission({ c.codelTarget, c.codelInterval, c.maxInflight }),
+		args(args),
+		signal_fd(-1),
+		handoff_fd(-1),
+		drainingAll(false)
+	{
+		snprintf(port_num, sizeof(port_num), "%s", port);
+
+		// workers, queue slots and fiber slots are split evenly between shards
+		const size_t nShards = config.shards;
+		const size_t cores = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
+		for(size_t i = 0; i < nShards; i++) {
+			unique_ptr<Shard> shard(new Shard(config.ioUring));
+			shard->core = nShards > 1 ? (int)(i % cores) : -1;
+			shard->tunnels.reset(new TunnelManager(
+				shard->loop,
+				config.tunnelSplice ? Relay::SPLICE : Relay::COPY,
+				config.tunnelBuffer,
+				config.tunnelIdleTimeout
+			));
+			if(config.fibers) {
+				shard->maxFibers = max(config.maxFibers / nShards, (size_t)1);
+				shards.push_back(move(shard));
+				continue;
+			}
+			shard->pool.reset(new WorkerPool(
+				max(config.workers / nShards, (size_t)1),
+				max(config.queueCapacity / nShards, (size_t)1),
+				shard->core
+			));
+			Shard* const sp = shard.get();
+			shard->pool->setOnSpaceAvailable([this, sp]() {
+				sp->loop.post([this, sp]() { resumeAccept(*sp); });
+			});
+			shards.push_back(move(shard));
+		}
+	}
+
+	/*
+	 * controlled by these signals, main blocks them before any thread starts
+	*/
+	static sigset_t controlSignals() {
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGTERM);
+		sigaddset(&signals, SIGUSR2);
+		return signals;
+	}
+
+	/*
+	 * returns once every shard is drained, false if some did not make it
+	 * before the deadline, their handlers may still be running then
+	*/
+	bool start() {
+		// the listeners of the proxy we replace, if there is one
+		int predecessor = -1;
+		vector<int> inherited;
+		if(!config.handoffPath.empty()) {
+			inherited = ListenerHandoff::takeOver(config.handoffPath, predecessor);
+		}
+		if(!inherited.empty()) {
+			Log::warning(Log::msg("took over ", inherited.size(), " listening sockets"));
+			if(inherited.size() != shards.size()) {
+				Log::warning(Log::msg("the old proxy had ", inherited.size(), " shards, now ", shards.size()));
+			}
+		}
+		const bool reusePort = shards.size() > 1;
+		for(size_t i = 0; i < shards.size(); i++) {
+			shards[i]->listen_fd = i < inherited.size() ? inherited[i] : createListener(reusePort);
+		}
+		for(size_t i = shards.size(); i < inherited.size(); i++) {
+			close(inherited[i]);
+		}
+		watchControl(predecessor);
+		if(shards.size() == 1) {
+			runShard(*shards[0]);
+			return stopControl();
+		}
+
+		vector<thread> threads;
+		for(auto& shard : shards) {
+			Shard* const sp = shard.get();
+			threads.push_back(thread([this, sp]() {
+				try {
+					runShard(*sp);
+				} catch(const exception& e) {
+					Log::error(Log::msg("shard on core ", sp->core, " stopped: ", e.what()));
+				}
+			}));
+		}
+		for(auto& t : threads) {
+			t.join();
+		}
+		return stopControl();
+	}
+
+	/*
+	 * thread-safe, once start() runs
+	 * serve client_fd, connected some other way than through a listener
+	 * (a socketpair ...), as if the first shard just accepted it
+	*/
+	void adopt(const int client_fd) {
+		Shard* const sp = shards[0].get();
+		sp->loop.post([this, sp, client_fd]() { adoptClient(*sp, client_fd, vector<char>(), true); });
+	}
+
+	/*
+	 * thread-safe, once start() runs
+	 * drain every shard, like SIGTERM does, start() returns after that
+	*/
+	void stop() {
+		shards[0]->loop.post([this]() { drainAll(); });
+	}
+
+	/*
+	 * the end of start()
+	*/
+	bool stopControl() {
+		if(signal_fd >= 0) { close(signal_fd); }
+		if(handoff_fd >= 0) { close(handoff_fd); }
+		signal_fd = handoff_fd = -1;
+		bool inTime = true;
+		for(auto const& shard : shards) {
+			inTime = inTime && shard->drainedInTime;
+		}
+		return inTime;
 	}
 };
 
 
+#ifndef PROXY_NO_MAIN // proxyTest.cpp has its own
 int main(int argc, char** argv) {
 	string port = "12345";
 
@@ -569,18 +1630,38 @@ int main(int argc, char** argv) {
 		port = "1234";
 	} 
 
+	// splice(2) has no MSG_NOSIGNAL, a closed peer must not kill us
+	signal(SIGPIPE, SIG_IGN);
+	// the next proxy started by SIGUSR2 is never waited for
+	signal(SIGCHLD, SIG_IGN);
+	// every thread must block them for the signalfd, see Proxy::watchControl
+	const sigset_t controlSignals = Proxy::controlSignals();
+	pthread_sigmask(SIG_BLOCK, &controlSignals, nullptr);
 	HTTPProxyCache::createInstance();
 	Log::setVerbose(false);
 	Log::setDebug(false);
+	const Config config = Config::fromEnv();
+	HTTPProxyCache& cache = HTTPProxyCache::getInstance();
+	cache.setCapacity({ config.cacheMaxBytes, config.cacheMaxEntries,
+		config.cacheHighWatermark, config.cacheLowWatermark, config.cacheTinyLfu,
+		config.cacheEvictionPolicy });
+	Log::proxy(Log::msg("(no-id): NOTE cache holds ", cache.usedBytes(), " bytes in ",
+		cache.usedEntries(), " entries, at most ", config.cacheMaxBytes, " bytes in ",
+		config.cacheMaxEntries, " entries, evicting by ", config.cacheEvictionPolicy));
 
 
 	while(true) {
 		try {
-			Proxy p(port.c_str());
-			p.start();
+			Proxy p(port.c_str(), config, vector<string>(argv, argv + argc));
+			if(!p.start()) {
+				// handlers that missed the deadline still run, don't wait for them
+				_exit(EXIT_SUCCESS);
+			}
+			return EXIT_SUCCESS;
 		} catch(const exception& e) {
 			Log::error(e.what());
 			Log::error("Restart server...");
 		}
 	}
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
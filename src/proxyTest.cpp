@@ -0,0 +1,142 @@
+#define PROXY_NO_MAIN
+#include "main.cpp"
+
+#include <mutex>
+#include <thread>
+
+/*
+ * a server on a random port of 127.0.0.1 that answers every request of
+ * a connection in turn, with the request target as the body
+*/
+class Origin {
+public:
+	Origin() : listen_fd(socket(AF_INET, SOCK_STREAM, 0)), port(0) {
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof(addr);
+		if(listen_fd < 0 || bind(listen_fd, (sockaddr*)&addr, len) < 0 || listen(listen_fd, 16) < 0
+			|| getsockname(listen_fd, (sockaddr*)&addr, &len) < 0) {
+			return;
+		}
+		port = ntohs(addr.sin_port);
+		acceptor = thread([this]() {
+			int fd;
+			while((fd = ::accept(listen_fd, NULL, NULL)) >= 0) {
+				lock_guard<mutex> lock(mtx);
+				conns.push_back(fd);
+				servers.push_back(thread([this, fd]() { serve(fd); }));
+			}
+		});
+	}
+
+	~Origin() {
+		shutdown(listen_fd, SHUT_RDWR);
+		if(acceptor.joinable()) { acceptor.join(); }
+		lock_guard<mutex> lock(mtx);
+		for(const int fd : conns) { shutdown(fd, SHUT_RDWR); }
+		for(auto& t : servers) { t.join(); }
+		for(const int fd : conns) { close(fd); }
+		close(listen_fd);
+	}
+
+	const int listen_fd;
+	int port; // 0 if it is not listening
+
+private:
+	thread acceptor;
+	mutex mtx;
+	vector<int> conns;
+	vector<thread> servers;
+
+	static void serve(const int fd) {
+		string in;
+		char buf[4096];
+		ssize_t n;
+		while((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+			in.append(buf, n);
+			size_t end;
+			while((end = in.find("\r\n\r\n")) != string::npos) {
+				const size_t sp = in.find(' ');
+				const string target = in.substr(sp + 1, in.find(' ', sp + 1) - sp - 1);
+				const string path = target.substr(min(target.find('/', target.find("//") + 2), target.size()));
+				in.erase(0, end + 4);
+				const string resp = "HTTP/1.1 200 OK\r\nContent-Length: " + to_string(path.size())
+					+ "\r\nCache-Control: no-store\r\n\r\n" + path;
+				if(send(fd, resp.data(), resp.size(), MSG_NOSIGNAL) < 0) { return; }
+			}
+		}
+	}
+};
+
+/*
+ * everything fd receives until EOF, or until nothing comes for a while
+*/
+string recvAll(const int fd) {
+	timeval tv = { 5, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	string s;
+	char buf[4096];
+	ssize_t n;
+	while((n = recv(fd, buf, sizeof(buf), 0)) > 0) { s.append(buf, n); }
+	return n == 0 ? s : s + "<no EOF>";
+}
+
+/*
+ * the loop side of keep-alive: two GETs pipelined in one write, the
+ * second with Connection: close, are answered in order on the same
+ * connection, which is closed after the second
+*/
+void testPipelining(const bool fibers) {
+	const string TAG = Log::msg("testPipelining, ", fibers ? "fibers" : "threads");
+	bool failFlag = false;
+
+	Origin origin;
+	if(origin.port == 0) {
+		Log::testFail(TAG, "cannot listen");
+		return;
+	}
+	Config config = Config::fromEnv();
+	config.shards = 1;
+	config.fibers = fibers;
+	Proxy proxy("0", config, vector<string>());
+	thread running([&proxy]() { proxy.start(); });
+
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		Log::testFail(TAG, "socketpair failed");
+		proxy.stop();
+		running.join();
+		return;
+	}
+	const string host = Log::msg("127.0.0.1:", origin.port);
+	const string reqs =
+		"GET http://" + host + "/first HTTP/1.1\r\nHost: " + host + "\r\n\r\n"
+		"GET http://" + host + "/second HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+	proxy.adopt(sv[1]);
+	send(sv[0], reqs.data(), reqs.size(), MSG_NOSIGNAL);
+	const string got = recvAll(sv[0]);
+
+	const size_t first = got.find("\r\n\r\n/first");
+	const size_t second = got.find("\r\n\r\n/second");
+	if(first == string::npos || second == string::npos || first > second
+		|| got.substr(got.size() - 7) != "/second" || got.find("HTTP/1.1 200") != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("got <", got, ">"));
+	}
+
+	close(sv[0]);
+	proxy.stop();
+	running.join();
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	signal(SIGPIPE, SIG_IGN);
+	HTTPProxyCache::createInstance();
+	Log::setVerbose(false);
+	Log::setDebug(false);
+	testPipelining(false);
+	testPipelining(true);
+}
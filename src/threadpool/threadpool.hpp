@@ -0,0 +1,234 @@
+#ifndef ZQ29_THREADPOOL
+#define ZQ29_THREADPOOL
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * a thread-safe FIFO queue with a fixed capacity
+	 * multiple producers and consumers are allowed
+	*/
+	template<typename T>
+	class BoundedQueue {
+	public:
+		BoundedQueue(const size_t capacity);
+
+		/*
+		 * never blocks
+		 * returns false if the queue is full or closed
+		*/
+		bool tryPush(T&& item);
+
+		/*
+		 * blocks until there is an item or the queue is closed
+		 * returns false only when the queue is closed AND empty
+		 * if wasFull is given, it tells if the queue was full before this pop
+		*/
+		bool pop(T& item, bool* wasFull = nullptr);
+
+		/*
+		 * wake up every consumer, items already in the queue can still be popped
+		*/
+		void close();
+
+		size_t size() const;
+		size_t capacity() const;
+
+	private:
+		const size_t cap;
+		bool closed;
+		deque<T> items;
+		mutable mutex m;
+		condition_variable notEmpty;
+	};
+
+	/*
+	 * restrict thread t to run on the given core only
+	 * returns false on failure
+	*/
+	bool pinToCore(pthread_t t, const size_t core);
+
+	/*
+	 * a fixed number of worker threads fed by a BoundedQueue of jobs
+	 *
+	 * jobs are never dropped silently: trySubmit tells the caller
+	 * when the queue is full, and the caller decides what to do
+	*/
+	class WorkerPool {
+	public:
+		typedef function<void()> Job;
+
+		/*
+		 * if core >= 0, every worker is pinned to that core
+		*/
+		WorkerPool(const size_t nWorkers, const size_t queueCapacity, const int core = -1);
+		/*
+		 * finishes the jobs already queued, then joins every worker
+		*/
+		~WorkerPool();
+		WorkerPool(const WorkerPool& rhs) = delete;
+		WorkerPool& operator=(const WorkerPool& rhs) = delete;
+
+		/*
+		 * returns false if the queue is full
+		*/
+		bool trySubmit(Job job);
+
+		/*
+		 * fn is called on a worker thread every time it takes a job out of
+		 * a queue that was full, so a paused producer knows when to resume
+		 * set it before the first trySubmit
+		*/
+		void setOnSpaceAvailable(const function<void()>& fn);
+
+		size_t queueSize() const;
+		size_t workerCount() const;
+
+	private:
+		BoundedQueue<Job> jobs;
+		vector<thread> workers;
+		function<void()> onSpaceAvailable;
+
+		void workerMain();
+	};
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// BoundedQueue Implementation ////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	template<typename T>
+	BoundedQueue<T>::BoundedQueue(const size_t capacity) :
+		cap(capacity > 0 ? capacity : 1), closed(false) {}
+
+	template<typename T>
+	bool BoundedQueue<T>::tryPush(T&& item) {
+		{
+			lock_guard<mutex> lck(m);
+			if(closed || items.size() >= cap) { return false; }
+			items.push_back(move(item));
+		}
+		notEmpty.notify_one();
+		return true;
+	}
+
+	template<typename T>
+	bool BoundedQueue<T>::pop(T& item, bool* wasFull) {
+		unique_lock<mutex> lck(m);
+		notEmpty.wait(lck, [this]() { return closed || !items.empty(); });
+		if(items.empty()) { return false; }
+		if(wasFull) { *wasFull = (items.size() >= cap); }
+		item = move(items.front());
+		items.pop_front();
+		return true;
+	}
+
+	template<typename T>
+	void BoundedQueue<T>::close() {
+		{
+			lock_guard<mutex> lck(m);
+			closed = true;
+		}
+		notEmpty.notify_all();
+	}
+
+	template<typename T>
+	size_t BoundedQueue<T>::size() const {
+		lock_guard<mutex> lck(m);
+		return items.size();
+	}
+
+	template<typename T>
+	size_t BoundedQueue<T>::capacity() const {
+		return cap;
+	}
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// WorkerPool Implementation //////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	bool pinToCore(pthread_t t, const size_t core) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(core, &cpus);
+		return pthread_setaffinity_np(t, sizeof(cpus), &cpus) == 0;
+	}
+
+	WorkerPool::WorkerPool(const size_t nWorkers, const size_t queueCapacity, const int core) :
+		jobs(queueCapacity)
+	{
+		const size_t n = nWorkers > 0 ? nWorkers : 1;
+		for(size_t i = 0; i < n; i++) {
+			workers.push_back(thread(&WorkerPool::workerMain, this));
+			if(core >= 0 && !pinToCore(workers.back().native_handle(), core)) {
+				Log::warning(Log::msg("in WorkerPool: failed to pin worker to core ", core));
+			}
+		}
+	}
+
+	WorkerPool::~WorkerPool() {
+		jobs.close();
+		for(auto& t : workers) {
+			t.join();
+		}
+	}
+
+	bool WorkerPool::trySubmit(Job job) {
+		return jobs.tryPush(move(job));
+	}
+
+	void WorkerPool::setOnSpaceAvailable(const function<void()>& fn) {
+		onSpaceAvailable = fn;
+	}
+
+	size_t WorkerPool::queueSize() const {
+		return jobs.size();
+	}
+
+	size_t WorkerPool::workerCount() const {
+		return workers.size();
+	}
+
+	void WorkerPool::workerMain() {
+		Job job;
+		while(true) {
+			bool wasFull = false;
+			if(!jobs.pop(job, &wasFull)) { return; }
+			if(wasFull && onSpaceAvailable) {
+				onSpaceAvailable();
+			}
+			try {
+				job();
+			} catch(const exception& e) {
+				Log::warning(Log::msg("in WorkerPool: exception ignored, what(): ", e.what()));
+			}
+			job = Job();
+		}
+	}
+
+}
+	using zq29Inner::BoundedQueue;
+	using zq29Inner::WorkerPool;
+	using zq29Inner::pinToCore;
+}
+
+#endif
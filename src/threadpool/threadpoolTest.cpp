@@ -0,0 +1,95 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+
+#include "threadpool.hpp"
+
+using namespace zq29;
+using namespace std;
+
+void testBoundedQueue() {
+	const string TAG = "testBoundedQueue";
+	bool failFlag = false;
+
+	BoundedQueue<int> q(2);
+	int a = 1, b = 2, c = 3;
+	if(!q.tryPush(move(a)) || !q.tryPush(move(b))) {
+		failFlag = true;
+		Log::testFail(TAG, "tryPush failed on a non-full queue");
+	}
+	if(q.tryPush(move(c))) {
+		failFlag = true;
+		Log::testFail(TAG, "tryPush succeeded on a full queue");
+	}
+
+	int item = 0;
+	bool wasFull = false;
+	if(!q.pop(item, &wasFull) || item != 1 || !wasFull) {
+		failFlag = true;
+		Log::testFail(TAG, "pop, 1st item");
+	}
+	if(!q.pop(item, &wasFull) || item != 2 || wasFull) {
+		failFlag = true;
+		Log::testFail(TAG, "pop, 2nd item");
+	}
+
+	q.close();
+	if(q.pop(item)) {
+		failFlag = true;
+		Log::testFail(TAG, "pop succeeded on a closed and empty queue");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+void testWorkerPool() {
+	const string TAG = "testWorkerPool";
+	bool failFlag = false;
+
+	atomic<int> done(0);
+	atomic<int> spaceAvailable(0);
+	{
+		WorkerPool pool(2, 4);
+		pool.setOnSpaceAvailable([&spaceAvailable]() { spaceAvailable++; });
+
+		size_t accepted = 0;
+		for(int i = 0; i < 100; i++) {
+			if(pool.trySubmit([&done]() {
+				this_thread::sleep_for(chrono::milliseconds(1));
+				done++;
+			})) {
+				accepted++;
+			}
+		}
+		// 2 running + 4 queued at least, but never all of them
+		if(accepted < 4 || accepted == 100) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("unexpected number of accepted jobs <", accepted, ">"));
+		}
+		// pool destructor finishes queued jobs
+		this_thread::sleep_for(chrono::milliseconds(50));
+		if(pool.queueSize() != 0) {
+			failFlag = true;
+			Log::testFail(TAG, "jobs left in the queue");
+		}
+		if(!pool.trySubmit([&done]() { done++; })) {
+			failFlag = true;
+			Log::testFail(TAG, "trySubmit failed on an idle pool");
+		}
+		if(spaceAvailable == 0) {
+			failFlag = true;
+			Log::testFail(TAG, "onSpaceAvailable was never called");
+		}
+	}
+	if(done == 0) {
+		failFlag = true;
+		Log::testFail(TAG, "no job was run");
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testBoundedQueue();
+	testWorkerPool();
+}
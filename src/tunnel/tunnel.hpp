@@ -0,0 +1,305 @@
+#ifndef ZQ29_TUNNEL
+#define ZQ29_TUNNEL
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "../log.hpp"
+#include "../bufferpool/bufferpool.hpp"
+#include "../eventloop/fiber.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * one direction of a tunnel: moves bytes from one socket to another
+	 *
+	 * SPLICE: socket -> pipe -> socket with splice(2), the bytes stay in
+	 *         the kernel, no copy to user space
+	 * COPY:   recv into a buffer, send from it, the buffer is only held
+	 *         while there are pending bytes, an idle relay costs no buffer
+	 * SPLICE falls back to COPY if no pipe can be made, or the sockets
+	 * cannot be spliced
+	 *
+	 * never blocks, both sockets must be non-blocking
+	 * after EOF from `from` and everything written, `to` is shut down
+	 * for writing, so the other direction can go on (half-close)
+	*/
+	class Relay {
+	public:
+		enum Mode { SPLICE, COPY };
+		/*
+		 * FAILED: a socket failed, the relay is useless now
+		 * WAITING: nothing more can move until a socket is ready again
+		 * BUDGET_USED: more could move, pump again later
+		*/
+		enum Status { FAILED, WAITING, BUDGET_USED };
+
+		static const size_t DEFAULT_CAPACITY = 64 * 1024;
+
+		/*
+		 * capacity: max bytes read from `from` but not written to `to` yet
+		*/
+		Relay(const int from, const int to, const Mode mode, const size_t capacity = DEFAULT_CAPACITY);
+		~Relay();
+		Relay(const Relay& rhs) = delete;
+		Relay& operator=(const Relay& rhs) = delete;
+
+		/*
+		 * move what can be moved right now, at most budget bytes
+		*/
+		Status pump(const size_t budget = SIZE_MAX);
+
+		/*
+		 * EOF from `from`, and everything is written
+		*/
+		bool done() const;
+		/*
+		 * what to wait for before pump() can make progress:
+		 * `from` readable, `to` writable
+		*/
+		bool wantsRead() const;
+		bool wantsWrite() const;
+
+		size_t pending() const;
+		size_t total() const;
+		Mode mode() const;
+
+	private:
+		const int from;
+		const int to;
+		Mode md;
+		size_t capacity;
+		int pipeFds[2];
+		/*
+		 * a pipe holds a few buffers, not bytes, so it can be full long
+		 * before capacity, and splice can't tell that from no data to read
+		*/
+		bool pipeMaybeFull;
+		BufferPool::Buffer buffer;
+		size_t head, tail; // of the pending bytes, in pipe mode only tail counts
+		size_t moved;
+		bool eof;
+		bool shutDown;
+
+		/*
+		 * > 0: bytes moved, 0: EOF (fill only), -1 with errno
+		*/
+		ssize_t fill(const size_t max);
+		ssize_t flush(const size_t max);
+		void toCopyMode();
+
+		/*
+		 * the COPY buffer comes from the BufferPool and goes back there
+		 * whenever it is empty
+		*/
+		void takeBuffer();
+		void giveBackBuffer();
+	};
+
+	/*
+	 * relay between a and b in both directions, until both directions
+	 * are done, a socket fails, or nothing moved for idleTimeoutMs (< 0: never)
+	 * a and b are made non-blocking
+	 *
+	 * waits like the async* functions of fiber.hpp
+	 * aToB and bToA are set to the bytes moved
+	*/
+	void runTunnel(const int a, const int b, const Relay::Mode mode, const int idleTimeoutMs,
+		size_t& aToB, size_t& bToA);
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// Relay Implementation ///////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	Relay::Relay(const int from, const int to, const Mode mode, const size_t capacity) :
+		from(from), to(to), md(mode), capacity(capacity), pipeFds{ -1, -1 }, pipeMaybeFull(false),
+		head(0), tail(0), moved(0), eof(false), shutDown(false)
+	{
+		if(md == SPLICE) {
+			if(pipe2(pipeFds, O_NONBLOCK | O_CLOEXEC) < 0) {
+				Log::warning(Log::msg("in Relay: cannot make a pipe, copy instead, ", strerror(errno)));
+				toCopyMode();
+			} else {
+				// may fail, then the pipe keeps its default size
+				fcntl(pipeFds[1], F_SETPIPE_SZ, (int)capacity);
+				const int size = fcntl(pipeFds[1], F_GETPIPE_SZ);
+				if(size > 0) { this->capacity = min(capacity, (size_t)size); }
+			}
+		}
+	}
+
+	Relay::~Relay() {
+		if(pipeFds[0] >= 0) { close(pipeFds[0]); }
+		if(pipeFds[1] >= 0) { close(pipeFds[1]); }
+		giveBackBuffer();
+	}
+
+	void Relay::toCopyMode() {
+		if(pipeFds[0] >= 0) { close(pipeFds[0]); }
+		if(pipeFds[1] >= 0) { close(pipeFds[1]); }
+		pipeFds[0] = pipeFds[1] = -1;
+		md = COPY;
+	}
+
+	void Relay::takeBuffer() {
+		if(buffer.empty()) { buffer = BufferPool::acquire(capacity); }
+	}
+
+	void Relay::giveBackBuffer() {
+		if(buffer.empty()) { return; }
+		buffer.release();
+		head = tail = 0;
+	}
+
+	ssize_t Relay::fill(const size_t max) {
+		while(true) {
+			ssize_t n;
+			if(md == SPLICE) {
+				n = splice(from, NULL, pipeFds[1], NULL, max, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if(n < 0 && errno == EINVAL && tail == 0) {
+					// not a socket that can be spliced
+					toCopyMode();
+					continue;
+				}
+			} else {
+				takeBuffer();
+				if(head == tail) { head = tail = 0; }
+				if(capacity - tail < max && head > 0) {
+					memmove(buffer.data(), buffer.data() + head, tail - head);
+					tail -= head;
+					head = 0;
+				}
+				n = recv(from, buffer.data() + tail, min(max, capacity - tail), MSG_DONTWAIT);
+			}
+			if(n < 0 && errno == EINTR) { continue; }
+			if(n > 0) { tail += n; }
+			return n;
+		}
+	}
+
+	ssize_t Relay::flush(const size_t max) {
+		while(true) {
+			ssize_t n;
+			if(md == SPLICE) {
+				n = splice(pipeFds[0], NULL, to, NULL, min(max, tail), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if(n > 0) { tail -= n; }
+			} else {
+				n = send(to, buffer.data() + head, min(max, tail - head), MSG_NOSIGNAL | MSG_DONTWAIT);
+				if(n > 0) { head += n; }
+			}
+			if(n < 0 && errno == EINTR) { continue; }
+			if(n > 0) { moved += n; }
+			return n;
+		}
+	}
+
+	Relay::Status Relay::pump(const size_t budget) {
+		size_t left = budget;
+		while(left > 0) {
+			bool progress = false;
+			if(!eof && pending() < capacity) {
+				const ssize_t n = fill(min(left, capacity - pending()));
+				if(n == 0) {
+					eof = true;
+				} else if(n > 0) {
+					progress = true;
+				} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					return FAILED;
+				} else {
+					pipeMaybeFull = md == SPLICE && pending() > 0;
+				}
+			}
+			if(pending() > 0) {
+				const ssize_t n = flush(left);
+				if(n > 0) {
+					left -= n;
+					pipeMaybeFull = false;
+					progress = true;
+				} else if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+					return FAILED;
+				}
+			}
+			if(!progress) { break; }
+		}
+		if(md == COPY && pending() == 0) {
+			giveBackBuffer();
+		}
+		if(eof && pending() == 0 && !shutDown) {
+			shutDown = true;
+			shutdown(to, SHUT_WR);
+		}
+		return left == 0 ? BUDGET_USED : WAITING;
+	}
+
+	bool Relay::done() const {
+		return eof && pending() == 0;
+	}
+
+	bool Relay::wantsRead() const {
+		return !eof && pending() < capacity && !pipeMaybeFull;
+	}
+
+	bool Relay::wantsWrite() const {
+		return pending() > 0;
+	}
+
+	size_t Relay::pending() const {
+		return md == SPLICE ? tail : tail - head;
+	}
+
+	size_t Relay::total() const {
+		return moved;
+	}
+
+	Relay::Mode Relay::mode() const {
+		return md;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// runTunnel Implementation ///////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	void runTunnel(const int a, const int b, const Relay::Mode mode, const int idleTimeoutMs,
+		size_t& aToB, size_t& bToA) {
+		for(const int fd : { a, b }) {
+			const int flags = fcntl(fd, F_GETFL, 0);
+			fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		}
+		Relay up(a, b, mode), down(b, a, mode);
+		while(true) {
+			if(up.pump() == Relay::FAILED || down.pump() == Relay::FAILED) { break; }
+			if(up.done() && down.done()) { break; }
+
+			map<int, uint32_t> events;
+			if(up.wantsRead()) { events[a] |= EPOLLIN | EPOLLRDHUP; }
+			if(up.wantsWrite()) { events[b] |= EPOLLOUT; }
+			if(down.wantsRead()) { events[b] |= EPOLLIN | EPOLLRDHUP; }
+			if(down.wantsWrite()) { events[a] |= EPOLLOUT; }
+			const vector<pair<int, uint32_t>> fds(events.begin(), events.end());
+			if(asyncWaitAny(fds, idleTimeoutMs) < 0) { break; }
+		}
+		aToB = up.total();
+		bToA = down.total();
+	}
+
+}
+	using zq29Inner::Relay;
+	using zq29Inner::runTunnel;
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * This file:
+ * pushes bytes through a tunnel over loopback TCP and prints the throughput
+ * of the old select-style relay (1K buffer) and of runTunnel with COPY and SPLICE,
+ * with the CPU time the tunnel thread spent per GB
+ *
+ * usage: ./tunnelBench [MB]
+*/
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+#include "tunnel.hpp"
+
+using namespace zq29;
+using namespace std;
+
+bool tcpPair(int fds[2]) {
+	const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if(bind(listen_fd, (sockaddr*)&addr, len) < 0 || listen(listen_fd, 1) < 0
+		|| getsockname(listen_fd, (sockaddr*)&addr, &len) < 0) {
+		close(listen_fd);
+		return false;
+	}
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(fds[0], (sockaddr*)&addr, len) < 0) {
+		close(listen_fd);
+		return false;
+	}
+	fds[1] = accept(listen_fd, NULL, NULL);
+	close(listen_fd);
+	return fds[1] >= 0;
+}
+
+/*
+ * what handleConnect used to do
+*/
+void legacyTunnel(const int client_fd, const int server_fd) {
+	char msg_buffer[1024];
+	while(true) {
+		const int ready = asyncWaitAny({
+			make_pair(server_fd, (uint32_t)(EPOLLIN | EPOLLRDHUP)),
+			make_pair(client_fd, (uint32_t)(EPOLLIN | EPOLLRDHUP))
+		});
+		const int ready_fd = ready == 0 ? server_fd : client_fd;
+		const int other_fd = ready == 0 ? client_fd : server_fd;
+		const ssize_t msg_len = asyncRecv(ready_fd, msg_buffer, sizeof(msg_buffer));
+		if(msg_len <= 0) { break; }
+		if(asyncSend(other_fd, msg_buffer, msg_len) == -1) { break; }
+	}
+}
+
+/*
+ * total bytes going server -> tunnel -> client
+*/
+void run(const string& name, const size_t total, const function<void(int, int)>& tunnel) {
+	int client[2], server[2];
+	if(!tcpPair(client) || !tcpPair(server)) { return; }
+	double cpu = 0;
+
+	const auto start = chrono::steady_clock::now();
+	thread t([&]() {
+		tunnel(client[1], server[0]);
+		rusage usage;
+		getrusage(RUSAGE_THREAD, &usage);
+		cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+			+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+		close(client[1]);
+		close(server[0]);
+	});
+	thread origin([&]() {
+		vector<char> chunk(256 * 1024, 'x');
+		size_t sent = 0;
+		while(sent < total) {
+			const ssize_t n = send(server[1], chunk.data(), min(chunk.size(), total - sent), MSG_NOSIGNAL);
+			if(n <= 0) { break; }
+			sent += n;
+		}
+		close(server[1]);
+	});
+	vector<char> buf(256 * 1024);
+	size_t received = 0;
+	ssize_t n;
+	while((n = recv(client[0], buf.data(), buf.size(), 0)) > 0) { received += n; }
+	const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	origin.join();
+	// runTunnel also waits for EOF from the client
+	close(client[0]);
+	t.join();
+	if(received != total) {
+		cerr << "received " << received << " bytes, expected " << total << endl;
+	}
+	cout << name << received / 1048576.0 / seconds << " MB/s, "
+		<< cpu / (received / 1073741824.0) << " CPU s/GB" << endl;
+}
+
+int main(int argc, char** argv) {
+	const size_t mb = argc > 1 ? atoi(argv[1]) : 1024;
+	const size_t total = mb * 1024 * 1024;
+	size_t up, down;
+	cout << "moving " << mb << " MB through each tunnel" << endl;
+	run("legacy 1K:  ", total, [](int c, int s) { legacyTunnel(c, s); });
+	run("copy 64K:   ", total, [&](int c, int s) { runTunnel(c, s, Relay::COPY, -1, up, down); });
+	run("splice:     ", total, [&](int c, int s) { runTunnel(c, s, Relay::SPLICE, -1, up, down); });
+}
@@ -0,0 +1,189 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+#include "tunnel.hpp"
+#include "tunnelmanager.hpp"
+
+using namespace zq29;
+using namespace std;
+
+/*
+ * two connected TCP sockets on 127.0.0.1
+*/
+bool tcpPair(int fds[2]) {
+	const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if(bind(listen_fd, (sockaddr*)&addr, len) < 0 || listen(listen_fd, 1) < 0
+		|| getsockname(listen_fd, (sockaddr*)&addr, &len) < 0) {
+		close(listen_fd);
+		return false;
+	}
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(fds[0], (sockaddr*)&addr, len) < 0) {
+		close(listen_fd);
+		return false;
+	}
+	fds[1] = accept(listen_fd, NULL, NULL);
+	close(listen_fd);
+	return fds[1] >= 0;
+}
+
+string pattern(const size_t len, const char seed) {
+	string s(len, 0);
+	for(size_t i = 0; i < len; i++) { s[i] = (char)(seed + i * 7 + i / 251); }
+	return s;
+}
+
+string recvAll(const int fd) {
+	string s;
+	char buf[65536];
+	ssize_t n;
+	while((n = recv(fd, buf, sizeof(buf), 0)) > 0) { s.append(buf, n); }
+	return s;
+}
+
+void sendAll(const int fd, const string& s) {
+	size_t sent = 0;
+	while(sent < s.size()) {
+		const ssize_t n = send(fd, s.data() + sent, s.size() - sent, MSG_NOSIGNAL);
+		if(n <= 0) { return; }
+		sent += n;
+	}
+}
+
+/*
+ * the client sends a request and shuts down writing, the server reads
+ * it to the end, only then answers, and closes
+*/
+void testTunnel(const Relay::Mode mode) {
+	const string TAG = Log::msg("testTunnel, ", mode == Relay::SPLICE ? "splice" : "copy");
+	bool failFlag = false;
+
+	int client[2], server[2];
+	if(!tcpPair(client) || !tcpPair(server)) {
+		Log::testFail(TAG, "cannot make sockets");
+		return;
+	}
+	const string request = pattern(3 * 1024 * 1024 + 17, 'a');
+	const string response = pattern(5 * 1024 * 1024 + 3, 'z');
+
+	size_t up = 0, down = 0;
+	thread tunnel([&]() { runTunnel(client[1], server[0], mode, 5000, up, down); });
+	string gotRequest, gotResponse;
+	thread origin([&]() {
+		gotRequest = recvAll(server[1]);
+		sendAll(server[1], response);
+		close(server[1]);
+	});
+	sendAll(client[0], request);
+	shutdown(client[0], SHUT_WR);
+	gotResponse = recvAll(client[0]);
+	origin.join();
+	tunnel.join();
+
+	if(gotRequest != request) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("request of ", gotRequest.size(), " bytes, expected ", request.size()));
+	}
+	if(gotResponse != response) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("response of ", gotResponse.size(), " bytes, expected ", response.size()));
+	}
+	if(up != request.size() || down != response.size()) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("counted ", up, " up, ", down, " down"));
+	}
+
+	close(client[0]); close(client[1]); close(server[0]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * many tunnels in both directions at once on one loop, then an idle one
+*/
+void testTunnelManager(const Relay::Mode mode) {
+	const string TAG = Log::msg("testTunnelManager, ", mode == Relay::SPLICE ? "splice" : "copy");
+	bool failFlag = false;
+
+	EventLoop loop;
+	TunnelManager manager(loop, mode, 16 * 1024, 100);
+	thread loopThread([&loop]() { loop.run(); });
+
+	const size_t N = 16;
+	const string request = pattern(1024 * 1024 + 5, 'a');
+	const string response = pattern(2 * 1024 * 1024 + 9, 'z');
+	atomic<size_t> closed(0), good(0), wrong(0);
+	vector<thread> threads;
+	for(size_t i = 0; i < N; i++) {
+		int client[2], server[2];
+		if(!tcpPair(client) || !tcpPair(server)) {
+			Log::testFail(TAG, "cannot make sockets");
+			break;
+		}
+		loop.post([&, client, server]() {
+			manager.add(client[1], server[0], [&](size_t up, size_t down) {
+				if(up == request.size() && down == response.size()) { good++; }
+				closed++;
+			});
+		});
+		// the client and the origin talk at the same time
+		threads.push_back(thread([&, client]() {
+			thread sender([&]() {
+				sendAll(client[0], request);
+				shutdown(client[0], SHUT_WR);
+			});
+			const string got = recvAll(client[0]);
+			sender.join();
+			if(got != response) { wrong++; }
+			close(client[0]);
+		}));
+		threads.push_back(thread([&, server]() {
+			thread sender([&]() { sendAll(server[1], response); });
+			const string got = recvAll(server[1]);
+			sender.join();
+			if(got != request) { wrong++; }
+			close(server[1]);
+		}));
+	}
+	for(auto& t : threads) { t.join(); }
+
+	// nothing moves, the manager gives up after 100ms
+	int client[2], server[2];
+	tcpPair(client);
+	tcpPair(server);
+	loop.post([&]() { manager.add(client[1], server[0], [&](size_t up, size_t down) { closed++; }); });
+	const auto start = chrono::steady_clock::now();
+	const string got = recvAll(client[0]);
+	const auto waited = chrono::steady_clock::now() - start;
+	if(!got.empty() || waited < chrono::milliseconds(80) || waited > chrono::milliseconds(1000)) {
+		failFlag = true;
+		Log::testFail(TAG, "idle tunnel was not closed in time");
+	}
+	close(client[0]);
+	close(server[1]);
+
+	loop.post([&loop]() { loop.stop(); });
+	loopThread.join();
+	if(good != N || wrong != 0 || closed != N + 1 || manager.size() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg(good.load(), " good tunnels, ", wrong.load(), " corrupted, ",
+			closed.load(), " closed, ", manager.size(), " left"));
+	}
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testTunnel(Relay::SPLICE);
+	testTunnel(Relay::COPY);
+	testTunnelManager(Relay::SPLICE);
+	testTunnelManager(Relay::COPY);
+}
@@ -0,0 +1,213 @@
+#ifndef ZQ29_TUNNELMANAGER
+#define ZQ29_TUNNELMANAGER
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
+#include "../log.hpp"
+#include "../eventloop/eventloop.hpp"
+#include "tunnel.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * every CONNECT tunnel of one event loop
+	 *
+	 * a tunnel is two Relays and a few flags, no thread and no fiber,
+	 * the loop watches both sockets and pumps both directions on every
+	 * wakeup, so a big download can't starve the upload of the same tunnel
+	 * a direction moves at most PUMP_BUDGET bytes per round, if there is
+	 * more the tunnel goes again after everything else that is ready,
+	 * so a busy tunnel can't starve the others either
+	 *
+	 * each direction buffers at most bufferLimit bytes, a slow reader
+	 * stops the writer instead of growing memory
+	 * EOF in one direction shuts the other side down for writing and the
+	 * other direction goes on, the tunnel is closed when both are done,
+	 * a socket fails, or nothing moved for idleTimeoutMs
+	 *
+	 * everything must be called from the loop thread
+	*/
+	class TunnelManager {
+	public:
+		/*
+		 * bytes moved client -> server and server -> client
+		*/
+		typedef function<void(size_t up, size_t down)> CloseCallback;
+
+		static const size_t PUMP_BUDGET = 256 * 1024;
+
+		TunnelManager(EventLoop& loop, const Relay::Mode mode, const size_t bufferLimit, const int idleTimeoutMs);
+		/*
+		 * closes every tunnel, without calling back
+		*/
+		~TunnelManager();
+		TunnelManager(const TunnelManager& rhs) = delete;
+		TunnelManager& operator=(const TunnelManager& rhs) = delete;
+
+		/*
+		 * relay between client_fd and server_fd from now on, they are
+		 * owned by the manager and made non-blocking
+		 * onClose is called once the tunnel is closed
+		*/
+		void add(const int client_fd, const int server_fd, const CloseCallback& onClose = CloseCallback());
+
+		size_t size() const;
+
+	private:
+		typedef chrono::steady_clock Clock;
+		struct Tunnel {
+			int client_fd;
+			int server_fd;
+			Relay up;
+			Relay down;
+			CloseCallback onClose;
+			Clock::time_point lastActive;
+			EventLoop::TimerId idleTimer;
+			bool scheduled; // a round is already posted
+			bool closed;
+
+			Tunnel(const int client_fd, const int server_fd, const Relay::Mode mode, const size_t bufferLimit);
+		};
+
+		EventLoop& loop;
+		const Relay::Mode mode;
+		const size_t bufferLimit;
+		const int idleTimeout;
+		unordered_map<int, shared_ptr<Tunnel>> tunnels; // by client_fd
+
+		void pump(const shared_ptr<Tunnel>& t);
+		void armIdleTimer(const shared_ptr<Tunnel>& t, const int ms);
+		void close(const shared_ptr<Tunnel>& t, const bool callBack);
+	};
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// TunnelManager Implementation ///////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	TunnelManager::Tunnel::Tunnel(const int client_fd, const int server_fd, const Relay::Mode mode, const size_t bufferLimit) :
+		client_fd(client_fd),
+		server_fd(server_fd),
+		up(client_fd, server_fd, mode, bufferLimit),
+		down(server_fd, client_fd, mode, bufferLimit),
+		lastActive(Clock::now()),
+		idleTimer(0),
+		scheduled(false),
+		closed(false)
+	{}
+
+	TunnelManager::TunnelManager(EventLoop& loop, const Relay::Mode mode, const size_t bufferLimit, const int idleTimeoutMs) :
+		loop(loop), mode(mode), bufferLimit(bufferLimit), idleTimeout(idleTimeoutMs)
+	{}
+
+	TunnelManager::~TunnelManager() {
+		while(!tunnels.empty()) {
+			close(tunnels.begin()->second, false);
+		}
+	}
+
+	void TunnelManager::add(const int client_fd, const int server_fd, const CloseCallback& onClose) {
+		for(const int fd : { client_fd, server_fd }) {
+			const int flags = fcntl(fd, F_GETFL, 0);
+			fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		}
+		const shared_ptr<Tunnel> t = make_shared<Tunnel>(client_fd, server_fd, mode, bufferLimit);
+		t->onClose = onClose;
+		tunnels[client_fd] = t;
+
+		// weak, the loop must not keep a closed tunnel alive
+		const weak_ptr<Tunnel> w = t;
+		const EventLoop::Callback cb = [this, w](uint32_t events) {
+			const shared_ptr<Tunnel> t = w.lock();
+			if(t) { pump(t); }
+		};
+		try {
+			loop.add(client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, cb);
+			loop.add(server_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, cb);
+		} catch(const exception& e) {
+			Log::warning(Log::msg("in TunnelManager: ", e.what()));
+			close(t, true);
+			return;
+		}
+		if(idleTimeout >= 0) { armIdleTimer(t, idleTimeout); }
+		// bytes may be waiting already, no edge would tell about them
+		pump(t);
+	}
+
+	void TunnelManager::pump(const shared_ptr<Tunnel>& t) {
+		if(t->closed) { return; }
+		const size_t before = t->up.total() + t->down.total();
+		const Relay::Status up = t->up.pump(PUMP_BUDGET);
+		const Relay::Status down = t->down.pump(PUMP_BUDGET);
+		if(t->up.total() + t->down.total() != before) {
+			t->lastActive = Clock::now();
+		}
+		if(up == Relay::FAILED || down == Relay::FAILED || (t->up.done() && t->down.done())) {
+			close(t, true);
+			return;
+		}
+		if((up == Relay::BUDGET_USED || down == Relay::BUDGET_USED) && !t->scheduled) {
+			// edge-triggered, nobody will tell us again about what is left
+			t->scheduled = true;
+			const weak_ptr<Tunnel> w = t;
+			loop.post([this, w]() {
+				const shared_ptr<Tunnel> t = w.lock();
+				if(!t) { return; }
+				t->scheduled = false;
+				pump(t);
+			});
+		}
+	}
+
+	void TunnelManager::armIdleTimer(const shared_ptr<Tunnel>& t, const int ms) {
+		const weak_ptr<Tunnel> w = t;
+		t->idleTimer = loop.runAfter(ms, [this, w]() {
+			const shared_ptr<Tunnel> t = w.lock();
+			if(!t) { return; }
+			t->idleTimer = 0;
+			const auto idle = chrono::duration_cast<chrono::milliseconds>(Clock::now() - t->lastActive).count();
+			if(idle >= idleTimeout) {
+				Log::debug("in TunnelManager: idle tunnel closed");
+				close(t, true);
+			} else {
+				armIdleTimer(t, idleTimeout - idle);
+			}
+		});
+	}
+
+	void TunnelManager::close(const shared_ptr<Tunnel>& t, const bool callBack) {
+		// t may be the last reference
+		const shared_ptr<Tunnel> self = t;
+		self->closed = true;
+		if(self->idleTimer != 0) { loop.cancelTimer(self->idleTimer); }
+		loop.remove(self->client_fd);
+		loop.remove(self->server_fd);
+		::close(self->client_fd);
+		::close(self->server_fd);
+		tunnels.erase(self->client_fd);
+		if(callBack && self->onClose) {
+			self->onClose(self->up.total(), self->down.total());
+		}
+	}
+
+	size_t TunnelManager::size() const {
+		return tunnels.size();
+	}
+
+}
+	using zq29Inner::TunnelManager;
+}
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef ZQ29_CONNPOOL
+#define ZQ29_CONNPOOL
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cctype>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../log.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * idle connections to origin servers, keyed by host:port
+	 *
+	 * a connection goes back to the pool after a complete exchange,
+	 * the next request to the same origin takes the most recently used one,
+	 * which skips DNS and the TCP handshake
+	 *
+	 * thread-safe
+	*/
+	class UpstreamPool {
+	public:
+		/*
+		 * maxIdlePerOrigin: more idle connections than that are closed
+		 * idleTimeoutMs: idle connections older than that are closed
+		*/
+		UpstreamPool(const size_t maxIdlePerOrigin, const size_t idleTimeoutMs);
+		~UpstreamPool();
+		UpstreamPool(const UpstreamPool& rhs) = delete;
+		UpstreamPool& operator=(const UpstreamPool& rhs) = delete;
+
+		/*
+		 * an idle connection that still looks alive, or -1
+		 * the caller owns it from now on
+		*/
+		int acquire(const string& host, const string& port);
+
+		/*
+		 * give fd back, it MUST be at a message boundary (nothing left
+		 * to read from the last response), the pool may close it
+		*/
+		void release(const string& host, const string& port, const int fd);
+
+		/*
+		 * close every expired connection, release() calls it from time to time
+		*/
+		void evictExpired();
+
+		size_t idleCount() const;
+
+	private:
+		typedef chrono::steady_clock Clock;
+		struct IdleConn {
+			int fd;
+			Clock::time_point since;
+		};
+
+		const size_t maxIdle;
+		const Clock::duration idleTimeout;
+		mutable mutex m;
+		// most recently used at the back
+		unordered_map<string, vector<IdleConn>> idle;
+		Clock::time_point lastEviction;
+
+		static string key(const string& host, const string& port);
+		/*
+		 * a connection the server did not close and did not write to
+		*/
+		static bool isAlive(const int fd);
+		void evictExpiredLocked(const Clock::time_point now);
+	};
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// UpstreamPool Implementation ////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	UpstreamPool::UpstreamPool(const size_t maxIdlePerOrigin, const size_t idleTimeoutMs) :
+		maxIdle(maxIdlePerOrigin),
+		idleTimeout(chrono::milliseconds(idleTimeoutMs)),
+		lastEviction(Clock::now())
+	{}
+
+	UpstreamPool::~UpstreamPool() {
+		for(auto const& origin : idle) {
+			for(auto const& c : origin.second) {
+				close(c.fd);
+			}
+		}
+	}
+
+	string UpstreamPool::key(const string& host, const string& port) {
+		string k;
+		for(char c : host) {
+			k.push_back(tolower(c));
+		}
+		return k + ":" + port;
+	}
+
+	bool UpstreamPool::isAlive(const int fd) {
+		char c;
+		const ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		// 0: closed by the server, > 0: unexpected data, the stream is out of sync
+		return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+
+	int UpstreamPool::acquire(const string& host, const string& port) {
+		vector<int> dead;
+		int fd = -1;
+		{
+			lock_guard<mutex> lck(m);
+			auto it = idle.find(key(host, port));
+			if(it == idle.end()) { return -1; }
+			const Clock::time_point now = Clock::now();
+			vector<IdleConn>& conns = it->second;
+			while(!conns.empty()) {
+				const IdleConn c = conns.back();
+				conns.pop_back();
+				if(now - c.since < idleTimeout && isAlive(c.fd)) {
+					fd = c.fd;
+					break;
+				}
+				dead.push_back(c.fd);
+			}
+			if(conns.empty()) { idle.erase(it); }
+		}
+		for(const int d : dead) {
+			close(d);
+		}
+		return fd;
+	}
+
+	void UpstreamPool::release(const string& host, const string& port, const int fd) {
+		bool full = false;
+		{
+			lock_guard<mutex> lck(m);
+			const Clock::time_point now = Clock::now();
+			vector<IdleConn>& conns = idle[key(host, port)];
+			if(conns.size() >= maxIdle) {
+				full = true;
+			} else {
+				conns.push_back(IdleConn{ fd, now });
+			}
+			if(now - lastEviction >= idleTimeout / 2) {
+				evictExpiredLocked(now);
+			}
+		}
+		if(full) {
+			close(fd);
+		}
+	}
+
+	void UpstreamPool::evictExpired() {
+		lock_guard<mutex> lck(m);
+		evictExpiredLocked(Clock::now());
+	}
+
+	void UpstreamPool::evictExpiredLocked(const Clock::time_point now) {
+		lastEviction = now;
+		for(auto it = idle.begin(); it != idle.end();) {
+			vector<IdleConn>& conns = it->second;
+			// oldest first
+			size_t n = 0;
+			while(n < conns.size() && now - conns[n].since >= idleTimeout) {
+				close(conns[n].fd);
+				n++;
+			}
+			conns.erase(conns.begin(), conns.begin() + n);
+			if(conns.empty()) {
+				idle.erase(it++);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	size_t UpstreamPool::idleCount() const {
+		lock_guard<mutex> lck(m);
+		size_t n = 0;
+		for(auto const& origin : idle) {
+			n += origin.second.size();
+		}
+		return n;
+	}
+
+}
+	using zq29Inner::UpstreamPool;
+}
+
+#endif
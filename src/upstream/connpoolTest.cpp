@@ -0,0 +1,112 @@
+#include <sys/socket.h>
+
+#include <iostream>
+#include <thread>
+
+#include "connpool.hpp"
+
+using namespace zq29;
+using namespace std;
+
+/*
+ * connections go back to their own origin, most recently used first
+*/
+void testAcquireRelease() {
+	const string TAG = "testAcquireRelease";
+	bool failFlag = false;
+
+	UpstreamPool pool(8, 10000);
+	int a[2], b[2];
+	socketpair(AF_UNIX, SOCK_STREAM, 0, a);
+	socketpair(AF_UNIX, SOCK_STREAM, 0, b);
+
+	if(pool.acquire("example.com", "80") != -1) {
+		failFlag = true;
+		Log::testFail(TAG, "empty pool returned a connection");
+	}
+
+	pool.release("example.com", "80", a[0]);
+	pool.release("Example.COM", "80", b[0]);
+	if(pool.acquire("example.com", "8080") != -1) {
+		failFlag = true;
+		Log::testFail(TAG, "got a connection of another port");
+	}
+	const int first = pool.acquire("EXAMPLE.com", "80");
+	const int second = pool.acquire("example.com", "80");
+	if(first != b[0] || second != a[0]) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("got ", first, ", ", second, ", expected ", b[0], ", ", a[0]));
+	}
+	if(pool.idleCount() != 0) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("idleCount() ", pool.idleCount(), ", expected 0"));
+	}
+
+	close(a[0]); close(a[1]);
+	close(b[0]); close(b[1]);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * closed by the peer, unexpected data, too many, too old
+*/
+void testDrop() {
+	const string TAG = "testDrop";
+	bool failFlag = false;
+
+	{
+		UpstreamPool pool(8, 10000);
+		int closed[2], chatty[2];
+		socketpair(AF_UNIX, SOCK_STREAM, 0, closed);
+		socketpair(AF_UNIX, SOCK_STREAM, 0, chatty);
+		pool.release("a", "80", closed[0]);
+		pool.release("a", "80", chatty[0]);
+		close(closed[1]);
+		send(chatty[1], "x", 1, 0);
+		if(pool.acquire("a", "80") != -1) {
+			failFlag = true;
+			Log::testFail(TAG, "got a dead connection");
+		}
+		close(chatty[1]);
+	}
+
+	{
+		UpstreamPool pool(2, 10000);
+		int fds[3][2];
+		for(int i = 0; i < 3; i++) {
+			socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+			pool.release("a", "80", fds[i][0]);
+		}
+		if(pool.idleCount() != 2) {
+			failFlag = true;
+			Log::testFail(TAG, Log::msg("idleCount() ", pool.idleCount(), ", expected 2"));
+		}
+		// the pool closed the 3rd one
+		char c;
+		if(recv(fds[2][1], &c, 1, 0) != 0) {
+			failFlag = true;
+			Log::testFail(TAG, "extra connection was not closed");
+		}
+		for(int i = 0; i < 3; i++) { close(fds[i][1]); }
+	}
+
+	{
+		UpstreamPool pool(8, 20);
+		int fds[2];
+		socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+		pool.release("a", "80", fds[0]);
+		this_thread::sleep_for(chrono::milliseconds(30));
+		if(pool.acquire("a", "80") != -1) {
+			failFlag = true;
+			Log::testFail(TAG, "got an expired connection");
+		}
+		close(fds[1]);
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testAcquireRelease();
+	testDrop();
+}
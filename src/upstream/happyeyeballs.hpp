@@ -0,0 +1,155 @@
+#ifndef ZQ29_HAPPYEYEBALLS
+#define ZQ29_HAPPYEYEBALLS
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+#include "../eventloop/fiber.hpp"
+#include "resolver.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * connect to the first of addresses that answers, RFC 8305 style
+	 *
+	 * addresses are tried with IPv6 and IPv4 interleaved, starting with
+	 * the family of the first one, a new attempt starts every
+	 * attemptDelayMs, or as soon as the previous one failed, while the
+	 * older ones keep going, each one for at most attemptTimeoutMs
+	 * the first socket to connect wins, the others are closed
+	 *
+	 * waits like the async* functions of fiber.hpp
+	 * returns a connected, blocking fd, or -1 with errno of the last failure
+	*/
+	int connectAny(const vector<SockAddr>& addresses, const int attemptDelayMs, const int attemptTimeoutMs);
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// connectAny Implementation //////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	int connectAny(const vector<SockAddr>& addresses, const int attemptDelayMs, const int attemptTimeoutMs) {
+		typedef chrono::steady_clock Clock;
+		if(addresses.empty()) {
+			errno = EADDRNOTAVAIL;
+			return -1;
+		}
+
+		// v6 v4 v6 v4 ..., in the order of the resolver within a family
+		vector<const SockAddr*> order;
+		{
+			vector<const SockAddr*> first, second;
+			for(const SockAddr& a : addresses) {
+				(a.family() == addresses[0].family() ? first : second).push_back(&a);
+			}
+			for(size_t i = 0; i < first.size() || i < second.size(); i++) {
+				if(i < first.size()) { order.push_back(first[i]); }
+				if(i < second.size()) { order.push_back(second[i]); }
+			}
+		}
+
+		struct Attempt {
+			int fd;
+			Clock::time_point deadline;
+		};
+		vector<Attempt> inflight;
+		size_t next = 0;
+		Clock::time_point nextStart = Clock::now();
+		int lastErrno = ETIMEDOUT;
+		int winner = -1;
+
+		while(winner < 0) {
+			const Clock::time_point now = Clock::now();
+			if(next < order.size() && (inflight.empty() || now >= nextStart)) {
+				const SockAddr& a = *order[next++];
+				const int fd = socket(a.family(), SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+				if(fd < 0) {
+					lastErrno = errno;
+					continue;
+				}
+				if(connect(fd, a.get(), a.len) == 0) {
+					winner = fd;
+					break;
+				}
+				if(errno != EINPROGRESS) {
+					// refused, unreachable ... go on with the next one right away
+					lastErrno = errno;
+					close(fd);
+					continue;
+				}
+				inflight.push_back(Attempt{ fd, now + chrono::milliseconds(attemptTimeoutMs) });
+				nextStart = now + chrono::milliseconds(attemptDelayMs);
+				continue;
+			}
+			if(inflight.empty()) { break; }
+
+			// wait for an attempt to finish, or the next one to start
+			Clock::time_point wakeUp = inflight[0].deadline;
+			vector<pair<int, uint32_t>> fds;
+			for(const Attempt& at : inflight) {
+				wakeUp = min(wakeUp, at.deadline);
+				fds.push_back(make_pair(at.fd, (uint32_t)EPOLLOUT));
+			}
+			if(next < order.size()) { wakeUp = min(wakeUp, nextStart); }
+			const int timeoutMs = wakeUp > now
+				? (int)chrono::duration_cast<chrono::milliseconds>(wakeUp - now + chrono::microseconds(999)).count()
+				: 0;
+			const int ready = asyncWaitAny(fds, timeoutMs);
+
+			if(ready >= 0) {
+				const int fd = inflight[ready].fd;
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				inflight.erase(inflight.begin() + ready);
+				if(err == 0) {
+					winner = fd;
+					break;
+				}
+				lastErrno = err;
+				close(fd);
+				nextStart = Clock::now();
+				continue;
+			}
+			const Clock::time_point after = Clock::now();
+			for(auto it = inflight.begin(); it != inflight.end();) {
+				if(after >= it->deadline) {
+					close(it->fd);
+					lastErrno = ETIMEDOUT;
+					it = inflight.erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+
+		for(const Attempt& at : inflight) {
+			close(at.fd);
+		}
+		if(winner < 0) {
+			errno = lastErrno;
+			return -1;
+		}
+		const int flags = fcntl(winner, F_GETFL, 0);
+		fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+		return winner;
+	}
+
+}
+	using zq29Inner::connectAny;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+
+#include "happyeyeballs.hpp"
+
+using namespace zq29;
+using namespace std;
+
+SockAddr v4(const char* ip, const uint16_t port) {
+	SockAddr a;
+	memset(&a.addr, 0, sizeof(a.addr));
+	sockaddr_in* const in = (sockaddr_in*)&a.addr;
+	in->sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &in->sin_addr);
+	a.len = sizeof(sockaddr_in);
+	a.setPort(port);
+	return a;
+}
+
+/*
+ * a listening socket on a random port of 127.0.0.1, and a port nobody listens on
+*/
+int listenLocal(uint16_t& port, uint16_t& closedPort) {
+	const int fd = socket(AF_INET, SOCK_STREAM, 0);
+	const int closed = socket(AF_INET, SOCK_STREAM, 0);
+	SockAddr a = v4("127.0.0.1", 0);
+	socklen_t len = a.len;
+	if(bind(fd, a.get(), a.len) < 0 || listen(fd, 16) < 0 || getsockname(fd, (sockaddr*)&a.addr, &len) < 0) {
+		return -1;
+	}
+	port = ntohs(((sockaddr_in*)&a.addr)->sin_port);
+	// bound but not listening, connecting to it is refused
+	a = v4("127.0.0.1", 0);
+	len = a.len;
+	bind(closed, a.get(), a.len);
+	getsockname(closed, (sockaddr*)&a.addr, &len);
+	closedPort = ntohs(((sockaddr_in*)&a.addr)->sin_port);
+	return fd;
+}
+
+uint16_t peerPort(const int fd) {
+	sockaddr_in a;
+	socklen_t len = sizeof(a);
+	if(getpeername(fd, (sockaddr*)&a, &len) < 0) { return 0; }
+	return ntohs(a.sin_port);
+}
+
+void testConnectAny() {
+	const string TAG = "testConnectAny";
+	bool failFlag = false;
+
+	uint16_t port, closedPort;
+	const int listen_fd = listenLocal(port, closedPort);
+	if(listen_fd < 0) {
+		Log::testFail(TAG, "cannot listen");
+		return;
+	}
+
+	// refused first, go on at once
+	typedef chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	int fd = connectAny({ v4("127.0.0.1", closedPort), v4("127.0.0.1", port) }, 1000, 1000);
+	if(fd < 0 || peerPort(fd) != port || Clock::now() - start > chrono::milliseconds(500)) {
+		failFlag = true;
+		Log::testFail(TAG, "refused address then a good one");
+	}
+	close(fd);
+
+	// a black hole (TEST-NET-1) first, the next attempt starts after the delay
+	start = Clock::now();
+	fd = connectAny({ v4("192.0.2.1", 80), v4("127.0.0.1", port) }, 50, 5000);
+	if(fd < 0 || peerPort(fd) != port || Clock::now() - start > chrono::milliseconds(1000)) {
+		failFlag = true;
+		Log::testFail(TAG, "black hole then a good one");
+	}
+	close(fd);
+
+	// nothing works
+	fd = connectAny({ v4("127.0.0.1", closedPort), v4("127.0.0.1", closedPort) }, 50, 1000);
+	if(fd != -1 || errno != ECONNREFUSED) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("expected ECONNREFUSED, got ", fd, ", ", strerror(errno)));
+	}
+	if(connectAny({}, 50, 1000) != -1) {
+		failFlag = true;
+		Log::testFail(TAG, "connected to nothing");
+	}
+
+	// the same inside a fiber
+	EventLoop loop;
+	fd = -1;
+	Fiber::spawn(loop, [&]() {
+		fd = connectAny({ v4("192.0.2.1", 80), v4("127.0.0.1", port) }, 50, 5000);
+		loop.stop();
+	});
+	loop.runAfter(2000, [&loop]() { loop.stop(); });
+	loop.run();
+	if(fd < 0 || peerPort(fd) != port) {
+		failFlag = true;
+		Log::testFail(TAG, "black hole then a good one, in a fiber");
+	}
+	close(fd);
+
+	close(listen_fd);
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testConnectAny();
+}
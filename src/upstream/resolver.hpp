@@ -0,0 +1,391 @@
+#ifndef ZQ29_RESOLVER
+#define ZQ29_RESOLVER
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../log.hpp"
+#include "../eventloop/fiber.hpp"
+#include "../threadpool/threadpool.hpp"
+
+namespace zq29 {
+namespace zq29Inner {
+
+	using namespace std;
+
+	/*
+	 * one address of a host, the port is set when it is used
+	*/
+	struct SockAddr {
+		sockaddr_storage addr;
+		socklen_t len;
+
+		int family() const;
+		const sockaddr* get() const;
+		void setPort(const uint16_t port);
+	};
+
+	/*
+	 * turns a host name into addresses, blocking
+	*/
+	class Resolver {
+	public:
+		/*
+		 * status: 0, or an EAI_* code like getaddrinfo(3) returns
+		 * ttlMs: how long the answer may be cached
+		*/
+		struct Result {
+			int status;
+			vector<SockAddr> addresses;
+			size_t ttlMs;
+		};
+
+		virtual ~Resolver() {}
+		virtual Result resolve(const string& host) = 0;
+	};
+
+	/*
+	 * getaddrinfo(3), it does not tell the TTL of the records,
+	 * so every answer gets the same one
+	*/
+	class SystemResolver : public Resolver {
+	public:
+		SystemResolver(const size_t ttlMs);
+		Result resolve(const string& host) override;
+
+	private:
+		const size_t ttl;
+	};
+
+	/*
+	 * names from a file in the /etc/hosts format and nothing else:
+	 *     127.0.0.1 localhost alias ...
+	 * one address per line, # starts a comment, read once
+	 * addresses like "127.0.0.1" or "::1" are resolved to themselves
+	*/
+	class HostsFileResolver : public Resolver {
+	public:
+		class HostsFileException : public exception {
+		private:
+			const string msg;
+		public:
+			HostsFileException(const string& msg);
+			const char* what() const throw() override;
+		};
+
+		HostsFileResolver(const string& path, const size_t ttlMs);
+		Result resolve(const string& host) override;
+
+	private:
+		const size_t ttl;
+		unordered_map<string, vector<SockAddr>> hosts;
+
+		/*
+		 * false if ip is not an IPv4 or IPv6 address
+		*/
+		static bool parseAddress(const string& ip, SockAddr& out);
+	};
+
+	/*
+	 * remembers the answers of a Resolver
+	 *
+	 * a hit after 3/4 of its TTL is still served, and the name is resolved
+	 * again in the background, so names in use keep being fresh and no
+	 * request waits for them
+	 * names that do not exist (EAI_NONAME) are remembered for negativeTtlMs,
+	 * other failures are not remembered, a stale answer is kept instead
+	 *
+	 * a miss inside a fiber is resolved in the background too, the fiber
+	 * waits without blocking its loop, anywhere else the caller blocks
+	 *
+	 * thread-safe
+	*/
+	class DnsCache {
+	public:
+		DnsCache(unique_ptr<Resolver> resolver, const size_t negativeTtlMs, const size_t maxEntries = 4096);
+		DnsCache(const DnsCache& rhs) = delete;
+		DnsCache& operator=(const DnsCache& rhs) = delete;
+
+		/*
+		 * addresses of host, with port set
+		 * returns 0, or an EAI_* code like getaddrinfo(3)
+		*/
+		int lookup(const string& host, const string& port, vector<SockAddr>& out);
+
+		size_t size() const;
+
+	private:
+		typedef chrono::steady_clock Clock;
+		struct Entry {
+			int status;
+			vector<SockAddr> addresses;
+			Clock::time_point refreshAt;
+			Clock::time_point expireAt;
+			bool refreshing;
+		};
+
+		static const size_t BACKGROUND_THREADS = 2;
+		static const size_t BACKGROUND_QUEUE = 1024;
+
+		unique_ptr<Resolver> resolver;
+		const Clock::duration negativeTtl;
+		const size_t maxEntries;
+		mutable mutex m;
+		unordered_map<string, Entry> entries;
+		// last, so it is joined before anything its jobs use is gone
+		WorkerPool background;
+
+		Resolver::Result resolveNow(const string& host);
+		void refresh(const string& host);
+		void store(const string& host, const Resolver::Result& r);
+	};
+
+
+
+
+
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// SockAddr Implementation ////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	int SockAddr::family() const {
+		return addr.ss_family;
+	}
+
+	const sockaddr* SockAddr::get() const {
+		return (const sockaddr*)&addr;
+	}
+
+	void SockAddr::setPort(const uint16_t port) {
+		if(addr.ss_family == AF_INET) {
+			((sockaddr_in*)&addr)->sin_port = htons(port);
+		} else if(addr.ss_family == AF_INET6) {
+			((sockaddr_in6*)&addr)->sin6_port = htons(port);
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// SystemResolver Implementation //////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	SystemResolver::SystemResolver(const size_t ttlMs) : ttl(ttlMs) {}
+
+	Resolver::Result SystemResolver::resolve(const string& host) {
+		Result r{ 0, {}, ttl };
+		struct addrinfo hints;
+		struct addrinfo* list;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		r.status = getaddrinfo(host.c_str(), NULL, &hints, &list);
+		if(r.status != 0) { return r; }
+		for(struct addrinfo* p = list; p != NULL; p = p->ai_next) {
+			SockAddr a;
+			memset(&a.addr, 0, sizeof(a.addr));
+			memcpy(&a.addr, p->ai_addr, p->ai_addrlen);
+			a.len = p->ai_addrlen;
+			r.addresses.push_back(a);
+		}
+		freeaddrinfo(list);
+		return r;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// HostsFileResolver Implementation ///////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	HostsFileResolver::HostsFileException::HostsFileException(const string& msg) : msg(msg) {}
+	const char* HostsFileResolver::HostsFileException::what() const throw() { return msg.c_str(); }
+
+	HostsFileResolver::HostsFileResolver(const string& path, const size_t ttlMs) : ttl(ttlMs) {
+		ifstream file(path);
+		if(!file) {
+			throw HostsFileException(Log::msg("cannot open hosts file <", path, ">"));
+		}
+		string line;
+		while(getline(file, line)) {
+			line = line.substr(0, line.find('#'));
+			stringstream ss(line);
+			string ip, name;
+			if(!(ss >> ip)) { continue; }
+			SockAddr a;
+			if(!parseAddress(ip, a)) {
+				Log::warning(Log::msg("in HostsFileResolver: ignore bad address <", ip, ">"));
+				continue;
+			}
+			while(ss >> name) {
+				for(char& c : name) { c = tolower(c); }
+				hosts[name].push_back(a);
+			}
+		}
+	}
+
+	bool HostsFileResolver::parseAddress(const string& ip, SockAddr& out) {
+		memset(&out.addr, 0, sizeof(out.addr));
+		sockaddr_in* const v4 = (sockaddr_in*)&out.addr;
+		sockaddr_in6* const v6 = (sockaddr_in6*)&out.addr;
+		if(inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1) {
+			v4->sin_family = AF_INET;
+			out.len = sizeof(sockaddr_in);
+			return true;
+		}
+		if(inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1) {
+			v6->sin6_family = AF_INET6;
+			out.len = sizeof(sockaddr_in6);
+			return true;
+		}
+		return false;
+	}
+
+	Resolver::Result HostsFileResolver::resolve(const string& host) {
+		SockAddr literal;
+		if(parseAddress(host, literal)) {
+			return Result{ 0, { literal }, ttl };
+		}
+		string k;
+		for(char c : host) { k.push_back(tolower(c)); }
+		auto it = hosts.find(k);
+		if(it == hosts.end()) {
+			return Result{ EAI_NONAME, {}, ttl };
+		}
+		return Result{ 0, it->second, ttl };
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////
+	//////////////////////////// DnsCache Implementation ////////////////////////////
+	/////////////////////////////////////////////////////////////////////////////////
+	DnsCache::DnsCache(unique_ptr<Resolver> resolver, const size_t negativeTtlMs, const size_t maxEntries) :
+		resolver(move(resolver)),
+		negativeTtl(chrono::milliseconds(negativeTtlMs)),
+		maxEntries(maxEntries),
+		background(BACKGROUND_THREADS, BACKGROUND_QUEUE)
+	{}
+
+	int DnsCache::lookup(const string& host, const string& port, vector<SockAddr>& out) {
+		char* end = nullptr;
+		const long portNum = strtol(port.c_str(), &end, 10);
+		if(port.empty() || *end != '\0' || portNum < 0 || portNum > 65535) {
+			return EAI_SERVICE;
+		}
+		string k;
+		for(char c : host) { k.push_back(tolower(c)); }
+
+		int status = 0;
+		bool hit = false, stale = false;
+		{
+			lock_guard<mutex> lck(m);
+			auto it = entries.find(k);
+			const Clock::time_point now = Clock::now();
+			if(it != entries.end() && now < it->second.expireAt) {
+				Entry& e = it->second;
+				hit = true;
+				status = e.status;
+				out = e.addresses;
+				if(e.status == 0 && now >= e.refreshAt && !e.refreshing) {
+					e.refreshing = stale = true;
+				}
+			}
+		}
+		if(stale) { refresh(k); }
+		if(!hit) {
+			const Resolver::Result r = resolveNow(k);
+			store(k, r);
+			status = r.status;
+			out = r.addresses;
+		}
+		for(SockAddr& a : out) {
+			a.setPort((uint16_t)portNum);
+		}
+		return status;
+	}
+
+	Resolver::Result DnsCache::resolveNow(const string& host) {
+		Fiber* const self = Fiber::current();
+		if(self != nullptr) {
+			Resolver::Result r;
+			EventLoop& loop = self->loop();
+			const bool submitted = background.trySubmit([this, host, self, &loop, &r]() {
+				r = resolver->resolve(host);
+				loop.post([self]() { self->wake(); });
+			});
+			if(submitted) {
+				self->suspend();
+				return r;
+			}
+			Log::warning("in DnsCache: background queue is full, resolve on the loop");
+		}
+		return resolver->resolve(host);
+	}
+
+	void DnsCache::refresh(const string& host) {
+		const bool submitted = background.trySubmit([this, host]() {
+			store(host, resolver->resolve(host));
+		});
+		if(!submitted) {
+			// someone will try again on the next hit
+			lock_guard<mutex> lck(m);
+			auto it = entries.find(host);
+			if(it != entries.end()) { it->second.refreshing = false; }
+		}
+	}
+
+	void DnsCache::store(const string& host, const Resolver::Result& r) {
+		lock_guard<mutex> lck(m);
+		const Clock::time_point now = Clock::now();
+		auto it = entries.find(host);
+		if(r.status != 0 && r.status != EAI_NONAME) {
+			// maybe the DNS server is down, the name is fine
+			if(it != entries.end()) { it->second.refreshing = false; }
+			Log::debug(Log::msg("in DnsCache: cannot resolve <", host, ">, ", gai_strerror(r.status)));
+			return;
+		}
+
+		if(it == entries.end() && entries.size() >= maxEntries) {
+			for(auto e = entries.begin(); e != entries.end();) {
+				if(now >= e->second.expireAt) {
+					e = entries.erase(e);
+				} else {
+					++e;
+				}
+			}
+			if(entries.size() >= maxEntries) { entries.erase(entries.begin()); }
+		}
+
+		Entry& e = entries[host];
+		e.status = r.status;
+		e.addresses = r.addresses;
+		e.refreshing = false;
+		if(r.status == 0) {
+			const Clock::duration ttl = chrono::milliseconds(r.ttlMs);
+			e.refreshAt = now + ttl * 3 / 4;
+			e.expireAt = now + ttl;
+		} else {
+			e.refreshAt = e.expireAt = now + negativeTtl;
+		}
+	}
+
+	size_t DnsCache::size() const {
+		lock_guard<mutex> lck(m);
+		return entries.size();
+	}
+
+}
+	using zq29Inner::SockAddr;
+	using zq29Inner::Resolver;
+	using zq29Inner::SystemResolver;
+	using zq29Inner::HostsFileResolver;
+	using zq29Inner::DnsCache;
+}
+
+#endif
@@ -0,0 +1,173 @@
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+#include "resolver.hpp"
+
+using namespace zq29;
+using namespace std;
+
+/*
+ * answers 10.0.0.<number of calls> for "good", EAI_NONAME for "missing",
+ * EAI_AGAIN for anything else
+*/
+class StubResolver : public Resolver {
+public:
+	atomic<int> calls;
+	const size_t ttl;
+
+	StubResolver(const size_t ttlMs) : calls(0), ttl(ttlMs) {}
+
+	Result resolve(const string& host) override {
+		const int n = ++calls;
+		if(host == "missing") { return Result{ EAI_NONAME, {}, ttl }; }
+		if(host != "good") { return Result{ EAI_AGAIN, {}, ttl }; }
+		SockAddr a;
+		memset(&a.addr, 0, sizeof(a.addr));
+		sockaddr_in* const v4 = (sockaddr_in*)&a.addr;
+		v4->sin_family = AF_INET;
+		v4->sin_addr.s_addr = htonl(0x0a000000 | n);
+		a.len = sizeof(sockaddr_in);
+		return Result{ 0, { a }, ttl };
+	}
+};
+
+string toStr(const SockAddr& a) {
+	char buf[INET6_ADDRSTRLEN];
+	const sockaddr_in* const v4 = (const sockaddr_in*)&a.addr;
+	inet_ntop(AF_INET, &v4->sin_addr, buf, sizeof(buf));
+	return Log::msg(buf, ":", ntohs(v4->sin_port));
+}
+
+/*
+ * hits, refresh in the background before expiry, negative caching
+*/
+void testDnsCache() {
+	const string TAG = "testDnsCache";
+	bool failFlag = false;
+
+	StubResolver* const stub = new StubResolver(100);
+	DnsCache cache(unique_ptr<Resolver>(stub), 50);
+	vector<SockAddr> out;
+
+	if(cache.lookup("good", "80", out) != 0 || out.size() != 1 || toStr(out[0]) != "10.0.0.1:80") {
+		failFlag = true;
+		Log::testFail(TAG, "first lookup");
+	}
+	// same name, other port and case, still cached
+	if(cache.lookup("GOOD", "8080", out) != 0 || out.size() != 1 || toStr(out[0]) != "10.0.0.1:8080"
+		|| stub->calls != 1) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("second lookup, ", stub->calls.load(), " calls"));
+	}
+
+	// past 3/4 of the TTL: the old answer, and a refresh
+	this_thread::sleep_for(chrono::milliseconds(80));
+	if(cache.lookup("good", "80", out) != 0 || toStr(out[0]) != "10.0.0.1:80") {
+		failFlag = true;
+		Log::testFail(TAG, "stale lookup did not return the cached answer");
+	}
+	this_thread::sleep_for(chrono::milliseconds(10));
+	if(cache.lookup("good", "80", out) != 0 || toStr(out[0]) != "10.0.0.2:80" || stub->calls != 2) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("not refreshed, ", stub->calls.load(), " calls"));
+	}
+
+	if(cache.lookup("good", "http", out) != EAI_SERVICE) {
+		failFlag = true;
+		Log::testFail(TAG, "non-numeric port accepted");
+	}
+
+	// negative answers are cached for a while, failures are not
+	stub->calls = 0;
+	cache.lookup("missing", "80", out);
+	if(cache.lookup("missing", "80", out) != EAI_NONAME || stub->calls != 1) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("negative answer, ", stub->calls.load(), " calls"));
+	}
+	this_thread::sleep_for(chrono::milliseconds(60));
+	cache.lookup("missing", "80", out);
+	cache.lookup("broken", "80", out);
+	if(cache.lookup("broken", "80", out) != EAI_AGAIN || stub->calls != 4) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("expiry or failures, ", stub->calls.load(), " calls, expected 4"));
+	}
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+/*
+ * a miss inside a fiber does not block the loop
+*/
+void testDnsCacheFiber() {
+	const string TAG = "testDnsCacheFiber";
+	bool failFlag = false;
+
+	class SlowResolver : public StubResolver {
+	public:
+		SlowResolver() : StubResolver(1000) {}
+		Result resolve(const string& host) override {
+			this_thread::sleep_for(chrono::milliseconds(50));
+			return StubResolver::resolve(host);
+		}
+	};
+	DnsCache cache(unique_ptr<Resolver>(new SlowResolver()), 1000);
+
+	EventLoop loop;
+	int ticks = 0, status = -1;
+	Fiber::spawn(loop, [&]() {
+		vector<SockAddr> out;
+		status = cache.lookup("good", "80", out);
+		loop.stop();
+	});
+	// counts while the fiber waits
+	function<void()> tick = [&]() {
+		ticks++;
+		loop.runAfter(5, tick);
+	};
+	loop.runAfter(5, tick);
+	loop.runAfter(1000, [&loop]() { loop.stop(); });
+	loop.run();
+
+	if(status != 0 || ticks < 5) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("status ", status, ", loop ticked ", ticks, " times"));
+	}
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+void testHostsFile() {
+	const string TAG = "testHostsFile";
+	bool failFlag = false;
+
+	const string path = "test.txt";
+	ofstream file(path);
+	file << "# comment\n127.0.0.1 localhost Origin.test\n\n::1 origin.test # v6\nbad host\n";
+	file.close();
+
+	HostsFileResolver r(path, 1000);
+	const Resolver::Result a = r.resolve("ORIGIN.test");
+	if(a.status != 0 || a.addresses.size() != 2
+		|| a.addresses[0].family() != AF_INET || a.addresses[1].family() != AF_INET6) {
+		failFlag = true;
+		Log::testFail(TAG, Log::msg("origin.test, status ", a.status, ", ", a.addresses.size(), " addresses"));
+	}
+	if(r.resolve("10.1.2.3").status != 0) {
+		failFlag = true;
+		Log::testFail(TAG, "address literal not resolved");
+	}
+	if(r.resolve("host").status != EAI_NONAME || r.resolve("example.com").status != EAI_NONAME) {
+		failFlag = true;
+		Log::testFail(TAG, "unknown names resolved");
+	}
+	remove(path.c_str());
+
+	if(!failFlag) { Log::testSuccess(TAG); }
+}
+
+int main() {
+	testDnsCache();
+	testDnsCacheFiber();
+	testHostsFile();
+}